@@ -0,0 +1,121 @@
+/*
+   The arena allocator. See cat_arena.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cat_arena.h"
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    /* the data follows, aligned by the size of this header */
+} arena_block;
+
+struct cat_arena {
+    arena_block *current;       /* allocations come from here */
+    size_t next_size;
+    size_t total;
+    int num_blocks;
+};
+
+#define BLOCK_HEADER  ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block *new_block(cat_arena *arena, size_t min_size);
+
+cat_arena *arena_create(void)
+{
+    cat_arena *arena;
+
+    arena = calloc(1, sizeof(*arena));
+    if (arena) {
+        arena->next_size = ARENA_MIN_BLOCK;
+    }
+    return(arena);
+}
+
+void arena_free(cat_arena *arena)
+{
+    arena_block *block, *next;
+
+    if (!arena) {
+        return;
+    }
+    for (block = arena->current; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+void *arena_alloc(cat_arena *arena, size_t size)
+{
+    arena_block *block = arena->current;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!block || block->size - block->used < size) {
+        block = new_block(arena, size);
+        if (!block) {
+            return(NULL);
+        }
+    }
+    ptr = (char *)block + BLOCK_HEADER + block->used;
+    block->used += size;
+    return(ptr);
+}
+
+char *arena_strdup(cat_arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy;
+
+    copy = arena_alloc(arena, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return(copy);
+}
+
+size_t arena_size(const cat_arena *arena)
+{
+    return(arena->total);
+}
+
+int arena_num_blocks(const cat_arena *arena)
+{
+    return(arena->num_blocks);
+}
+
+/* An allocation too big for the next block gets a block of its own, which
+   goes behind the current one so that the space left there isn't lost */
+static arena_block *new_block(cat_arena *arena, size_t min_size)
+{
+    arena_block *block;
+    size_t size = arena->next_size;
+
+    if (min_size > size) {
+        size = min_size;
+    }
+    block = malloc(BLOCK_HEADER + size);
+    if (!block) {
+        return(NULL);
+    }
+    block->size = size;
+    block->used = 0;
+    if (size > arena->next_size && arena->current) {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    } else {
+        block->next = arena->current;
+        arena->current = block;
+        if (arena->next_size < ARENA_MAX_BLOCK) {
+            arena->next_size *= 2;
+        }
+    }
+    arena->total += BLOCK_HEADER + size;
+    arena->num_blocks++;
+    return(block);
+}
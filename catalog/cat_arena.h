@@ -0,0 +1,31 @@
+/*
+   A bump allocator for data that is built up piece by piece and thrown
+   away all at once. Allocations are carved off the end of large blocks
+   taken from malloc, each twice the size of the last up to ARENA_MAX_BLOCK,
+   so a million small allocations cost a few dozen mallocs. Nothing is
+   freed on its own: arena_free returns every block in one pass.
+ */
+
+#ifndef CAT_ARENA_H
+#define CAT_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_MIN_BLOCK  (64 * 1024)
+#define ARENA_MAX_BLOCK  (64 * 1024 * 1024)
+#define ARENA_ALIGN      8
+
+typedef struct cat_arena cat_arena;
+
+cat_arena *arena_create(void);
+void arena_free(cat_arena *arena);
+
+/* size bytes aligned to ARENA_ALIGN, NULL if out of memory */
+void *arena_alloc(cat_arena *arena, size_t size);
+char *arena_strdup(cat_arena *arena, const char *str);
+
+/* Bytes taken from malloc, and how many blocks they came in */
+size_t arena_size(const cat_arena *arena);
+int arena_num_blocks(const cat_arena *arena);
+
+#endif
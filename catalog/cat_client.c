@@ -0,0 +1,230 @@
+/*
+   The client side of the cdserve protocol. See cat_client.h.
+
+   The socket is blocking: a request queued by client_send goes out with
+   the others when a reply is wanted, and client_reply waits for it.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cat_client.h"
+
+struct cat_client {
+    int fd;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    char *in;
+    size_t in_size;
+    char **fields;
+    int fields_size;
+    int failed;
+};
+
+static int reserve(char **buf, size_t *size, size_t needed);
+static int read_full(int fd, void *buf, size_t len);
+
+cat_client *client_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    cat_client *client;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return(NULL);
+    }
+    client = calloc(1, sizeof(*client));
+    if (!client) {
+        return(NULL);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->fd == -1 ||
+        connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Unable to reach the catalog server at %s: %s\n",
+                path, strerror(errno));
+        if (client->fd != -1) {
+            close(client->fd);
+        }
+        free(client);
+        return(NULL);
+    }
+    return(client);
+}
+
+void client_close(cat_client *client)
+{
+    if (client) {
+        close(client->fd);
+        free(client->out);
+        free(client->in);
+        free(client->fields);
+        free(client);
+    }
+}
+
+int client_send(cat_client *client, int op, int num_args, const char *const args[])
+{
+    size_t body_len = 1;
+    size_t arg_len;
+    char *pos;
+    int i;
+
+    for (i = 0; i < num_args; i++) {
+        body_len += strlen(args[i]) + 1;
+    }
+    if (body_len > SERVE_MAX_FRAME ||
+        !reserve(&client->out, &client->out_size, client->out_len + 4 + body_len)) {
+        return(0);
+    }
+    pos = client->out + client->out_len;
+    *pos++ = (body_len >> 24) & 0xff;
+    *pos++ = (body_len >> 16) & 0xff;
+    *pos++ = (body_len >> 8) & 0xff;
+    *pos++ = body_len & 0xff;
+    *pos++ = op;
+    for (i = 0; i < num_args; i++) {
+        arg_len = strlen(args[i]) + 1;
+        memcpy(pos, args[i], arg_len);
+        pos += arg_len;
+    }
+    client->out_len += 4 + body_len;
+    return(1);
+}
+
+/* MSG_NOSIGNAL, so a server that has gone away is an error rather than
+   SIGPIPE */
+int client_flush(cat_client *client)
+{
+    size_t sent = 0;
+    ssize_t result;
+
+    while (sent < client->out_len && !client->failed) {
+        result = send(client->fd, client->out + sent, client->out_len - sent,
+                      MSG_NOSIGNAL);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            client->failed = 1;
+            break;
+        }
+        sent += result;
+    }
+    client->out_len = 0;
+    return(!client->failed);
+}
+
+int client_reply(cat_client *client, serve_reply *reply)
+{
+    unsigned char header[4];
+    uint32_t len, i;
+    int num_fields = 0;
+
+    memset(reply, 0, sizeof(*reply));
+    if (!client_flush(client) || !read_full(client->fd, header, 4)) {
+        client->failed = 1;
+        return(0);
+    }
+    len = (uint32_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+    if (len == 0 || len > SERVE_MAX_FRAME ||
+        !reserve(&client->in, &client->in_size, len) ||
+        !read_full(client->fd, client->in, len)) {
+        client->failed = 1;
+        return(0);
+    }
+
+    for (i = 1; i < len; i++) {
+        if (client->in[i] == '\0') {
+            num_fields++;
+        }
+    }
+    if (num_fields > client->fields_size) {
+        free(client->fields);
+        client->fields_size = num_fields * 2;
+        client->fields = malloc(client->fields_size * sizeof(*client->fields));
+        if (!client->fields) {
+            client->fields_size = 0;
+            client->failed = 1;
+            return(0);
+        }
+    }
+    reply->ok = client->in[0] == SERVE_OK;
+    reply->num_fields = serve_split(client->in + 1, len - 1, client->fields, num_fields);
+    reply->fields = client->fields;
+    if (reply->num_fields < 0) {
+        client->failed = 1;
+        return(0);
+    }
+    return(1);
+}
+
+int client_call(cat_client *client, int op, int num_args,
+                const char *const args[], serve_reply *reply)
+{
+    return(client_send(client, op, num_args, args) && client_reply(client, reply));
+}
+
+int serve_split(char *body, size_t len, char **fields, int max_fields)
+{
+    size_t start = 0, i;
+    int count = 0;
+
+    for (i = 0; i < len; i++) {
+        if (body[i] == '\0') {
+            if (count == max_fields) {
+                return(-1);
+            }
+            fields[count++] = body + start;
+            start = i + 1;
+        }
+    }
+    return(start == len ? count : -1);
+}
+
+static int reserve(char **buf, size_t *size, size_t needed)
+{
+    size_t new_size = *size ? *size : 4096;
+    char *bigger;
+
+    if (needed <= *size) {
+        return(1);
+    }
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+    bigger = realloc(*buf, new_size);
+    if (!bigger) {
+        return(0);
+    }
+    *buf = bigger;
+    *size = new_size;
+    return(1);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < len) {
+        result = read(fd, (char *)buf + done, len - done);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return(0);
+        }
+        done += result;
+    }
+    return(1);
+}
@@ -0,0 +1,78 @@
+/*
+   Talking to cdserve, the catalog server, over its Unix socket.
+
+   cdserve holds the text catalog of a directory in memory and answers
+   every mini_cd_manager started with -s, so that they share one parsed
+   copy of the files instead of each reading them again for every find.
+
+   Requests and replies are frames: the length of the body as four bytes,
+   most significant first, then the body. A request body is an operation
+   byte followed by its arguments, a reply body is SERVE_OK or SERVE_ERROR
+   followed by its fields, and every argument and field ends with a '\0'.
+   A client may send any number of requests before reading a reply. The
+   replies come back in the order the requests were sent.
+
+   A reply to a change is sent only once the change is in the files. The
+   server writes all the changes made within a few milliseconds of each
+   other together (group commit), so many clients changing the catalog at
+   once share the cost of writing it.
+ */
+
+#ifndef CAT_CLIENT_H
+#define CAT_CLIENT_H
+
+#include <stddef.h>
+
+#include "catalog.h"
+
+#define SERVE_SOCKET     "cdserve.sock"     /* in the catalog directory */
+#define SERVE_MAX_FRAME  (64 * 1024 * 1024)
+#define SERVE_MAX_ARGS   (CATALOG_MAX_TRACKS + 2)
+
+#define SERVE_OK     '+'
+#define SERVE_ERROR  '-'    /* the one field is the reason */
+
+/* The operations, with their arguments -> the fields of their reply */
+#define SERVE_FIND        'f'   /* text -> catalog, title, type, artist of
+                                   each CD with text in its title, ignoring
+                                   case and accents */
+#define SERVE_LIST        'l'   /* -> the same for every CD */
+#define SERVE_GET         'g'   /* catalog -> catalog, title, type, artist */
+#define SERVE_TRACKS      't'   /* catalog -> number and title of each
+                                   track, in order */
+#define SERVE_COUNT       'c'   /* -> number of CDs, number of tracks */
+#define SERVE_COMPLETE    'p'   /* prefix, max -> total, then text, catalog
+                                   and title of each completion */
+#define SERVE_PUT         'a'   /* catalog, title, type, artist -> */
+#define SERVE_PUT_TRACKS  'u'   /* catalog, titles... -> */
+#define SERVE_DEL         'r'   /* catalog -> */
+
+typedef struct cat_client cat_client;
+
+/* The fields point into the client and last until its next reply */
+typedef struct {
+    int ok;
+    int num_fields;
+    char **fields;
+} serve_reply;
+
+/* NULL, with a message on stderr, if nothing is listening at path */
+cat_client *client_connect(const char *path);
+void client_close(cat_client *client);
+
+/* Queue a request. Requests are sent when a reply is waited for, or on
+   client_flush. */
+int client_send(cat_client *client, int op, int num_args, const char *const args[]);
+int client_flush(cat_client *client);
+/* The reply to the oldest request not yet answered. 0 if the connection
+   has failed. */
+int client_reply(cat_client *client, serve_reply *reply);
+/* client_send and client_reply together */
+int client_call(cat_client *client, int op, int num_args,
+                const char *const args[], serve_reply *reply);
+
+/* Split a frame body into its '\0' terminated fields. Returns how many,
+   or -1 if there are more than max_fields or the last is unterminated. */
+int serve_split(char *body, size_t len, char **fields, int max_fields);
+
+#endif
@@ -0,0 +1,975 @@
+/*
+   Building, opening and querying the columnar export. See cat_cols.h.
+
+   The filter kernels AND a predicate into a selection 64 rows at a time,
+   one bitmap word per step, and skip words that are already empty. With
+   SSE2 the compares run 8 or 16 codes to an instruction and movemask turns
+   the results straight into bitmap bits; elsewhere the plain loops are used.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "catalog.h"
+#include "cat_cols.h"
+
+#define COLS_ALIGN  64
+
+struct cat_cols {
+    const char *map;
+    size_t map_size;
+    const cols_header *header;
+    const uint32_t *types;
+    const uint32_t *artists;
+    const uint16_t *type_col;
+    const uint32_t *artist_col;
+    const uint8_t *tracks_col;
+    const uint32_t *title_col;
+    const uint32_t *catalog_col;
+    const char *heap;
+};
+
+/* Strings while building; offset 0 is the empty string */
+typedef struct {
+    char *data;
+    uint32_t size;
+    uint32_t allocated;
+} col_heap;
+
+/* The distinct values of one field, codes given in the order first seen.
+   table is open addressed and holds code + 1, 0 being empty. */
+typedef struct {
+    uint32_t *offsets;
+    uint32_t count;
+    uint32_t allocated;
+    uint32_t *table;
+    uint32_t table_size;
+} col_dict;
+
+typedef struct {
+    catalog_backend *from;
+    col_heap heap;
+    col_dict types;
+    col_dict artists;
+    uint16_t *type_col;
+    uint32_t *artist_col;
+    uint8_t *tracks_col;
+    uint32_t *title_col;
+    uint32_t *catalog_col;
+    uint32_t num_cds;
+    uint32_t allocated;
+    int failed;
+} cols_builder;
+
+static uint32_t cols_hash(const char *str);
+static int collect_row(const cat_cd *cd, void *arg);
+static int grow_columns(cols_builder *cb);
+static uint32_t heap_append(col_heap *heap, const char *str);
+static int dict_code(col_heap *heap, col_dict *dict, const char *str, uint32_t *code);
+static int dict_grow_table(col_heap *heap, col_dict *dict);
+static uint32_t *dict_sort(const col_heap *heap, col_dict *dict);
+static int compare_heap_strings(const void *a, const void *b);
+static int write_column(FILE *fp, const void *data, size_t size, uint64_t *offset_ptr);
+static const char *cols_str(const cat_cols *cols, uint32_t offset);
+static int filter_one(const cat_cols *cols, cols_bitmap *sel, const cols_pred *pred);
+static int string_matches(const char *str, const cols_pred *pred);
+static void kernel_eq16(const uint16_t *col, uint16_t value, uint64_t *words, uint32_t num_words);
+static void kernel_eq32(const uint32_t *col, uint32_t value, uint64_t *words, uint32_t num_words);
+static void kernel_in16(const uint16_t *col, const unsigned char *hits, uint64_t *words, uint32_t num_words);
+static void kernel_in32(const uint32_t *col, const unsigned char *hits, uint64_t *words, uint32_t num_words);
+static void kernel_range8(const uint8_t *col, uint8_t lo, uint8_t hi, uint64_t *words, uint32_t num_words);
+
+/* The heap being sorted against by dict_sort */
+static const char *sort_heap;
+
+/* FNV-1a, only used for the dictionaries while building */
+static uint32_t cols_hash(const char *str)
+{
+    uint32_t h = 2166136261U;
+
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619U;
+    }
+    return(h);
+}
+
+/* Scan the store into columns in memory, sort the dictionaries so that
+   codes follow the order of their strings, and write the file under a
+   temporary name before renaming it. */
+int cols_build(catalog_backend *from, const char *path)
+{
+    cols_builder cb;
+    cols_header header;
+    uint32_t *type_map = NULL;
+    uint32_t *artist_map = NULL;
+    char temp_path[FILENAME_MAX];
+    uint32_t padded, i;
+    FILE *fp;
+    int ok = 0;
+
+    memset(&cb, 0, sizeof(cb));
+    cb.from = from;
+    if (heap_append(&cb.heap, "") != 0 || !cb.heap.data) {
+        fprintf(stderr, "Out of memory\n");
+        return(0);
+    }
+    if (!catalog_scan(from, collect_row, &cb) || cb.failed) {
+        goto done;
+    }
+
+    /* Pad the columns to whole bitmap words with rows that are never
+       selected, so the kernels need no tail loop */
+    padded = (cb.num_cds + COLS_BLOCK - 1) / COLS_BLOCK * COLS_BLOCK;
+    while (cb.allocated < padded || cb.allocated == 0) {
+        if (!grow_columns(&cb)) {
+            goto done;
+        }
+    }
+    for (i = cb.num_cds; i < padded; i++) {
+        cb.type_col[i] = 0;
+        cb.artist_col[i] = 0;
+        cb.tracks_col[i] = 0;
+        cb.title_col[i] = 0;
+        cb.catalog_col[i] = 0;
+    }
+
+    type_map = dict_sort(&cb.heap, &cb.types);
+    artist_map = dict_sort(&cb.heap, &cb.artists);
+    if ((cb.types.count && !type_map) || (cb.artists.count && !artist_map)) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    for (i = 0; i < cb.num_cds; i++) {
+        cb.type_col[i] = type_map[cb.type_col[i]];
+        cb.artist_col[i] = artist_map[cb.artist_col[i]];
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COLS_MAGIC, sizeof(COLS_MAGIC));
+    header.version = COLS_VERSION;
+    header.num_cds = cb.num_cds;
+    header.padded_cds = padded;
+    header.num_types = cb.types.count;
+    header.num_artists = cb.artists.count;
+    header.heap_size = cb.heap.size;
+
+    sprintf(temp_path, "%.*s.tmp", FILENAME_MAX - 5, path);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to create %s\n", temp_path);
+        goto done;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        !write_column(fp, cb.types.offsets, cb.types.count * sizeof(uint32_t),
+                      &header.types_offset) ||
+        !write_column(fp, cb.artists.offsets, cb.artists.count * sizeof(uint32_t),
+                      &header.artists_offset) ||
+        !write_column(fp, cb.type_col, padded * sizeof(uint16_t),
+                      &header.type_col_offset) ||
+        !write_column(fp, cb.artist_col, padded * sizeof(uint32_t),
+                      &header.artist_col_offset) ||
+        !write_column(fp, cb.tracks_col, padded * sizeof(uint8_t),
+                      &header.tracks_col_offset) ||
+        !write_column(fp, cb.title_col, padded * sizeof(uint32_t),
+                      &header.title_col_offset) ||
+        !write_column(fp, cb.catalog_col, padded * sizeof(uint32_t),
+                      &header.catalog_col_offset) ||
+        !write_column(fp, cb.heap.data, cb.heap.size, &header.heap_offset) ||
+        fseek(fp, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, fp) != 1) {
+        fprintf(stderr, "Failed to write %s\n", temp_path);
+        fclose(fp);
+        unlink(temp_path);
+        goto done;
+    }
+    if (fclose(fp) != 0 || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        unlink(temp_path);
+        goto done;
+    }
+    printf("Columns %s: %u CDs, %u types, %u artists\n", path,
+           cb.num_cds, cb.types.count, cb.artists.count);
+    ok = 1;
+
+done:
+    free(cb.heap.data);
+    free(cb.types.offsets);
+    free(cb.types.table);
+    free(cb.artists.offsets);
+    free(cb.artists.table);
+    free(cb.type_col);
+    free(cb.artist_col);
+    free(cb.tracks_col);
+    free(cb.title_col);
+    free(cb.catalog_col);
+    free(type_map);
+    free(artist_map);
+    return(ok);
+}
+
+static int collect_row(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    cols_builder *cb = arg;
+    uint32_t type_code, artist_code;
+    uint32_t row = cb->num_cds;
+
+    if (row == cb->allocated && !grow_columns(cb)) {
+        cb->failed = 1;
+        return(0);
+    }
+    if (!dict_code(&cb->heap, &cb->types, cd->type, &type_code) ||
+        !dict_code(&cb->heap, &cb->artists, cd->artist, &artist_code)) {
+        cb->failed = 1;
+        return(0);
+    }
+    if (type_code >= COLS_MAX_TYPES) {
+        fprintf(stderr, "More than %d CD types\n", COLS_MAX_TYPES);
+        cb->failed = 1;
+        return(0);
+    }
+    cb->type_col[row] = type_code;
+    cb->artist_col[row] = artist_code;
+    cb->tracks_col[row] = catalog_get_tracks(cb->from, cd->catalog, tracks,
+                                             CATALOG_MAX_TRACKS);
+    cb->title_col[row] = heap_append(&cb->heap, cd->title);
+    cb->catalog_col[row] = heap_append(&cb->heap, cd->catalog);
+    if (!cb->heap.data) {
+        fprintf(stderr, "Out of memory\n");
+        cb->failed = 1;
+        return(0);
+    }
+    cb->num_cds++;
+    return(1);
+}
+
+static int grow_columns(cols_builder *cb)
+{
+    uint32_t new_size = cb->allocated ? cb->allocated * 2 : 4096;
+    uint16_t *type_col;
+    uint32_t *artist_col, *title_col, *catalog_col;
+    uint8_t *tracks_col;
+
+    type_col = realloc(cb->type_col, new_size * sizeof(*type_col));
+    if (type_col) {
+        cb->type_col = type_col;
+    }
+    artist_col = realloc(cb->artist_col, new_size * sizeof(*artist_col));
+    if (artist_col) {
+        cb->artist_col = artist_col;
+    }
+    tracks_col = realloc(cb->tracks_col, new_size * sizeof(*tracks_col));
+    if (tracks_col) {
+        cb->tracks_col = tracks_col;
+    }
+    title_col = realloc(cb->title_col, new_size * sizeof(*title_col));
+    if (title_col) {
+        cb->title_col = title_col;
+    }
+    catalog_col = realloc(cb->catalog_col, new_size * sizeof(*catalog_col));
+    if (catalog_col) {
+        cb->catalog_col = catalog_col;
+    }
+    if (!type_col || !artist_col || !tracks_col || !title_col || !catalog_col) {
+        fprintf(stderr, "Out of memory\n");
+        return(0);
+    }
+    cb->allocated = new_size;
+    return(1);
+}
+
+/* Append a string to the heap. On running out of memory heap->data
+   becomes NULL and every later call returns 0. */
+static uint32_t heap_append(col_heap *heap, const char *str)
+{
+    uint32_t len = strlen(str) + 1;
+    uint32_t offset;
+    char *bigger;
+
+    if (heap->size && !heap->data) {
+        return(0);
+    }
+    if (heap->size && !str[0]) {
+        return(0);
+    }
+    if (heap->size + len > heap->allocated) {
+        heap->allocated = heap->allocated ? heap->allocated * 2 : 65536;
+        while (heap->size + len > heap->allocated) {
+            heap->allocated *= 2;
+        }
+        bigger = realloc(heap->data, heap->allocated);
+        if (!bigger) {
+            free(heap->data);
+            heap->data = NULL;
+            return(0);
+        }
+        heap->data = bigger;
+    }
+    offset = heap->size;
+    memcpy(heap->data + offset, str, len);
+    heap->size += len;
+    return(offset);
+}
+
+/* Find the code of str, adding it to the dictionary if it is new */
+static int dict_code(col_heap *heap, col_dict *dict, const char *str, uint32_t *code)
+{
+    uint32_t pos, entry;
+    uint32_t *bigger;
+
+    if (dict->count * 2 >= dict->table_size && !dict_grow_table(heap, dict)) {
+        return(0);
+    }
+    pos = cols_hash(str) & (dict->table_size - 1);
+    while ((entry = dict->table[pos]) != 0) {
+        if (strcmp(heap->data + dict->offsets[entry - 1], str) == 0) {
+            *code = entry - 1;
+            return(1);
+        }
+        pos = (pos + 1) & (dict->table_size - 1);
+    }
+
+    if (dict->count == dict->allocated) {
+        dict->allocated = dict->allocated ? dict->allocated * 2 : 256;
+        bigger = realloc(dict->offsets, dict->allocated * sizeof(*bigger));
+        if (!bigger) {
+            return(0);
+        }
+        dict->offsets = bigger;
+    }
+    dict->offsets[dict->count] = heap_append(heap, str);
+    if (!heap->data) {
+        return(0);
+    }
+    dict->table[pos] = ++dict->count;
+    *code = dict->count - 1;
+    return(1);
+}
+
+static int dict_grow_table(col_heap *heap, col_dict *dict)
+{
+    uint32_t new_size = dict->table_size ? dict->table_size * 2 : 512;
+    uint32_t *new_table;
+    uint32_t i, pos;
+
+    new_table = calloc(new_size, sizeof(*new_table));
+    if (!new_table) {
+        return(0);
+    }
+    for (i = 0; i < dict->table_size; i++) {
+        if (dict->table[i]) {
+            pos = cols_hash(heap->data + dict->offsets[dict->table[i] - 1]) &
+                  (new_size - 1);
+            while (new_table[pos]) {
+                pos = (pos + 1) & (new_size - 1);
+            }
+            new_table[pos] = dict->table[i];
+        }
+    }
+    free(dict->table);
+    dict->table = new_table;
+    dict->table_size = new_size;
+    return(1);
+}
+
+/* Sort the dictionary by string and return a map from the old codes to
+   the new ones, to be freed by the caller */
+static uint32_t *dict_sort(const col_heap *heap, col_dict *dict)
+{
+    uint32_t *order, *map;
+    uint32_t i;
+
+    if (dict->count == 0) {
+        return(NULL);
+    }
+    order = malloc(dict->count * sizeof(*order));
+    map = malloc(dict->count * sizeof(*map));
+    if (!order || !map) {
+        free(order);
+        free(map);
+        return(NULL);
+    }
+    sort_heap = heap->data;
+    for (i = 0; i < dict->count; i++) {
+        order[i] = dict->offsets[i];
+    }
+    qsort(order, dict->count, sizeof(*order), compare_heap_strings);
+    /* order now holds the offsets sorted; match each old code to its place */
+    for (i = 0; i < dict->count; i++) {
+        uint32_t lo = 0, hi = dict->count;
+        const char *str = heap->data + dict->offsets[i];
+
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+
+            if (strcmp(heap->data + order[mid], str) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        map[i] = lo;
+    }
+    memcpy(dict->offsets, order, dict->count * sizeof(*order));
+    free(order);
+    return(map);
+}
+
+static int compare_heap_strings(const void *a, const void *b)
+{
+    return(strcmp(sort_heap + *(const uint32_t *)a,
+                  sort_heap + *(const uint32_t *)b));
+}
+
+static int write_column(FILE *fp, const void *data, size_t size, uint64_t *offset_ptr)
+{
+    static const char padding[COLS_ALIGN];
+    long pos = ftell(fp);
+
+    if (pos < 0) {
+        return(0);
+    }
+    if (pos % COLS_ALIGN) {
+        if (fwrite(padding, COLS_ALIGN - pos % COLS_ALIGN, 1, fp) != 1) {
+            return(0);
+        }
+        pos += COLS_ALIGN - pos % COLS_ALIGN;
+    }
+    *offset_ptr = pos;
+    if (size && fwrite(data, size, 1, fp) != 1) {
+        return(0);
+    }
+    return(1);
+}
+
+/* Map an export and check it, including every dictionary code, so that
+   queries and aggregates can index by code without further tests. */
+cat_cols *cols_open(const char *path)
+{
+    const cols_header *hdr;
+    cat_cols *cols;
+    struct stat st;
+    uint64_t size;
+    uint32_t i;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return(NULL);
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(cols_header)) {
+        fprintf(stderr, "%s is not a columnar export\n", path);
+        close(fd);
+        return(NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s\n", path);
+        return(NULL);
+    }
+
+    hdr = map;
+    size = st.st_size;
+    if (memcmp(hdr->magic, COLS_MAGIC, sizeof(COLS_MAGIC)) != 0 ||
+        hdr->version != COLS_VERSION || hdr->heap_size == 0 ||
+        hdr->padded_cds % COLS_BLOCK != 0 || hdr->num_cds > hdr->padded_cds ||
+        hdr->types_offset + (uint64_t)hdr->num_types * sizeof(uint32_t) > size ||
+        hdr->artists_offset + (uint64_t)hdr->num_artists * sizeof(uint32_t) > size ||
+        hdr->type_col_offset + (uint64_t)hdr->padded_cds * sizeof(uint16_t) > size ||
+        hdr->artist_col_offset + (uint64_t)hdr->padded_cds * sizeof(uint32_t) > size ||
+        hdr->tracks_col_offset + (uint64_t)hdr->padded_cds * sizeof(uint8_t) > size ||
+        hdr->title_col_offset + (uint64_t)hdr->padded_cds * sizeof(uint32_t) > size ||
+        hdr->catalog_col_offset + (uint64_t)hdr->padded_cds * sizeof(uint32_t) > size ||
+        hdr->heap_offset + hdr->heap_size > size ||
+        ((const char *)map)[hdr->heap_offset + hdr->heap_size - 1] != '\0') {
+        fprintf(stderr, "%s is not a valid columnar export\n", path);
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+
+    cols = calloc(1, sizeof(*cols));
+    if (!cols) {
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+    cols->map = map;
+    cols->map_size = st.st_size;
+    cols->header = hdr;
+    cols->types = (const uint32_t *)(cols->map + hdr->types_offset);
+    cols->artists = (const uint32_t *)(cols->map + hdr->artists_offset);
+    cols->type_col = (const uint16_t *)(cols->map + hdr->type_col_offset);
+    cols->artist_col = (const uint32_t *)(cols->map + hdr->artist_col_offset);
+    cols->tracks_col = (const uint8_t *)(cols->map + hdr->tracks_col_offset);
+    cols->title_col = (const uint32_t *)(cols->map + hdr->title_col_offset);
+    cols->catalog_col = (const uint32_t *)(cols->map + hdr->catalog_col_offset);
+    cols->heap = cols->map + hdr->heap_offset;
+
+    for (i = 0; i < hdr->num_cds; i++) {
+        if (cols->type_col[i] >= hdr->num_types ||
+            cols->artist_col[i] >= hdr->num_artists) {
+            fprintf(stderr, "%s is not a valid columnar export\n", path);
+            cols_close(cols);
+            return(NULL);
+        }
+    }
+    return(cols);
+}
+
+void cols_close(cat_cols *cols)
+{
+    if (!cols) {
+        return;
+    }
+    munmap((void *)cols->map, cols->map_size);
+    free(cols);
+}
+
+uint32_t cols_num_cds(const cat_cols *cols)
+{
+    return(cols->header->num_cds);
+}
+
+static const char *cols_str(const cat_cols *cols, uint32_t offset)
+{
+    if (offset >= cols->header->heap_size) {
+        return("");
+    }
+    return(cols->heap + offset);
+}
+
+cols_bitmap *cols_select_all(const cat_cols *cols)
+{
+    cols_bitmap *sel;
+    uint32_t rows = cols->header->num_cds;
+
+    sel = malloc(sizeof(*sel));
+    if (!sel) {
+        return(NULL);
+    }
+    sel->num_rows = rows;
+    sel->num_words = cols->header->padded_cds / COLS_BLOCK;
+    sel->words = malloc((sel->num_words + 1) * sizeof(uint64_t));
+    if (!sel->words) {
+        free(sel);
+        return(NULL);
+    }
+    memset(sel->words, 0xff, sel->num_words * sizeof(uint64_t));
+    if (rows % COLS_BLOCK) {
+        sel->words[sel->num_words - 1] = (1ULL << (rows % COLS_BLOCK)) - 1;
+    }
+    return(sel);
+}
+
+void cols_bitmap_free(cols_bitmap *sel)
+{
+    if (!sel) {
+        return;
+    }
+    free(sel->words);
+    free(sel);
+}
+
+/* Predicates on the coded columns go first: they are cheap and leave
+   fewer rows for the string compares of title and catalog. */
+int cols_query(const cat_cols *cols, cols_bitmap *sel,
+               const cols_pred *preds, int num_preds)
+{
+    int pass, i;
+    int coded;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < num_preds; i++) {
+            coded = preds[i].field != COLS_TITLE && preds[i].field != COLS_CATALOG;
+            if (coded == (pass == 0) && !filter_one(cols, sel, &preds[i])) {
+                return(0);
+            }
+        }
+    }
+    return(1);
+}
+
+static int filter_one(const cat_cols *cols, cols_bitmap *sel, const cols_pred *pred)
+{
+    const cols_header *hdr = cols->header;
+    const uint32_t *dict;
+    unsigned char *hits;
+    uint32_t dict_size, matches, last, code, w;
+    long row;
+    int n;
+
+    switch (pred->field) {
+    case COLS_TRACKS:
+        n = atoi(pred->value);
+        if (pred->op == COLS_EQ) {
+            if (n < 0 || n > 255) {
+                memset(sel->words, 0, sel->num_words * sizeof(uint64_t));
+            } else {
+                kernel_range8(cols->tracks_col, n, n, sel->words, sel->num_words);
+            }
+        } else if (pred->op == COLS_LT) {
+            if (n <= 0) {
+                memset(sel->words, 0, sel->num_words * sizeof(uint64_t));
+            } else if (n <= 255) {
+                kernel_range8(cols->tracks_col, 0, n - 1, sel->words, sel->num_words);
+            }
+        } else if (pred->op == COLS_GT) {
+            if (n >= 255) {
+                memset(sel->words, 0, sel->num_words * sizeof(uint64_t));
+            } else if (n >= 0) {
+                kernel_range8(cols->tracks_col, n + 1, 255, sel->words, sel->num_words);
+            }
+        } else {
+            return(0);
+        }
+        return(1);
+
+    case COLS_TYPE:
+    case COLS_ARTIST:
+        if (pred->op != COLS_EQ && pred->op != COLS_CONTAINS) {
+            return(0);
+        }
+        if (pred->field == COLS_TYPE) {
+            dict = cols->types;
+            dict_size = hdr->num_types;
+        } else {
+            dict = cols->artists;
+            dict_size = hdr->num_artists;
+        }
+        hits = calloc(dict_size + 1, 1);
+        if (!hits) {
+            return(0);
+        }
+        matches = 0;
+        last = 0;
+        for (code = 0; code < dict_size; code++) {
+            if (string_matches(cols_str(cols, dict[code]), pred)) {
+                hits[code] = 1;
+                matches++;
+                last = code;
+            }
+        }
+        if (matches == 0) {
+            memset(sel->words, 0, sel->num_words * sizeof(uint64_t));
+        } else if (pred->field == COLS_TYPE) {
+            if (matches == 1) {
+                kernel_eq16(cols->type_col, last, sel->words, sel->num_words);
+            } else {
+                kernel_in16(cols->type_col, hits, sel->words, sel->num_words);
+            }
+        } else {
+            if (matches == 1) {
+                kernel_eq32(cols->artist_col, last, sel->words, sel->num_words);
+            } else {
+                kernel_in32(cols->artist_col, hits, sel->words, sel->num_words);
+            }
+        }
+        free(hits);
+        return(1);
+
+    case COLS_TITLE:
+    case COLS_CATALOG:
+        if (pred->op != COLS_EQ && pred->op != COLS_CONTAINS) {
+            return(0);
+        }
+        for (row = cols_next(sel, 0); row != -1; row = cols_next(sel, row + 1)) {
+            w = pred->field == COLS_TITLE ? cols->title_col[row] : cols->catalog_col[row];
+            if (!string_matches(cols_str(cols, w), pred)) {
+                sel->words[row / COLS_BLOCK] &= ~(1ULL << (row % COLS_BLOCK));
+            }
+        }
+        return(1);
+    }
+    return(0);
+}
+
+static int string_matches(const char *str, const cols_pred *pred)
+{
+    if (pred->op == COLS_EQ) {
+        return(strcmp(str, pred->value) == 0);
+    }
+    return(strstr(str, pred->value) != NULL);
+}
+
+uint32_t cols_count(const cols_bitmap *sel)
+{
+    uint32_t count = 0;
+    uint32_t w;
+
+    for (w = 0; w < sel->num_words; w++) {
+        count += __builtin_popcountll(sel->words[w]);
+    }
+    return(count);
+}
+
+long cols_next(const cols_bitmap *sel, uint32_t row)
+{
+    uint32_t w = row / COLS_BLOCK;
+    uint64_t word;
+
+    if (row >= sel->num_rows) {
+        return(-1);
+    }
+    word = sel->words[w] & (~0ULL << (row % COLS_BLOCK));
+    while (!word) {
+        if (++w >= sel->num_words) {
+            return(-1);
+        }
+        word = sel->words[w];
+    }
+    return((long)w * COLS_BLOCK + __builtin_ctzll(word));
+}
+
+uint64_t cols_sum_tracks(const cat_cols *cols, const cols_bitmap *sel)
+{
+    const uint8_t *col = cols->tracks_col;
+    uint64_t sum = 0;
+    uint64_t word;
+    uint32_t w, i, block_sum;
+
+    for (w = 0; w < sel->num_words; w++) {
+        word = sel->words[w];
+        if (word == ~0ULL) {
+            block_sum = 0;
+            for (i = 0; i < COLS_BLOCK; i++) {
+                block_sum += col[w * COLS_BLOCK + i];
+            }
+            sum += block_sum;
+            continue;
+        }
+        while (word) {
+            sum += col[w * COLS_BLOCK + __builtin_ctzll(word)];
+            word &= word - 1;
+        }
+    }
+    return(sum);
+}
+
+int cols_group_count(const cat_cols *cols, const cols_bitmap *sel,
+                     cols_field field, uint32_t *counts)
+{
+    uint64_t word;
+    uint32_t w, row;
+
+    if (field != COLS_TYPE && field != COLS_ARTIST) {
+        return(0);
+    }
+    memset(counts, 0, cols_dict_size(cols, field) * sizeof(*counts));
+    for (w = 0; w < sel->num_words; w++) {
+        word = sel->words[w];
+        while (word) {
+            row = w * COLS_BLOCK + __builtin_ctzll(word);
+            if (field == COLS_TYPE) {
+                counts[cols->type_col[row]]++;
+            } else {
+                counts[cols->artist_col[row]]++;
+            }
+            word &= word - 1;
+        }
+    }
+    return(1);
+}
+
+uint32_t cols_dict_size(const cat_cols *cols, cols_field field)
+{
+    if (field == COLS_TYPE) {
+        return(cols->header->num_types);
+    }
+    if (field == COLS_ARTIST) {
+        return(cols->header->num_artists);
+    }
+    return(0);
+}
+
+const char *cols_dict_entry(const cat_cols *cols, cols_field field, uint32_t code)
+{
+    if (code >= cols_dict_size(cols, field)) {
+        return("");
+    }
+    if (field == COLS_TYPE) {
+        return(cols_str(cols, cols->types[code]));
+    }
+    return(cols_str(cols, cols->artists[code]));
+}
+
+void cols_row(const cat_cols *cols, uint32_t row, cat_cd *dest, int *tracks)
+{
+    memset(dest, '\0', sizeof(*dest));
+    catalog_set_field(dest->catalog, cols_str(cols, cols->catalog_col[row]),
+                      CATALOG_CAT_LEN);
+    catalog_set_field(dest->title, cols_str(cols, cols->title_col[row]),
+                      CATALOG_TITLE_LEN);
+    catalog_set_field(dest->type,
+                      cols_str(cols, cols->types[cols->type_col[row]]),
+                      CATALOG_TYPE_LEN);
+    catalog_set_field(dest->artist,
+                      cols_str(cols, cols->artists[cols->artist_col[row]]),
+                      CATALOG_ARTIST_LEN);
+    if (tracks) {
+        *tracks = cols->tracks_col[row];
+    }
+}
+
+/* The kernels. Each ANDs its predicate into words[0 .. num_words). */
+
+static void kernel_eq16(const uint16_t *col, uint16_t value, uint64_t *words, uint32_t num_words)
+{
+    uint32_t w, i;
+    uint64_t mask;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi16((short)value);
+    const __m128i *p;
+    __m128i a, b;
+
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        p = (const __m128i *)(col + w * COLS_BLOCK);
+        mask = 0;
+        for (i = 0; i < 4; i++) {
+            a = _mm_cmpeq_epi16(_mm_loadu_si128(p + 2 * i), v);
+            b = _mm_cmpeq_epi16(_mm_loadu_si128(p + 2 * i + 1), v);
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << (i * 16);
+        }
+        words[w] &= mask;
+    }
+#else
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        mask = 0;
+        for (i = 0; i < COLS_BLOCK; i++) {
+            mask |= (uint64_t)(col[w * COLS_BLOCK + i] == value) << i;
+        }
+        words[w] &= mask;
+    }
+#endif
+}
+
+static void kernel_eq32(const uint32_t *col, uint32_t value, uint64_t *words, uint32_t num_words)
+{
+    uint32_t w, i;
+    uint64_t mask;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi32((int)value);
+    const __m128i *p;
+    __m128i a, b, c, d;
+
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        p = (const __m128i *)(col + w * COLS_BLOCK);
+        mask = 0;
+        for (i = 0; i < 4; i++) {
+            a = _mm_cmpeq_epi32(_mm_loadu_si128(p + 4 * i), v);
+            b = _mm_cmpeq_epi32(_mm_loadu_si128(p + 4 * i + 1), v);
+            c = _mm_cmpeq_epi32(_mm_loadu_si128(p + 4 * i + 2), v);
+            d = _mm_cmpeq_epi32(_mm_loadu_si128(p + 4 * i + 3), v);
+            a = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(a) << (i * 16);
+        }
+        words[w] &= mask;
+    }
+#else
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        mask = 0;
+        for (i = 0; i < COLS_BLOCK; i++) {
+            mask |= (uint64_t)(col[w * COLS_BLOCK + i] == value) << i;
+        }
+        words[w] &= mask;
+    }
+#endif
+}
+
+/* Several codes match: look each row's code up in the table of hits */
+static void kernel_in16(const uint16_t *col, const unsigned char *hits, uint64_t *words, uint32_t num_words)
+{
+    uint32_t w, i;
+    uint64_t mask;
+
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        mask = 0;
+        for (i = 0; i < COLS_BLOCK; i++) {
+            mask |= (uint64_t)hits[col[w * COLS_BLOCK + i]] << i;
+        }
+        words[w] &= mask;
+    }
+}
+
+static void kernel_in32(const uint32_t *col, const unsigned char *hits, uint64_t *words, uint32_t num_words)
+{
+    uint32_t w, i;
+    uint64_t mask;
+
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        mask = 0;
+        for (i = 0; i < COLS_BLOCK; i++) {
+            mask |= (uint64_t)hits[col[w * COLS_BLOCK + i]] << i;
+        }
+        words[w] &= mask;
+    }
+}
+
+/* lo <= col[row] <= hi. With SSE2 both bounds are tested with saturating
+   subtraction, which is zero exactly when the value is inside. */
+static void kernel_range8(const uint8_t *col, uint8_t lo, uint8_t hi, uint64_t *words, uint32_t num_words)
+{
+    uint32_t w, i;
+    uint64_t mask;
+#ifdef __SSE2__
+    const __m128i vlo = _mm_set1_epi8((char)lo);
+    const __m128i vhi = _mm_set1_epi8((char)hi);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i *p;
+    __m128i x, out;
+
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        p = (const __m128i *)(col + w * COLS_BLOCK);
+        mask = 0;
+        for (i = 0; i < 4; i++) {
+            x = _mm_loadu_si128(p + i);
+            out = _mm_or_si128(_mm_subs_epu8(x, vhi), _mm_subs_epu8(vlo, x));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(out, zero)) << (i * 16);
+        }
+        words[w] &= mask;
+    }
+#else
+    for (w = 0; w < num_words; w++) {
+        if (!words[w]) {
+            continue;
+        }
+        mask = 0;
+        for (i = 0; i < COLS_BLOCK; i++) {
+            mask |= (uint64_t)(col[w * COLS_BLOCK + i] >= lo &&
+                               col[w * COLS_BLOCK + i] <= hi) << i;
+        }
+        words[w] &= mask;
+    }
+#endif
+}
@@ -0,0 +1,105 @@
+/*
+   A columnar export of the catalog for ad-hoc questions over many CDs,
+   such as "how many CDs of type Jazz are there by artists matching Davis".
+   Each field is stored as its own array, one entry per CD:
+
+   - type and artist are dictionary encoded: the distinct values are kept
+     once, sorted, and the column holds a small code per CD
+   - title and catalog are string offsets into a heap
+   - tracks holds the number of tracks of each CD
+
+   A query runs each predicate over a whole column at a time and keeps the
+   answer as a bitmap with one bit per CD, so predicates combine with AND
+   and counts are a popcount. Predicates on type and artist are first
+   evaluated once per dictionary entry, then as a compare of codes.
+ */
+
+#ifndef CAT_COLS_H
+#define CAT_COLS_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define COLS_MAGIC    "CDCOLS1"
+#define COLS_VERSION  1
+#define COLS_BLOCK    64        /* columns are padded to whole bitmap words */
+#define COLS_MAX_TYPES 65535
+
+/* On-disk layout, offsets from the start of the file */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_cds;
+    uint32_t padded_cds;        /* num_cds rounded up to COLS_BLOCK */
+    uint32_t num_types;
+    uint32_t num_artists;
+    uint32_t heap_size;
+    uint64_t types_offset;      /* uint32_t heap offsets, sorted */
+    uint64_t artists_offset;    /* uint32_t heap offsets, sorted */
+    uint64_t type_col_offset;   /* uint16_t code per CD */
+    uint64_t artist_col_offset; /* uint32_t code per CD */
+    uint64_t tracks_col_offset; /* uint8_t count per CD */
+    uint64_t title_col_offset;  /* uint32_t heap offset per CD */
+    uint64_t catalog_col_offset;/* uint32_t heap offset per CD */
+    uint64_t heap_offset;
+} cols_header;
+
+typedef struct cat_cols cat_cols;
+
+typedef enum {
+    COLS_CATALOG,
+    COLS_TITLE,
+    COLS_TYPE,
+    COLS_ARTIST,
+    COLS_TRACKS
+} cols_field;
+
+typedef enum {
+    COLS_EQ,            /* equal */
+    COLS_CONTAINS,      /* substring, for the string fields */
+    COLS_LT,            /* less than, for tracks */
+    COLS_GT             /* greater than, for tracks */
+} cols_op;
+
+typedef struct {
+    cols_field field;
+    cols_op op;
+    const char *value;
+} cols_pred;
+
+/* One bit per CD, CD n being bit n % 64 of word n / 64 */
+typedef struct {
+    uint32_t num_rows;
+    uint32_t num_words;
+    uint64_t *words;
+} cols_bitmap;
+
+/* Exporting a store, and opening an export */
+int cols_build(catalog_backend *from, const char *path);
+cat_cols *cols_open(const char *path);
+void cols_close(cat_cols *cols);
+uint32_t cols_num_cds(const cat_cols *cols);
+
+/* Selections. cols_query narrows sel to the CDs matching every predicate;
+   it returns 0 if a predicate can't apply to its field. */
+cols_bitmap *cols_select_all(const cat_cols *cols);
+void cols_bitmap_free(cols_bitmap *sel);
+int cols_query(const cat_cols *cols, cols_bitmap *sel,
+               const cols_pred *preds, int num_preds);
+uint32_t cols_count(const cols_bitmap *sel);
+/* the first selected row at or after row, or -1 */
+long cols_next(const cols_bitmap *sel, uint32_t row);
+
+/* Aggregates over a selection */
+uint64_t cols_sum_tracks(const cat_cols *cols, const cols_bitmap *sel);
+/* counts must hold cols_dict_size(cols, field) entries; type and artist only */
+int cols_group_count(const cat_cols *cols, const cols_bitmap *sel,
+                     cols_field field, uint32_t *counts);
+uint32_t cols_dict_size(const cat_cols *cols, cols_field field);
+const char *cols_dict_entry(const cat_cols *cols, cols_field field, uint32_t code);
+
+/* The fields of one row */
+void cols_row(const cat_cols *cols, uint32_t row, cat_cd *dest, int *tracks);
+
+#endif
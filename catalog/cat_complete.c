@@ -0,0 +1,457 @@
+/*
+   Building and searching the completion trie. See cat_complete.h.
+
+   The trie is built breadth first over the sorted keys, so the children
+   of a node are always made together and land next to each other. A node
+   covering keys lo to hi that share their first d bytes takes as its
+   label the bytes from d that the first and last of them share, which
+   for sorted keys all of them do. Keys that end at the node come first
+   in its range; the rest are split into children by their next byte.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_complete.h"
+
+#define COMPLETE_KEY_LEN  CATALOG_TITLE_LEN     /* the longest key */
+/* Where the entries start in an index file, aligned for them */
+#define COMPLETE_DATA     ((sizeof(complete_header) + 7) & ~(size_t)7)
+
+/* One key and the CD it came from, all as heap offsets */
+typedef struct {
+    uint32_t key;
+    uint32_t catalog;
+    uint32_t title;
+    uint32_t is_title;
+} complete_entry;
+
+typedef struct {
+    uint32_t label;         /* heap offset of the label */
+    uint32_t first_child;
+    uint32_t first_key;
+    uint32_t num_keys;
+    uint8_t label_len;
+    uint8_t key_len;        /* bytes from the root to the end of the label */
+    uint16_t num_children;
+} complete_node;
+
+struct cat_complete {
+    char *heap;
+    uint32_t heap_size;
+    uint32_t heap_allocated;
+    complete_entry *entries;
+    uint32_t num_entries;
+    uint32_t entries_allocated;
+    complete_node *nodes;
+    uint32_t num_nodes;
+    void *map;              /* of an index file, which the arrays are in */
+    size_t map_len;
+};
+
+static int add_cd(const cat_cd *cd, void *arg);
+static cat_complete *load_index(const char *path, const char *spec,
+                                const char *stamp);
+static int save_index(const cat_complete *index, const char *path,
+                      const char *spec, const char *stamp);
+static int heap_add(cat_complete *index, const char *str, uint32_t *offset);
+static int add_entry(cat_complete *index, const char *key, uint32_t catalog,
+                     uint32_t title, int is_title);
+static int compare_entries(const void *a, const void *b);
+static const complete_node *find_child(const cat_complete *index,
+                                       const complete_node *node, unsigned char c);
+
+/* The heap being sorted by compare_entries */
+static const char *sort_heap;
+
+cat_complete *complete_build(catalog_backend *from)
+{
+    cat_complete *index;
+
+    index = complete_new();
+    if (!index) {
+        return(NULL);
+    }
+    if (!catalog_scan(from, add_cd, index) || !complete_finish(index)) {
+        complete_free(index);
+        return(NULL);
+    }
+    return(index);
+}
+
+static int add_cd(const cat_cd *cd, void *arg)
+{
+    return(complete_add(arg, cd));
+}
+
+/* The stamp is taken before the scan, so a change during it makes the
+   file out of date. Failing to write it only costs the next run a scan. */
+cat_complete *complete_open(catalog_backend *from, const char *path)
+{
+    char stamp[CATALOG_STAMP_LEN + 1];
+    cat_complete *index;
+
+    if (!catalog_stamp(from, stamp)) {
+        return(complete_build(from));
+    }
+    index = load_index(path, from->spec, stamp);
+    if (index) {
+        return(index);
+    }
+    index = complete_build(from);
+    if (index) {
+        (void) save_index(index, path, from->spec, stamp);
+    }
+    return(index);
+}
+
+/* NULL if the file is missing, of another store or stamp, or the wrong
+   size for its header */
+static cat_complete *load_index(const char *path, const char *spec,
+                                const char *stamp)
+{
+    const complete_header *header;
+    cat_complete *index;
+    struct stat st;
+    size_t nodes, heap;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return(NULL);
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < COMPLETE_DATA) {
+        close(fd);
+        return(NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return(NULL);
+    }
+    header = map;
+    nodes = COMPLETE_DATA + (size_t)header->num_entries * sizeof(complete_entry);
+    heap = nodes + (size_t)header->num_nodes * sizeof(complete_node);
+    if (memcmp(header->magic, COMPLETE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != COMPLETE_VERSION ||
+        strncmp(header->spec, spec, sizeof(header->spec)) != 0 ||
+        strncmp(header->stamp, stamp, sizeof(header->stamp)) != 0 ||
+        header->num_nodes == 0 || header->heap_size == 0 ||
+        (size_t)st.st_size != heap + header->heap_size ||
+        ((char *)map)[st.st_size - 1] != '\0') {
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+    index = calloc(1, sizeof(*index));
+    if (!index) {
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+    index->map = map;
+    index->map_len = st.st_size;
+    index->entries = (complete_entry *)((char *)map + COMPLETE_DATA);
+    index->num_entries = header->num_entries;
+    index->nodes = (complete_node *)((char *)map + nodes);
+    index->num_nodes = header->num_nodes;
+    index->heap = (char *)map + heap;
+    index->heap_size = header->heap_size;
+    return(index);
+}
+
+/* Under a temporary name, renamed over the old file when it is whole */
+static int save_index(const cat_complete *index, const char *path,
+                      const char *spec, const char *stamp)
+{
+    static const char padding[8];
+    complete_header header;
+    char temp_path[FILENAME_MAX];
+    FILE *fp;
+    int ok;
+
+    memset(&header, '\0', sizeof(header));
+    memcpy(header.magic, COMPLETE_MAGIC, sizeof(header.magic));
+    header.version = COMPLETE_VERSION;
+    header.num_entries = index->num_entries;
+    header.num_nodes = index->num_nodes;
+    header.heap_size = index->heap_size;
+    snprintf(header.spec, sizeof(header.spec), "%s", spec);
+    snprintf(header.stamp, sizeof(header.stamp), "%s", stamp);
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        return(0);
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(padding, 1, COMPLETE_DATA - sizeof(header), fp) ==
+         COMPLETE_DATA - sizeof(header) &&
+         fwrite(index->entries, sizeof(complete_entry), index->num_entries, fp) ==
+         index->num_entries &&
+         fwrite(index->nodes, sizeof(complete_node), index->num_nodes, fp) ==
+         index->num_nodes &&
+         fwrite(index->heap, 1, index->heap_size, fp) == index->heap_size;
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return(0);
+    }
+    return(1);
+}
+
+/* Offset 0 of the heap is always the empty string */
+cat_complete *complete_new(void)
+{
+    cat_complete *index;
+    uint32_t offset;
+
+    index = calloc(1, sizeof(*index));
+    if (!index) {
+        return(NULL);
+    }
+    if (!heap_add(index, "", &offset)) {
+        free(index);
+        return(NULL);
+    }
+    return(index);
+}
+
+void complete_free(cat_complete *index)
+{
+    if (!index) {
+        return;
+    }
+    if (index->map) {
+        munmap(index->map, index->map_len);
+    } else {
+        free(index->heap);
+        free(index->entries);
+        free(index->nodes);
+    }
+    free(index);
+}
+
+int complete_add(cat_complete *index, const cat_cd *cd)
+{
+    char key[COMPLETE_KEY_LEN + 1];
+    uint32_t catalog, title;
+
+    if (index->nodes || !cd->catalog[0]) {
+        return(0);
+    }
+    if (!heap_add(index, cd->catalog, &catalog) ||
+        !heap_add(index, cd->title, &title)) {
+        return(0);
+    }
+    catalog_fold(key, cd->catalog, CATALOG_CAT_LEN);
+    if (!add_entry(index, key, catalog, title, 0)) {
+        return(0);
+    }
+    catalog_fold(key, cd->title, CATALOG_TITLE_LEN);
+    if (key[0] && !add_entry(index, key, catalog, title, 1)) {
+        return(0);
+    }
+    return(1);
+}
+
+static int heap_add(cat_complete *index, const char *str, uint32_t *offset)
+{
+    uint32_t len = strlen(str) + 1;
+    uint32_t new_size;
+    char *new_heap;
+
+    if (index->heap_size + len > index->heap_allocated) {
+        new_size = index->heap_allocated ? index->heap_allocated * 2 : 4096;
+        while (new_size < index->heap_size + len) {
+            new_size *= 2;
+        }
+        new_heap = realloc(index->heap, new_size);
+        if (!new_heap) {
+            return(0);
+        }
+        index->heap = new_heap;
+        index->heap_allocated = new_size;
+    }
+    memcpy(index->heap + index->heap_size, str, len);
+    *offset = index->heap_size;
+    index->heap_size += len;
+    return(1);
+}
+
+static int add_entry(cat_complete *index, const char *key, uint32_t catalog,
+                     uint32_t title, int is_title)
+{
+    complete_entry *new_entries;
+    complete_entry *entry;
+    uint32_t new_size;
+
+    if (index->num_entries == index->entries_allocated) {
+        new_size = index->entries_allocated ? index->entries_allocated * 2 : 1024;
+        new_entries = realloc(index->entries, new_size * sizeof(*new_entries));
+        if (!new_entries) {
+            return(0);
+        }
+        index->entries = new_entries;
+        index->entries_allocated = new_size;
+    }
+    entry = &index->entries[index->num_entries];
+    if (!heap_add(index, key, &entry->key)) {
+        return(0);
+    }
+    entry->catalog = catalog;
+    entry->title = title;
+    entry->is_title = is_title;
+    index->num_entries++;
+    return(1);
+}
+
+/* Sort the keys and build the trie over them */
+int complete_finish(cat_complete *index)
+{
+    complete_node *node, *child;
+    const char *first, *last;
+    uint32_t lo, hi, end, i;
+    size_t d, len;
+
+    if (index->nodes) {
+        return(0);
+    }
+    sort_heap = index->heap;
+    qsort(index->entries, index->num_entries, sizeof(*index->entries),
+          compare_entries);
+
+    /* a trie over n keys has at most 2n nodes, with the root */
+    index->nodes = calloc(2 * index->num_entries + 1, sizeof(*index->nodes));
+    if (!index->nodes) {
+        return(0);
+    }
+    index->nodes[0].num_keys = index->num_entries;
+    index->num_nodes = 1;
+
+    for (i = 0; i < index->num_nodes; i++) {
+        node = &index->nodes[i];
+        d = node->key_len;
+        lo = node->first_key;
+        end = node->first_key + node->num_keys;
+        while (lo < end && index->heap[index->entries[lo].key + d] == '\0') {
+            lo++;
+        }
+        node->first_child = index->num_nodes;
+        for (; lo < end; lo = hi) {
+            first = index->heap + index->entries[lo].key;
+            hi = lo + 1;
+            while (hi < end && index->heap[index->entries[hi].key + d] == first[d]) {
+                hi++;
+            }
+            last = index->heap + index->entries[hi - 1].key;
+            len = d + 1;
+            while (first[len] && first[len] == last[len]) {
+                len++;
+            }
+            child = &index->nodes[index->num_nodes++];
+            child->label = index->entries[lo].key + d;
+            child->label_len = len - d;
+            child->key_len = len;
+            child->first_key = lo;
+            child->num_keys = hi - lo;
+            node->num_children++;
+        }
+    }
+    return(1);
+}
+
+/* By key, then catalog numbers before titles, then by catalog number */
+static int compare_entries(const void *a, const void *b)
+{
+    const complete_entry *entry_a = a;
+    const complete_entry *entry_b = b;
+    int res;
+
+    res = strcmp(sort_heap + entry_a->key, sort_heap + entry_b->key);
+    if (res == 0) {
+        res = (int)entry_a->is_title - (int)entry_b->is_title;
+    }
+    if (res == 0) {
+        res = strcmp(sort_heap + entry_a->catalog, sort_heap + entry_b->catalog);
+    }
+    return(res);
+}
+
+int complete_prefix(const cat_complete *index, const char *prefix,
+                    complete_match *dest, int max_matches, uint32_t *total)
+{
+    char key[COMPLETE_KEY_LEN + 1];
+    const complete_node *node;
+    const complete_entry *entry;
+    size_t pos, len, n;
+    int count;
+
+    if (total) {
+        *total = 0;
+    }
+    if (!index || !index->nodes) {
+        return(0);
+    }
+    catalog_fold(key, prefix, COMPLETE_KEY_LEN);
+    len = strlen(key);
+    node = &index->nodes[0];
+    for (pos = 0; pos < len; pos += n) {
+        node = find_child(index, node, key[pos]);
+        if (!node) {
+            return(0);
+        }
+        n = node->label_len < len - pos ? node->label_len : len - pos;
+        if (memcmp(index->heap + node->label, key + pos, n) != 0) {
+            return(0);
+        }
+    }
+
+    if (total) {
+        *total = node->num_keys;
+    }
+    for (count = 0; count < max_matches && (uint32_t)count < node->num_keys; count++) {
+        entry = &index->entries[node->first_key + count];
+        dest[count].catalog = index->heap + entry->catalog;
+        dest[count].title = index->heap + entry->title;
+        dest[count].is_title = entry->is_title;
+        dest[count].text = entry->is_title ? dest[count].title : dest[count].catalog;
+    }
+    return(count);
+}
+
+/* The children are in order of the first byte of their labels */
+static const complete_node *find_child(const cat_complete *index,
+                                       const complete_node *node, unsigned char c)
+{
+    const complete_node *child;
+    int lo = 0;
+    int hi = node->num_children;
+    int mid;
+    unsigned char first;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        child = &index->nodes[node->first_child + mid];
+        first = index->heap[child->label];
+        if (first == c) {
+            return(child);
+        }
+        if (first < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return(NULL);
+}
+
+uint32_t complete_num_keys(const cat_complete *index)
+{
+    return(index ? index->num_entries : 0);
+}
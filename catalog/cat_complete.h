@@ -0,0 +1,73 @@
+/*
+   Prefix completion of catalog numbers and titles, for typing them a few
+   characters at a time.
+
+   The index is a compressed trie held in flat arrays. Every catalog number
+   and title is a key, folded by catalog_fold so completion ignores case and
+   accents. The keys are sorted, and each node of the trie has the label of
+   the edge into it, its children next to each other in byte order, and the
+   range of sorted keys below it. Completing a prefix is a walk down the
+   trie of at most one step per byte typed; the first k keys of the range
+   found are the answer, already in order, with the size of the range as
+   the number of matches. The labels point into the keys, so the trie adds
+   one small node per branch and nothing per byte.
+
+   A program that completes once per run, such as a shell completion,
+   keeps the index in a file with complete_open. The file is the arrays as
+   they are in memory after a header naming the store and holding its
+   stamp (catalog_stamp), as with a sort file (cat_sort.h), and is mapped
+   rather than read, so while the stamp is unchanged a completion costs
+   the pages it walks rather than a scan of the store.
+ */
+
+#ifndef CAT_COMPLETE_H
+#define CAT_COMPLETE_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define COMPLETE_MAGIC    "CDCOMP1"
+#define COMPLETE_VERSION  1
+
+/* The header of an index file; the entries, the nodes and the heap follow */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t num_nodes;
+    uint32_t heap_size;
+    char spec[100];
+    char stamp[CATALOG_STAMP_LEN + 1];
+} complete_header;
+
+typedef struct cat_complete cat_complete;
+
+/* One completion. The strings belong to the index. */
+typedef struct {
+    const char *text;       /* what completes the prefix, as stored */
+    const char *catalog;    /* the CD it is from */
+    const char *title;
+    int is_title;           /* text is the title rather than the catalog */
+} complete_match;
+
+/* Index every CD of a store */
+cat_complete *complete_build(catalog_backend *from);
+/* The index in the file at path, or, if it isn't an up to date one of the
+   store, a new one, written to the file if it can be */
+cat_complete *complete_open(catalog_backend *from, const char *path);
+
+/* Or add the CDs one at a time, then finish to build the trie */
+cat_complete *complete_new(void);
+int complete_add(cat_complete *index, const cat_cd *cd);
+int complete_finish(cat_complete *index);
+void complete_free(cat_complete *index);
+
+/* Fill dest with the first max_matches completions of prefix in order and
+   return how many there are; *total, if not NULL, gets how many keys start
+   with the prefix */
+int complete_prefix(const cat_complete *index, const char *prefix,
+                    complete_match *dest, int max_matches, uint32_t *total);
+uint32_t complete_num_keys(const cat_complete *index);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+   The dbm backend maps the catalog operations onto cd_access.c, so the
+   files stay readable by the cd_dbm application. Tracks are stored one
+   per key, numbered from 1, and a CD's tracks end at the first missing
+   number, as in app_ui.c. Disc IDs are kept in a third file, which the
+   cd_dbm application leaves alone apart from removing deleted CDs, and
+   track titles in a fourth, shared by the tracks with the same title.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "cd_data.h"
+
+/* The files cd_access.c keeps the data in */
+#define DBM_CDC_FILE  "cdc_data.pag"
+#define DBM_CDT_FILE  "cdt_data.pag"
+#define DBM_CDI_FILE  "cdi_data.pag"
+#define DBM_CDD_FILE  "cdd_data.pag"
+
+static int dbm_open_store(catalog_backend *be, const char *location, int create);
+static void dbm_close_store(catalog_backend *be);
+static int dbm_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+static int dbm_get_tracks(catalog_backend *be, const char *catalog,
+                          cat_track *dest, int max_tracks);
+static int dbm_put_cd(catalog_backend *be, const cat_cd *cd);
+static int dbm_put_tracks(catalog_backend *be, const char *catalog,
+                          const cat_track *tracks, int count);
+static int dbm_del_cd(catalog_backend *be, const char *catalog);
+static int dbm_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+static int dbm_stamp(catalog_backend *be, char *dest, int dest_len);
+static int dbm_scan_tracks(catalog_backend *be, int part, int num_parts,
+                           cat_track_fn fn, void *arg);
+static int dbm_del_tracks(catalog_backend *be, const char *catalog);
+static int dbm_find_disc_id(catalog_backend *be, const char *disc_id,
+                            cat_scan_fn fn, void *arg);
+static void del_all_tracks(const char *catalog);
+
+const struct catalog_ops cat_dbm_ops = {
+    "dbm",
+    1,
+    dbm_open_store,
+    dbm_close_store,
+    dbm_get_cd,
+    dbm_get_tracks,
+    dbm_put_cd,
+    dbm_put_tracks,
+    dbm_del_cd,
+    dbm_scan,
+    NULL,
+    dbm_stamp,
+    dbm_scan_tracks,
+    dbm_del_tracks,
+    NULL,
+    dbm_find_disc_id
+};
+
+/* cd_access.c keeps one database open in file scope variables */
+static int dbm_in_use = 0;
+
+/* The location is not a place, as the files are always in the current
+   directory, but gdbm options for this store, as database_parse_options
+   takes them */
+static int dbm_open_store(catalog_backend *be, const char *location, int create)
+{
+    cd_db_options saved, options;
+    int result;
+
+    if (dbm_in_use) {
+        fprintf(stderr, "Only one dbm catalog can be open at a time\n");
+        return(0);
+    }
+    database_get_options(&saved);
+    options = saved;
+    if (location && !database_parse_options(location, &options)) {
+        fprintf(stderr, "The dbm catalog is always in the current directory\n");
+        return(0);
+    }
+    database_set_options(&options);
+    result = database_initialize(create);
+    database_set_options(&saved);
+    if (!result) {
+        return(0);
+    }
+    dbm_in_use = 1;
+    return(1);
+}
+
+static void dbm_close_store(catalog_backend *be)
+{
+    database_close();
+    dbm_in_use = 0;
+}
+
+static int dbm_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    cdc_entry cdc;
+
+    cdc = get_cdc_entry(catalog);
+    if (!cdc.catalog[0]) {
+        return(0);
+    }
+    catalog_set_field(dest->catalog, cdc.catalog, CATALOG_CAT_LEN);
+    catalog_set_field(dest->title, cdc.title, CATALOG_TITLE_LEN);
+    catalog_set_field(dest->type, cdc.type, CATALOG_TYPE_LEN);
+    catalog_set_field(dest->artist, cdc.artist, CATALOG_ARTIST_LEN);
+    get_cdc_disc_id(cdc.catalog, dest->disc_id);
+    return(1);
+}
+
+static int dbm_get_tracks(catalog_backend *be, const char *catalog,
+                          cat_track *dest, int max_tracks)
+{
+    cdt_entry cdt;
+    int count = 0;
+
+    while (count < max_tracks) {
+        cdt = get_cdt_entry(catalog, count + 1);
+        if (!cdt.catalog[0]) {
+            break;
+        }
+        catalog_set_field(dest[count].catalog, cdt.catalog, CATALOG_CAT_LEN);
+        dest[count].track_no = cdt.track_no;
+        catalog_set_field(dest[count].title, cdt.track_txt, CATALOG_TRACK_LEN);
+        count++;
+    }
+    return(count);
+}
+
+static int dbm_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    cdc_entry cdc;
+
+    memset(&cdc, '\0', sizeof(cdc));
+    catalog_set_field(cdc.catalog, cd->catalog, CAT_CAT_LEN);
+    catalog_set_field(cdc.title, cd->title, CAT_TITLE_LEN);
+    catalog_set_field(cdc.type, cd->type, CAT_TYPE_LEN);
+    catalog_set_field(cdc.artist, cd->artist, CAT_ARTIST_LEN);
+    return(add_cdc_entry(cdc) && set_cdc_disc_id(cdc.catalog, cd->disc_id));
+}
+
+/* The new tracks are renumbered from 1, so there are never gaps */
+static int dbm_put_tracks(catalog_backend *be, const char *catalog,
+                          const cat_track *tracks, int count)
+{
+    cdt_entry cdt;
+    int i;
+
+    del_all_tracks(catalog);
+    for (i = 0; i < count; i++) {
+        memset(&cdt, '\0', sizeof(cdt));
+        catalog_set_field(cdt.catalog, catalog, TRACK_CAT_LEN);
+        cdt.track_no = i + 1;
+        catalog_set_field(cdt.track_txt, tracks[i].title, TRACK_TTEXT_LEN);
+        if (!add_cdt_entry(cdt)) {
+            return(0);
+        }
+    }
+    return(1);
+}
+
+static int dbm_del_cd(catalog_backend *be, const char *catalog)
+{
+    del_all_tracks(catalog);
+    return(del_cdc_entry(catalog));
+}
+
+/* search_cdc_entry with an empty string matches every entry */
+static int dbm_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    cdc_entry cdc;
+    cat_cd cd;
+    int first_call = 1;
+
+    do {
+        cdc = search_cdc_entry("", &first_call);
+        if (cdc.catalog[0]) {
+            memset(&cd, '\0', sizeof(cd));
+            catalog_set_field(cd.catalog, cdc.catalog, CATALOG_CAT_LEN);
+            catalog_set_field(cd.title, cdc.title, CATALOG_TITLE_LEN);
+            catalog_set_field(cd.type, cdc.type, CATALOG_TYPE_LEN);
+            catalog_set_field(cd.artist, cdc.artist, CATALOG_ARTIST_LEN);
+            get_cdc_disc_id(cdc.catalog, cd.disc_id);
+            if (!fn(&cd, arg)) {
+                break;
+            }
+        }
+    } while (cdc.catalog[0]);
+    return(1);
+}
+
+/* dbm writes in place, so this relies on the change time of the files.
+   Two changes within the resolution of the file system clock look alike. */
+static int dbm_stamp(catalog_backend *be, char *dest, int dest_len)
+{
+    catalog_stamp_file(dest, dest_len, DBM_CDC_FILE);
+    catalog_stamp_file(dest, dest_len, DBM_CDT_FILE);
+    catalog_stamp_file(dest, dest_len, DBM_CDI_FILE);
+    catalog_stamp_file(dest, dest_len, DBM_CDD_FILE);
+    return(1);
+}
+
+/* One walk of the dbm file can't be shared out, so part 0 does it all */
+static int dbm_scan_tracks(catalog_backend *be, int part, int num_parts,
+                           cat_track_fn fn, void *arg)
+{
+    cat_track track;
+    cdt_entry cdt;
+    int first_call = 1;
+
+    if (part != 0) {
+        return(1);
+    }
+    while (1) {
+        cdt = next_cdt_entry(&first_call);
+        if (!cdt.catalog[0]) {
+            break;
+        }
+        memset(&track, '\0', sizeof(track));
+        catalog_set_field(track.catalog, cdt.catalog, CATALOG_CAT_LEN);
+        track.track_no = cdt.track_no;
+        catalog_set_field(track.title, cdt.track_txt, CATALOG_TRACK_LEN);
+        if (!fn(&track, arg)) {
+            break;
+        }
+    }
+    return(1);
+}
+
+/* Every number a track can have, past any gap, unlike del_all_tracks */
+static int dbm_del_tracks(catalog_backend *be, const char *catalog)
+{
+    int track_no;
+
+    for (track_no = 1; track_no <= CATALOG_MAX_TRACKS; track_no++) {
+        del_cdt_entry(catalog, track_no);
+    }
+    return(1);
+}
+
+/* One fetch for the list of CDs with the ID, and one for each of them */
+static int dbm_find_disc_id(catalog_backend *be, const char *disc_id,
+                            cat_scan_fn fn, void *arg)
+{
+    cdi_entry cdi;
+    cat_cd cd;
+    int i;
+
+    cdi = get_cdi_entry(disc_id);
+    for (i = 0; i < cdi.count; i++) {
+        if (dbm_get_cd(be, cdi.catalog[i], &cd) && !fn(&cd, arg)) {
+            break;
+        }
+    }
+    return(1);
+}
+
+static void del_all_tracks(const char *catalog)
+{
+    int track_no = 1;
+
+    while (del_cdt_entry(catalog, track_no)) {
+        track_no++;
+    }
+}
@@ -0,0 +1,602 @@
+/*
+   Compiling and running catalog filters. See cat_filter.h for the language.
+
+   The program works on one flag, the result so far. A test sets it, NOT
+   inverts it, and "a and b" compiles to
+
+       a; JUMP_FALSE end; b; end:
+
+   so b is only tried when a held; "or" is the same with JUMP_TRUE. The
+   program keeps the shape of the expression, which is what lets
+   filter_to_sql turn it back into SQL.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "catalog.h"
+#include "cat_filter.h"
+
+typedef enum {
+    OP_TEST,
+    OP_NOT,
+    OP_JUMP_FALSE,
+    OP_JUMP_TRUE
+} filter_op;
+
+typedef enum {
+    MATCH_EQUAL,
+    MATCH_PREFIX,
+    MATCH_CONTAINS
+} filter_match_kind;
+
+typedef struct {
+    unsigned char op;
+    unsigned char field;
+    unsigned char match;
+    int target;         /* for the jumps, where to go */
+    int value;          /* for a test, offset into values */
+    int value_len;
+} filter_insn;
+
+struct cat_filter {
+    int flags;
+    filter_insn *program;
+    int length;
+    int allocated;
+    char *values;
+    int values_size;
+};
+
+typedef struct {
+    const char *pos;
+    cat_filter *filter;
+    int failed;
+} filter_parser;
+
+/* A growing string for filter_to_sql */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t allocated;
+} sql_text;
+
+static const char *field_names[FILTER_NUM_FIELDS] = {
+    "catalog", "title", "type", "artist"
+};
+
+static int parse_or(filter_parser *fp);
+static int parse_and(filter_parser *fp);
+static int parse_not(filter_parser *fp);
+static int parse_primary(filter_parser *fp);
+static int parse_word(filter_parser *fp, char *dest, int dest_len);
+static int next_is_keyword(filter_parser *fp, const char *keyword);
+static int at_term_start(filter_parser *fp);
+static void skip_space(filter_parser *fp);
+static int emit_any_field(filter_parser *fp, const char *word);
+static int emit(filter_parser *fp, filter_op op, int field, int match,
+                const char *value);
+static int test_field(const char *str, const cat_filter *filter,
+                      const filter_insn *insn);
+static int sql_append(sql_text *text, const char *str, size_t len);
+static int sql_test(sql_text *text, const cat_filter *filter,
+                    const filter_insn *insn, const char *column);
+
+cat_filter *filter_compile(const char *expr, int flags)
+{
+    filter_parser fp;
+    cat_filter *filter;
+
+    filter = calloc(1, sizeof(*filter));
+    if (!filter) {
+        return(NULL);
+    }
+    filter->flags = flags;
+    memset(&fp, 0, sizeof(fp));
+    fp.pos = expr;
+    fp.filter = filter;
+
+    skip_space(&fp);
+    if (*fp.pos && (!parse_or(&fp) || (skip_space(&fp), *fp.pos))) {
+        if (!fp.failed) {
+            fprintf(stderr, "Filter: unexpected \"%s\"\n", fp.pos);
+        }
+        filter_free(filter);
+        return(NULL);
+    }
+    return(filter);
+}
+
+int filter_ignores_case(const cat_filter *filter)
+{
+    return((filter->flags & FILTER_IGNORE_CASE) != 0);
+}
+
+void filter_free(cat_filter *filter)
+{
+    if (!filter) {
+        return;
+    }
+    free(filter->program);
+    free(filter->values);
+    free(filter);
+}
+
+/* or_expr := and_expr { "or" and_expr } */
+static int parse_or(filter_parser *fp)
+{
+    int jump;
+
+    if (!parse_and(fp)) {
+        return(0);
+    }
+    while (next_is_keyword(fp, "or")) {
+        jump = fp->filter->length;
+        if (!emit(fp, OP_JUMP_TRUE, 0, 0, NULL) || !parse_and(fp)) {
+            return(0);
+        }
+        fp->filter->program[jump].target = fp->filter->length;
+    }
+    return(1);
+}
+
+/* and_expr := not_expr { ["and"] not_expr } */
+static int parse_and(filter_parser *fp)
+{
+    int jump;
+
+    if (!parse_not(fp)) {
+        return(0);
+    }
+    for (;;) {
+        if (!next_is_keyword(fp, "and") && !at_term_start(fp)) {
+            return(1);
+        }
+        jump = fp->filter->length;
+        if (!emit(fp, OP_JUMP_FALSE, 0, 0, NULL) || !parse_not(fp)) {
+            return(0);
+        }
+        fp->filter->program[jump].target = fp->filter->length;
+    }
+}
+
+/* not_expr := "not" not_expr | primary */
+static int parse_not(filter_parser *fp)
+{
+    if (next_is_keyword(fp, "not")) {
+        return(parse_not(fp) && emit(fp, OP_NOT, 0, 0, NULL));
+    }
+    return(parse_primary(fp));
+}
+
+/* primary := "(" or_expr ")" | FIELD OP VALUE | WORD */
+static int parse_primary(filter_parser *fp)
+{
+    char word[CATALOG_TITLE_LEN + 1];
+    char value[CATALOG_TITLE_LEN + 1];
+    int field, match;
+
+    skip_space(fp);
+    if (*fp->pos == '(') {
+        fp->pos++;
+        if (!parse_or(fp)) {
+            return(0);
+        }
+        skip_space(fp);
+        if (*fp->pos != ')') {
+            fprintf(stderr, "Filter: missing )\n");
+            fp->failed = 1;
+            return(0);
+        }
+        fp->pos++;
+        return(1);
+    }
+
+    if (!parse_word(fp, word, sizeof(word) - 1)) {
+        return(0);
+    }
+    skip_space(fp);
+    switch (*fp->pos) {
+    case '=': match = MATCH_EQUAL; break;
+    case '^': match = MATCH_PREFIX; break;
+    case '~': match = MATCH_CONTAINS; break;
+    default: return(emit_any_field(fp, word));
+    }
+    fp->pos++;
+
+    for (field = 0; field < FILTER_NUM_FIELDS; field++) {
+        if (strcasecmp(word, field_names[field]) == 0) {
+            break;
+        }
+    }
+    if (field == FILTER_NUM_FIELDS) {
+        fprintf(stderr, "Filter: unknown field %s, expected catalog, title, "
+                "type or artist\n", word);
+        fp->failed = 1;
+        return(0);
+    }
+    if (!parse_word(fp, value, sizeof(value) - 1)) {
+        return(0);
+    }
+    return(emit(fp, OP_TEST, field, match, value));
+}
+
+/* A bare word, or a string in double quotes with \" and \\ escapes */
+static int parse_word(filter_parser *fp, char *dest, int dest_len)
+{
+    int len = 0;
+
+    skip_space(fp);
+    if (*fp->pos == '"') {
+        fp->pos++;
+        while (*fp->pos && *fp->pos != '"') {
+            if (*fp->pos == '\\' && fp->pos[1]) {
+                fp->pos++;
+            }
+            if (len < dest_len) {
+                dest[len++] = *fp->pos;
+            }
+            fp->pos++;
+        }
+        if (*fp->pos != '"') {
+            fprintf(stderr, "Filter: missing closing quote\n");
+            fp->failed = 1;
+            return(0);
+        }
+        fp->pos++;
+    } else {
+        while (*fp->pos && !isspace((unsigned char)*fp->pos) &&
+               !strchr("()=^~\"", *fp->pos)) {
+            if (len < dest_len) {
+                dest[len++] = *fp->pos;
+            }
+            fp->pos++;
+        }
+        if (len == 0) {
+            fprintf(stderr, "Filter: expected a word at \"%s\"\n", fp->pos);
+            fp->failed = 1;
+            return(0);
+        }
+    }
+    dest[len] = '\0';
+    return(1);
+}
+
+/* Consume keyword if it comes next as a whole word */
+static int next_is_keyword(filter_parser *fp, const char *keyword)
+{
+    size_t len = strlen(keyword);
+    char after;
+
+    skip_space(fp);
+    if (strncasecmp(fp->pos, keyword, len) != 0) {
+        return(0);
+    }
+    after = fp->pos[len];
+    if (after && !isspace((unsigned char)after) && after != '(' && after != '"') {
+        return(0);
+    }
+    fp->pos += len;
+    return(1);
+}
+
+/* Does another test follow, making an implicit "and"? */
+static int at_term_start(filter_parser *fp)
+{
+    const char *word = fp->pos;
+
+    skip_space(fp);
+    if (!*fp->pos || *fp->pos == ')') {
+        return(0);
+    }
+    /* "or" belongs to parse_or */
+    if (next_is_keyword(fp, "or")) {
+        fp->pos = word;
+        return(0);
+    }
+    return(1);
+}
+
+static void skip_space(filter_parser *fp)
+{
+    while (isspace((unsigned char)*fp->pos)) {
+        fp->pos++;
+    }
+}
+
+/* A word alone is "catalog~word or title~word or artist~word" */
+static int emit_any_field(filter_parser *fp, const char *word)
+{
+    int jump;
+
+    if (!emit(fp, OP_TEST, FILTER_CATALOG, MATCH_CONTAINS, word)) {
+        return(0);
+    }
+    jump = fp->filter->length;
+    if (!emit(fp, OP_JUMP_TRUE, 0, 0, NULL) ||
+        !emit(fp, OP_TEST, FILTER_TITLE, MATCH_CONTAINS, word)) {
+        return(0);
+    }
+    fp->filter->program[jump].target = fp->filter->length;
+    jump = fp->filter->length;
+    if (!emit(fp, OP_JUMP_TRUE, 0, 0, NULL) ||
+        !emit(fp, OP_TEST, FILTER_ARTIST, MATCH_CONTAINS, word)) {
+        return(0);
+    }
+    fp->filter->program[jump].target = fp->filter->length;
+    return(1);
+}
+
+static int emit(filter_parser *fp, filter_op op, int field, int match,
+                const char *value)
+{
+    cat_filter *filter = fp->filter;
+    char folded[CATALOG_TITLE_LEN + 1];
+    filter_insn *bigger_program;
+    filter_insn *insn;
+    char *bigger_values;
+    int len;
+
+    if (filter->length == filter->allocated) {
+        filter->allocated = filter->allocated ? filter->allocated * 2 : 16;
+        bigger_program = realloc(filter->program,
+                                 filter->allocated * sizeof(*filter->program));
+        if (!bigger_program) {
+            fp->failed = 1;
+            return(0);
+        }
+        filter->program = bigger_program;
+    }
+    insn = &filter->program[filter->length];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = op;
+    insn->field = field;
+    insn->match = match;
+    if (value && (filter->flags & FILTER_IGNORE_CASE)) {
+        catalog_fold(folded, value, sizeof(folded) - 1);
+        value = folded;
+    }
+    if (value) {
+        len = strlen(value);
+        bigger_values = realloc(filter->values, filter->values_size + len + 1);
+        if (!bigger_values) {
+            fp->failed = 1;
+            return(0);
+        }
+        filter->values = bigger_values;
+        memcpy(filter->values + filter->values_size, value, len + 1);
+        insn->value = filter->values_size;
+        insn->value_len = len;
+        filter->values_size += len + 1;
+    }
+    filter->length++;
+    return(1);
+}
+
+int filter_match(const cat_filter *filter, const cat_cd *cd)
+{
+    const char *fields[FILTER_NUM_FIELDS];
+    cat_keys keys;
+
+    if (filter->flags & FILTER_IGNORE_CASE) {
+        catalog_make_keys(cd, &keys);
+        fields[FILTER_CATALOG] = keys.catalog;
+        fields[FILTER_TITLE] = keys.title;
+        fields[FILTER_TYPE] = keys.type;
+        fields[FILTER_ARTIST] = keys.artist;
+    } else {
+        fields[FILTER_CATALOG] = cd->catalog;
+        fields[FILTER_TITLE] = cd->title;
+        fields[FILTER_TYPE] = cd->type;
+        fields[FILTER_ARTIST] = cd->artist;
+    }
+    return(filter_match_fields(filter, fields));
+}
+
+int filter_match_fields(const cat_filter *filter,
+                        const char *const fields[FILTER_NUM_FIELDS])
+{
+    const filter_insn *insn;
+    int result = 1;
+    int pc = 0;
+
+    while (pc < filter->length) {
+        insn = &filter->program[pc++];
+        switch (insn->op) {
+        case OP_TEST:
+            result = test_field(fields[insn->field], filter, insn);
+            break;
+        case OP_NOT:
+            result = !result;
+            break;
+        case OP_JUMP_FALSE:
+            if (!result) {
+                pc = insn->target;
+            }
+            break;
+        case OP_JUMP_TRUE:
+            if (result) {
+                pc = insn->target;
+            }
+            break;
+        }
+    }
+    return(result);
+}
+
+static int test_field(const char *str, const cat_filter *filter,
+                      const filter_insn *insn)
+{
+    const char *value = filter->values + insn->value;
+
+    switch (insn->match) {
+    case MATCH_EQUAL:
+        return(strcmp(str, value) == 0);
+    case MATCH_PREFIX:
+        return(strncmp(str, value, insn->value_len) == 0);
+    default:
+        return(strstr(str, value) != NULL);
+    }
+}
+
+/* Rebuild the expression from the program. A test pushes its SQL; a jump
+   remembers that when its target is reached, the two expressions on top
+   of the stack join with AND or OR; NOT wraps the top one. */
+char *filter_to_sql(const cat_filter *filter,
+                    const char *const columns[FILTER_NUM_FIELDS])
+{
+    char **stack;
+    int *pending;
+    int depth = 0, num_pending = 0;
+    const filter_insn *insn;
+    sql_text text;
+    char *left, *right;
+    int pc, ok = 1;
+
+    if (filter->length == 0) {
+        return(strdup("TRUE"));
+    }
+    stack = calloc(filter->length + 1, sizeof(*stack));
+    pending = calloc(filter->length + 1, sizeof(*pending));
+    if (!stack || !pending) {
+        free(stack);
+        free(pending);
+        return(NULL);
+    }
+
+    for (pc = 0; ok && pc <= filter->length; pc++) {
+        /* innermost jumps end first */
+        while (ok && num_pending && filter->program[pending[num_pending - 1]].target == pc) {
+            insn = &filter->program[pending[--num_pending]];
+            right = stack[--depth];
+            left = stack[--depth];
+            memset(&text, 0, sizeof(text));
+            ok = sql_append(&text, "(", 1) &&
+                 sql_append(&text, left, strlen(left)) &&
+                 sql_append(&text, insn->op == OP_JUMP_FALSE ? " AND " : " OR ",
+                            insn->op == OP_JUMP_FALSE ? 5 : 4) &&
+                 sql_append(&text, right, strlen(right)) &&
+                 sql_append(&text, ")", 1);
+            free(left);
+            free(right);
+            stack[depth++] = text.data;
+        }
+        if (!ok || pc == filter->length) {
+            break;
+        }
+
+        insn = &filter->program[pc];
+        switch (insn->op) {
+        case OP_TEST:
+            memset(&text, 0, sizeof(text));
+            ok = sql_test(&text, filter, insn, columns[insn->field]);
+            stack[depth++] = text.data;
+            break;
+        case OP_NOT:
+            right = stack[--depth];
+            memset(&text, 0, sizeof(text));
+            ok = sql_append(&text, "(NOT ", 5) &&
+                 sql_append(&text, right, strlen(right)) &&
+                 sql_append(&text, ")", 1);
+            free(right);
+            stack[depth++] = text.data;
+            break;
+        default:
+            pending[num_pending++] = pc;
+            break;
+        }
+    }
+
+    if (ok && depth == 1 && num_pending == 0) {
+        left = stack[0];
+    } else {
+        left = NULL;
+        while (depth > 0) {
+            free(stack[--depth]);
+        }
+    }
+    free(stack);
+    free(pending);
+    return(left);
+}
+
+static int sql_append(sql_text *text, const char *str, size_t len)
+{
+    char *bigger;
+
+    if (text->len + len + 1 > text->allocated) {
+        text->allocated = (text->len + len + 1) * 2;
+        bigger = realloc(text->data, text->allocated);
+        if (!bigger) {
+            free(text->data);
+            text->data = NULL;
+            return(0);
+        }
+        text->data = bigger;
+    }
+    memcpy(text->data + text->len, str, len);
+    text->len += len;
+    text->data[text->len] = '\0';
+    return(1);
+}
+
+/* One test as SQL. BINARY keeps the comparison case sensitive like
+   filter_match, unless the filter ignores case. Quotes and backslashes are escaped, and for LIKE the
+   wildcards too. */
+static int sql_test(sql_text *text, const cat_filter *filter,
+                    const filter_insn *insn, const char *column)
+{
+    const char *value = filter->values + insn->value;
+    const char *compare;
+    const char *escaped;
+    int i;
+
+    if (!column) {
+        /* the store doesn't keep this field, so it is always empty */
+        if (test_field("", filter, insn)) {
+            return(sql_append(text, "TRUE", 4));
+        }
+        return(sql_append(text, "FALSE", 5));
+    }
+    if (insn->match == MATCH_EQUAL) {
+        compare = filter->flags & FILTER_IGNORE_CASE ? " = '" : " = BINARY '";
+    } else {
+        compare = filter->flags & FILTER_IGNORE_CASE ? " LIKE '" : " LIKE BINARY '";
+    }
+    if (!sql_append(text, "(", 1) ||
+        !sql_append(text, column, strlen(column)) ||
+        !sql_append(text, compare, strlen(compare))) {
+        return(0);
+    }
+    if (insn->match == MATCH_CONTAINS && !sql_append(text, "%", 1)) {
+        return(0);
+    }
+    for (i = 0; i < insn->value_len; i++) {
+        escaped = NULL;
+        switch (value[i]) {
+        case '\'':
+            escaped = "\\'";
+            break;
+        case '\\':
+            escaped = insn->match == MATCH_EQUAL ? "\\\\" : "\\\\\\\\";
+            break;
+        case '%':
+            escaped = insn->match == MATCH_EQUAL ? NULL : "\\%";
+            break;
+        case '_':
+            escaped = insn->match == MATCH_EQUAL ? NULL : "\\_";
+            break;
+        }
+        if (escaped ? !sql_append(text, escaped, strlen(escaped))
+                    : !sql_append(text, &value[i], 1)) {
+            return(0);
+        }
+    }
+    if (insn->match != MATCH_EQUAL && !sql_append(text, "%", 1)) {
+        return(0);
+    }
+    return(sql_append(text, "')", 2));
+}
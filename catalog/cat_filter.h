@@ -0,0 +1,59 @@
+/*
+   Catalog filters. A filter is written as a small expression, for example
+
+       type=Jazz and (artist~Davis or artist^Coltrane) and not title~Live
+
+   A test is FIELD OP VALUE, where FIELD is catalog, title, type or artist
+   and OP is = for equality, ^ for a prefix or ~ for a substring. A word on
+   its own matches any CD with it in the catalog, title or artist, which is
+   what cdctl find always did. Tests combine with and, or, not and
+   parentheses; two tests side by side mean and. A VALUE with spaces or
+   brackets in it goes in double quotes.
+
+   filter_compile turns the expression into a flat program once. Matching a
+   CD then runs the program with no parsing, stopping as soon as the answer
+   is known. The MySQL backend translates the program into a WHERE clause
+   instead, so the database does the filtering.
+
+   Compiled with FILTER_IGNORE_CASE, a filter ignores case and accents. Its
+   values are folded once by catalog_fold, and it is then matched against
+   the folded search keys of each CD (cat_keys) rather than the fields.
+   Stores that keep the keys pass them to filter_match_fields; for the
+   others filter_match folds each CD as it goes.
+ */
+
+#ifndef CAT_FILTER_H
+#define CAT_FILTER_H
+
+#include "catalog.h"
+
+typedef enum {
+    FILTER_CATALOG,
+    FILTER_TITLE,
+    FILTER_TYPE,
+    FILTER_ARTIST,
+    FILTER_NUM_FIELDS
+} filter_field;
+
+#define FILTER_IGNORE_CASE  1
+
+/* NULL, with the reason on stderr, if the expression doesn't parse */
+cat_filter *filter_compile(const char *expr, int flags);
+void filter_free(cat_filter *filter);
+int filter_ignores_case(const cat_filter *filter);
+
+int filter_match(const cat_filter *filter, const cat_cd *cd);
+/* fields are indexed by filter_field, and must be the search keys when
+   the filter ignores case */
+int filter_match_fields(const cat_filter *filter,
+                        const char *const fields[FILTER_NUM_FIELDS]);
+
+/* The filter as an SQL condition, in a string to be freed by the caller.
+   columns names the column holding each field; a field whose column is NULL
+   isn't kept by the store and so is taken to be empty. A filter ignoring
+   case leaves that to the column collation, which for the usual utf8 ones
+   ignores accents too. */
+char *filter_to_sql(const cat_filter *filter,
+                    const char *const columns[FILTER_NUM_FIELDS]);
+
+#endif
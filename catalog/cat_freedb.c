@@ -0,0 +1,513 @@
+/*
+   Importing a freedb dump. See cat_freedb.h.
+
+   The directories are read on the calling thread, which only collects
+   file names: every batch_size of them in a category become a chunk, and
+   a chunk is a task for the pool. A task reads and parses its files one
+   after another into a buffer it reuses, then takes the lock and puts the
+   whole chunk into the store as one batch. While one task writes, the
+   others carry on reading and parsing theirs.
+
+   The parser works on the bytes of the file as read. It finds the lines
+   and their keys in place and copies only the values it keeps, straight
+   into the catalog records.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "catalog.h"
+#include "cat_pool.h"
+#include "cat_freedb.h"
+
+#define FREEDB_READ_START   16384   /* bytes, grown for a bigger file */
+#define FREEDB_DTITLE_LEN   (CATALOG_ARTIST_LEN + 3 + CATALOG_TITLE_LEN)
+#define FREEDB_PROGRESS_MS  1000.0
+
+typedef struct import_state import_state;
+
+/* The disc files of one batch, all in one directory. The names follow
+   each other in names, each ending in a NUL. */
+typedef struct {
+    import_state *import;
+    int dir_fd;
+    char category[CATALOG_TYPE_LEN + 1];
+    char *names;
+    size_t names_len;
+    size_t names_size;
+    int num_files;
+} file_chunk;
+
+struct import_state {
+    catalog_backend *be;
+    int batch_size;
+    pool_group *group;
+    pthread_mutex_t lock;       /* the store, the totals and progress */
+    freedb_result totals;
+    double start_ms;
+    double progress_ms;
+    freedb_progress_fn progress;
+    void *arg;
+};
+
+static int entry_type(int dir_fd, const struct dirent *entry);
+static void walk_category(import_state *import, DIR *dir, const char *category);
+static int add_file(import_state *import, file_chunk **chunk, int dir_fd,
+                    const char *category, const char *name);
+static void count_unreadable(import_state *import);
+static void spawn_chunk(import_state *import, file_chunk *chunk);
+static void import_chunk(pool_group *group, void *arg);
+static int read_file(int dir_fd, const char *name, char **buf,
+                     size_t *buf_size, size_t *len);
+static int parse_index(const char *from, const char *to);
+static void append_value(char *field, int field_len, const char *value,
+                         const char *end);
+static void set_text(char *field, int field_len, const char *src, size_t len);
+static void trim_utf8(char *field, size_t len);
+static double now_ms(void);
+
+int freedb_import(catalog_backend *be, const char *dir, int num_threads,
+                  int batch_size, freedb_progress_fn progress, void *arg,
+                  freedb_result *result)
+{
+    import_state import;
+    char category[CATALOG_TYPE_LEN + 1];
+    const char *base;
+    size_t base_len;
+    struct dirent *entry;
+    file_chunk *loose = NULL;
+    DIR *top, *sub, **subdirs = NULL, **more;
+    cat_pool *pool;
+    int fd, num_subdirs = 0, i;
+
+    memset(result, 0, sizeof(*result));
+    top = opendir(dir);
+    if (!top) {
+        return(0);
+    }
+    pool = num_threads > 0 ? pool_create(num_threads) : pool_default();
+    if (!pool) {
+        closedir(top);
+        return(0);
+    }
+
+    memset(&import, 0, sizeof(import));
+    import.be = be;
+    import.batch_size = batch_size > 0 ? batch_size : FREEDB_BATCH;
+    import.progress = progress;
+    import.arg = arg;
+    import.start_ms = now_ms();
+    import.progress_ms = import.start_ms;
+    pthread_mutex_init(&import.lock, NULL);
+    import.group = pool_group_new(pool);
+
+    /* Files directly in dir are of the category named by its last part */
+    base_len = strlen(dir);
+    while (base_len > 1 && dir[base_len - 1] == '/') {
+        base_len--;
+    }
+    for (base = dir + base_len; base > dir && base[-1] != '/'; base--) {
+    }
+    base_len -= base - dir;
+    if (base_len > CATALOG_TYPE_LEN) {
+        base_len = CATALOG_TYPE_LEN;
+    }
+    memcpy(category, base, base_len);
+    category[base_len] = '\0';
+
+    while (import.group && (entry = readdir(top)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        switch (entry_type(dirfd(top), entry)) {
+        case DT_DIR:
+            more = realloc(subdirs, (num_subdirs + 1) * sizeof(*subdirs));
+            if (!more) {
+                break;
+            }
+            subdirs = more;
+            fd = openat(dirfd(top), entry->d_name, O_RDONLY | O_DIRECTORY);
+            sub = fd >= 0 ? fdopendir(fd) : NULL;
+            if (!sub) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                fprintf(stderr, "Unable to read %s/%s\n", dir, entry->d_name);
+                break;
+            }
+            /* the directory stays open for the tasks reading its files */
+            subdirs[num_subdirs++] = sub;
+            walk_category(&import, sub, entry->d_name);
+            break;
+        case DT_REG:
+            add_file(&import, &loose, dirfd(top), category, entry->d_name);
+            break;
+        }
+    }
+    if (loose) {
+        spawn_chunk(&import, loose);
+    }
+    if (import.group) {
+        pool_join(import.group);
+    }
+
+    for (i = 0; i < num_subdirs; i++) {
+        closedir(subdirs[i]);
+    }
+    free(subdirs);
+    closedir(top);
+    if (num_threads > 0) {
+        pool_destroy(pool);
+    }
+    pthread_mutex_destroy(&import.lock);
+    *result = import.totals;
+    result->elapsed_ms = now_ms() - import.start_ms;
+    return(import.group != NULL);
+}
+
+int freedb_parse(const char *text, size_t len, const char *category,
+                 const char *disc_id, cat_cd *cd, cat_track *tracks, int max_tracks)
+{
+    char dtitle[FREEDB_DTITLE_LEN + 1];
+    const char *end = text + len;
+    const char *line, *eol, *stop, *value, *split;
+    size_t cat_len;
+    int num_tracks = 0, have_title = 0, n;
+
+    memset(cd, '\0', sizeof(*cd));
+    cat_len = strlen(category);
+    if (!disc_id[0] || cat_len + 1 + strlen(disc_id) >= CATALOG_CAT_LEN) {
+        return(-1);
+    }
+    memcpy(cd->catalog, category, cat_len);
+    cd->catalog[cat_len] = '/';
+    strcpy(cd->catalog + cat_len + 1, disc_id);
+    if (catalog_disc_id_ok(disc_id)) {
+        strcpy(cd->disc_id, disc_id);
+    }
+    catalog_set_field(cd->type, category, CATALOG_TYPE_LEN);
+    dtitle[0] = '\0';
+
+    for (line = text; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        stop = eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line[0] == '#' || !(value = memchr(line, '=', stop - line))) {
+            continue;
+        }
+        value++;
+        if (value - line == 7 && memcmp(line, "DTITLE=", 7) == 0) {
+            append_value(dtitle, FREEDB_DTITLE_LEN, value, stop);
+            have_title = 1;
+        } else if (value - line > 7 && memcmp(line, "TTITLE", 6) == 0) {
+            n = parse_index(line + 6, value - 1);
+            if (n < 0 || n >= max_tracks) {
+                continue;
+            }
+            /* a track with no line of its own is kept, untitled */
+            while (num_tracks <= n) {
+                memset(&tracks[num_tracks], '\0', sizeof(*tracks));
+                strcpy(tracks[num_tracks].catalog, cd->catalog);
+                tracks[num_tracks].track_no = num_tracks + 1;
+                num_tracks++;
+            }
+            append_value(tracks[n].title, CATALOG_TRACK_LEN, value, stop);
+        }
+    }
+    if (!have_title) {
+        return(-1);
+    }
+
+    split = strstr(dtitle, " / ");
+    if (split) {
+        set_text(cd->artist, CATALOG_ARTIST_LEN, dtitle, split - dtitle);
+        set_text(cd->title, CATALOG_TITLE_LEN, split + 3, strlen(split + 3));
+    } else {
+        set_text(cd->artist, CATALOG_ARTIST_LEN, dtitle, strlen(dtitle));
+        set_text(cd->title, CATALOG_TITLE_LEN, dtitle, strlen(dtitle));
+    }
+    return(num_tracks);
+}
+
+/* DT_DIR, DT_REG or something else, asking the file system when the
+   directory entry doesn't say */
+static int entry_type(int dir_fd, const struct dirent *entry)
+{
+    struct stat st;
+
+    if (entry->d_type != DT_UNKNOWN) {
+        return(entry->d_type);
+    }
+    if (fstatat(dir_fd, entry->d_name, &st, 0) < 0) {
+        return(DT_UNKNOWN);
+    }
+    return(S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+}
+
+/* Every file in a category directory, a chunk at a time */
+static void walk_category(import_state *import, DIR *dir, const char *category)
+{
+    struct dirent *entry;
+    file_chunk *chunk = NULL;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.' && entry_type(dirfd(dir), entry) == DT_REG) {
+            add_file(import, &chunk, dirfd(dir), category, entry->d_name);
+        }
+    }
+    if (chunk) {
+        spawn_chunk(import, chunk);
+    }
+}
+
+/* Add a name to the chunk being filled, starting one if need be, and hand
+   the chunk to the pool when it is full */
+static int add_file(import_state *import, file_chunk **chunk, int dir_fd,
+                    const char *category, const char *name)
+{
+    file_chunk *fill = *chunk;
+    size_t len = strlen(name) + 1;
+    char *more;
+
+    if (!fill) {
+        fill = calloc(1, sizeof(*fill));
+        if (!fill) {
+            count_unreadable(import);
+            return(0);
+        }
+        fill->import = import;
+        fill->dir_fd = dir_fd;
+        catalog_set_field(fill->category, category, CATALOG_TYPE_LEN);
+        *chunk = fill;
+    }
+    if (fill->names_len + len > fill->names_size) {
+        fill->names_size = fill->names_size ? fill->names_size * 2 : 4096;
+        while (fill->names_len + len > fill->names_size) {
+            fill->names_size *= 2;
+        }
+        more = realloc(fill->names, fill->names_size);
+        if (!more) {
+            count_unreadable(import);
+            return(0);
+        }
+        fill->names = more;
+    }
+    memcpy(fill->names + fill->names_len, name, len);
+    fill->names_len += len;
+    fill->num_files++;
+    if (fill->num_files == import->batch_size) {
+        spawn_chunk(import, fill);
+        *chunk = NULL;
+    }
+    return(1);
+}
+
+/* The tasks may be adding to the totals already */
+static void count_unreadable(import_state *import)
+{
+    pthread_mutex_lock(&import->lock);
+    import->totals.unreadable++;
+    pthread_mutex_unlock(&import->lock);
+}
+
+/* The chunk is run here and now if the pool can't take it */
+static void spawn_chunk(import_state *import, file_chunk *chunk)
+{
+    if (!pool_spawn(import->group, import_chunk, chunk)) {
+        import_chunk(import->group, chunk);
+    }
+}
+
+static void import_chunk(pool_group *group, void *arg)
+{
+    file_chunk *chunk = arg;
+    import_state *import = chunk->import;
+    cat_track disc[CATALOG_MAX_TRACKS];
+    cat_track *tracks = NULL, *more;
+    cat_entry *entries;
+    size_t *first;
+    size_t num_tracks = 0, tracks_size = 0, buf_size = 0, len;
+    uint64_t unreadable = 0;
+    const char *name = chunk->names;
+    char *buf = NULL;
+    double now;
+    int i, n, count = 0, put = 0;
+
+    entries = malloc(chunk->num_files * sizeof(*entries));
+    first = malloc(chunk->num_files * sizeof(*first));
+    for (i = 0; i < chunk->num_files; i++, name += strlen(name) + 1) {
+        if (!entries || !first || !read_file(chunk->dir_fd, name, &buf, &buf_size, &len) ||
+            (n = freedb_parse(buf, len, chunk->category, name, &entries[count].cd,
+                              disc, CATALOG_MAX_TRACKS)) < 0) {
+            unreadable++;
+            continue;
+        }
+        if (num_tracks + n > tracks_size) {
+            tracks_size = tracks_size ? tracks_size * 2 : 1024;
+            more = realloc(tracks, tracks_size * sizeof(*tracks));
+            if (!more) {
+                unreadable++;
+                continue;
+            }
+            tracks = more;
+        }
+        memcpy(tracks + num_tracks, disc, n * sizeof(*disc));
+        first[count] = num_tracks;
+        entries[count].num_tracks = n;
+        num_tracks += n;
+        count++;
+    }
+    /* tracks has stopped moving */
+    for (i = 0; i < count; i++) {
+        entries[i].tracks = tracks + first[i];
+    }
+
+    pthread_mutex_lock(&import->lock);
+    if (count) {
+        put = catalog_put_batch(import->be, entries, count);
+    }
+    import->totals.files += chunk->num_files;
+    import->totals.discs += put;
+    import->totals.tracks += num_tracks;
+    import->totals.unreadable += unreadable;
+    import->totals.refused += count - put;
+    now = now_ms();
+    if (import->progress && now - import->progress_ms >= FREEDB_PROGRESS_MS) {
+        import->progress_ms = now;
+        import->totals.elapsed_ms = now - import->start_ms;
+        import->progress(&import->totals, import->arg);
+    }
+    pthread_mutex_unlock(&import->lock);
+
+    free(buf);
+    free(tracks);
+    free(first);
+    free(entries);
+    free(chunk->names);
+    free(chunk);
+}
+
+/* The whole of a file into *buf, which is grown to fit */
+static int read_file(int dir_fd, const char *name, char **buf,
+                     size_t *buf_size, size_t *len)
+{
+    ssize_t got;
+    char *more;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY);
+    if (fd < 0) {
+        return(0);
+    }
+    *len = 0;
+    while (1) {
+        if (*len == *buf_size) {
+            more = realloc(*buf, *buf_size ? *buf_size * 2 : FREEDB_READ_START);
+            if (!more) {
+                close(fd);
+                return(0);
+            }
+            *buf = more;
+            *buf_size = *buf_size ? *buf_size * 2 : FREEDB_READ_START;
+        }
+        got = read(fd, *buf + *len, *buf_size - *len);
+        if (got < 0) {
+            close(fd);
+            return(0);
+        }
+        if (got == 0) {
+            break;
+        }
+        *len += got;
+    }
+    close(fd);
+    return(1);
+}
+
+/* The decimal number from from up to to, or -1 */
+static int parse_index(const char *from, const char *to)
+{
+    int n = 0;
+
+    if (from == to || to - from > 4) {
+        return(-1);
+    }
+    for (; from < to; from++) {
+        if (*from < '0' || *from > '9') {
+            return(-1);
+        }
+        n = n * 10 + *from - '0';
+    }
+    return(n);
+}
+
+/* Add a value to what the field holds from earlier lines of the same key,
+   undoing the escapes, as far as it fits */
+static void append_value(char *field, int field_len, const char *value,
+                         const char *end)
+{
+    size_t len = strlen(field);
+    char c;
+
+    while (value < end) {
+        c = *value++;
+        if (c == '\\' && value < end) {
+            c = *value++;
+            if (c == 'n' || c == 't') {
+                c = ' ';
+            }
+        }
+        if (len == (size_t)field_len) {
+            trim_utf8(field, len);
+            return;
+        }
+        field[len++] = c;
+    }
+    field[len] = '\0';
+}
+
+static void set_text(char *field, int field_len, const char *src, size_t len)
+{
+    if (len > (size_t)field_len) {
+        memcpy(field, src, field_len);
+        trim_utf8(field, field_len);
+        return;
+    }
+    memcpy(field, src, len);
+    field[len] = '\0';
+}
+
+/* End the field of len bytes before any UTF-8 character cut short */
+static void trim_utf8(char *field, size_t len)
+{
+    size_t start = len, need;
+    unsigned char lead;
+
+    while (start > 0 && len - start < 3 && ((unsigned char)field[start - 1] & 0xc0) == 0x80) {
+        start--;
+    }
+    if (start == 0) {
+        field[len] = '\0';
+        return;
+    }
+    lead = field[start - 1];
+    need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    field[len - (start - 1) < need ? start - 1 : len] = '\0';
+}
+
+static double now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return(tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0);
+}
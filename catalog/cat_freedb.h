@@ -0,0 +1,69 @@
+/*
+   Importing a freedb dump.
+
+   freedb, like CDDB before it, keeps one small text file per disc, named
+   by its disc ID and filed in a directory per category:
+
+       rock/7a0b3a0b
+           # xmcd
+           ...
+           DISCID=7a0b3a0b
+           DTITLE=Artist / Title
+           DGENRE=Rock
+           TTITLE0=First track
+           TTITLE1=Second track
+           ...
+
+   A value too long for one line carries on in more lines with the same
+   key, and "\n", "\t" and "\\" in a value stand for a newline, a tab and
+   a backslash. No store keeps a newline in a field, so the first two
+   become spaces.
+
+   A disc becomes the CD "category/discid", since the same disc ID turns
+   up in more than one category for different discs. Its disc ID is the
+   file name, when that is a proper one. Its type is the category, and DTITLE is split into artist and title at the first
+   " / ", or is both when there is none. TTITLEn is track n + 1. Fields
+   too long for the catalog records are cut at a whole UTF-8 character.
+
+   The files are read and parsed in parallel, in chunks of one batch each,
+   and each batch goes to the store in one catalog_put_batch. A store is
+   only ever used by one thread at a time.
+ */
+
+#ifndef CAT_FREEDB_H
+#define CAT_FREEDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define FREEDB_BATCH  10000     /* discs per batch, unless told otherwise */
+
+typedef struct {
+    uint64_t files;             /* disc files read */
+    uint64_t discs;             /* CDs put in the store */
+    uint64_t tracks;            /* and their tracks */
+    uint64_t unreadable;        /* files that couldn't be read or parsed */
+    uint64_t refused;           /* discs the store wouldn't take */
+    double elapsed_ms;
+} freedb_result;
+
+/* Called with the totals so far about once a second while importing */
+typedef void (*freedb_progress_fn)(const freedb_result *so_far, void *arg);
+
+/* Parse the len bytes of one disc file, which are left as they are, into
+   cd and up to max_tracks tracks. Returns how many tracks, or -1 if it
+   isn't a disc record or the catalog number would be too long. */
+int freedb_parse(const char *text, size_t len, const char *category,
+                 const char *disc_id, cat_cd *cd, cat_track *tracks, int max_tracks);
+
+/* Import every disc under dir, which holds either the category
+   directories of a dump or the files of one category. num_threads 0
+   means one per CPU; batch_size 0 means FREEDB_BATCH. progress may be
+   NULL. 0 if dir couldn't be read. */
+int freedb_import(catalog_backend *be, const char *dir, int num_threads,
+                  int batch_size, freedb_progress_fn progress, void *arg,
+                  freedb_result *result);
+
+#endif
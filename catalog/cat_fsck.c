@@ -0,0 +1,708 @@
+/*
+   Checking a store. See cat_fsck.h.
+
+   The CDs are read once, on one thread, into the key set. The tracks are
+   then read in as many parts as there are threads, each part checking its
+   tracks against the set as it goes: the set is only read by then, apart
+   from the track number bitmaps, which are set with atomic ORs. A track
+   of no CD costs its part one fingerprint, and only if it differs from
+   the one before, since a CD's tracks are usually stored together.
+
+   Orphan tracks are named, and the tracks of CDs to be repaired gathered,
+   by a second pass over the tracks, which is only made when there is
+   something to name or gather.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "cat_pool.h"
+#include "cat_fsck.h"
+
+#define FSCK_MIN_SET    1024
+#define FSCK_PROBLEM    80
+
+/* What was found for a CD */
+#define FSCK_DUPLICATE   0x01
+#define FSCK_REPEATED    0x02
+#define FSCK_BAD_NUMBER  0x04
+#define FSCK_GAP         0x08
+#define FSCK_REPORTED    0x10
+#define FSCK_ANY         (FSCK_DUPLICATE | FSCK_REPEATED | FSCK_BAD_NUMBER | FSCK_GAP)
+
+/* Open addressing on the fingerprint, at most half full. Bit n - 1 of
+   numbers is track n. */
+typedef struct {
+    uint64_t *keys;             /* 0 is empty */
+    uint64_t (*numbers)[2];
+    uint8_t *flags;
+    uint32_t size;
+    uint32_t count;
+} key_set;
+
+/* A track gathered for repair, with where it came in the store */
+typedef struct {
+    uint32_t slot;
+    uint32_t seq;
+    cat_track track;
+} fsck_track;
+
+typedef struct fsck_run_state fsck_run_state;
+
+/* One part of a pass over the tracks */
+typedef struct {
+    fsck_run_state *run;
+    int part;
+    int ok;
+    uint64_t tracks;
+    uint64_t orphans;
+    uint64_t bad_numbers;
+    uint64_t last_orphan;
+    uint64_t *orphan_keys;
+    uint32_t num_orphan_keys;
+    uint32_t orphan_keys_size;
+    fsck_track *gathered;
+    uint32_t num_gathered;
+    uint32_t gathered_size;
+} fsck_part;
+
+struct fsck_run_state {
+    catalog_backend *be;
+    int num_parts;
+    int repair;
+    key_set set;
+    /* the catalog numbers of the orphans, sorted, and what was found of
+       them by the second pass */
+    uint64_t *orphans;
+    uint32_t num_orphans;
+    char (*orphan_names)[CATALOG_CAT_LEN + 1];
+    uint8_t *orphan_named;
+    uint32_t *orphan_counts;
+};
+
+static int add_cd(const cat_cd *cd, void *arg);
+static int set_add(key_set *set, uint64_t key);
+static int set_find(const key_set *set, uint64_t key);
+static int set_grow(key_set *set);
+static uint64_t fingerprint(const char *catalog);
+static int run_parts(fsck_run_state *run, cat_pool *pool, fsck_part *parts,
+                     pool_task_fn fn);
+static void check_part(pool_group *group, void *arg);
+static int check_track(const cat_track *track, void *arg);
+static void gather_part(pool_group *group, void *arg);
+static int gather_track(const cat_track *track, void *arg);
+static int find_orphan(const fsck_run_state *run, uint64_t key);
+static int merge_orphans(fsck_run_state *run, fsck_part *parts);
+static int numbered_from_one(const uint64_t numbers[2]);
+static void describe_numbers(const uint64_t numbers[2], char *dest, int dest_len);
+static int report_cd(const cat_cd *cd, void *arg);
+static int repair_cd(fsck_run_state *run, const cat_cd *cd, uint8_t flags,
+                     fsck_track *tracks, int count);
+static int compare_key(const void *a, const void *b);
+static int compare_gathered(const void *a, const void *b);
+static int compare_repair(const void *a, const void *b);
+
+/* A CD to repair, and where it is in the key set */
+typedef struct {
+    uint32_t slot;
+    cat_cd cd;
+} fsck_cd;
+
+/* What report_cd passes on */
+typedef struct {
+    fsck_run_state *run;
+    fsck_report_fn report;
+    void *arg;
+    fsck_cd *to_repair;
+    uint32_t num_to_repair;
+    uint32_t to_repair_size;
+} report_state;
+
+int fsck_run(catalog_backend *be, int num_threads, int repair,
+             fsck_report_fn report, void *arg, fsck_result *result)
+{
+    fsck_run_state run;
+    report_state rs;
+    fsck_part *parts = NULL;
+    fsck_track *gathered = NULL;
+    uint32_t num_gathered = 0;
+    cat_pool *pool;
+    char problem[FSCK_PROBLEM];
+    uint32_t i, j, first;
+    int p, slot, gather = 0, ok = 0;
+
+    memset(result, 0, sizeof(*result));
+    memset(&run, 0, sizeof(run));
+    memset(&rs, 0, sizeof(rs));
+    run.be = be;
+    run.repair = repair;
+    pool = num_threads > 0 ? pool_create(num_threads) : pool_default();
+    if (!pool) {
+        return(0);
+    }
+    run.num_parts = pool_num_threads(pool);
+
+    if (!catalog_scan(be, add_cd, &run.set) ||
+        (!run.set.keys && !set_grow(&run.set))) {
+        goto done;
+    }
+    result->num_cds = run.set.count;
+    for (i = 0; i < run.set.size; i++) {
+        if (run.set.flags[i] & FSCK_DUPLICATE) {
+            result->duplicate_cds++;
+        }
+    }
+
+    parts = calloc(run.num_parts, sizeof(*parts));
+    if (!parts) {
+        goto done;
+    }
+    if (be->ops->scan_tracks) {
+        if (!run_parts(&run, pool, parts, check_part)) {
+            goto done;
+        }
+        result->tracks_checked = 1;
+        for (p = 0; p < run.num_parts; p++) {
+            result->num_tracks += parts[p].tracks;
+            result->orphan_tracks += parts[p].orphans;
+            result->bad_numbers += parts[p].bad_numbers;
+        }
+        if (!merge_orphans(&run, parts)) {
+            goto done;
+        }
+        result->orphan_catalogs = run.num_orphans;
+        for (i = 0; i < run.set.size; i++) {
+            if (!run.set.keys[i]) {
+                continue;
+            }
+            if (run.set.flags[i] & FSCK_REPEATED) {
+                result->repeated_cds++;
+            }
+            if (!numbered_from_one(run.set.numbers[i])) {
+                run.set.flags[i] |= FSCK_GAP;
+                result->gapped_cds++;
+            }
+            if (repair && (run.set.flags[i] & FSCK_ANY)) {
+                gather = 1;
+            }
+        }
+        gather |= run.num_orphans > 0;
+    }
+
+    /* Name the orphans and gather the tracks of the CDs to repair */
+    if (gather) {
+        run.orphan_names = calloc(run.num_orphans + 1, sizeof(*run.orphan_names));
+        run.orphan_named = calloc(run.num_orphans + 1, 1);
+        run.orphan_counts = calloc(run.num_orphans + 1, sizeof(*run.orphan_counts));
+        if (!run.orphan_names || !run.orphan_named || !run.orphan_counts ||
+            !run_parts(&run, pool, parts, gather_part)) {
+            goto done;
+        }
+        for (p = 0; p < run.num_parts; p++) {
+            num_gathered += parts[p].num_gathered;
+        }
+        if (num_gathered) {
+            gathered = malloc(num_gathered * sizeof(*gathered));
+            if (!gathered) {
+                goto done;
+            }
+            for (p = 0, j = 0; p < run.num_parts; p++) {
+                memcpy(gathered + j, parts[p].gathered,
+                       parts[p].num_gathered * sizeof(*gathered));
+                j += parts[p].num_gathered;
+            }
+            /* the parts are in store order, and so is each part */
+            for (j = 0; j < num_gathered; j++) {
+                gathered[j].seq = j;
+            }
+            qsort(gathered, num_gathered, sizeof(*gathered), compare_gathered);
+        }
+        for (i = 0; i < run.num_orphans; i++) {
+            snprintf(problem, sizeof(problem), "%u track%s with no CD",
+                     run.orphan_counts[i], run.orphan_counts[i] == 1 ? "" : "s");
+            report(run.orphan_names[i], problem, arg);
+        }
+    }
+
+    /* The CDs found wrong, by name, in the order the store keeps them */
+    rs.run = &run;
+    rs.report = report;
+    rs.arg = arg;
+    if ((result->duplicate_cds || result->repeated_cds || result->gapped_cds ||
+         result->bad_numbers) && !catalog_scan(be, report_cd, &rs)) {
+        goto done;
+    }
+
+    if (repair) {
+        for (i = 0; i < run.num_orphans; i++) {
+            if (catalog_del_tracks(be, run.orphan_names[i])) {
+                result->repaired++;
+            } else {
+                result->repair_failures++;
+            }
+        }
+        /* the gathered tracks are in slot order, so the CDs are put in the
+           same order to walk the two together */
+        qsort(rs.to_repair, rs.num_to_repair, sizeof(*rs.to_repair), compare_repair);
+        for (i = 0, j = 0; i < rs.num_to_repair; i++) {
+            slot = rs.to_repair[i].slot;
+            while (j < num_gathered && gathered[j].slot < (uint32_t)slot) {
+                j++;
+            }
+            first = j;
+            while (j < num_gathered && gathered[j].slot == (uint32_t)slot) {
+                j++;
+            }
+            if (repair_cd(&run, &rs.to_repair[i].cd, run.set.flags[slot],
+                          gathered + first, j - first)) {
+                result->repaired++;
+            } else {
+                result->repair_failures++;
+            }
+        }
+    }
+    ok = 1;
+
+done:
+    if (parts) {
+        for (p = 0; p < run.num_parts; p++) {
+            free(parts[p].orphan_keys);
+            free(parts[p].gathered);
+        }
+        free(parts);
+    }
+    free(gathered);
+    free(rs.to_repair);
+    free(run.orphans);
+    free(run.orphan_names);
+    free(run.orphan_named);
+    free(run.orphan_counts);
+    free(run.set.keys);
+    free(run.set.numbers);
+    free(run.set.flags);
+    if (num_threads > 0) {
+        pool_destroy(pool);
+    }
+    return(ok);
+}
+
+int fsck_problems(const fsck_result *result)
+{
+    return(result->duplicate_cds || result->orphan_tracks || result->repeated_cds ||
+           result->gapped_cds || result->bad_numbers);
+}
+
+static int add_cd(const cat_cd *cd, void *arg)
+{
+    return(set_add(arg, fingerprint(cd->catalog)));
+}
+
+static int set_add(key_set *set, uint64_t key)
+{
+    uint32_t pos;
+
+    if (set->count * 2 >= set->size && !set_grow(set)) {
+        return(0);
+    }
+    pos = key & (set->size - 1);
+    while (set->keys[pos]) {
+        if (set->keys[pos] == key) {
+            set->flags[pos] |= FSCK_DUPLICATE;
+            return(1);
+        }
+        pos = (pos + 1) & (set->size - 1);
+    }
+    set->keys[pos] = key;
+    set->count++;
+    return(1);
+}
+
+/* The slot of key, or -1 */
+static int set_find(const key_set *set, uint64_t key)
+{
+    uint32_t pos = key & (set->size - 1);
+
+    while (set->keys[pos]) {
+        if (set->keys[pos] == key) {
+            return(pos);
+        }
+        pos = (pos + 1) & (set->size - 1);
+    }
+    return(-1);
+}
+
+/* Only while the CDs are read, so the track numbers are all still clear */
+static int set_grow(key_set *set)
+{
+    uint32_t new_size = set->size ? set->size * 2 : FSCK_MIN_SET;
+    uint64_t *new_keys;
+    uint64_t (*new_numbers)[2];
+    uint8_t *new_flags;
+    uint32_t i, pos;
+
+    new_keys = calloc(new_size, sizeof(*new_keys));
+    new_numbers = calloc(new_size, sizeof(*new_numbers));
+    new_flags = calloc(new_size, sizeof(*new_flags));
+    if (!new_keys || !new_numbers || !new_flags) {
+        free(new_keys);
+        free(new_numbers);
+        free(new_flags);
+        return(0);
+    }
+    for (i = 0; i < set->size; i++) {
+        if (set->keys[i]) {
+            pos = set->keys[i] & (new_size - 1);
+            while (new_keys[pos]) {
+                pos = (pos + 1) & (new_size - 1);
+            }
+            new_keys[pos] = set->keys[i];
+            new_flags[pos] = set->flags[i];
+        }
+    }
+    free(set->keys);
+    free(set->numbers);
+    free(set->flags);
+    set->keys = new_keys;
+    set->numbers = new_numbers;
+    set->flags = new_flags;
+    set->size = new_size;
+    return(1);
+}
+
+/* FNV-1a, mixed so the low bits the set uses depend on all of it. Never 0. */
+static uint64_t fingerprint(const char *catalog)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    while (*catalog) {
+        h ^= (unsigned char)*catalog++;
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return(h ? h : 1);
+}
+
+/* One task per part. The caller's thread runs parts too while it joins. */
+static int run_parts(fsck_run_state *run, cat_pool *pool, fsck_part *parts,
+                     pool_task_fn fn)
+{
+    pool_group *group;
+    int p, ok = 1;
+
+    group = pool_group_new(pool);
+    if (!group) {
+        return(0);
+    }
+    for (p = 0; p < run->num_parts; p++) {
+        parts[p].run = run;
+        parts[p].part = p;
+        parts[p].ok = 0;
+        if (!pool_spawn(group, fn, &parts[p])) {
+            pool_cancel(group);
+            ok = 0;
+            break;
+        }
+    }
+    ok &= pool_join(group);
+    for (p = 0; ok && p < run->num_parts; p++) {
+        ok = parts[p].ok;
+    }
+    return(ok);
+}
+
+static void check_part(pool_group *group, void *arg)
+{
+    fsck_part *part = arg;
+
+    part->ok = catalog_scan_tracks(part->run->be, part->part, part->run->num_parts,
+                                   check_track, part);
+}
+
+static int check_track(const cat_track *track, void *arg)
+{
+    fsck_part *part = arg;
+    key_set *set = &part->run->set;
+    uint64_t key = fingerprint(track->catalog);
+    uint64_t bit, *more;
+    int slot, n = track->track_no;
+
+    part->tracks++;
+    slot = set_find(set, key);
+    if (slot < 0) {
+        part->orphans++;
+        if (key == part->last_orphan) {
+            return(1);
+        }
+        if (part->num_orphan_keys == part->orphan_keys_size) {
+            part->orphan_keys_size = part->orphan_keys_size ? part->orphan_keys_size * 2 : 256;
+            more = realloc(part->orphan_keys, part->orphan_keys_size * sizeof(*more));
+            if (!more) {
+                return(0);
+            }
+            part->orphan_keys = more;
+        }
+        part->orphan_keys[part->num_orphan_keys++] = key;
+        part->last_orphan = key;
+        return(1);
+    }
+    if (n < 1 || n > CATALOG_MAX_TRACKS) {
+        part->bad_numbers++;
+        __atomic_fetch_or(&set->flags[slot], FSCK_BAD_NUMBER, __ATOMIC_RELAXED);
+        return(1);
+    }
+    bit = (uint64_t)1 << ((n - 1) & 63);
+    if (__atomic_fetch_or(&set->numbers[slot][(n - 1) >> 6], bit, __ATOMIC_RELAXED) & bit) {
+        __atomic_fetch_or(&set->flags[slot], FSCK_REPEATED, __ATOMIC_RELAXED);
+    }
+    return(1);
+}
+
+static void gather_part(pool_group *group, void *arg)
+{
+    fsck_part *part = arg;
+
+    part->num_gathered = 0;
+    part->ok = catalog_scan_tracks(part->run->be, part->part, part->run->num_parts,
+                                   gather_track, part);
+}
+
+/* The first part to reach an orphan names it */
+static int gather_track(const cat_track *track, void *arg)
+{
+    fsck_part *part = arg;
+    fsck_run_state *run = part->run;
+    uint64_t key = fingerprint(track->catalog);
+    fsck_track *more;
+    int slot, n;
+
+    slot = set_find(&run->set, key);
+    if (slot < 0) {
+        n = find_orphan(run, key);
+        if (n >= 0) {
+            __atomic_fetch_add(&run->orphan_counts[n], 1, __ATOMIC_RELAXED);
+            if (!__atomic_exchange_n(&run->orphan_named[n], 1, __ATOMIC_ACQ_REL)) {
+                strcpy(run->orphan_names[n], track->catalog);
+            }
+        }
+        return(1);
+    }
+    if (!run->repair || !(run->set.flags[slot] & FSCK_ANY)) {
+        return(1);
+    }
+    if (part->num_gathered == part->gathered_size) {
+        part->gathered_size = part->gathered_size ? part->gathered_size * 2 : 64;
+        more = realloc(part->gathered, part->gathered_size * sizeof(*more));
+        if (!more) {
+            return(0);
+        }
+        part->gathered = more;
+    }
+    part->gathered[part->num_gathered].slot = slot;
+    part->gathered[part->num_gathered].track = *track;
+    part->num_gathered++;
+    return(1);
+}
+
+static int find_orphan(const fsck_run_state *run, uint64_t key)
+{
+    const uint64_t *found;
+
+    found = bsearch(&key, run->orphans, run->num_orphans, sizeof(*found), compare_key);
+    return(found ? (int)(found - run->orphans) : -1);
+}
+
+static int merge_orphans(fsck_run_state *run, fsck_part *parts)
+{
+    uint32_t total = 0, i, n;
+    int p;
+
+    for (p = 0; p < run->num_parts; p++) {
+        total += parts[p].num_orphan_keys;
+    }
+    if (!total) {
+        return(1);
+    }
+    run->orphans = malloc(total * sizeof(*run->orphans));
+    if (!run->orphans) {
+        return(0);
+    }
+    for (p = 0, n = 0; p < run->num_parts; p++) {
+        memcpy(run->orphans + n, parts[p].orphan_keys,
+               parts[p].num_orphan_keys * sizeof(*run->orphans));
+        n += parts[p].num_orphan_keys;
+    }
+    qsort(run->orphans, total, sizeof(*run->orphans), compare_key);
+    for (i = 1, n = 1; i < total; i++) {
+        if (run->orphans[i] != run->orphans[n - 1]) {
+            run->orphans[n++] = run->orphans[i];
+        }
+    }
+    run->num_orphans = n;
+    return(1);
+}
+
+/* Is every number from 1 up to the highest used? */
+static int numbered_from_one(const uint64_t numbers[2])
+{
+    if (numbers[1] == 0) {
+        return((numbers[0] & (numbers[0] + 1)) == 0);
+    }
+    return(numbers[0] == ~(uint64_t)0 && (numbers[1] & (numbers[1] + 1)) == 0);
+}
+
+/* "1-3,5,7-9" */
+static void describe_numbers(const uint64_t numbers[2], char *dest, int dest_len)
+{
+    int len = 0, n, first;
+
+    dest[0] = '\0';
+    for (n = 1; n <= CATALOG_MAX_TRACKS; n++) {
+        if (!(numbers[(n - 1) >> 6] >> ((n - 1) & 63) & 1)) {
+            continue;
+        }
+        first = n;
+        while (n < CATALOG_MAX_TRACKS && (numbers[n >> 6] >> (n & 63) & 1)) {
+            n++;
+        }
+        if (len < dest_len) {
+            len += snprintf(dest + len, dest_len - len, first == n ? "%s%d" : "%s%d-%d",
+                            len ? "," : "", first, n);
+        }
+    }
+}
+
+/* Each CD found wrong is reported once, however often the store has it.
+   Its details are kept for the repair, which can't change the store while
+   it is being scanned. */
+static int report_cd(const cat_cd *cd, void *arg)
+{
+    report_state *rs = arg;
+    key_set *set = &rs->run->set;
+    char problem[FSCK_PROBLEM];
+    char numbers[FSCK_PROBLEM - 40];
+    fsck_cd *more;
+    uint8_t flags;
+    int slot;
+
+    slot = set_find(set, fingerprint(cd->catalog));
+    if (slot < 0 || !(set->flags[slot] & FSCK_ANY) || (set->flags[slot] & FSCK_REPORTED)) {
+        return(1);
+    }
+    flags = set->flags[slot];
+    set->flags[slot] |= FSCK_REPORTED;
+    if (flags & FSCK_DUPLICATE) {
+        rs->report(cd->catalog, "stored more than once", rs->arg);
+    }
+    if (flags & FSCK_REPEATED) {
+        rs->report(cd->catalog, "a track number used twice", rs->arg);
+    }
+    if (flags & FSCK_BAD_NUMBER) {
+        snprintf(problem, sizeof(problem), "a track numbered outside 1-%d",
+                 CATALOG_MAX_TRACKS);
+        rs->report(cd->catalog, problem, rs->arg);
+    }
+    if (flags & FSCK_GAP) {
+        describe_numbers(set->numbers[slot], numbers, sizeof(numbers));
+        snprintf(problem, sizeof(problem), "tracks numbered %s", numbers);
+        rs->report(cd->catalog, problem, rs->arg);
+    }
+    if (!rs->run->repair) {
+        return(1);
+    }
+    if (rs->num_to_repair == rs->to_repair_size) {
+        rs->to_repair_size = rs->to_repair_size ? rs->to_repair_size * 2 : 64;
+        more = realloc(rs->to_repair, rs->to_repair_size * sizeof(*more));
+        if (!more) {
+            return(0);
+        }
+        rs->to_repair = more;
+    }
+    rs->to_repair[rs->num_to_repair].slot = slot;
+    rs->to_repair[rs->num_to_repair].cd = *cd;
+    rs->num_to_repair++;
+    return(1);
+}
+
+/* Keep the first copy of the CD the store finds, and the first track
+   stored under each number, with any badly numbered ones after them, all
+   renumbered from 1 */
+static int repair_cd(fsck_run_state *run, const cat_cd *cd, uint8_t flags,
+                     fsck_track *tracks, int count)
+{
+    catalog_backend *be = run->be;
+    cat_track kept[CATALOG_MAX_TRACKS];
+    int first[CATALOG_MAX_TRACKS + 1];
+    cat_cd copy;
+    int num_kept = 0, guard, i, n;
+
+    if (flags & FSCK_DUPLICATE) {
+        for (guard = 0; guard < 100 && catalog_get_cd(be, cd->catalog, &copy); guard++) {
+            if (!catalog_del_cd(be, cd->catalog)) {
+                return(0);
+            }
+        }
+        if (!catalog_put_cd(be, cd)) {
+            return(0);
+        }
+    }
+    if (!(flags & (FSCK_REPEATED | FSCK_BAD_NUMBER | FSCK_GAP)) &&
+        !(flags & FSCK_DUPLICATE && count)) {
+        return(1);
+    }
+
+    for (n = 1; n <= CATALOG_MAX_TRACKS; n++) {
+        first[n] = -1;
+    }
+    for (i = 0; i < count; i++) {
+        n = tracks[i].track.track_no;
+        if (n >= 1 && n <= CATALOG_MAX_TRACKS && first[n] < 0) {
+            first[n] = i;
+        }
+    }
+    for (n = 1; n <= CATALOG_MAX_TRACKS; n++) {
+        if (first[n] >= 0) {
+            kept[num_kept++] = tracks[first[n]].track;
+        }
+    }
+    for (i = 0; i < count && num_kept < CATALOG_MAX_TRACKS; i++) {
+        n = tracks[i].track.track_no;
+        if (n < 1 || n > CATALOG_MAX_TRACKS) {
+            kept[num_kept++] = tracks[i].track;
+        }
+    }
+    for (i = 0; i < num_kept; i++) {
+        kept[i].track_no = i + 1;
+    }
+    if (!catalog_del_tracks(be, cd->catalog)) {
+        return(0);
+    }
+    return(catalog_put_tracks(be, cd->catalog, kept, num_kept));
+}
+
+static int compare_key(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return(x < y ? -1 : x > y);
+}
+
+static int compare_gathered(const void *a, const void *b)
+{
+    const fsck_track *x = a, *y = b;
+
+    if (x->slot != y->slot) {
+        return(x->slot < y->slot ? -1 : 1);
+    }
+    return(x->seq < y->seq ? -1 : x->seq > y->seq);
+}
+
+static int compare_repair(const void *a, const void *b)
+{
+    const fsck_cd *x = a, *y = b;
+
+    return(x->slot < y->slot ? -1 : x->slot > y->slot);
+}
@@ -0,0 +1,57 @@
+/*
+   Checking that the tracks of a store belong to its CDs.
+
+   None of the stores keeps the two together: mini_cd_manager used to
+   remove the tracks of "B10" along with "B1", the cd_dbm application
+   stops deleting a CD's tracks at the first missing number, and cd_mysql
+   deletes a CD and its tracks in two statements. So a store can hold
+   tracks for CDs it doesn't have, a catalog number twice, and tracks
+   numbered with gaps or twice over.
+
+   fsck_run scans the CDs into a set of 64-bit fingerprints of their
+   catalog numbers, with a bitmap of the track numbers each has, then
+   scans the tracks against it in parallel parts. Nothing else is kept
+   per CD or per track, so a catalog of millions of tracks is checked in
+   a few tens of bytes per CD. Two catalog numbers with the same
+   fingerprint would be taken for one, a chance of about one in 30
+   million for a million CDs.
+
+   The tracks are only checked if the store has scan_tracks. Repairing
+   goes through the ordinary operations, one CD at a time, so it is for
+   the problems a check finds rather than for rebuilding a store.
+ */
+
+#ifndef CAT_FSCK_H
+#define CAT_FSCK_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+typedef struct {
+    uint32_t num_cds;
+    uint64_t num_tracks;
+    int tracks_checked;         /* 0 if the store can't list its tracks */
+    uint32_t duplicate_cds;     /* catalog numbers stored more than once */
+    uint64_t orphan_tracks;     /* tracks of no CD */
+    uint32_t orphan_catalogs;   /* the catalog numbers they are for */
+    uint32_t repeated_cds;      /* CDs with a track number used twice */
+    uint32_t gapped_cds;        /* CDs whose tracks aren't numbered 1 to n */
+    uint64_t bad_numbers;       /* tracks numbered outside 1 to CATALOG_MAX_TRACKS */
+    uint32_t repaired;          /* catalog numbers put right */
+    uint32_t repair_failures;
+} fsck_result;
+
+/* Called for each problem found, with the catalog number and what is
+   wrong with it */
+typedef void (*fsck_report_fn)(const char *catalog, const char *problem, void *arg);
+
+/* Check a store with num_threads threads, 0 for one per CPU, and repair
+   what was found if repair is nonzero. 0 if the store couldn't be read. */
+int fsck_run(catalog_backend *be, int num_threads, int repair,
+             fsck_report_fn report, void *arg, fsck_result *result);
+
+/* Did the check find anything wrong? */
+int fsck_problems(const fsck_result *result);
+
+#endif
@@ -0,0 +1,727 @@
+/*
+   Streaming reads and writes over io_uring, with pread and pwrite to fall
+   back on. See cat_io.h.
+
+   The ring is driven through the raw system calls rather than liburing,
+   so the library needs nothing beyond the kernel headers. It is only set
+   up for a file bigger than one block: a smaller one is a single pread or
+   pwrite, which is cheaper than creating the ring. Build with
+   -DNO_IO_URING to leave io_uring out altogether.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifndef HAVE_IO_URING
+#define IORING_OP_READV  0
+#define IORING_OP_WRITEV 0
+#endif
+
+#include "cat_io.h"
+
+#define IO_PRINTF_LEN 512       /* io_printf formats longer output on the heap */
+
+typedef struct {
+#ifdef HAVE_IO_URING
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+#endif
+    int in_flight;
+} io_ring;
+
+/* Block seq of the file is at offset seq * block and is read into slot
+   seq % IO_DEPTH. Reads are submitted up to IO_DEPTH blocks ahead of the
+   one io_gets is in. A read that comes back short is the end of the file. */
+struct cat_reader {
+    int fd;
+    off_t base;                 /* where in the file it was opened */
+    off_t size;                 /* from base to the end */
+    size_t block;
+    char *buffers;
+    int use_ring;
+    io_ring ring;
+    struct iovec iov[IO_DEPTH];
+    int done[IO_DEPTH];
+    ssize_t result[IO_DEPTH];
+    unsigned long next_seq;     /* the next block to submit */
+    unsigned long cur_seq;      /* the block being parsed */
+    const char *pos, *end;
+    size_t cur_len;             /* what the read of the current block got */
+    int at_end;
+    int error;
+};
+
+/* Full blocks are written at their offsets from slot after slot while the
+   next one fills. A slot is busy until its write completes. */
+struct cat_writer {
+    int fd;
+    char *buffers;
+    int use_ring;
+    int ring_tried;
+    io_ring ring;
+    struct iovec iov[IO_DEPTH];
+    off_t offset[IO_DEPTH];
+    int busy[IO_DEPTH];
+    int slot;
+    size_t fill;
+    off_t next_offset;
+    int error;
+};
+
+static int ring_setup(io_ring *ring, unsigned int entries);
+static void ring_free(io_ring *ring);
+static int ring_submit(io_ring *ring, int opcode, int fd,
+                       const struct iovec *iov, off_t offset, int slot);
+static int ring_wait(io_ring *ring, int *slot, ssize_t *result);
+static int read_block(cat_reader *reader);
+static void submit_reads(cat_reader *reader);
+static ssize_t read_fully(int fd, char *buffer, size_t len, off_t offset);
+static int write_fully(int fd, const char *buffer, size_t len, off_t offset);
+static int flush_block(cat_writer *writer);
+static int reap_write(cat_writer *writer);
+
+cat_reader *io_open_read(const char *path)
+{
+    return(io_open_at(path, 0));
+}
+
+cat_reader *io_open_at(const char *path, off_t offset)
+{
+    cat_reader *reader;
+    struct stat st;
+    int saved;
+
+    reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        return(NULL);
+    }
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd == -1 || fstat(reader->fd, &st) == -1) {
+        goto fail;
+    }
+    reader->base = offset < st.st_size ? offset : st.st_size;
+    reader->size = st.st_size - reader->base;
+
+    /* One block one byte bigger than a small file reads it, and its end,
+       in one go */
+    reader->block = IO_BLOCK;
+    if (reader->size < IO_BLOCK) {
+        reader->block = reader->size + 1;
+    } else {
+        reader->use_ring = ring_setup(&reader->ring, IO_DEPTH);
+    }
+    reader->buffers = malloc(reader->block * (reader->use_ring ? IO_DEPTH : 1));
+    if (!reader->buffers) {
+        errno = ENOMEM;
+        goto fail;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (!reader->use_ring && reader->size >= IO_BLOCK) {
+        posix_fadvise(reader->fd, reader->base, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    if (!read_block(reader)) {
+        reader->at_end = 1;
+    }
+    return(reader);
+
+fail:
+    saved = errno;
+    if (reader->use_ring) {
+        ring_free(&reader->ring);
+    }
+    if (reader->fd != -1) {
+        close(reader->fd);
+    }
+    free(reader);
+    errno = saved;
+    return(NULL);
+}
+
+/* As fgets: up to size - 1 characters, stopping after a newline */
+char *io_gets(char *line, int size, cat_reader *reader)
+{
+    const char *newline;
+    size_t want, len;
+    int copied = 0;
+
+    if (size <= 0) {
+        return(NULL);
+    }
+    while (copied < size - 1) {
+        if (reader->pos == reader->end) {
+            if (reader->at_end || !read_block(reader)) {
+                reader->at_end = 1;
+                break;
+            }
+            continue;
+        }
+        want = size - 1 - copied;
+        len = reader->end - reader->pos;
+        if (len > want) {
+            len = want;
+        }
+        newline = memchr(reader->pos, '\n', len);
+        if (newline) {
+            len = newline - reader->pos + 1;
+        }
+        memcpy(line + copied, reader->pos, len);
+        reader->pos += len;
+        copied += len;
+        if (newline) {
+            break;
+        }
+    }
+    if (copied == 0) {
+        return(NULL);
+    }
+    line[copied] = '\0';
+    return(line);
+}
+
+int io_close_read(cat_reader *reader)
+{
+    int slot;
+    ssize_t result;
+    int ok;
+
+    if (!reader) {
+        return(0);
+    }
+    /* The kernel may still be reading into the buffers */
+    if (reader->use_ring) {
+        while (reader->ring.in_flight > 0 &&
+               ring_wait(&reader->ring, &slot, &result)) {
+        }
+        ring_free(&reader->ring);
+    }
+    ok = !reader->error;
+    close(reader->fd);
+    free(reader->buffers);
+    free(reader);
+    return(ok);
+}
+
+off_t io_read_offset(const cat_reader *reader)
+{
+    if (!reader->pos) {
+        return(0);
+    }
+    return((off_t)reader->cur_seq * reader->block +
+           (reader->pos - (reader->end - reader->cur_len)));
+}
+
+/* Make the next block the current one. Returns 0 at the end of the file. */
+static int read_block(cat_reader *reader)
+{
+    off_t offset;
+    ssize_t got, more;
+    int slot, done_slot;
+    char *buffer;
+
+    if (reader->pos) {
+        /* The block just parsed came back short, so that was the end */
+        if (reader->cur_len < reader->block) {
+            return(0);
+        }
+        reader->cur_seq++;
+    }
+    offset = (off_t)reader->cur_seq * reader->block;
+
+    if (!reader->use_ring) {
+        buffer = reader->buffers;
+        got = read_fully(reader->fd, buffer, reader->block, reader->base + offset);
+    } else {
+        submit_reads(reader);
+        slot = reader->cur_seq % IO_DEPTH;
+        buffer = reader->buffers + slot * reader->block;
+        if (reader->cur_seq >= reader->next_seq) {
+            /* The ring wouldn't take it */
+            got = read_fully(reader->fd, buffer, reader->block, reader->base + offset);
+            reader->next_seq = reader->cur_seq + 1;
+        } else {
+            while (!reader->done[slot]) {
+                if (!ring_wait(&reader->ring, &done_slot, &got)) {
+                    reader->error = 1;
+                    return(0);
+                }
+                reader->done[done_slot] = 1;
+                reader->result[done_slot] = got;
+            }
+            reader->done[slot] = 0;
+            got = reader->result[slot];
+            if (got >= 0 && (size_t)got < reader->block &&
+                offset + got < reader->size) {
+                /* Short of the end of the file: read the rest of the block */
+                more = read_fully(reader->fd, buffer + got, reader->block - got,
+                                  reader->base + offset + got);
+                got = more < 0 ? more : got + more;
+            }
+        }
+    }
+    if (got < 0) {
+        errno = -got;
+        reader->error = 1;
+        return(0);
+    }
+    reader->pos = buffer;
+    reader->end = buffer + got;
+    reader->cur_len = got;
+    return(got > 0);
+}
+
+/* Keep IO_DEPTH reads going, but none past the block holding the end of
+   the file as it was when opened */
+static void submit_reads(cat_reader *reader)
+{
+    int slot;
+
+    while (reader->next_seq < reader->cur_seq + IO_DEPTH &&
+           (off_t)(reader->next_seq * reader->block) <= reader->size) {
+        slot = reader->next_seq % IO_DEPTH;
+        reader->iov[slot].iov_base = reader->buffers + slot * reader->block;
+        reader->iov[slot].iov_len = reader->block;
+        if (!ring_submit(&reader->ring, IORING_OP_READV, reader->fd,
+                         &reader->iov[slot],
+                         reader->base + (off_t)reader->next_seq * reader->block,
+                         slot)) {
+            break;
+        }
+        reader->next_seq++;
+    }
+}
+
+/* pread until len bytes or the end of the file. -errno on failure. */
+static ssize_t read_fully(int fd, char *buffer, size_t len, off_t offset)
+{
+    size_t total = 0;
+    ssize_t got;
+
+    while (total < len) {
+        got = pread(fd, buffer + total, len - total, offset + total);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            return(-errno);
+        }
+        if (got == 0) {
+            break;
+        }
+        total += got;
+    }
+    return(total);
+}
+
+cat_writer *io_open_write(const char *path)
+{
+    cat_writer *writer;
+    int saved;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        return(NULL);
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer->fd == -1) {
+        saved = errno;
+        free(writer);
+        errno = saved;
+        return(NULL);
+    }
+    /* Only one buffer until the first one fills */
+    writer->buffers = malloc(IO_BLOCK);
+    if (!writer->buffers) {
+        close(writer->fd);
+        free(writer);
+        errno = ENOMEM;
+        return(NULL);
+    }
+    return(writer);
+}
+
+int io_write(cat_writer *writer, const void *data, size_t len)
+{
+    const char *from = data;
+    size_t room;
+
+    while (len > 0) {
+        room = IO_BLOCK - writer->fill;
+        if (room > len) {
+            room = len;
+        }
+        memcpy(writer->buffers + writer->slot * IO_BLOCK + writer->fill,
+               from, room);
+        writer->fill += room;
+        from += room;
+        len -= room;
+        if (writer->fill == IO_BLOCK && !flush_block(writer)) {
+            return(0);
+        }
+    }
+    return(!writer->error);
+}
+
+int io_puts(const char *str, cat_writer *writer)
+{
+    return(io_write(writer, str, strlen(str)) ? 1 : EOF);
+}
+
+int io_printf(cat_writer *writer, const char *format, ...)
+{
+    char text[IO_PRINTF_LEN];
+    char *long_text;
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0) {
+        return(-1);
+    }
+    if ((size_t)len < sizeof(text)) {
+        return(io_write(writer, text, len) ? len : -1);
+    }
+
+    long_text = malloc(len + 1);
+    if (!long_text) {
+        writer->error = 1;
+        return(-1);
+    }
+    va_start(args, format);
+    vsnprintf(long_text, len + 1, format, args);
+    va_end(args);
+    if (!io_write(writer, long_text, len)) {
+        len = -1;
+    }
+    free(long_text);
+    return(len);
+}
+
+int io_close_write(cat_writer *writer)
+{
+    int ok;
+
+    if (!writer) {
+        return(0);
+    }
+    if (writer->fill > 0 &&
+        !write_fully(writer->fd, writer->buffers + writer->slot * IO_BLOCK,
+                     writer->fill, writer->next_offset)) {
+        writer->error = 1;
+    }
+    if (writer->use_ring) {
+        while (writer->ring.in_flight > 0) {
+            if (!reap_write(writer)) {
+                break;
+            }
+        }
+        ring_free(&writer->ring);
+    }
+    if (close(writer->fd) == -1) {
+        writer->error = 1;
+    }
+    ok = !writer->error;
+    free(writer->buffers);
+    free(writer);
+    return(ok);
+}
+
+off_t io_write_offset(const cat_writer *writer)
+{
+    return(writer->next_offset + writer->fill);
+}
+
+/* Pass a full block to the kernel and move on to a free slot. The ring
+   and the other slots are set up when the first block fills, so a file
+   of less than a block never has them. */
+static int flush_block(cat_writer *writer)
+{
+    char *buffers;
+    int slot = writer->slot;
+
+    if (!writer->ring_tried) {
+        writer->ring_tried = 1;
+        buffers = realloc(writer->buffers, (size_t)IO_BLOCK * IO_DEPTH);
+        if (buffers) {
+            writer->buffers = buffers;
+            writer->use_ring = ring_setup(&writer->ring, IO_DEPTH);
+        }
+    }
+
+    if (!writer->use_ring) {
+        if (!write_fully(writer->fd, writer->buffers, IO_BLOCK,
+                         writer->next_offset)) {
+            writer->error = 1;
+            return(0);
+        }
+        writer->next_offset += IO_BLOCK;
+        writer->fill = 0;
+        return(1);
+    }
+
+    writer->iov[slot].iov_base = writer->buffers + slot * IO_BLOCK;
+    writer->iov[slot].iov_len = IO_BLOCK;
+    writer->offset[slot] = writer->next_offset;
+    if (ring_submit(&writer->ring, IORING_OP_WRITEV, writer->fd,
+                    &writer->iov[slot], writer->next_offset, slot)) {
+        writer->busy[slot] = 1;
+    } else if (!write_fully(writer->fd, writer->buffers + slot * IO_BLOCK,
+                            IO_BLOCK, writer->next_offset)) {
+        writer->error = 1;
+        return(0);
+    }
+    writer->next_offset += IO_BLOCK;
+    writer->fill = 0;
+    writer->slot = (slot + 1) % IO_DEPTH;
+    while (writer->busy[writer->slot]) {
+        if (!reap_write(writer)) {
+            return(0);
+        }
+    }
+    return(!writer->error);
+}
+
+/* Wait for one write to complete, finishing it with pwrite if it was short */
+static int reap_write(cat_writer *writer)
+{
+    ssize_t result;
+    int slot;
+
+    if (!ring_wait(&writer->ring, &slot, &result)) {
+        writer->error = 1;
+        return(0);
+    }
+    writer->busy[slot] = 0;
+    if (result < 0) {
+        errno = -result;
+        writer->error = 1;
+    } else if (result < IO_BLOCK &&
+               !write_fully(writer->fd,
+                            writer->buffers + slot * IO_BLOCK + result,
+                            IO_BLOCK - result,
+                            writer->offset[slot] + result)) {
+        writer->error = 1;
+    }
+    return(!writer->error);
+}
+
+static int write_fully(int fd, const char *buffer, size_t len, off_t offset)
+{
+    ssize_t put;
+
+    while (len > 0) {
+        put = pwrite(fd, buffer, len, offset);
+        if (put == -1 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return(0);
+        }
+        buffer += put;
+        offset += put;
+        len -= put;
+    }
+    return(1);
+}
+
+const char *io_method(void)
+{
+    static int probed = 0;
+    static int have_ring = 0;
+    io_ring ring;
+
+    if (!probed) {
+        have_ring = ring_setup(&ring, 1);
+        if (have_ring) {
+            ring_free(&ring);
+        }
+        probed = 1;
+    }
+    return(have_ring ? "io_uring" : "pread");
+}
+
+#ifdef HAVE_IO_URING
+
+static int ring_setup(io_ring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, '\0', sizeof(*ring));
+    memset(&params, '\0', sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return(0);
+    }
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+        ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_len);
+            goto fail;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_len);
+        }
+        munmap(ring->sq_map, ring->sq_map_len);
+        goto fail;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return(1);
+
+fail:
+    close(ring->fd);
+    return(0);
+}
+
+static void ring_free(io_ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+/* Queue one request and enter the kernel to start it. Returns 0 if it
+   couldn't be submitted, so the caller does the I/O itself. */
+static int ring_submit(io_ring *ring, int opcode, int fd,
+                       const struct iovec *iov, off_t offset, int slot)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+    int submitted;
+
+    tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+        *ring->sq_mask) {
+        return(0);
+    }
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, '\0', sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while (submitted == -1 && (errno == EINTR || errno == EAGAIN));
+    if (submitted != 1) {
+        /* Take the entry back if the kernel didn't */
+        if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        }
+        return(0);
+    }
+    ring->in_flight++;
+    return(1);
+}
+
+/* Wait for the next completion. result is the byte count or -errno. */
+static int ring_wait(io_ring *ring, int *slot, ssize_t *result)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+            return(0);
+        }
+    }
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *slot = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight--;
+    return(1);
+}
+
+#else
+
+static int ring_setup(io_ring *ring, unsigned int entries)
+{
+    return(0);
+}
+
+static void ring_free(io_ring *ring)
+{
+}
+
+static int ring_submit(io_ring *ring, int opcode, int fd,
+                       const struct iovec *iov, off_t offset, int slot)
+{
+    return(0);
+}
+
+static int ring_wait(io_ring *ring, int *slot, ssize_t *result)
+{
+    return(0);
+}
+
+#endif
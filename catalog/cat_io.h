@@ -0,0 +1,50 @@
+/*
+   Streaming file I/O for the text catalog, which is read from the start
+   to the end to answer almost anything and rewritten whole to change
+   anything.
+
+   A reader keeps IO_DEPTH reads of IO_BLOCK bytes in flight ahead of
+   the line being parsed, and a writer hands each block to the kernel as
+   soon as it fills and carries on into the next. Both use io_uring where
+   the kernel has it, and otherwise fall back to pread and pwrite of the
+   same large blocks. io_gets and io_puts behave like fgets and fputs, so
+   a loop over lines reads the same either way.
+ */
+
+#ifndef CAT_IO_H
+#define CAT_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IO_BLOCK  (256 * 1024)
+#define IO_DEPTH  4
+
+typedef struct cat_reader cat_reader;
+typedef struct cat_writer cat_writer;
+
+/* NULL, with errno set, if the file can't be opened */
+cat_reader *io_open_read(const char *path);
+/* Or read from offset to the end, for one of several threads reading a
+   part of the file each */
+cat_reader *io_open_at(const char *path, off_t offset);
+char *io_gets(char *line, int size, cat_reader *reader);
+/* 0 if a read failed along the way */
+int io_close_read(cat_reader *reader);
+/* How many bytes io_gets has returned so far, from where it was opened */
+off_t io_read_offset(const cat_reader *reader);
+
+/* Create or truncate path for writing */
+cat_writer *io_open_write(const char *path);
+int io_write(cat_writer *writer, const void *data, size_t len);
+int io_puts(const char *str, cat_writer *writer);
+int io_printf(cat_writer *writer, const char *format, ...);
+/* Wait for the writes and close. 0 if any of them failed. */
+int io_close_write(cat_writer *writer);
+/* How many bytes have been written so far, including any still buffered */
+off_t io_write_offset(const cat_writer *writer);
+
+/* "io_uring" or "pread", whichever the next file opened will use */
+const char *io_method(void);
+
+#endif
@@ -0,0 +1,2231 @@
+/*
+   The lsm backend (see cat_lsm.h). The keys are a letter and a catalog
+   number: 'c' for a CD, whose value is its title, type, artist and disc
+   ID, and 't' for its tracks, whose value is each track's number and
+   title. The disc ID index is keyed on 'd', the disc ID, a '\0' and the
+   catalog number, with no value, so the CDs with an ID are the keys
+   starting with it. Keys and values are at most LSM_KEY_MAX and
+   LSM_VALUE_MAX bytes.
+
+   A record is the same bytes in memory, in a log and in a run: a kind, the
+   lengths, the key and the value. In a log each is preceded by a checksum.
+
+   The caller's thread writes the log and the memtable; the worker thread
+   writes runs and the manifest. runs_lock guards the levels and the frozen
+   memtable for readers, and is only taken for writing to change them.
+   lock, with work and done, is for the two threads to wait on each other,
+   and guards the file numbers. Only the worker changes the levels, so it
+   reads them without a lock.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_lsm.h"
+#include "cat_io.h"
+
+#define MAX_PATH        1024
+#define LSM_KEY_MAX     (CATALOG_DISCID_LEN + CATALOG_CAT_LEN + 2)
+#define LSM_VALUE_MAX   16384
+#define LSM_RECORD_MAX  (4 + LSM_KEY_MAX + LSM_VALUE_MAX)
+#define LSM_READ_BYTES  (256 * 1024)    /* read at a time by a scan or merge */
+
+#define KIND_PUT        0
+#define KIND_DELETE     1
+
+/* What a lookup found */
+#define LOOKUP_MISSING  0
+#define LOOKUP_FOUND    1
+#define LOOKUP_DELETED  2
+
+typedef struct __attribute__((packed)) {
+    uint8_t kind;
+    uint8_t key_len;
+    uint16_t value_len;
+    char data[];                /* the key, then the value */
+} lsm_entry;
+
+#define ENTRY_VALUE(e)  ((e)->data + (e)->key_len)
+#define ENTRY_SIZE(e)   (sizeof(lsm_entry) + (e)->key_len + (e)->value_len)
+
+typedef struct {
+    lsm_entry **slots;          /* open addressing on the key's hash */
+    int size;                   /* a power of two */
+    int count;
+    size_t bytes;               /* of the records */
+    lsm_entry **sorted;         /* by key, made when it is frozen */
+    uint32_t log;               /* the log with its records */
+} lsm_memtable;
+
+/* The end of a run file */
+typedef struct {
+    char magic[8];
+    uint64_t num_records;
+    uint64_t index_offset;      /* the records end here */
+    uint64_t bloom_offset;
+    uint32_t num_blocks;
+    uint32_t bloom_bits;
+    uint32_t max_key_len;
+    char max_key[LSM_KEY_MAX];
+} lsm_footer;
+
+typedef struct {
+    uint32_t seq;
+    int fd;
+    uint64_t bytes;             /* of the file */
+    uint64_t num_records;
+    uint64_t data_end;
+    uint32_t num_blocks;
+    uint64_t *block_offsets;    /* num_blocks + 1, the last data_end */
+    char (*block_keys)[LSM_KEY_MAX];    /* the first of each block */
+    uint8_t *block_key_lens;
+    char max_key[LSM_KEY_MAX];
+    int max_key_len;
+    uint8_t *bloom;
+    uint32_t bloom_bits;
+} lsm_run;
+
+/* A run being written */
+typedef struct {
+    uint32_t seq;
+    char path[MAX_PATH];
+    cat_writer *out;
+    uint64_t offset;
+    uint64_t block_start;
+    uint64_t num_records;
+    uint64_t *block_offsets;
+    char (*block_keys)[LSM_KEY_MAX];
+    uint8_t *block_key_lens;
+    int num_blocks;
+    int blocks_size;
+    uint32_t *hashes;           /* of every key, for the Bloom filter */
+    uint64_t hashes_size;
+    char last_key[LSM_KEY_MAX];
+    int last_key_len;
+} run_writer;
+
+/* Records in key order, from a memtable or from runs whose ranges don't
+   overlap, in order */
+typedef struct {
+    lsm_entry **entries;
+    int num_entries;
+    int next_entry;
+    lsm_run **runs;
+    int num_runs;
+    int next_run;
+    lsm_run *run;
+    char *buf;
+    uint64_t buf_offset;        /* in the run, of buf[0] */
+    size_t buf_len;
+    size_t pos;
+    const lsm_entry *current;   /* NULL at the end */
+    int failed;
+} lsm_source;
+
+/* Sources from the newest to the oldest */
+typedef struct {
+    lsm_source *sources;
+    int num_sources;
+    lsm_entry *record;          /* the last one returned */
+    lsm_entry **active;         /* the memtable's records, sorted for this merge */
+} lsm_merge;
+
+typedef struct {
+    char dir[MAX_PATH - 32];    /* leaving room for the file names */
+    lsm_memtable *active;
+    lsm_memtable *frozen;       /* being written out, or NULL */
+    lsm_run **levels[LSM_LEVELS];
+    int num_runs[LSM_LEVELS];
+    int runs_size[LSM_LEVELS];
+    char compact_key[LSM_LEVELS][LSM_KEY_MAX];  /* where each level's next merge starts */
+    int compact_key_len[LSM_LEVELS];
+    uint32_t next_file;
+    int log_fd;
+    char *log_buf;
+    size_t log_size;
+    pthread_rwlock_t runs_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t worker;
+    int worker_running;
+    int stopping;
+    int failed;                 /* the worker couldn't write */
+} lsm_state;
+
+/* What the functions of a scan are given */
+typedef int (*entry_fn)(const lsm_entry *entry, void *arg);
+
+static int lsm_open(catalog_backend *be, const char *location, int create);
+static void lsm_close(catalog_backend *be);
+static int lsm_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+static int lsm_get_tracks(catalog_backend *be, const char *catalog,
+                          cat_track *dest, int max_tracks);
+static int lsm_put_cd(catalog_backend *be, const cat_cd *cd);
+static int lsm_put_tracks(catalog_backend *be, const char *catalog,
+                          const cat_track *tracks, int count);
+static int lsm_del_cd(catalog_backend *be, const char *catalog);
+static int lsm_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+static int lsm_stamp(catalog_backend *be, char *dest, int dest_len);
+static int lsm_scan_tracks(catalog_backend *be, int part, int num_parts,
+                           cat_track_fn fn, void *arg);
+static int lsm_del_tracks(catalog_backend *be, const char *catalog);
+static int lsm_put_batch(catalog_backend *be, const cat_entry *entries, int count);
+static int lsm_find_disc_id(catalog_backend *be, const char *disc_id,
+                            cat_scan_fn fn, void *arg);
+
+static int cd_entries(lsm_state *ls, const cat_cd *cd, lsm_entry **dest);
+static lsm_entry *cd_entry(const cat_cd *cd);
+static lsm_entry *index_entry(int kind, const char *disc_id, const char *catalog);
+static lsm_entry *tracks_entry(const char *catalog, const cat_track *tracks, int count);
+static lsm_entry *make_entry(int kind, char prefix, const char *catalog,
+                             const char *value, int value_len);
+static int decode_cd(const lsm_entry *entry, cat_cd *dest);
+static int decode_tracks(const lsm_entry *entry, cat_track *dest, int max_tracks);
+static int write_entries(lsm_state *ls, lsm_entry **entries, int count);
+static int lookup(lsm_state *ls, char prefix, const char *catalog,
+                  lsm_entry *dest);
+static int scan_prefix(lsm_state *ls, const char *prefix, int prefix_len,
+                       entry_fn fn, void *arg);
+
+static lsm_memtable *memtable_create(uint32_t log);
+static void memtable_free(lsm_memtable *mem);
+static int memtable_put(lsm_memtable *mem, lsm_entry *entry);
+static const lsm_entry *memtable_get(const lsm_memtable *mem, const char *key,
+                                     int key_len);
+static lsm_entry **memtable_sort(const lsm_memtable *mem);
+static int freeze(lsm_state *ls);
+static int open_log(lsm_state *ls, uint32_t seq);
+static int replay_log(lsm_state *ls, uint32_t seq, lsm_memtable *mem);
+
+static void *lsm_worker(void *arg);
+static int flush_frozen(lsm_state *ls);
+static int pick_compaction(lsm_state *ls);
+static int compact(lsm_state *ls, int level);
+static void remove_runs(lsm_state *ls, lsm_run **runs, int count);
+static int add_run(lsm_state *ls, int level, lsm_run *run);
+static int write_manifest(lsm_state *ls);
+static int read_manifest(lsm_state *ls, uint32_t *oldest_log);
+
+static int writer_start(lsm_state *ls, run_writer *w);
+static int writer_add(run_writer *w, const lsm_entry *entry);
+static lsm_run *writer_finish(lsm_state *ls, run_writer *w, int *ok);
+static void writer_abandon(run_writer *w);
+static lsm_run *open_run(lsm_state *ls, uint32_t seq);
+static void close_run(lsm_run *run);
+static void discard_run(lsm_state *ls, lsm_run *run);
+static int run_get(lsm_run *run, const char *key, int key_len, uint32_t hash,
+                   lsm_entry *dest);
+static int run_find_block(const lsm_run *run, const char *key, int key_len);
+static int run_overlaps(const lsm_run *run, const char *lo, int lo_len,
+                        const char *hi, int hi_len);
+static uint64_t level_bytes(const lsm_state *ls, int level);
+
+static void source_memtable(lsm_source *src, lsm_entry **entries, int count);
+static int source_runs(lsm_source *src, lsm_run **runs, int count);
+static void source_seek(lsm_source *src, const char *key, int key_len);
+static void source_next(lsm_source *src);
+static void source_free(lsm_source *src);
+static const lsm_entry *merge_next(lsm_merge *merge);
+static int merge_open(lsm_state *ls, lsm_merge *merge, const char *key, int key_len);
+static void merge_free(lsm_merge *merge);
+
+static int key_cmp(const char *a, int a_len, const char *b, int b_len);
+static uint32_t fnv_hash(const void *data, size_t len);
+static void lsm_path(const lsm_state *ls, uint32_t seq, const char *ext, char *dest);
+static int write_all(int fd, const void *data, size_t len);
+static int sync_path(const char *path);
+static int compare_entries(const void *a, const void *b);
+static int compare_seqs(const void *a, const void *b);
+
+const struct catalog_ops cat_lsm_ops = {
+    "lsm",
+    1,
+    lsm_open,
+    lsm_close,
+    lsm_get_cd,
+    lsm_get_tracks,
+    lsm_put_cd,
+    lsm_put_tracks,
+    lsm_del_cd,
+    lsm_scan,
+    NULL,
+    lsm_stamp,
+    lsm_scan_tracks,
+    lsm_del_tracks,
+    lsm_put_batch,
+    lsm_find_disc_id
+};
+
+/* location is the directory of the store, "." by default. The runs of the
+   manifest are opened, any others left by a merge cut short removed, and
+   the logs it still needs replayed and written out as a run, so the store
+   starts with an empty memtable and a new log. */
+static int lsm_open(catalog_backend *be, const char *location, int create)
+{
+    lsm_state *ls;
+    lsm_memtable *replayed;
+    lsm_run *run;
+    run_writer w;
+    struct dirent *de;
+    DIR *dir;
+    char path[MAX_PATH];
+    uint32_t *logs = NULL;
+    uint32_t oldest_log = 0;
+    uint32_t seq;
+    char ext[8];
+    int num_logs = 0, logs_size = 0;
+    int i, ok, in_manifest, level;
+    uint32_t *more;
+
+    if (!location || !location[0]) {
+        location = ".";
+    }
+    if (create && mkdir(location, 0777) == -1 && errno != EEXIST) {
+        perror(location);
+        return(0);
+    }
+    ls = calloc(1, sizeof(*ls));
+    if (!ls) {
+        return(0);
+    }
+    snprintf(ls->dir, sizeof(ls->dir), "%s", location);
+    ls->log_fd = -1;
+    ls->next_file = 1;
+    pthread_rwlock_init(&ls->runs_lock, NULL);
+    pthread_mutex_init(&ls->lock, NULL);
+    pthread_cond_init(&ls->work, NULL);
+    pthread_cond_init(&ls->done, NULL);
+    be->state = ls;
+
+    dir = opendir(location);
+    if (!dir) {
+        perror(location);
+        lsm_close(be);
+        return(0);
+    }
+    if (create) {
+        snprintf(path, MAX_PATH, "%s/%s", location, LSM_MANIFEST);
+        unlink(path);
+    }
+    if (!read_manifest(ls, &oldest_log)) {
+        closedir(dir);
+        lsm_close(be);
+        return(0);
+    }
+
+    /* the logs to replay, and runs the manifest doesn't name */
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "lsm-%u.%3s", &seq, ext) != 2) {
+            continue;
+        }
+        if (seq >= ls->next_file) {
+            ls->next_file = seq + 1;
+        }
+        snprintf(path, MAX_PATH, "%s/%s", location, de->d_name);
+        if (strcmp(ext, "run") == 0) {
+            in_manifest = 0;
+            for (level = 0; level < LSM_LEVELS && !in_manifest; level++) {
+                for (i = 0; i < ls->num_runs[level]; i++) {
+                    if (ls->levels[level][i]->seq == seq) {
+                        in_manifest = 1;
+                    }
+                }
+            }
+            if (!in_manifest) {
+                unlink(path);
+            }
+        } else if (strcmp(ext, "log") == 0) {
+            if (create || seq < oldest_log) {
+                unlink(path);
+            } else {
+                if (num_logs == logs_size) {
+                    logs_size = logs_size ? logs_size * 2 : 8;
+                    more = realloc(logs, logs_size * sizeof(*logs));
+                    if (!more) {
+                        break;
+                    }
+                    logs = more;
+                }
+                logs[num_logs++] = seq;
+            }
+        }
+    }
+    closedir(dir);
+    qsort(logs, num_logs, sizeof(*logs), compare_seqs);
+
+    replayed = memtable_create(0);
+    ls->active = memtable_create(ls->next_file++);
+    ok = replayed && ls->active;
+    for (i = 0; ok && i < num_logs; i++) {
+        ok = replay_log(ls, logs[i], replayed);
+    }
+    if (ok && replayed->count) {
+        replayed->sorted = memtable_sort(replayed);
+        ok = replayed->sorted && writer_start(ls, &w);
+        for (i = 0; ok && i < replayed->count; i++) {
+            ok = writer_add(&w, replayed->sorted[i]);
+        }
+        if (ok) {
+            run = writer_finish(ls, &w, &ok);
+            ok = ok && (!run || add_run(ls, 0, run));
+        } else if (replayed->sorted) {
+            writer_abandon(&w);
+        }
+    }
+    ok = ok && open_log(ls, ls->active->log) && write_manifest(ls);
+    for (i = 0; ok && i < num_logs; i++) {
+        lsm_path(ls, logs[i], "log", path);
+        unlink(path);
+    }
+    free(logs);
+    memtable_free(replayed);
+    if (!ok) {
+        fprintf(stderr, "Unable to open the lsm catalog in %s\n", location);
+        lsm_close(be);
+        return(0);
+    }
+    if (pthread_create(&ls->worker, NULL, lsm_worker, ls) != 0) {
+        lsm_close(be);
+        return(0);
+    }
+    ls->worker_running = 1;
+    return(1);
+}
+
+/* The worker writes out the frozen memtable before it stops. What is left
+   in the active one is in its log. */
+static void lsm_close(catalog_backend *be)
+{
+    lsm_state *ls = be->state;
+    int level, i;
+
+    if (!ls) {
+        return;
+    }
+    if (ls->worker_running) {
+        pthread_mutex_lock(&ls->lock);
+        ls->stopping = 1;
+        pthread_cond_signal(&ls->work);
+        pthread_mutex_unlock(&ls->lock);
+        pthread_join(ls->worker, NULL);
+    }
+    if (ls->log_fd != -1) {
+        fsync(ls->log_fd);
+        close(ls->log_fd);
+    }
+    memtable_free(ls->active);
+    memtable_free(ls->frozen);
+    for (level = 0; level < LSM_LEVELS; level++) {
+        for (i = 0; i < ls->num_runs[level]; i++) {
+            close_run(ls->levels[level][i]);
+        }
+        free(ls->levels[level]);
+    }
+    free(ls->log_buf);
+    pthread_rwlock_destroy(&ls->runs_lock);
+    pthread_mutex_destroy(&ls->lock);
+    pthread_cond_destroy(&ls->work);
+    pthread_cond_destroy(&ls->done);
+    free(ls);
+    be->state = NULL;
+}
+
+static int lsm_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    char record[LSM_RECORD_MAX];
+    lsm_entry *entry = (lsm_entry *)record;
+
+    if (lookup(be->state, 'c', catalog, entry) != LOOKUP_FOUND) {
+        return(0);
+    }
+    return(decode_cd(entry, dest));
+}
+
+static int lsm_get_tracks(catalog_backend *be, const char *catalog,
+                          cat_track *dest, int max_tracks)
+{
+    char record[LSM_RECORD_MAX];
+    lsm_entry *entry = (lsm_entry *)record;
+
+    if (lookup(be->state, 't', catalog, entry) != LOOKUP_FOUND) {
+        return(0);
+    }
+    return(decode_tracks(entry, dest, max_tracks));
+}
+
+static int lsm_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    lsm_entry *entries[3];
+    int count;
+
+    count = cd_entries(be->state, cd, entries);
+    return(count && write_entries(be->state, entries, count));
+}
+
+/* No tracks is a delete, rather than an empty record */
+static int lsm_put_tracks(catalog_backend *be, const char *catalog,
+                          const cat_track *tracks, int count)
+{
+    lsm_entry *entry;
+
+    entry = tracks_entry(catalog, tracks, count);
+    return(entry && write_entries(be->state, &entry, 1));
+}
+
+/* A lookup first, as the other stores fail for a CD they haven't got */
+static int lsm_del_cd(catalog_backend *be, const char *catalog)
+{
+    lsm_entry *entries[3] = { NULL, NULL, NULL };
+    cat_cd existing;
+    int count = 2;
+
+    if (!lsm_get_cd(be, catalog, &existing)) {
+        return(0);
+    }
+    entries[0] = make_entry(KIND_DELETE, 'c', catalog, NULL, 0);
+    entries[1] = make_entry(KIND_DELETE, 't', catalog, NULL, 0);
+    if (existing.disc_id[0]) {
+        entries[count++] = index_entry(KIND_DELETE, existing.disc_id, catalog);
+    }
+    if (!entries[0] || !entries[1] || (count == 3 && !entries[2])) {
+        free(entries[0]);
+        free(entries[1]);
+        free(entries[2]);
+        return(0);
+    }
+    return(write_entries(be->state, entries, count));
+}
+
+typedef struct {
+    cat_scan_fn fn;
+    void *arg;
+} cd_scan;
+
+static int scan_cd_entry(const lsm_entry *entry, void *arg)
+{
+    cd_scan *scan = arg;
+    cat_cd cd;
+
+    if (!decode_cd(entry, &cd)) {
+        return(1);
+    }
+    return(scan->fn(&cd, scan->arg));
+}
+
+/* In catalog number order */
+static int lsm_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    cd_scan scan;
+
+    scan.fn = fn;
+    scan.arg = arg;
+    return(scan_prefix(be->state, "c", 1, scan_cd_entry, &scan));
+}
+
+/* The manifest changes with every run written, and the log with every
+   write in between */
+static int lsm_stamp(catalog_backend *be, char *dest, int dest_len)
+{
+    lsm_state *ls = be->state;
+    char path[MAX_PATH];
+
+    snprintf(path, MAX_PATH, "%s/%s", ls->dir, LSM_MANIFEST);
+    catalog_stamp_file(dest, dest_len, path);
+    lsm_path(ls, ls->active->log, "log", path);
+    catalog_stamp_file(dest, dest_len, path);
+    return(1);
+}
+
+typedef struct {
+    cat_track_fn fn;
+    void *arg;
+} track_scan;
+
+static int scan_track_entry(const lsm_entry *entry, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    track_scan *scan = arg;
+    int count, i;
+
+    count = decode_tracks(entry, tracks, CATALOG_MAX_TRACKS);
+    for (i = 0; i < count; i++) {
+        if (!scan->fn(&tracks[i], scan->arg)) {
+            return(0);
+        }
+    }
+    return(1);
+}
+
+/* One merge of every source can't be shared out, so part 0 does it all */
+static int lsm_scan_tracks(catalog_backend *be, int part, int num_parts,
+                           cat_track_fn fn, void *arg)
+{
+    track_scan scan;
+
+    if (part != 0) {
+        return(1);
+    }
+    scan.fn = fn;
+    scan.arg = arg;
+    return(scan_prefix(be->state, "t", 1, scan_track_entry, &scan));
+}
+
+static int lsm_del_tracks(catalog_backend *be, const char *catalog)
+{
+    lsm_entry *entry;
+
+    entry = make_entry(KIND_DELETE, 't', catalog, NULL, 0);
+    return(entry && write_entries(be->state, &entry, 1));
+}
+
+/* Every record of the batch goes to the log in one write */
+static int lsm_put_batch(catalog_backend *be, const cat_entry *entries, int count)
+{
+    lsm_entry **records;
+    int i, n = 0, m;
+
+    records = malloc(count * 4 * sizeof(*records));
+    if (!records) {
+        return(0);
+    }
+    for (i = 0; i < count; i++) {
+        m = cd_entries(be->state, &entries[i].cd, records + n);
+        if (!m) {
+            break;
+        }
+        records[n + m] = tracks_entry(entries[i].cd.catalog, entries[i].tracks,
+                                      entries[i].num_tracks);
+        if (!records[n + m]) {
+            while (m-- > 0) {
+                free(records[n + m]);
+            }
+            break;
+        }
+        n += m + 1;
+    }
+    if (!write_entries(be->state, records, n)) {
+        i = 0;
+    }
+    free(records);
+    return(i);
+}
+
+typedef struct {
+    char (*catalogs)[CATALOG_CAT_LEN + 1];
+    int count;
+    int size;
+    int failed;
+} disc_scan;
+
+static int scan_disc_entry(const lsm_entry *entry, void *arg)
+{
+    disc_scan *scan = arg;
+    const char *catalog;
+    void *bigger;
+    int len;
+
+    if (scan->count == scan->size) {
+        bigger = realloc(scan->catalogs, (scan->size + 16) * sizeof(*scan->catalogs));
+        if (!bigger) {
+            scan->failed = 1;
+            return(0);
+        }
+        scan->catalogs = bigger;
+        scan->size += 16;
+    }
+    catalog = (const char *)memchr(entry->data, '\0', entry->key_len) + 1;
+    len = entry->data + entry->key_len - catalog;
+    if (len > CATALOG_CAT_LEN) {
+        len = CATALOG_CAT_LEN;
+    }
+    memcpy(scan->catalogs[scan->count], catalog, len);
+    scan->catalogs[scan->count][len] = '\0';
+    scan->count++;
+    return(1);
+}
+
+/* The index keys are gathered first, as fn mustn't be called with the
+   runs locked, then each CD is got. One whose disc ID doesn't match is
+   skipped: a batch putting a CD twice can leave a key for its first ID. */
+static int lsm_find_disc_id(catalog_backend *be, const char *disc_id,
+                            cat_scan_fn fn, void *arg)
+{
+    char prefix[CATALOG_DISCID_LEN + 2];
+    disc_scan scan;
+    cat_cd cd;
+    int id_len = strlen(disc_id);
+    int ok, i;
+
+    if (id_len == 0 || id_len > CATALOG_DISCID_LEN) {
+        return(1);
+    }
+    prefix[0] = 'd';
+    memcpy(prefix + 1, disc_id, id_len + 1);
+    memset(&scan, '\0', sizeof(scan));
+    ok = scan_prefix(be->state, prefix, id_len + 2, scan_disc_entry, &scan) &&
+         !scan.failed;
+    for (i = 0; ok && i < scan.count; i++) {
+        if (lsm_get_cd(be, scan.catalogs[i], &cd) && strcmp(cd.disc_id, disc_id) == 0 &&
+            !fn(&cd, arg)) {
+            break;
+        }
+    }
+    free(scan.catalogs);
+    return(ok);
+}
+
+/* The CD's record and its disc ID's, into dest, returning how many. The
+   CD is looked up first, and if it had another disc ID that key is
+   deleted; for a new CD that is mostly the Bloom filters saying no. */
+static int cd_entries(lsm_state *ls, const cat_cd *cd, lsm_entry **dest)
+{
+    char record[LSM_RECORD_MAX];
+    lsm_entry *old = (lsm_entry *)record;
+    cat_cd existing;
+    int count = 0;
+    int i;
+
+    existing.disc_id[0] = '\0';
+    if (lookup(ls, 'c', cd->catalog, old) == LOOKUP_FOUND) {
+        decode_cd(old, &existing);
+    }
+    dest[count++] = cd_entry(cd);
+    if (existing.disc_id[0] && strcmp(existing.disc_id, cd->disc_id) != 0) {
+        dest[count++] = index_entry(KIND_DELETE, existing.disc_id, cd->catalog);
+    }
+    if (cd->disc_id[0] && strcmp(existing.disc_id, cd->disc_id) != 0) {
+        dest[count++] = index_entry(KIND_PUT, cd->disc_id, cd->catalog);
+    }
+    for (i = 0; i < count; i++) {
+        if (!dest[i]) {
+            for (i = 0; i < count; i++) {
+                free(dest[i]);
+            }
+            return(0);
+        }
+    }
+    return(count);
+}
+
+/* title, type, artist and disc ID, each ended by a '\0' */
+static lsm_entry *cd_entry(const cat_cd *cd)
+{
+    char value[CATALOG_TITLE_LEN + CATALOG_TYPE_LEN + CATALOG_ARTIST_LEN +
+               CATALOG_DISCID_LEN + 4];
+    int len;
+
+    len = sprintf(value, "%s%c%s%c%s%c%s", cd->title, '\0', cd->type, '\0',
+                  cd->artist, '\0', cd->disc_id) + 1;
+    return(make_entry(KIND_PUT, 'c', cd->catalog, value, len));
+}
+
+/* The track number as a base 128 varint, low bits first, then the title
+   ended by a '\0', for each. A track numbered below 1 can't be put. */
+static lsm_entry *tracks_entry(const char *catalog, const cat_track *tracks, int count)
+{
+    char value[CATALOG_MAX_TRACKS * (CATALOG_TRACK_LEN + 6)];
+    unsigned int track_no;
+    int len = 0;
+    int i, title_len;
+
+    if (count == 0) {
+        return(make_entry(KIND_DELETE, 't', catalog, NULL, 0));
+    }
+    for (i = 0; i < count && i < CATALOG_MAX_TRACKS; i++) {
+        title_len = strlen(tracks[i].title);
+        if (title_len > CATALOG_TRACK_LEN) {
+            title_len = CATALOG_TRACK_LEN;
+        }
+        if (tracks[i].track_no < 1) {
+            return(NULL);
+        }
+        for (track_no = tracks[i].track_no; track_no >= 0x80; track_no >>= 7) {
+            value[len++] = (char)(track_no | 0x80);
+        }
+        value[len++] = (char)track_no;
+        memcpy(value + len, tracks[i].title, title_len);
+        len += title_len;
+        value[len++] = '\0';
+    }
+    return(make_entry(KIND_PUT, 't', catalog, value, len));
+}
+
+static lsm_entry *make_entry(int kind, char prefix, const char *catalog,
+                             const char *value, int value_len)
+{
+    lsm_entry *entry;
+    int cat_len = strlen(catalog);
+
+    if (cat_len + 1 > LSM_KEY_MAX || value_len > LSM_VALUE_MAX) {
+        return(NULL);
+    }
+    entry = malloc(sizeof(*entry) + cat_len + 1 + value_len);
+    if (!entry) {
+        return(NULL);
+    }
+    entry->kind = kind;
+    entry->key_len = cat_len + 1;
+    entry->value_len = value_len;
+    entry->data[0] = prefix;
+    memcpy(entry->data + 1, catalog, cat_len);
+    if (value_len) {
+        memcpy(ENTRY_VALUE(entry), value, value_len);
+    }
+    return(entry);
+}
+
+/* 'd', the disc ID, a '\0' and the catalog number, with no value */
+static lsm_entry *index_entry(int kind, const char *disc_id, const char *catalog)
+{
+    lsm_entry *entry;
+    int id_len = strlen(disc_id);
+    int cat_len = strlen(catalog);
+
+    if (id_len > CATALOG_DISCID_LEN || cat_len > CATALOG_CAT_LEN) {
+        return(NULL);
+    }
+    entry = malloc(sizeof(*entry) + id_len + cat_len + 2);
+    if (!entry) {
+        return(NULL);
+    }
+    entry->kind = kind;
+    entry->key_len = id_len + cat_len + 2;
+    entry->value_len = 0;
+    entry->data[0] = 'd';
+    memcpy(entry->data + 1, disc_id, id_len + 1);
+    memcpy(entry->data + id_len + 2, catalog, cat_len);
+    return(entry);
+}
+
+static int decode_cd(const lsm_entry *entry, cat_cd *dest)
+{
+    const char *fields[4];
+    const char *value = ENTRY_VALUE(entry);
+    const char *end = value + entry->value_len;
+    char catalog[LSM_KEY_MAX];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        fields[i] = value;
+        value = memchr(value, '\0', end - value);
+        if (!value) {
+            return(0);
+        }
+        value++;
+    }
+    memcpy(catalog, entry->data + 1, entry->key_len - 1);
+    catalog[entry->key_len - 1] = '\0';
+    memset(dest, '\0', sizeof(*dest));
+    catalog_set_field(dest->catalog, catalog, CATALOG_CAT_LEN);
+    catalog_set_field(dest->title, fields[0], CATALOG_TITLE_LEN);
+    catalog_set_field(dest->type, fields[1], CATALOG_TYPE_LEN);
+    catalog_set_field(dest->artist, fields[2], CATALOG_ARTIST_LEN);
+    catalog_set_field(dest->disc_id, fields[3], CATALOG_DISCID_LEN);
+    return(1);
+}
+
+static int decode_tracks(const lsm_entry *entry, cat_track *dest, int max_tracks)
+{
+    const char *value = ENTRY_VALUE(entry);
+    const char *end = value + entry->value_len;
+    const char *title_end;
+    char catalog[LSM_KEY_MAX];
+    unsigned int track_no;
+    int count = 0;
+    int shift;
+
+    memcpy(catalog, entry->data + 1, entry->key_len - 1);
+    catalog[entry->key_len - 1] = '\0';
+    while (value < end && count < max_tracks) {
+        track_no = 0;
+        for (shift = 0; value < end && shift < 32 && (*value & 0x80); shift += 7) {
+            track_no |= (unsigned int)(*value++ & 0x7f) << shift;
+        }
+        if (value == end || shift >= 32) {
+            break;
+        }
+        track_no |= (unsigned int)*value++ << shift;
+        title_end = memchr(value, '\0', end - value);
+        if (!title_end) {
+            break;
+        }
+        memset(&dest[count], '\0', sizeof(dest[count]));
+        catalog_set_field(dest[count].catalog, catalog, CATALOG_CAT_LEN);
+        dest[count].track_no = track_no;
+        catalog_set_field(dest[count].title, value, CATALOG_TRACK_LEN);
+        count++;
+        value = title_end + 1;
+    }
+    return(count);
+}
+
+/* To the log in one write, then into the memtable, which takes the
+   entries. A full memtable is handed to the worker. */
+static int write_entries(lsm_state *ls, lsm_entry **entries, int count)
+{
+    size_t need = 0, len = 0;
+    uint32_t sum;
+    char *bigger;
+    int i, ok;
+
+    for (i = 0; i < count; i++) {
+        need += sizeof(sum) + ENTRY_SIZE(entries[i]);
+    }
+    if (need > ls->log_size) {
+        bigger = realloc(ls->log_buf, need);
+        if (!bigger) {
+            for (i = 0; i < count; i++) {
+                free(entries[i]);
+            }
+            return(0);
+        }
+        ls->log_buf = bigger;
+        ls->log_size = need;
+    }
+    for (i = 0; i < count; i++) {
+        sum = fnv_hash(entries[i], ENTRY_SIZE(entries[i]));
+        memcpy(ls->log_buf + len, &sum, sizeof(sum));
+        memcpy(ls->log_buf + len + sizeof(sum), entries[i], ENTRY_SIZE(entries[i]));
+        len += sizeof(sum) + ENTRY_SIZE(entries[i]);
+    }
+    ok = write_all(ls->log_fd, ls->log_buf, len);
+    for (i = 0; i < count; i++) {
+        if (!ok || !memtable_put(ls->active, entries[i])) {
+            free(entries[i]);
+            ok = 0;
+        }
+    }
+    if (ok && ls->active->bytes >= LSM_MEMTABLE) {
+        ok = freeze(ls);
+    }
+    return(ok);
+}
+
+/* The newest record of the key: the memtables, then level 0 from its
+   newest run, then the run of each level below that covers the key */
+static int lookup(lsm_state *ls, char prefix, const char *catalog,
+                  lsm_entry *dest)
+{
+    char key[LSM_KEY_MAX];
+    const lsm_entry *entry;
+    lsm_run *run;
+    uint32_t hash;
+    int key_len = strlen(catalog) + 1;
+    int found = LOOKUP_MISSING;
+    int level, i, lo, hi, mid;
+
+    if (key_len > LSM_KEY_MAX) {
+        return(LOOKUP_MISSING);
+    }
+    key[0] = prefix;
+    memcpy(key + 1, catalog, key_len - 1);
+    hash = fnv_hash(key, key_len);
+
+    entry = memtable_get(ls->active, key, key_len);
+    pthread_rwlock_rdlock(&ls->runs_lock);
+    if (!entry && ls->frozen) {
+        entry = memtable_get(ls->frozen, key, key_len);
+    }
+    if (entry) {
+        memcpy(dest, entry, ENTRY_SIZE(entry));
+        found = entry->kind == KIND_PUT ? LOOKUP_FOUND : LOOKUP_DELETED;
+    }
+    for (i = ls->num_runs[0] - 1; found == LOOKUP_MISSING && i >= 0; i--) {
+        found = run_get(ls->levels[0][i], key, key_len, hash, dest);
+    }
+    for (level = 1; found == LOOKUP_MISSING && level < LSM_LEVELS; level++) {
+        /* the first run whose last key isn't below the key */
+        lo = 0;
+        hi = ls->num_runs[level];
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            run = ls->levels[level][mid];
+            if (key_cmp(run->max_key, run->max_key_len, key, key_len) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < ls->num_runs[level]) {
+            found = run_get(ls->levels[level][lo], key, key_len, hash, dest);
+        }
+    }
+    pthread_rwlock_unlock(&ls->runs_lock);
+    return(found);
+}
+
+/* fn for the live record of each key starting with prefix, in order */
+static int scan_prefix(lsm_state *ls, const char *prefix, int prefix_len,
+                       entry_fn fn, void *arg)
+{
+    const lsm_entry *entry;
+    lsm_merge merge;
+    int ok = 1;
+    int i;
+
+    pthread_rwlock_rdlock(&ls->runs_lock);
+    if (!merge_open(ls, &merge, prefix, prefix_len)) {
+        pthread_rwlock_unlock(&ls->runs_lock);
+        return(0);
+    }
+    while ((entry = merge_next(&merge)) != NULL && entry->key_len >= prefix_len &&
+           memcmp(entry->data, prefix, prefix_len) == 0) {
+        if (entry->kind == KIND_PUT && !fn(entry, arg)) {
+            break;
+        }
+    }
+    for (i = 0; i < merge.num_sources; i++) {
+        if (merge.sources[i].failed) {
+            ok = 0;
+        }
+    }
+    merge_free(&merge);
+    pthread_rwlock_unlock(&ls->runs_lock);
+    return(ok);
+}
+
+static lsm_memtable *memtable_create(uint32_t log)
+{
+    lsm_memtable *mem;
+
+    mem = calloc(1, sizeof(*mem));
+    if (!mem) {
+        return(NULL);
+    }
+    mem->size = 1024;
+    mem->slots = calloc(mem->size, sizeof(*mem->slots));
+    if (!mem->slots) {
+        free(mem);
+        return(NULL);
+    }
+    mem->log = log;
+    return(mem);
+}
+
+static void memtable_free(lsm_memtable *mem)
+{
+    int i;
+
+    if (!mem) {
+        return;
+    }
+    for (i = 0; i < mem->size; i++) {
+        free(mem->slots[i]);
+    }
+    free(mem->slots);
+    free(mem->sorted);
+    free(mem);
+}
+
+/* Takes the entry, replacing any with the same key. Grown at half full. */
+static int memtable_put(lsm_memtable *mem, lsm_entry *entry)
+{
+    lsm_entry **old_slots, **slots;
+    int old_size, size, i, slot;
+
+    if ((mem->count + 1) * 2 > mem->size) {
+        size = mem->size * 2;
+        slots = calloc(size, sizeof(*slots));
+        if (!slots) {
+            return(0);
+        }
+        old_slots = mem->slots;
+        old_size = mem->size;
+        mem->slots = slots;
+        mem->size = size;
+        for (i = 0; i < old_size; i++) {
+            if (old_slots[i]) {
+                slot = fnv_hash(old_slots[i]->data, old_slots[i]->key_len) & (size - 1);
+                while (slots[slot]) {
+                    slot = (slot + 1) & (size - 1);
+                }
+                slots[slot] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    slot = fnv_hash(entry->data, entry->key_len) & (mem->size - 1);
+    while (mem->slots[slot]) {
+        if (key_cmp(mem->slots[slot]->data, mem->slots[slot]->key_len,
+                    entry->data, entry->key_len) == 0) {
+            mem->bytes -= ENTRY_SIZE(mem->slots[slot]);
+            free(mem->slots[slot]);
+            mem->slots[slot] = entry;
+            mem->bytes += ENTRY_SIZE(entry);
+            return(1);
+        }
+        slot = (slot + 1) & (mem->size - 1);
+    }
+    mem->slots[slot] = entry;
+    mem->count++;
+    mem->bytes += ENTRY_SIZE(entry);
+    return(1);
+}
+
+static const lsm_entry *memtable_get(const lsm_memtable *mem, const char *key,
+                                     int key_len)
+{
+    int slot;
+
+    slot = fnv_hash(key, key_len) & (mem->size - 1);
+    while (mem->slots[slot]) {
+        if (key_cmp(mem->slots[slot]->data, mem->slots[slot]->key_len,
+                    key, key_len) == 0) {
+            return(mem->slots[slot]);
+        }
+        slot = (slot + 1) & (mem->size - 1);
+    }
+    return(NULL);
+}
+
+/* The records in key order, in an array of their own */
+static lsm_entry **memtable_sort(const lsm_memtable *mem)
+{
+    lsm_entry **sorted;
+    int i, n = 0;
+
+    sorted = malloc((mem->count + 1) * sizeof(*sorted));
+    if (!sorted) {
+        return(NULL);
+    }
+    for (i = 0; i < mem->size; i++) {
+        if (mem->slots[i]) {
+            sorted[n++] = mem->slots[i];
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), compare_entries);
+    return(sorted);
+}
+
+/* Hand the active memtable to the worker and start a new one, with a new
+   log, first waiting for the worker if it is behind */
+static int freeze(lsm_state *ls)
+{
+    lsm_memtable *fresh;
+    lsm_entry **sorted;
+    int old_fd = ls->log_fd;
+    uint32_t seq;
+
+    sorted = memtable_sort(ls->active);
+    if (!sorted) {
+        return(0);
+    }
+    pthread_mutex_lock(&ls->lock);
+    while (!ls->failed && (ls->frozen || ls->num_runs[0] >= LSM_L0_STOP)) {
+        pthread_cond_wait(&ls->done, &ls->lock);
+    }
+    if (ls->failed) {
+        pthread_mutex_unlock(&ls->lock);
+        free(sorted);
+        fprintf(stderr, "The lsm catalog in %s can't write its runs\n", ls->dir);
+        return(0);
+    }
+    seq = ls->next_file++;
+    pthread_mutex_unlock(&ls->lock);
+
+    fresh = memtable_create(seq);
+    if (!fresh || fdatasync(old_fd) != 0 || !open_log(ls, seq)) {
+        memtable_free(fresh);
+        free(sorted);
+        return(0);
+    }
+    close(old_fd);
+
+    pthread_mutex_lock(&ls->lock);
+    pthread_rwlock_wrlock(&ls->runs_lock);
+    ls->active->sorted = sorted;
+    ls->frozen = ls->active;
+    ls->active = fresh;
+    pthread_rwlock_unlock(&ls->runs_lock);
+    pthread_cond_signal(&ls->work);
+    pthread_mutex_unlock(&ls->lock);
+    return(1);
+}
+
+static int open_log(lsm_state *ls, uint32_t seq)
+{
+    char path[MAX_PATH];
+    int fd;
+
+    lsm_path(ls, seq, "log", path);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (fd == -1) {
+        perror(path);
+        return(0);
+    }
+    ls->log_fd = fd;
+    return(1);
+}
+
+/* Into mem, up to the end or the first record that fails its checksum */
+static int replay_log(lsm_state *ls, uint32_t seq, lsm_memtable *mem)
+{
+    char path[MAX_PATH];
+    const lsm_entry *record;
+    lsm_entry *entry;
+    struct stat st;
+    char *buf;
+    size_t pos = 0;
+    uint32_t sum;
+    int fd, ok = 1;
+
+    lsm_path(ls, seq, "log", path);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return(0);
+    }
+    if (fstat(fd, &st) == -1 || !(buf = malloc(st.st_size + 1))) {
+        close(fd);
+        return(0);
+    }
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        ok = 0;
+    }
+    close(fd);
+    while (ok && pos + sizeof(sum) + sizeof(lsm_entry) <= (size_t)st.st_size) {
+        memcpy(&sum, buf + pos, sizeof(sum));
+        record = (const lsm_entry *)(buf + pos + sizeof(sum));
+        if (pos + sizeof(sum) + ENTRY_SIZE(record) > (size_t)st.st_size ||
+            fnv_hash(record, ENTRY_SIZE(record)) != sum) {
+            fprintf(stderr, "%s: stopped at a damaged record %lu bytes in\n",
+                    path, (unsigned long)pos);
+            break;
+        }
+        entry = malloc(ENTRY_SIZE(record));
+        if (!entry) {
+            ok = 0;
+            break;
+        }
+        memcpy(entry, record, ENTRY_SIZE(record));
+        if (!memtable_put(mem, entry)) {
+            free(entry);
+            ok = 0;
+        }
+        pos += sizeof(sum) + ENTRY_SIZE(record);
+    }
+    free(buf);
+    return(ok);
+}
+
+/* Writing out frozen memtables comes before merging, as writes may be
+   waiting for it */
+static void *lsm_worker(void *arg)
+{
+    lsm_state *ls = arg;
+    int level, ok;
+
+    pthread_mutex_lock(&ls->lock);
+    while (!ls->failed) {
+        if (ls->frozen) {
+            pthread_mutex_unlock(&ls->lock);
+            ok = flush_frozen(ls);
+            pthread_mutex_lock(&ls->lock);
+        } else if (ls->stopping) {
+            break;
+        } else if ((level = pick_compaction(ls)) >= 0) {
+            pthread_mutex_unlock(&ls->lock);
+            ok = compact(ls, level);
+            pthread_mutex_lock(&ls->lock);
+        } else {
+            pthread_cond_wait(&ls->work, &ls->lock);
+            continue;
+        }
+        if (!ok) {
+            ls->failed = 1;
+        }
+        pthread_cond_broadcast(&ls->done);
+    }
+    pthread_cond_broadcast(&ls->done);
+    pthread_mutex_unlock(&ls->lock);
+    return(NULL);
+}
+
+/* The frozen memtable as a new run of level 0, then its log is done with */
+static int flush_frozen(lsm_state *ls)
+{
+    lsm_memtable *mem = ls->frozen;
+    char path[MAX_PATH];
+    run_writer w;
+    lsm_run *run;
+    int ok, i;
+
+    if (!writer_start(ls, &w)) {
+        return(0);
+    }
+    ok = 1;
+    for (i = 0; ok && i < mem->count; i++) {
+        ok = writer_add(&w, mem->sorted[i]);
+    }
+    if (!ok) {
+        writer_abandon(&w);
+        return(0);
+    }
+    run = writer_finish(ls, &w, &ok);
+    if (!ok) {
+        return(0);
+    }
+
+    pthread_mutex_lock(&ls->lock);
+    pthread_rwlock_wrlock(&ls->runs_lock);
+    ok = !run || add_run(ls, 0, run);
+    if (ok) {
+        ls->frozen = NULL;
+    }
+    pthread_rwlock_unlock(&ls->runs_lock);
+    ok = ok && write_manifest(ls);
+    pthread_mutex_unlock(&ls->lock);
+    if (!ok) {
+        return(0);
+    }
+    lsm_path(ls, mem->log, "log", path);
+    unlink(path);
+    memtable_free(mem);
+    return(1);
+}
+
+/* Level 0 once it has LSM_L0_RUNS runs, or else the first level over its
+   size. -1 if none needs merging. */
+static int pick_compaction(lsm_state *ls)
+{
+    uint64_t limit = LSM_LEVEL1_BYTES;
+    int level;
+
+    if (ls->num_runs[0] >= LSM_L0_RUNS) {
+        return(0);
+    }
+    for (level = 1; level < LSM_LEVELS - 1; level++) {
+        if (level_bytes(ls, level) > limit) {
+            return(level);
+        }
+        limit *= 10;
+    }
+    return(-1);
+}
+
+/* Merge level 0, or the next run of another level in turn, with the runs
+   of the level below that it overlaps, into new runs of that level. A run
+   that overlaps nothing below just moves down. Tombstones are dropped
+   when there is nothing older under them. */
+static int compact(lsm_state *ls, int level)
+{
+    lsm_run **inputs, **outputs = NULL, **more;
+    lsm_run *upper, *run;
+    lsm_merge merge;
+    const lsm_entry *entry;
+    run_writer w;
+    char lo[LSM_KEY_MAX], hi[LSM_KEY_MAX];
+    int lo_len = 0, hi_len = 0;
+    int num_upper, first, last, num_inputs, num_outputs = 0, outputs_size = 0;
+    int drop, writing = 0, ok = 1;
+    int i, l;
+
+    num_upper = level == 0 ? ls->num_runs[0] : 1;
+    inputs = malloc((num_upper + ls->num_runs[level + 1]) * sizeof(*inputs));
+    if (!inputs) {
+        return(0);
+    }
+    if (level == 0) {
+        /* newest first, as the merge wants them */
+        for (i = 0; i < num_upper; i++) {
+            inputs[i] = ls->levels[0][num_upper - 1 - i];
+        }
+    } else {
+        for (i = 0; i < ls->num_runs[level] - 1; i++) {
+            run = ls->levels[level][i];
+            if (key_cmp(run->block_keys[0], run->block_key_lens[0],
+                        ls->compact_key[level], ls->compact_key_len[level]) > 0) {
+                break;
+            }
+        }
+        inputs[0] = ls->levels[level][i];
+    }
+    for (i = 0; i < num_upper; i++) {
+        upper = inputs[i];
+        if (i == 0 || key_cmp(upper->block_keys[0], upper->block_key_lens[0], lo, lo_len) < 0) {
+            lo_len = upper->block_key_lens[0];
+            memcpy(lo, upper->block_keys[0], lo_len);
+        }
+        if (i == 0 || key_cmp(upper->max_key, upper->max_key_len, hi, hi_len) > 0) {
+            hi_len = upper->max_key_len;
+            memcpy(hi, upper->max_key, hi_len);
+        }
+    }
+    first = -1;
+    last = -1;
+    for (i = 0; i < ls->num_runs[level + 1]; i++) {
+        if (run_overlaps(ls->levels[level + 1][i], lo, lo_len, hi, hi_len)) {
+            if (first < 0) {
+                first = i;
+            }
+            last = i;
+        }
+    }
+    num_inputs = num_upper;
+    for (i = first; first >= 0 && i <= last; i++) {
+        inputs[num_inputs++] = ls->levels[level + 1][i];
+    }
+    if (level > 0) {
+        ls->compact_key_len[level] = hi_len;
+        memcpy(ls->compact_key[level], hi, hi_len);
+    }
+
+    if (level > 0 && first < 0) {
+        pthread_mutex_lock(&ls->lock);
+        pthread_rwlock_wrlock(&ls->runs_lock);
+        remove_runs(ls, inputs, 1);
+        ok = add_run(ls, level + 1, inputs[0]);
+        pthread_rwlock_unlock(&ls->runs_lock);
+        ok = ok && write_manifest(ls);
+        pthread_mutex_unlock(&ls->lock);
+        free(inputs);
+        return(ok);
+    }
+
+    drop = 1;
+    for (l = level + 2; l < LSM_LEVELS; l++) {
+        if (ls->num_runs[l]) {
+            drop = 0;
+        }
+    }
+    memset(&merge, '\0', sizeof(merge));
+    merge.sources = calloc(num_upper + 1, sizeof(*merge.sources));
+    merge.record = malloc(LSM_RECORD_MAX);
+    ok = merge.sources && merge.record;
+    for (i = 0; ok && i < num_upper; i++) {
+        ok = source_runs(&merge.sources[merge.num_sources++], &inputs[i], 1);
+    }
+    if (ok && num_inputs > num_upper) {
+        ok = source_runs(&merge.sources[merge.num_sources++], inputs + num_upper,
+                         num_inputs - num_upper);
+    }
+    for (i = 0; ok && i < merge.num_sources; i++) {
+        source_seek(&merge.sources[i], NULL, 0);
+    }
+    while (ok && (entry = merge_next(&merge)) != NULL) {
+        if (drop && entry->kind == KIND_DELETE) {
+            continue;
+        }
+        if (!writing) {
+            ok = writer_start(ls, &w);
+            writing = ok;
+        }
+        ok = ok && writer_add(&w, entry);
+        if (ok && w.offset >= LSM_RUN_BYTES) {
+            writing = 0;
+            run = writer_finish(ls, &w, &ok);
+            if (ok && run) {
+                if (num_outputs == outputs_size) {
+                    outputs_size = outputs_size ? outputs_size * 2 : 8;
+                    more = realloc(outputs, outputs_size * sizeof(*outputs));
+                    if (!more) {
+                        close_run(run);
+                        ok = 0;
+                        break;
+                    }
+                    outputs = more;
+                }
+                outputs[num_outputs++] = run;
+            }
+        }
+    }
+    for (i = 0; i < merge.num_sources; i++) {
+        if (merge.sources[i].failed) {
+            ok = 0;
+        }
+    }
+    merge_free(&merge);
+    if (writing) {
+        if (ok) {
+            run = writer_finish(ls, &w, &ok);
+            if (ok && run) {
+                more = realloc(outputs, (num_outputs + 1) * sizeof(*outputs));
+                if (more) {
+                    outputs = more;
+                    outputs[num_outputs++] = run;
+                } else {
+                    close_run(run);
+                    ok = 0;
+                }
+            }
+        } else {
+            writer_abandon(&w);
+        }
+    }
+    if (!ok) {
+        for (i = 0; i < num_outputs; i++) {
+            discard_run(ls, outputs[i]);
+        }
+        free(outputs);
+        free(inputs);
+        return(0);
+    }
+
+    pthread_mutex_lock(&ls->lock);
+    pthread_rwlock_wrlock(&ls->runs_lock);
+    remove_runs(ls, inputs, num_inputs);
+    for (i = 0; ok && i < num_outputs; i++) {
+        ok = add_run(ls, level + 1, outputs[i]);
+    }
+    pthread_rwlock_unlock(&ls->runs_lock);
+    ok = ok && write_manifest(ls);
+    pthread_mutex_unlock(&ls->lock);
+
+    /* nothing reads the inputs now */
+    for (i = 0; i < num_inputs; i++) {
+        discard_run(ls, inputs[i]);
+    }
+    free(outputs);
+    free(inputs);
+    return(ok);
+}
+
+/* Take the runs out of whichever levels they are in */
+static void remove_runs(lsm_state *ls, lsm_run **runs, int count)
+{
+    int level, i, j, k, found;
+
+    for (level = 0; level < LSM_LEVELS; level++) {
+        for (i = 0, j = 0; i < ls->num_runs[level]; i++) {
+            found = 0;
+            for (k = 0; k < count; k++) {
+                if (ls->levels[level][i] == runs[k]) {
+                    found = 1;
+                }
+            }
+            if (!found) {
+                ls->levels[level][j++] = ls->levels[level][i];
+            }
+        }
+        ls->num_runs[level] = j;
+    }
+}
+
+/* Level 0 is in the order the runs were written, the others by key */
+static int add_run(lsm_state *ls, int level, lsm_run *run)
+{
+    lsm_run **more;
+    int i;
+
+    if (ls->num_runs[level] == ls->runs_size[level]) {
+        more = realloc(ls->levels[level],
+                       (ls->runs_size[level] ? ls->runs_size[level] * 2 : 8) *
+                       sizeof(*more));
+        if (!more) {
+            return(0);
+        }
+        ls->levels[level] = more;
+        ls->runs_size[level] = ls->runs_size[level] ? ls->runs_size[level] * 2 : 8;
+    }
+    i = ls->num_runs[level];
+    if (level > 0) {
+        while (i > 0 && key_cmp(ls->levels[level][i - 1]->block_keys[0],
+                                ls->levels[level][i - 1]->block_key_lens[0],
+                                run->block_keys[0], run->block_key_lens[0]) > 0) {
+            ls->levels[level][i] = ls->levels[level][i - 1];
+            i--;
+        }
+    }
+    ls->levels[level][i] = run;
+    ls->num_runs[level]++;
+    return(1);
+}
+
+/* With lock held. The oldest log still needed is the frozen memtable's,
+   if there is one. */
+static int write_manifest(lsm_state *ls)
+{
+    char path[MAX_PATH], temp[MAX_PATH + 4];
+    FILE *fp;
+    int level, i, ok;
+
+    snprintf(path, MAX_PATH, "%s/%s", ls->dir, LSM_MANIFEST);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    fp = fopen(temp, "w");
+    if (!fp) {
+        perror(temp);
+        return(0);
+    }
+    fprintf(fp, "%s\nnext %u\nlog %u\n", LSM_MAGIC, ls->next_file,
+            ls->frozen ? ls->frozen->log : ls->active->log);
+    for (level = 0; level < LSM_LEVELS; level++) {
+        for (i = 0; i < ls->num_runs[level]; i++) {
+            fprintf(fp, "run %d %u\n", level, ls->levels[level][i]->seq);
+        }
+    }
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return(0);
+    }
+    return(1);
+}
+
+/* Open the runs it names. No manifest is an empty store. */
+static int read_manifest(lsm_state *ls, uint32_t *oldest_log)
+{
+    char path[MAX_PATH];
+    char line[100];
+    lsm_run *run;
+    uint32_t seq;
+    int level;
+    FILE *fp;
+
+    snprintf(path, MAX_PATH, "%s/%s", ls->dir, LSM_MANIFEST);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return(errno == ENOENT);
+    }
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, LSM_MAGIC, strlen(LSM_MAGIC)) != 0) {
+        fprintf(stderr, "%s is not an lsm manifest\n", path);
+        fclose(fp);
+        return(0);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "next %u", &seq) == 1) {
+            ls->next_file = seq;
+        } else if (sscanf(line, "log %u", &seq) == 1) {
+            *oldest_log = seq;
+        } else if (sscanf(line, "run %d %u", &level, &seq) == 2 &&
+                   level >= 0 && level < LSM_LEVELS) {
+            run = open_run(ls, seq);
+            if (!run || !add_run(ls, level, run)) {
+                close_run(run);
+                fclose(fp);
+                return(0);
+            }
+        }
+    }
+    fclose(fp);
+    return(1);
+}
+
+static int writer_start(lsm_state *ls, run_writer *w)
+{
+    memset(w, '\0', sizeof(*w));
+    pthread_mutex_lock(&ls->lock);
+    w->seq = ls->next_file++;
+    pthread_mutex_unlock(&ls->lock);
+    lsm_path(ls, w->seq, "run", w->path);
+    w->out = io_open_write(w->path);
+    if (!w->out) {
+        perror(w->path);
+        return(0);
+    }
+    return(1);
+}
+
+/* Records come in key order. A block ends with the first record that
+   takes it to LSM_BLOCK bytes. */
+static int writer_add(run_writer *w, const lsm_entry *entry)
+{
+    uint64_t *offsets;
+    char (*keys)[LSM_KEY_MAX];
+    uint8_t *lens;
+    uint32_t *hashes;
+
+    if (w->offset == w->block_start) {
+        if (w->num_blocks == w->blocks_size) {
+            w->blocks_size = w->blocks_size ? w->blocks_size * 2 : 256;
+            offsets = realloc(w->block_offsets, w->blocks_size * sizeof(*offsets));
+            if (offsets) {
+                w->block_offsets = offsets;
+            }
+            keys = realloc(w->block_keys, w->blocks_size * sizeof(*keys));
+            if (keys) {
+                w->block_keys = keys;
+            }
+            lens = realloc(w->block_key_lens, w->blocks_size * sizeof(*lens));
+            if (lens) {
+                w->block_key_lens = lens;
+            }
+            if (!offsets || !keys || !lens) {
+                return(0);
+            }
+        }
+        w->block_offsets[w->num_blocks] = w->offset;
+        memcpy(w->block_keys[w->num_blocks], entry->data, entry->key_len);
+        w->block_key_lens[w->num_blocks] = entry->key_len;
+        w->num_blocks++;
+    }
+    if (w->num_records == w->hashes_size) {
+        w->hashes_size = w->hashes_size ? w->hashes_size * 2 : 4096;
+        hashes = realloc(w->hashes, w->hashes_size * sizeof(*hashes));
+        if (!hashes) {
+            return(0);
+        }
+        w->hashes = hashes;
+    }
+    w->hashes[w->num_records++] = fnv_hash(entry->data, entry->key_len);
+    if (!io_write(w->out, entry, ENTRY_SIZE(entry))) {
+        return(0);
+    }
+    w->offset += ENTRY_SIZE(entry);
+    if (w->offset - w->block_start >= LSM_BLOCK) {
+        w->block_start = w->offset;
+    }
+    memcpy(w->last_key, entry->data, entry->key_len);
+    w->last_key_len = entry->key_len;
+    return(1);
+}
+
+/* The index, the Bloom filter and the footer after the records, then the
+   run is synced and opened for reading. NULL, with *ok still 1, if it
+   had no records. */
+static lsm_run *writer_finish(lsm_state *ls, run_writer *w, int *ok)
+{
+    lsm_footer footer;
+    uint8_t *bloom;
+    uint64_t offset;
+    uint32_t bits, h, delta;
+    uint8_t len;
+    uint64_t i;
+    int k;
+
+    *ok = 1;
+    if (w->num_records == 0) {
+        writer_abandon(w);
+        return(NULL);
+    }
+    memset(&footer, '\0', sizeof(footer));
+    memcpy(footer.magic, LSM_MAGIC, sizeof(footer.magic));
+    footer.num_records = w->num_records;
+    footer.index_offset = w->offset;
+    footer.num_blocks = w->num_blocks;
+    footer.max_key_len = w->last_key_len;
+    memcpy(footer.max_key, w->last_key, w->last_key_len);
+
+    offset = w->offset;
+    for (i = 0; i < (uint64_t)w->num_blocks && *ok; i++) {
+        len = w->block_key_lens[i];
+        *ok = io_write(w->out, &w->block_offsets[i], sizeof(uint64_t)) &&
+              io_write(w->out, &len, 1) &&
+              io_write(w->out, w->block_keys[i], len);
+        offset += sizeof(uint64_t) + 1 + len;
+    }
+    footer.bloom_offset = offset;
+
+    bits = (w->num_records * LSM_BLOOM_BITS + 63) / 64 * 64;
+    bloom = calloc(bits / 8, 1);
+    if (!bloom) {
+        *ok = 0;
+    }
+    for (i = 0; *ok && i < w->num_records; i++) {
+        h = w->hashes[i];
+        delta = (h >> 17) | (h << 15);
+        for (k = 0; k < LSM_BLOOM_HASHES; k++) {
+            bloom[(h % bits) / 8] |= 1 << ((h % bits) % 8);
+            h += delta;
+        }
+    }
+    footer.bloom_bits = bits;
+    *ok = *ok && io_write(w->out, bloom, bits / 8) &&
+          io_write(w->out, &footer, sizeof(footer));
+    free(bloom);
+    if (!*ok) {
+        writer_abandon(w);
+        return(NULL);
+    }
+    *ok = io_close_write(w->out) && sync_path(w->path);
+    w->out = NULL;
+    writer_abandon(w);
+    if (!*ok) {
+        return(NULL);
+    }
+    return(open_run(ls, w->seq));
+}
+
+/* Free what the writer holds, removing the file unless it was finished */
+static void writer_abandon(run_writer *w)
+{
+    if (w->out) {
+        io_close_write(w->out);
+        unlink(w->path);
+        w->out = NULL;
+    }
+    free(w->block_offsets);
+    free(w->block_keys);
+    free(w->block_key_lens);
+    free(w->hashes);
+    w->block_offsets = NULL;
+    w->block_keys = NULL;
+    w->block_key_lens = NULL;
+    w->hashes = NULL;
+}
+
+/* The footer, index and Bloom filter are read into memory */
+static lsm_run *open_run(lsm_state *ls, uint32_t seq)
+{
+    char path[MAX_PATH];
+    lsm_footer footer;
+    lsm_run *run;
+    struct stat st;
+    char *index = NULL;
+    size_t index_len, pos = 0;
+    uint32_t i;
+    uint8_t len;
+    int ok = 0;
+
+    lsm_path(ls, seq, "run", path);
+    run = calloc(1, sizeof(*run));
+    if (!run) {
+        return(NULL);
+    }
+    run->seq = seq;
+    run->fd = open(path, O_RDONLY);
+    if (run->fd == -1 || fstat(run->fd, &st) == -1 ||
+        st.st_size < (off_t)sizeof(footer) ||
+        pread(run->fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer) ||
+        memcmp(footer.magic, LSM_MAGIC, sizeof(footer.magic)) != 0 ||
+        footer.num_blocks == 0 || footer.index_offset > footer.bloom_offset ||
+        footer.bloom_offset + footer.bloom_bits / 8 + sizeof(footer) != (uint64_t)st.st_size ||
+        footer.max_key_len == 0 || footer.max_key_len > LSM_KEY_MAX) {
+        goto done;
+    }
+    run->bytes = st.st_size;
+    run->num_records = footer.num_records;
+    run->data_end = footer.index_offset;
+    run->num_blocks = footer.num_blocks;
+    run->max_key_len = footer.max_key_len;
+    memcpy(run->max_key, footer.max_key, footer.max_key_len);
+    run->bloom_bits = footer.bloom_bits;
+
+    index_len = footer.bloom_offset - footer.index_offset;
+    index = malloc(index_len);
+    run->block_offsets = malloc((run->num_blocks + 1) * sizeof(*run->block_offsets));
+    run->block_keys = malloc(run->num_blocks * sizeof(*run->block_keys));
+    run->block_key_lens = malloc(run->num_blocks);
+    run->bloom = malloc(run->bloom_bits / 8);
+    if (!index || !run->block_offsets || !run->block_keys || !run->block_key_lens ||
+        !run->bloom ||
+        pread(run->fd, index, index_len, footer.index_offset) != (ssize_t)index_len ||
+        pread(run->fd, run->bloom, run->bloom_bits / 8, footer.bloom_offset) !=
+            (ssize_t)(run->bloom_bits / 8)) {
+        goto done;
+    }
+    for (i = 0; i < run->num_blocks; i++) {
+        if (pos + sizeof(uint64_t) + 1 > index_len) {
+            goto done;
+        }
+        memcpy(&run->block_offsets[i], index + pos, sizeof(uint64_t));
+        len = index[pos + sizeof(uint64_t)];
+        pos += sizeof(uint64_t) + 1;
+        if (len == 0 || len > LSM_KEY_MAX || pos + len > index_len) {
+            goto done;
+        }
+        memcpy(run->block_keys[i], index + pos, len);
+        run->block_key_lens[i] = len;
+        pos += len;
+    }
+    run->block_offsets[run->num_blocks] = run->data_end;
+    ok = 1;
+
+done:
+    free(index);
+    if (!ok) {
+        fprintf(stderr, "%s is not a run of an lsm catalog\n", path);
+        close_run(run);
+        return(NULL);
+    }
+    return(run);
+}
+
+static void close_run(lsm_run *run)
+{
+    if (!run) {
+        return;
+    }
+    if (run->fd != -1) {
+        close(run->fd);
+    }
+    free(run->block_offsets);
+    free(run->block_keys);
+    free(run->block_key_lens);
+    free(run->bloom);
+    free(run);
+}
+
+/* Close a run and remove its file */
+static void discard_run(lsm_state *ls, lsm_run *run)
+{
+    char path[MAX_PATH];
+
+    lsm_path(ls, run->seq, "run", path);
+    unlink(path);
+    close_run(run);
+}
+
+/* The Bloom filter, then the one block that can hold the key */
+static int run_get(lsm_run *run, const char *key, int key_len, uint32_t hash,
+                   lsm_entry *dest)
+{
+    const lsm_entry *entry;
+    uint32_t h = hash, delta = (hash >> 17) | (hash << 15);
+    uint64_t start, len, pos;
+    char *block;
+    int b, k, c;
+    int found = LOOKUP_MISSING;
+
+    for (k = 0; k < LSM_BLOOM_HASHES; k++) {
+        if (!(run->bloom[(h % run->bloom_bits) / 8] & (1 << ((h % run->bloom_bits) % 8)))) {
+            return(LOOKUP_MISSING);
+        }
+        h += delta;
+    }
+    if (key_cmp(key, key_len, run->max_key, run->max_key_len) > 0) {
+        return(LOOKUP_MISSING);
+    }
+    b = run_find_block(run, key, key_len);
+    if (b < 0) {
+        return(LOOKUP_MISSING);
+    }
+    start = run->block_offsets[b];
+    len = run->block_offsets[b + 1] - start;
+    block = malloc(len);
+    if (!block) {
+        return(LOOKUP_MISSING);
+    }
+    if (pread(run->fd, block, len, start) != (ssize_t)len) {
+        fprintf(stderr, "Unable to read run %u of the lsm catalog\n", run->seq);
+        free(block);
+        return(LOOKUP_MISSING);
+    }
+    for (pos = 0; pos + sizeof(lsm_entry) <= len; pos += ENTRY_SIZE(entry)) {
+        entry = (const lsm_entry *)(block + pos);
+        if (entry->key_len == 0 || pos + ENTRY_SIZE(entry) > len) {
+            break;
+        }
+        c = key_cmp(entry->data, entry->key_len, key, key_len);
+        if (c == 0) {
+            memcpy(dest, entry, ENTRY_SIZE(entry));
+            found = entry->kind == KIND_PUT ? LOOKUP_FOUND : LOOKUP_DELETED;
+        }
+        if (c >= 0) {
+            break;
+        }
+    }
+    free(block);
+    return(found);
+}
+
+/* The last block whose first key isn't above the key, -1 if the key is
+   before them all */
+static int run_find_block(const lsm_run *run, const char *key, int key_len)
+{
+    int lo = 0, hi = run->num_blocks, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (key_cmp(run->block_keys[mid], run->block_key_lens[mid], key, key_len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return(lo - 1);
+}
+
+static int run_overlaps(const lsm_run *run, const char *lo, int lo_len,
+                        const char *hi, int hi_len)
+{
+    return(key_cmp(run->max_key, run->max_key_len, lo, lo_len) >= 0 &&
+           key_cmp(run->block_keys[0], run->block_key_lens[0], hi, hi_len) <= 0);
+}
+
+static uint64_t level_bytes(const lsm_state *ls, int level)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < ls->num_runs[level]; i++) {
+        bytes += ls->levels[level][i]->bytes;
+    }
+    return(bytes);
+}
+
+static void source_memtable(lsm_source *src, lsm_entry **entries, int count)
+{
+    memset(src, '\0', sizeof(*src));
+    src->entries = entries;
+    src->num_entries = count;
+}
+
+static int source_runs(lsm_source *src, lsm_run **runs, int count)
+{
+    memset(src, '\0', sizeof(*src));
+    src->runs = runs;
+    src->num_runs = count;
+    src->buf = malloc(LSM_READ_BYTES);
+    return(src->buf != NULL);
+}
+
+/* To the first record whose key isn't below key, or the very first if
+   key is NULL */
+static void source_seek(lsm_source *src, const char *key, int key_len)
+{
+    const lsm_entry *e;
+    lsm_run *run;
+    int lo, hi, mid, b;
+
+    if (!src->runs) {
+        lo = 0;
+        hi = src->num_entries;
+        while (key && lo < hi) {
+            mid = (lo + hi) / 2;
+            e = src->entries[mid];
+            if (key_cmp(e->data, e->key_len, key, key_len) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        src->next_entry = lo;
+        source_next(src);
+        return;
+    }
+    src->next_run = 0;
+    while (key && src->next_run < src->num_runs) {
+        run = src->runs[src->next_run];
+        if (key_cmp(run->max_key, run->max_key_len, key, key_len) >= 0) {
+            break;
+        }
+        src->next_run++;
+    }
+    src->run = NULL;
+    src->current = NULL;
+    if (src->next_run == src->num_runs) {
+        return;
+    }
+    src->run = src->runs[src->next_run++];
+    b = key ? run_find_block(src->run, key, key_len) : 0;
+    src->buf_offset = src->run->block_offsets[b < 0 ? 0 : b];
+    src->buf_len = 0;
+    src->pos = 0;
+    source_next(src);
+    while (key && src->current &&
+           key_cmp(src->current->data, src->current->key_len, key, key_len) < 0) {
+        source_next(src);
+    }
+}
+
+/* A run is read LSM_READ_BYTES at a time, from the record that didn't fit
+   in the last read */
+static void source_next(lsm_source *src)
+{
+    const lsm_entry *e;
+    uint64_t file_pos;
+    size_t avail, len;
+
+    if (!src->runs) {
+        src->current = src->next_entry < src->num_entries ?
+                       src->entries[src->next_entry++] : NULL;
+        return;
+    }
+    while (src->run) {
+        avail = src->buf_len - src->pos;
+        if (avail >= sizeof(lsm_entry)) {
+            e = (const lsm_entry *)(src->buf + src->pos);
+            if (e->key_len == 0 || ENTRY_SIZE(e) > LSM_RECORD_MAX) {
+                break;
+            }
+            if (avail >= ENTRY_SIZE(e)) {
+                src->current = e;
+                src->pos += ENTRY_SIZE(e);
+                return;
+            }
+        }
+        file_pos = src->buf_offset + src->pos;
+        if (file_pos >= src->run->data_end) {
+            src->run = src->next_run < src->num_runs ? src->runs[src->next_run++] : NULL;
+            src->buf_offset = 0;
+            src->buf_len = 0;
+            src->pos = 0;
+            continue;
+        }
+        len = src->run->data_end - file_pos;
+        if (len > LSM_READ_BYTES) {
+            len = LSM_READ_BYTES;
+        }
+        if (len <= avail || pread(src->run->fd, src->buf, len, file_pos) != (ssize_t)len) {
+            break;
+        }
+        src->buf_offset = file_pos;
+        src->buf_len = len;
+        src->pos = 0;
+    }
+    if (src->run) {
+        fprintf(stderr, "Run %u of the lsm catalog is damaged\n", src->run->seq);
+        src->failed = 1;
+        src->run = NULL;
+    }
+    src->current = NULL;
+}
+
+static void source_free(lsm_source *src)
+{
+    free(src->buf);
+    src->buf = NULL;
+}
+
+/* The smallest key of the sources, from the first of them that has it,
+   the newest. Copied, as the source it came from may read over it. */
+static const lsm_entry *merge_next(lsm_merge *merge)
+{
+    const lsm_entry *best = NULL, *e;
+    int i;
+
+    for (i = 0; i < merge->num_sources; i++) {
+        e = merge->sources[i].current;
+        if (e && (!best || key_cmp(e->data, e->key_len, best->data, best->key_len) < 0)) {
+            best = e;
+        }
+    }
+    if (!best) {
+        return(NULL);
+    }
+    memcpy(merge->record, best, ENTRY_SIZE(best));
+    for (i = 0; i < merge->num_sources; i++) {
+        e = merge->sources[i].current;
+        if (e && key_cmp(e->data, e->key_len, merge->record->data,
+                         merge->record->key_len) == 0) {
+            source_next(&merge->sources[i]);
+        }
+    }
+    return(merge->record);
+}
+
+/* With runs_lock held: the memtables, level 0 from the newest run, then
+   each level below, all from key on */
+static int merge_open(lsm_state *ls, lsm_merge *merge, const char *key, int key_len)
+{
+    int level, i, ok;
+
+    memset(merge, '\0', sizeof(*merge));
+    merge->sources = calloc(2 + ls->num_runs[0] + LSM_LEVELS, sizeof(*merge->sources));
+    merge->record = malloc(LSM_RECORD_MAX);
+    merge->active = memtable_sort(ls->active);
+    ok = merge->sources && merge->record && merge->active;
+    if (ok) {
+        source_memtable(&merge->sources[merge->num_sources++], merge->active,
+                        ls->active->count);
+    }
+    if (ok && ls->frozen) {
+        source_memtable(&merge->sources[merge->num_sources++], ls->frozen->sorted,
+                        ls->frozen->count);
+    }
+    for (i = ls->num_runs[0] - 1; ok && i >= 0; i--) {
+        ok = source_runs(&merge->sources[merge->num_sources++], &ls->levels[0][i], 1);
+    }
+    for (level = 1; ok && level < LSM_LEVELS; level++) {
+        if (ls->num_runs[level]) {
+            ok = source_runs(&merge->sources[merge->num_sources++], ls->levels[level],
+                             ls->num_runs[level]);
+        }
+    }
+    if (!ok) {
+        merge_free(merge);
+        return(0);
+    }
+    for (i = 0; i < merge->num_sources; i++) {
+        source_seek(&merge->sources[i], key, key_len);
+    }
+    return(1);
+}
+
+static void merge_free(lsm_merge *merge)
+{
+    int i;
+
+    for (i = 0; i < merge->num_sources; i++) {
+        source_free(&merge->sources[i]);
+    }
+    free(merge->sources);
+    free(merge->record);
+    free(merge->active);
+    merge->sources = NULL;
+    merge->record = NULL;
+    merge->active = NULL;
+}
+
+static int key_cmp(const char *a, int a_len, const char *b, int b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    return(c ? c : a_len - b_len);
+}
+
+/* FNV-1a, for the hash table, the Bloom filters and the log's checksums */
+static uint32_t fnv_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return(h);
+}
+
+static void lsm_path(const lsm_state *ls, uint32_t seq, const char *ext, char *dest)
+{
+    snprintf(dest, MAX_PATH, "%s/lsm-%06u.%s", ls->dir, seq, ext);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return(0);
+        }
+        p += n;
+        len -= n;
+    }
+    return(1);
+}
+
+static int sync_path(const char *path)
+{
+    int fd, ok;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return(0);
+    }
+    ok = fsync(fd) == 0;
+    ok &= close(fd) == 0;
+    return(ok);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const lsm_entry *x = *(lsm_entry *const *)a;
+    const lsm_entry *y = *(lsm_entry *const *)b;
+
+    return(key_cmp(x->data, x->key_len, y->data, y->key_len));
+}
+
+static int compare_seqs(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return(x < y ? -1 : x > y);
+}
@@ -0,0 +1,65 @@
+/*
+   The lsm backend is a log-structured merge store for catalogs that are
+   mostly written, such as a freedb import. Nothing on disk is ever
+   changed in place: every write is appended to a log and made in memory,
+   and the memory is written out whole, in key order, as it fills.
+
+   - The memtable holds the latest writes, hashed on their keys. A delete
+     is a record too, a tombstone, until a merge can drop it.
+   - Each write is appended to the current log (lsm-N.log) before it is
+     made, so reopening the store replays what hadn't been written out. A
+     record torn by a crash fails its checksum and ends the replay there.
+   - A full memtable is frozen and a worker thread writes it out as a run
+     (lsm-N.run): the records in key order, an index with the first key
+     of every block of about LSM_BLOCK bytes, and a Bloom filter of the
+     keys, so a lookup in a run without the key reads nothing.
+   - Runs are kept in levels. Level 0 has the runs as they were written
+     out, which may overlap. When there are LSM_L0_RUNS of them the worker
+     merges them into level 1, whose runs, like those of every level below
+     it, cover separate ranges of keys. When a level is more than its size,
+     LSM_LEVEL1_BYTES for level 1 and ten times that for each next one, a
+     run of it is merged into the next level, taking its turn by key.
+   - lsm.manifest names the runs of each level and the oldest log still
+     needed, and is replaced by renaming a new one over it.
+
+   A lookup tries the memtable, the frozen one, level 0 from the newest
+   run, then the one run of each level below that can hold the key. A scan
+   merges them all in key order, the newest record of each key winning.
+
+   A CD is one record, keyed on its catalog number, and its tracks are
+   another, so putting a CD with its tracks is two records, and a third
+   when it has a disc ID, which keys an index of the CDs by disc ID. The logs and
+   runs are only read and written from one end to the other, so a long
+   run of puts goes as fast as the disk writes in sequence, as long as
+   the worker keeps up; if it falls behind, by a second memtable or
+   LSM_L0_STOP runs in level 0, writes wait for it.
+
+   Writes reach the kernel before a put returns, so a crash of the program
+   loses nothing, but the log is only synced when it is replaced and on
+   close, so a crash of the machine can lose the last writes, as with the
+   text files. Runs and the manifest are synced before they are used.
+
+   One thread at a time may write. The functions called by scan and
+   scan_tracks mustn't change the store.
+ */
+
+#ifndef CAT_LSM_H
+#define CAT_LSM_H
+
+#include "catalog.h"
+
+#define LSM_MANIFEST      "lsm.manifest"
+#define LSM_MAGIC         "CDLSM03"
+#define LSM_MEMTABLE      (4 * 1024 * 1024)     /* bytes of records */
+#define LSM_BLOCK         4096
+#define LSM_BLOOM_BITS    10            /* per key, about 1% false positives */
+#define LSM_BLOOM_HASHES  7
+#define LSM_L0_RUNS       4
+#define LSM_L0_STOP       12
+#define LSM_LEVELS        7
+#define LSM_LEVEL1_BYTES  (16 * 1024 * 1024)
+#define LSM_RUN_BYTES     (4 * 1024 * 1024)     /* of a run made by a merge */
+
+extern const struct catalog_ops cat_lsm_ops;
+
+#endif
@@ -0,0 +1,268 @@
+/*
+   Loading a catalog into memory. See cat_mem.h.
+
+   The CD records are allocated MEM_CHUNK at a time, since how many there
+   will be isn't known until the scan ends, and found through a directory
+   of the chunks. The table that finds a string already stored is only
+   needed while loading, so it is the one thing kept outside the arena.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "cat_arena.h"
+#include "cat_mem.h"
+
+#define MEM_CHUNK_SHIFT  12
+#define MEM_CHUNK        (1 << MEM_CHUNK_SHIFT)     /* CDs per chunk */
+#define MEM_MIN_INDEX    16
+
+struct cat_mem {
+    cat_arena *arena;
+    mem_cd **chunks;
+    uint32_t chunks_allocated;
+    uint32_t num_cds;
+    uint32_t num_tracks;
+    uint32_t *index;            /* CD number + 1, 0 is empty */
+    uint32_t index_size;
+    uint32_t num_strings;
+    uint32_t string_refs;
+};
+
+typedef struct {
+    cat_mem *mem;
+    catalog_backend *from;
+    const char **strings;       /* open addressing, NULL is empty */
+    uint32_t strings_size;
+} mem_loader;
+
+static int load_cd(const cat_cd *cd, void *arg);
+static mem_cd *new_cd(cat_mem *mem);
+static const char *intern(mem_loader *loader, const char *str);
+static int grow_strings(mem_loader *loader);
+static int build_index(cat_mem *mem);
+static uint32_t mem_hash(const char *str);
+
+cat_mem *mem_load(catalog_backend *from)
+{
+    mem_loader loader;
+    cat_mem *mem;
+
+    mem = calloc(1, sizeof(*mem));
+    if (!mem) {
+        return(NULL);
+    }
+    mem->arena = arena_create();
+    memset(&loader, 0, sizeof(loader));
+    loader.mem = mem;
+    loader.from = from;
+    if (!mem->arena || !catalog_scan(from, load_cd, &loader) ||
+        !build_index(mem)) {
+        fprintf(stderr, "Unable to load %s into memory\n", from->spec);
+        free(loader.strings);
+        mem_free(mem);
+        return(NULL);
+    }
+    free(loader.strings);
+    return(mem);
+}
+
+void mem_free(cat_mem *mem)
+{
+    if (mem) {
+        arena_free(mem->arena);
+        free(mem);
+    }
+}
+
+uint32_t mem_num_cds(const cat_mem *mem)
+{
+    return(mem->num_cds);
+}
+
+const mem_cd *mem_cd_at(const cat_mem *mem, uint32_t n)
+{
+    return(&mem->chunks[n >> MEM_CHUNK_SHIFT][n & (MEM_CHUNK - 1)]);
+}
+
+const mem_cd *mem_get_cd(const cat_mem *mem, const char *catalog)
+{
+    uint32_t pos = mem_hash(catalog) & (mem->index_size - 1);
+    const mem_cd *cd;
+
+    while (mem->index[pos]) {
+        cd = mem_cd_at(mem, mem->index[pos] - 1);
+        if (strcmp(cd->catalog, catalog) == 0) {
+            return(cd);
+        }
+        pos = (pos + 1) & (mem->index_size - 1);
+    }
+    return(NULL);
+}
+
+void mem_get_stats(const cat_mem *mem, mem_stats *dest)
+{
+    dest->num_cds = mem->num_cds;
+    dest->num_tracks = mem->num_tracks;
+    dest->num_strings = mem->num_strings;
+    dest->string_refs = mem->string_refs;
+    dest->arena_size = arena_size(mem->arena);
+    dest->arena_blocks = arena_num_blocks(mem->arena);
+}
+
+static int load_cd(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    mem_loader *loader = arg;
+    cat_mem *mem = loader->mem;
+    mem_track *spans = NULL;
+    mem_cd *rec;
+    int count, i;
+
+    count = catalog_get_tracks(loader->from, cd->catalog, tracks, CATALOG_MAX_TRACKS);
+    rec = new_cd(mem);
+    if (!rec) {
+        return(0);
+    }
+    if (count > 0) {
+        spans = arena_alloc(mem->arena, count * sizeof(*spans));
+        if (!spans) {
+            return(0);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        spans[i].track_no = tracks[i].track_no;
+        spans[i].title = intern(loader, tracks[i].title);
+        if (!spans[i].title) {
+            return(0);
+        }
+    }
+    rec->catalog = intern(loader, cd->catalog);
+    rec->title = intern(loader, cd->title);
+    rec->type = intern(loader, cd->type);
+    rec->artist = intern(loader, cd->artist);
+    rec->tracks = spans;
+    rec->num_tracks = count;
+    if (!rec->catalog || !rec->title || !rec->type || !rec->artist) {
+        return(0);
+    }
+    mem->num_cds++;
+    mem->num_tracks += count;
+    return(1);
+}
+
+/* The next CD record, starting a chunk when the last is full. An outgrown
+   chunk directory is left behind in the arena; it is a pointer per chunk,
+   so all of them together are less than one chunk. */
+static mem_cd *new_cd(cat_mem *mem)
+{
+    uint32_t chunk = mem->num_cds >> MEM_CHUNK_SHIFT;
+    mem_cd **bigger;
+
+    if ((mem->num_cds & (MEM_CHUNK - 1)) == 0) {
+        if (chunk == mem->chunks_allocated) {
+            mem->chunks_allocated = mem->chunks_allocated ? mem->chunks_allocated * 2 : 64;
+            bigger = arena_alloc(mem->arena, mem->chunks_allocated * sizeof(*bigger));
+            if (!bigger) {
+                return(NULL);
+            }
+            if (chunk) {
+                memcpy(bigger, mem->chunks, chunk * sizeof(*bigger));
+            }
+            mem->chunks = bigger;
+        }
+        mem->chunks[chunk] = arena_alloc(mem->arena, MEM_CHUNK * sizeof(mem_cd));
+        if (!mem->chunks[chunk]) {
+            return(NULL);
+        }
+    }
+    return(&mem->chunks[chunk][mem->num_cds & (MEM_CHUNK - 1)]);
+}
+
+/* The stored copy of str, adding it if it is new */
+static const char *intern(mem_loader *loader, const char *str)
+{
+    cat_mem *mem = loader->mem;
+    uint32_t pos;
+
+    if (mem->num_strings * 2 >= loader->strings_size && !grow_strings(loader)) {
+        return(NULL);
+    }
+    mem->string_refs++;
+    pos = mem_hash(str) & (loader->strings_size - 1);
+    while (loader->strings[pos]) {
+        if (strcmp(loader->strings[pos], str) == 0) {
+            return(loader->strings[pos]);
+        }
+        pos = (pos + 1) & (loader->strings_size - 1);
+    }
+    loader->strings[pos] = arena_strdup(mem->arena, str);
+    if (loader->strings[pos]) {
+        mem->num_strings++;
+    }
+    return(loader->strings[pos]);
+}
+
+static int grow_strings(mem_loader *loader)
+{
+    uint32_t new_size = loader->strings_size ? loader->strings_size * 2 : 4096;
+    const char **new_table;
+    uint32_t i, pos;
+
+    new_table = calloc(new_size, sizeof(*new_table));
+    if (!new_table) {
+        return(0);
+    }
+    for (i = 0; i < loader->strings_size; i++) {
+        if (loader->strings[i]) {
+            pos = mem_hash(loader->strings[i]) & (new_size - 1);
+            while (new_table[pos]) {
+                pos = (pos + 1) & (new_size - 1);
+            }
+            new_table[pos] = loader->strings[i];
+        }
+    }
+    free(loader->strings);
+    loader->strings = new_table;
+    loader->strings_size = new_size;
+    return(1);
+}
+
+/* At most half full. A catalog number the store has twice is found as
+   the first of them. */
+static int build_index(cat_mem *mem)
+{
+    uint32_t n, pos;
+
+    mem->index_size = MEM_MIN_INDEX;
+    while (mem->index_size < mem->num_cds * 2) {
+        mem->index_size *= 2;
+    }
+    mem->index = arena_alloc(mem->arena, mem->index_size * sizeof(*mem->index));
+    if (!mem->index) {
+        return(0);
+    }
+    memset(mem->index, 0, mem->index_size * sizeof(*mem->index));
+    for (n = 0; n < mem->num_cds; n++) {
+        pos = mem_hash(mem_cd_at(mem, n)->catalog) & (mem->index_size - 1);
+        while (mem->index[pos]) {
+            pos = (pos + 1) & (mem->index_size - 1);
+        }
+        mem->index[pos] = n + 1;
+    }
+    return(1);
+}
+
+/* FNV-1a, with the high bits folded in since the tables use the low ones */
+static uint32_t mem_hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return(h ^ (h >> 16));
+}
@@ -0,0 +1,62 @@
+/*
+   A whole catalog loaded into memory from any store, for code that wants
+   every CD at hand rather than asking the store for each one.
+
+   Everything lives in one arena (see cat_arena.h). Each distinct string is
+   stored once, so the type, the artist of a prolific band or "Track 1" is
+   shared by every record that has it. A CD is a few pointers into those
+   strings, not the fixed size fields of cat_cd, and its tracks are one
+   span of the track records. The CDs are numbered in the order the store
+   gave them, and a hash index on catalog number finds one in a probe or
+   two. Loading takes tens of mallocs whatever the size of the catalog,
+   and mem_free gives it all back in one pass.
+
+   The records are read only and stay valid until mem_free.
+ */
+
+#ifndef CAT_MEM_H
+#define CAT_MEM_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+typedef struct {
+    const char *title;
+    int track_no;
+} mem_track;
+
+typedef struct {
+    const char *catalog;
+    const char *title;
+    const char *type;
+    const char *artist;
+    const mem_track *tracks;
+    int num_tracks;
+} mem_cd;
+
+typedef struct cat_mem cat_mem;
+
+/* How the memory went */
+typedef struct {
+    uint32_t num_cds;
+    uint32_t num_tracks;
+    uint32_t num_strings;       /* distinct */
+    uint32_t string_refs;       /* fields and track titles pointing at them */
+    size_t arena_size;
+    int arena_blocks;
+} mem_stats;
+
+/* NULL, with a message on stderr, if the store can't be read or memory
+   runs out */
+cat_mem *mem_load(catalog_backend *from);
+void mem_free(cat_mem *mem);
+
+uint32_t mem_num_cds(const cat_mem *mem);
+/* 0 <= n < mem_num_cds */
+const mem_cd *mem_cd_at(const cat_mem *mem, uint32_t n);
+/* NULL if there is no such CD */
+const mem_cd *mem_get_cd(const cat_mem *mem, const char *catalog);
+void mem_get_stats(const cat_mem *mem, mem_stats *dest);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+   The MySQL backend maps the catalog operations onto app_mysql.c. That code
+   identifies CDs by their cd_id, so each operation starts by looking the
+   catalogue number up. The schema has no CD type, and keeps at most
+   MAX_CD_TRACKS tracks per CD through struct current_tracks_st.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "cat_filter.h"
+#include "app_mysql.h"
+
+#define TRACK_BUCKETS  16      /* parts scan_tracks fetches the track table in */
+
+static int mysql_open_store(catalog_backend *be, const char *location, int create);
+static void mysql_close_store(catalog_backend *be);
+static int mysql_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+static int mysql_get_tracks(catalog_backend *be, const char *catalog,
+                            cat_track *dest, int max_tracks);
+static int mysql_put_cd(catalog_backend *be, const cat_cd *cd);
+static int mysql_put_tracks(catalog_backend *be, const char *catalog,
+                            const cat_track *tracks, int count);
+static int mysql_del_cd(catalog_backend *be, const char *catalog);
+static int mysql_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+static int mysql_find(catalog_backend *be, const cat_filter *filter,
+                      cat_scan_fn fn, void *arg);
+static int mysql_stamp(catalog_backend *be, char *dest, int dest_len);
+static int mysql_scan_tracks(catalog_backend *be, int part, int num_parts,
+                             cat_track_fn fn, void *arg);
+static int mysql_del_tracks(catalog_backend *be, const char *catalog);
+static int mysql_find_disc_id(catalog_backend *be, const char *disc_id,
+                              cat_scan_fn fn, void *arg);
+static void copy_cd(const struct current_cd_st *cd, cat_cd *dest);
+
+const struct catalog_ops cat_mysql_ops = {
+    "mysql",
+    0,
+    mysql_open_store,
+    mysql_close_store,
+    mysql_get_cd,
+    mysql_get_tracks,
+    mysql_put_cd,
+    mysql_put_tracks,
+    mysql_del_cd,
+    mysql_scan,
+    mysql_find,
+    mysql_stamp,
+    mysql_scan_tracks,
+    mysql_del_tracks,
+    NULL,
+    mysql_find_disc_id
+};
+
+/* Where each filter field lives in the schema; there is no CD type */
+static const char *const filter_columns[FILTER_NUM_FIELDS] = {
+    "cd.catalogue", "cd.title", NULL, "artist.name"
+};
+
+/* location is "user[:password]", by default root with no password. Creating
+   a new store means emptying the tables of the existing blpcd database. */
+static int mysql_open_store(catalog_backend *be, const char *location, int create)
+{
+    char user[100] = "root";
+    char *password = "";
+    struct cd_search_st cds;
+    char *colon;
+    int i, found;
+
+    if (location && location[0]) {
+        catalog_set_field(user, location, sizeof(user) - 1);
+        colon = strchr(user, ':');
+        if (colon) {
+            *colon = '\0';
+            password = colon + 1;
+        }
+    }
+    if (!database_start(user, password)) {
+        return(0);
+    }
+    if (create) {
+        do {
+            found = list_cds(0, &cds);
+            for (i = 0; i < found; i++) {
+                if (!delete_cd(cds.cd_id[i])) {
+                    database_end();
+                    return(0);
+                }
+            }
+        } while (found);
+    }
+    return(1);
+}
+
+static void mysql_close_store(catalog_backend *be)
+{
+    database_end();
+}
+
+static int mysql_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    struct current_cd_st cd;
+    int cd_id;
+
+    cd_id = find_cd_by_catalogue((char *)catalog);
+    if (cd_id == -1 || !get_cd(cd_id, &cd)) {
+        return(0);
+    }
+    copy_cd(&cd, dest);
+    return(1);
+}
+
+static int mysql_get_tracks(catalog_backend *be, const char *catalog,
+                            cat_track *dest, int max_tracks)
+{
+    struct current_tracks_st tracks;
+    int cd_id;
+    int count, i;
+
+    cd_id = find_cd_by_catalogue((char *)catalog);
+    if (cd_id == -1) {
+        return(0);
+    }
+    count = get_cd_tracks(cd_id, &tracks);
+    if (count > MAX_CD_TRACKS) {
+        count = MAX_CD_TRACKS;
+    }
+    if (count > max_tracks) {
+        count = max_tracks;
+    }
+    for (i = 0; i < count; i++) {
+        catalog_set_field(dest[i].catalog, catalog, CATALOG_CAT_LEN);
+        dest[i].track_no = i + 1;
+        catalog_set_field(dest[i].title, tracks.track[i], CATALOG_TRACK_LEN);
+    }
+    return(count);
+}
+
+static int mysql_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    int cd_id;
+
+    cd_id = find_cd_by_catalogue((char *)cd->catalog);
+    if (cd_id != -1) {
+        if (!update_cd(cd_id, (char *)cd->artist, (char *)cd->title,
+                       (char *)cd->catalog)) {
+            return(0);
+        }
+    } else if (!add_cd((char *)cd->artist, (char *)cd->title, (char *)cd->catalog,
+                       &cd_id)) {
+        return(0);
+    }
+    return(set_disc_id(cd_id, cd->disc_id));
+}
+
+static int mysql_put_tracks(catalog_backend *be, const char *catalog,
+                            const cat_track *tracks, int count)
+{
+    struct current_tracks_st new_tracks;
+    int cd_id;
+    int i;
+
+    if (count > MAX_CD_TRACKS) {
+        fprintf(stderr, "MySQL catalog keeps at most %d tracks per CD\n",
+                MAX_CD_TRACKS);
+        return(0);
+    }
+    cd_id = find_cd_by_catalogue((char *)catalog);
+    if (cd_id == -1 || !delete_tracks(cd_id)) {
+        return(0);
+    }
+    memset(&new_tracks, 0, sizeof(new_tracks));
+    new_tracks.cd_id = cd_id;
+    for (i = 0; i < count; i++) {
+        strcpy(new_tracks.track[i], tracks[i].title);
+    }
+    return(add_tracks(&new_tracks));
+}
+
+static int mysql_del_cd(catalog_backend *be, const char *catalog)
+{
+    int cd_id;
+
+    cd_id = find_cd_by_catalogue((char *)catalog);
+    if (cd_id == -1) {
+        return(0);
+    }
+    return(delete_cd(cd_id));
+}
+
+/* Page through the cd table in id order */
+static int mysql_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    struct cd_search_st cds;
+    struct current_cd_st cd;
+    cat_cd entry;
+    int last_id = 0;
+    int found, i;
+
+    do {
+        found = list_cds(last_id, &cds);
+        for (i = 0; i < found; i++) {
+            last_id = cds.cd_id[i];
+            if (get_cd(last_id, &cd)) {
+                copy_cd(&cd, &entry);
+                if (!fn(&entry, arg)) {
+                    return(1);
+                }
+            }
+        }
+    } while (found == MAX_CD_RESULT);
+    return(1);
+}
+
+/* Let the database do the filtering. The rows it returns are checked
+   again with filter_match, since the catalog keeps shorter fields than
+   the database and a test might only hold on the part cut off. */
+static int mysql_find(catalog_backend *be, const cat_filter *filter,
+                      cat_scan_fn fn, void *arg)
+{
+    struct cd_search_st cds;
+    struct current_cd_st cd;
+    cat_cd entry;
+    char *condition;
+    int last_id = 0;
+    int found, i;
+
+    condition = filter_to_sql(filter, filter_columns);
+    if (!condition) {
+        return(0);
+    }
+    do {
+        found = list_cds_matching(condition, last_id, &cds);
+        for (i = 0; i < found; i++) {
+            last_id = cds.cd_id[i];
+            if (get_cd(last_id, &cd)) {
+                copy_cd(&cd, &entry);
+                if (filter_match(filter, &entry) && !fn(&entry, arg)) {
+                    free(condition);
+                    return(1);
+                }
+            }
+        }
+    } while (found == MAX_CD_RESULT);
+    free(condition);
+    return(1);
+}
+
+/* The digest cdctl compare uses, over the whole catalog in one bucket. The
+   server reads every CD for it, but only one number comes back. */
+static int mysql_stamp(catalog_backend *be, char *dest, int dest_len)
+{
+    unsigned int digest;
+
+    if (!get_bucket_digests(1, &digest)) {
+        return(0);
+    }
+    snprintf(dest, dest_len + 1, "%08x", digest);
+    return(1);
+}
+
+/* The track table a bucket of cd_ids at a time, all from part 0 since
+   the one connection can't be shared between threads. A track whose CD
+   has gone has no catalogue to give, so it is named "#cd_id", which
+   mysql_del_tracks understands. */
+static int mysql_scan_tracks(catalog_backend *be, int part, int num_parts,
+                             cat_track_fn fn, void *arg)
+{
+    struct track_row_st *rows;
+    cat_track track;
+    char orphan[20];
+    int bucket, found, i;
+
+    if (part != 0) {
+        return(1);
+    }
+    for (bucket = 0; bucket < TRACK_BUCKETS; bucket++) {
+        found = get_track_rows(TRACK_BUCKETS, bucket, &rows);
+        if (found < 0) {
+            return(0);
+        }
+        for (i = 0; i < found; i++) {
+            memset(&track, '\0', sizeof(track));
+            if (rows[i].catalogue[0]) {
+                catalog_set_field(track.catalog, rows[i].catalogue, CATALOG_CAT_LEN);
+            } else {
+                sprintf(orphan, "#%d", rows[i].cd_id);
+                catalog_set_field(track.catalog, orphan, CATALOG_CAT_LEN);
+            }
+            track.track_no = rows[i].track_id;
+            catalog_set_field(track.title, rows[i].title, CATALOG_TRACK_LEN);
+            if (!fn(&track, arg)) {
+                free(rows);
+                return(1);
+            }
+        }
+        free(rows);
+    }
+    return(1);
+}
+
+static int mysql_del_tracks(catalog_backend *be, const char *catalog)
+{
+    int cd_id;
+
+    if (catalog[0] == '#') {
+        return(delete_tracks(atoi(catalog + 1)));
+    }
+    cd_id = find_cd_by_catalogue((char *)catalog);
+    if (cd_id == -1) {
+        return(0);
+    }
+    return(delete_tracks(cd_id));
+}
+
+/* The index on cd.disc_id finds the rows */
+static int mysql_find_disc_id(catalog_backend *be, const char *disc_id,
+                              cat_scan_fn fn, void *arg)
+{
+    struct cd_search_st cds;
+    struct current_cd_st cd;
+    cat_cd entry;
+    int found, i;
+
+    found = find_cds_by_disc_id(disc_id, &cds);
+    for (i = 0; i < found; i++) {
+        if (get_cd(cds.cd_id[i], &cd)) {
+            copy_cd(&cd, &entry);
+            if (!fn(&entry, arg)) {
+                break;
+            }
+        }
+    }
+    return(1);
+}
+
+static void copy_cd(const struct current_cd_st *cd, cat_cd *dest)
+{
+    memset(dest, '\0', sizeof(*dest));
+    catalog_set_field(dest->catalog, cd->catalogue, CATALOG_CAT_LEN);
+    catalog_set_field(dest->title, cd->title, CATALOG_TITLE_LEN);
+    catalog_set_field(dest->artist, cd->artist_name, CATALOG_ARTIST_LEN);
+    catalog_set_field(dest->disc_id, cd->disc_id, CATALOG_DISCID_LEN);
+}
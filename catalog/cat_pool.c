@@ -0,0 +1,385 @@
+/*
+   The work-stealing pool. See cat_pool.h.
+
+   The deques are rings with a lock each rather than lock-free: a task
+   here is thousands of CDs of work, so the lock is never what limits the
+   pool. The pool lock only guards the count of queued tasks that idle
+   workers sleep on.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cat_pool.h"
+
+#define POOL_DEQUE_START  64    /* tasks, a power of two */
+#define POOL_MAX_THREADS  64
+#define POOL_JOIN_WAIT_NS 1000000   /* how long a join sleeps before looking
+                                       for work again */
+
+typedef struct {
+    pool_task_fn fn;
+    void *arg;
+    pool_group *group;
+} pool_task;
+
+/* top is where thieves take from, bottom where the owner pushes and pops */
+typedef struct {
+    pthread_mutex_t lock;
+    pool_task *tasks;
+    unsigned int size;
+    unsigned int top;
+    unsigned int bottom;
+} pool_deque;
+
+typedef struct {
+    cat_pool *pool;
+    int id;
+} worker_start;
+
+struct cat_pool {
+    int num_threads;
+    pthread_t *threads;
+    worker_start *starts;
+    pool_deque *deques;         /* one per worker, then the outside one */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int queued;
+    int stopping;
+};
+
+struct pool_group {
+    cat_pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int outstanding;
+    volatile int cancelled;
+};
+
+/* Which pool, if any, the current thread works for, and its deque */
+static __thread cat_pool *worker_pool = NULL;
+static __thread int worker_id;
+
+static cat_pool *default_pool = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void *worker_main(void *arg);
+static int deque_push(pool_deque *deque, const pool_task *task);
+static int deque_pop(pool_deque *deque, pool_task *task);
+static int deque_steal(pool_deque *deque, pool_task *task);
+static int take_task(cat_pool *pool, int home, pool_task *task);
+static void run_task(const pool_task *task);
+static void create_default_pool(void);
+
+cat_pool *pool_create(int num_threads)
+{
+    cat_pool *pool;
+    int i;
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+    if (num_threads > POOL_MAX_THREADS) {
+        num_threads = POOL_MAX_THREADS;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return(NULL);
+    }
+    pool->threads = calloc(num_threads, sizeof(*pool->threads));
+    pool->deques = calloc(num_threads + 1, sizeof(*pool->deques));
+    pool->starts = calloc(num_threads, sizeof(*pool->starts));
+    if (!pool->threads || !pool->deques || !pool->starts) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool->starts);
+        free(pool);
+        return(NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    for (i = 0; i <= num_threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        pool->starts[i].pool = pool;
+        pool->starts[i].id = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main,
+                           &pool->starts[i]) != 0) {
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        fprintf(stderr, "Unable to start any pool threads\n");
+        pool_destroy(pool);
+        return(NULL);
+    }
+    return(pool);
+}
+
+void pool_destroy(cat_pool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (i = 0; i < pool->num_threads + 1; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool->starts);
+    free(pool);
+}
+
+int pool_num_threads(const cat_pool *pool)
+{
+    return(pool->num_threads);
+}
+
+cat_pool *pool_default(void)
+{
+    pthread_once(&default_once, create_default_pool);
+    return(default_pool);
+}
+
+static void create_default_pool(void)
+{
+    default_pool = pool_create(0);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_start *start = arg;
+    cat_pool *pool = start->pool;
+    pool_task task;
+
+    worker_pool = pool;
+    worker_id = start->id;
+    for (;;) {
+        if (take_task(pool, worker_id, &task)) {
+            run_task(&task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return(NULL);
+}
+
+pool_group *pool_group_new(cat_pool *pool)
+{
+    pool_group *group;
+
+    if (!pool) {
+        return(NULL);
+    }
+    group = calloc(1, sizeof(*group));
+    if (!group) {
+        return(NULL);
+    }
+    group->pool = pool;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+    return(group);
+}
+
+/* A worker spawns onto its own deque, anything else onto the outside one */
+int pool_spawn(pool_group *group, pool_task_fn fn, void *arg)
+{
+    cat_pool *pool = group->pool;
+    pool_task task;
+    int home;
+
+    task.fn = fn;
+    task.arg = arg;
+    task.group = group;
+    home = worker_pool == pool ? worker_id : pool->num_threads;
+
+    pthread_mutex_lock(&group->lock);
+    group->outstanding++;
+    pthread_mutex_unlock(&group->lock);
+    if (!deque_push(&pool->deques[home], &task)) {
+        pthread_mutex_lock(&group->lock);
+        group->outstanding--;
+        pthread_mutex_unlock(&group->lock);
+        return(0);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return(1);
+}
+
+/* Help with the queued tasks until the group is done. With nothing to
+   take, sleep until the group finishes, but only briefly: a task still
+   running elsewhere may yet spawn work that needs this thread. */
+int pool_join(pool_group *group)
+{
+    cat_pool *pool = group->pool;
+    struct timespec until;
+    pool_task task;
+    int home;
+    int cancelled;
+
+    home = worker_pool == pool ? worker_id : pool->num_threads;
+    for (;;) {
+        pthread_mutex_lock(&group->lock);
+        if (group->outstanding == 0) {
+            pthread_mutex_unlock(&group->lock);
+            break;
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (take_task(pool, home, &task)) {
+            run_task(&task);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += POOL_JOIN_WAIT_NS;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&group->lock);
+        if (group->outstanding > 0) {
+            pthread_cond_timedwait(&group->done, &group->lock, &until);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    cancelled = group->cancelled;
+    pthread_cond_destroy(&group->done);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+    return(!cancelled);
+}
+
+void pool_cancel(pool_group *group)
+{
+    group->cancelled = 1;
+}
+
+int pool_cancelled(const pool_group *group)
+{
+    return(group->cancelled);
+}
+
+static void run_task(const pool_task *task)
+{
+    pool_group *group = task->group;
+
+    if (!group->cancelled) {
+        task->fn(group, task->arg);
+    }
+    pthread_mutex_lock(&group->lock);
+    if (--group->outstanding == 0) {
+        pthread_cond_broadcast(&group->done);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+/* The newest task of our own deque, or failing that the oldest of anyone
+   else's, looking at the others in turn from the next one along */
+static int take_task(cat_pool *pool, int home, pool_task *task)
+{
+    int num_deques = pool->num_threads + 1;
+    int found = 0;
+    int i;
+
+    if (deque_pop(&pool->deques[home], task)) {
+        found = 1;
+    }
+    for (i = 1; !found && i < num_deques; i++) {
+        found = deque_steal(&pool->deques[(home + i) % num_deques], task);
+    }
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return(found);
+}
+
+static int deque_push(pool_deque *deque, const pool_task *task)
+{
+    pool_task *new_tasks;
+    unsigned int new_size, i;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->size) {
+        new_size = deque->size ? deque->size * 2 : POOL_DEQUE_START;
+        new_tasks = malloc(new_size * sizeof(*new_tasks));
+        if (!new_tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return(0);
+        }
+        for (i = deque->top; i != deque->bottom; i++) {
+            new_tasks[i & (new_size - 1)] = deque->tasks[i & (deque->size - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = new_tasks;
+        deque->size = new_size;
+    }
+    deque->tasks[deque->bottom & (deque->size - 1)] = *task;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+    return(1);
+}
+
+static int deque_pop(pool_deque *deque, pool_task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        deque->bottom--;
+        *task = deque->tasks[deque->bottom & (deque->size - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return(found);
+}
+
+static int deque_steal(pool_deque *deque, pool_task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        *task = deque->tasks[deque->top & (deque->size - 1)];
+        deque->top++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return(found);
+}
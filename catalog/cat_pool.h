@@ -0,0 +1,44 @@
+/*
+   A work-stealing thread pool for the parallel parts of the catalog
+   library.
+
+   Each worker has its own deque of tasks. A task spawned on a worker goes
+   on the bottom of that worker's deque and the worker takes its next task
+   from the bottom too, so related work stays on one thread while it is
+   hot in the cache. A worker with nothing left steals from the top of
+   the other deques, taking the oldest and usually biggest piece of work.
+   Tasks spawned from outside the pool go on a deque of their own, which
+   every worker steals from.
+
+   Tasks are spawned into a group. pool_join waits for every task of a
+   group, and while it waits the joining thread runs queued tasks itself,
+   so a task may spawn and join a group of its own without tying up a
+   worker. Cancelling a group skips its tasks that haven't started; the
+   ones running can look at pool_cancelled and stop early.
+ */
+
+#ifndef CAT_POOL_H
+#define CAT_POOL_H
+
+typedef struct cat_pool cat_pool;
+typedef struct pool_group pool_group;
+
+typedef void (*pool_task_fn)(pool_group *group, void *arg);
+
+/* num_threads 0 means one per online CPU */
+cat_pool *pool_create(int num_threads);
+/* Every group must have been joined first */
+void pool_destroy(cat_pool *pool);
+int pool_num_threads(const cat_pool *pool);
+/* One pool shared by the library, created on first use and sized to the
+   CPUs available */
+cat_pool *pool_default(void);
+
+/* Groups. pool_join frees the group and returns 0 if it was cancelled. */
+pool_group *pool_group_new(cat_pool *pool);
+int pool_spawn(pool_group *group, pool_task_fn fn, void *arg);
+int pool_join(pool_group *group);
+void pool_cancel(pool_group *group);
+int pool_cancelled(const pool_group *group);
+
+#endif
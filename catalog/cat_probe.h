@@ -0,0 +1,48 @@
+/*
+   Static tracepoints (USDT) for the CD programs.
+
+   With <sys/sdt.h> (systemtap-sdt-dev, or systemtap-sdt-devel) each
+   CD_PROBE is a single nop and an ELF note naming it. bpftrace, perf and
+   systemtap find the notes and patch the nops only while they are
+   attached, for instance
+
+     bpftrace -l 'usdt:./application:*'
+     bpftrace -e 'usdt:./application:cd_dbm:get_cd_start { @t[tid] = nsecs; }
+                  usdt:./application:cd_dbm:get_cd_done /@t[tid]/ {
+                      @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+
+   Without the header, or built with -DNO_PROBES, they compile to nothing,
+   though the arguments still count as used, so a variable kept only for a
+   probe draws no warning.
+
+   An operation fires NAME_start as it begins and NAME_done as it ends,
+   both with the key first. A call turned away before it reaches the store
+   (nothing open, a key too long) fires neither. The arguments are values
+   the code has to hand anyway, so an idle probe costs nothing to evaluate.
+ */
+
+#ifndef CAT_PROBE_H
+#define CAT_PROBE_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define CD_PROBE(provider, name, ...) \
+    STAP_PROBEV(provider, name, ## __VA_ARGS__)
+#else
+/* never called: it only gives the arguments somewhere to go */
+static inline void cd_probe_unused(int none, ...)
+{
+    (void) none;
+}
+
+#define CD_PROBE(provider, name, ...) \
+    do { if (0) cd_probe_unused(0, ## __VA_ARGS__); } while (0)
+#endif
+
+#endif
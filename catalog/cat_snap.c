@@ -0,0 +1,933 @@
+/*
+   Building and reading catalog snapshots. See cat_snap.h for the layout.
+
+   The perfect hash is built with "hash and displace": catalog numbers are
+   first spread over num_cds / SNAP_BUCKET_LOAD buckets. Taking the biggest
+   buckets first, each bucket gets the smallest displacement d for which
+   hash(key, d) sends all of its keys to free slots. A lookup is then two
+   hashes and one string compare, whatever the size of the catalog.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_snap.h"
+#include "cat_filter.h"
+#include "cat_pool.h"
+
+#define SNAP_BUCKET_LOAD     4          /* average keys per bucket */
+#define SNAP_MAX_DISPLACE    100000000  /* give up on a bucket after this */
+#define SNAP_ALIGN           8
+#define SNAP_FIND_CHUNK      8192       /* CDs per task of a parallel find */
+
+struct cat_snap {
+    const char *map;
+    size_t map_size;
+    const snap_header *header;
+    const uint32_t *buckets;
+    const snap_cd_rec *cds;
+    const snap_track_rec *tracks;
+    const char *heap;
+    const uint32_t *disc_ids;
+};
+
+/* A CD read from the source store, with where its tracks went */
+typedef struct {
+    cat_cd cd;
+    uint32_t first_track;
+    uint32_t num_tracks;
+    uint32_t bucket;
+} build_cd;
+
+/* The strings, each stored once. table holds heap offsets, 0 is empty
+   (offset 0 is always the empty string). */
+typedef struct {
+    char *data;
+    uint32_t size;
+    uint32_t allocated;
+    uint32_t *table;
+    uint32_t table_size;
+    uint32_t used;
+} string_heap;
+
+typedef struct {
+    catalog_backend *from;
+    build_cd *cds;
+    int num_cds;
+    int cds_allocated;
+    cat_track *tracks;
+    int num_tracks;
+    int tracks_allocated;
+} snap_builder;
+
+static uint64_t snap_hash(const char *key, uint64_t seed);
+static int collect_cd(const cat_cd *cd, void *arg);
+static int compare_build_catalog(const void *a, const void *b);
+static int compare_bucket_size(const void *a, const void *b);
+static int compare_disc_id_slot(const void *a, const void *b);
+static int place_keys(build_cd *cds, int num_cds, uint32_t num_buckets,
+                      uint32_t *displace, uint32_t *slot_of);
+static uint32_t heap_add(string_heap *heap, const char *str);
+static int heap_grow_table(string_heap *heap);
+static int write_section(FILE *fp, const void *data, size_t size, uint64_t *offset_ptr);
+static const char *snap_str(const cat_snap *snap, uint32_t offset);
+
+/* Bucket sizes while placing, sorted biggest first */
+static const uint32_t *sort_bucket_sizes;
+
+/* The CD table and heap while sorting the disc ID slots */
+static const snap_cd_rec *sort_cd_recs;
+static const char *sort_heap;
+
+/* FNV-1a with the seed mixed in, then the murmur3 finalizer to spread the
+   bits over the whole word */
+static uint64_t snap_hash(const char *key, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return(h);
+}
+
+/* Read every CD of the store, lay it out and write the snapshot. The file
+   is written under a temporary name and renamed, so a reader never sees
+   half a snapshot. */
+int snap_build(catalog_backend *from, const char *path)
+{
+    snap_builder sb;
+    string_heap heap;
+    snap_header header;
+    snap_cd_rec *cd_recs = NULL;
+    snap_track_rec *track_recs = NULL;
+    uint32_t *displace = NULL;
+    uint32_t *slot_of = NULL;
+    uint32_t *disc_ids = NULL;
+    uint32_t num_disc_ids;
+    uint32_t num_buckets;
+    uint32_t next_track;
+    char temp_path[FILENAME_MAX];
+    const build_cd *bcd;
+    cat_keys keys;
+    FILE *fp = NULL;
+    int kept, i, j;
+    int ok = 0;
+
+    memset(&sb, 0, sizeof(sb));
+    memset(&heap, 0, sizeof(heap));
+    sb.from = from;
+    if (!catalog_scan(from, collect_cd, &sb)) {
+        goto done;
+    }
+
+    /* A perfect hash needs distinct keys: keep the first of any duplicates */
+    qsort(sb.cds, sb.num_cds, sizeof(*sb.cds), compare_build_catalog);
+    kept = 0;
+    for (i = 0; i < sb.num_cds; i++) {
+        if (kept && strcmp(sb.cds[kept - 1].cd.catalog, sb.cds[i].cd.catalog) == 0) {
+            fprintf(stderr, "Duplicate catalog %s left out of the snapshot\n",
+                    sb.cds[i].cd.catalog);
+            continue;
+        }
+        sb.cds[kept++] = sb.cds[i];
+    }
+    sb.num_cds = kept;
+
+    num_buckets = sb.num_cds / SNAP_BUCKET_LOAD + 1;
+    displace = calloc(num_buckets, sizeof(*displace));
+    slot_of = calloc(sb.num_cds + 1, sizeof(*slot_of));
+    cd_recs = calloc(sb.num_cds + 1, sizeof(*cd_recs));
+    track_recs = calloc(sb.num_tracks + 1, sizeof(*track_recs));
+    disc_ids = calloc(sb.num_cds + 1, sizeof(*disc_ids));
+    if (!displace || !slot_of || !cd_recs || !track_recs || !disc_ids) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    if (!place_keys(sb.cds, sb.num_cds, num_buckets, displace, slot_of)) {
+        goto done;
+    }
+
+    /* Offset 0 of the heap is the empty string */
+    heap_add(&heap, "");
+    if (!heap.data) {
+        goto done;
+    }
+
+    /* Fill the CD table in slot order, giving each CD's tracks the next range
+       of the track table so that neighbouring slots share pages. */
+    for (i = 0; i < sb.num_cds; i++) {
+        bcd = &sb.cds[i];
+        cd_recs[slot_of[i]].num_tracks = bcd->num_tracks;
+    }
+    next_track = 0;
+    for (i = 0; i < sb.num_cds; i++) {
+        cd_recs[i].first_track = next_track;
+        next_track += cd_recs[i].num_tracks;
+    }
+    for (i = 0; i < sb.num_cds; i++) {
+        snap_track_rec *tr;
+
+        bcd = &sb.cds[i];
+        cd_recs[slot_of[i]].catalog = heap_add(&heap, bcd->cd.catalog);
+        cd_recs[slot_of[i]].title = heap_add(&heap, bcd->cd.title);
+        cd_recs[slot_of[i]].type = heap_add(&heap, bcd->cd.type);
+        cd_recs[slot_of[i]].artist = heap_add(&heap, bcd->cd.artist);
+        cd_recs[slot_of[i]].disc_id = heap_add(&heap, bcd->cd.disc_id);
+        catalog_make_keys(&bcd->cd, &keys);
+        cd_recs[slot_of[i]].key_catalog = heap_add(&heap, keys.catalog);
+        cd_recs[slot_of[i]].key_title = heap_add(&heap, keys.title);
+        cd_recs[slot_of[i]].key_type = heap_add(&heap, keys.type);
+        cd_recs[slot_of[i]].key_artist = heap_add(&heap, keys.artist);
+        for (j = 0; j < (int)bcd->num_tracks; j++) {
+            tr = &track_recs[cd_recs[slot_of[i]].first_track + j];
+            tr->title = heap_add(&heap, sb.tracks[bcd->first_track + j].title);
+            tr->track_no = sb.tracks[bcd->first_track + j].track_no;
+        }
+        if (!heap.data) {
+            fprintf(stderr, "Out of memory\n");
+            goto done;
+        }
+    }
+
+    /* The disc ID index: the slots of the CDs with one, in disc ID order */
+    num_disc_ids = 0;
+    for (i = 0; i < sb.num_cds; i++) {
+        if (cd_recs[i].disc_id) {
+            disc_ids[num_disc_ids++] = i;
+        }
+    }
+    sort_cd_recs = cd_recs;
+    sort_heap = heap.data;
+    qsort(disc_ids, num_disc_ids, sizeof(*disc_ids), compare_disc_id_slot);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    header.version = SNAP_VERSION;
+    header.num_cds = sb.num_cds;
+    header.num_tracks = sb.num_tracks;
+    header.num_buckets = num_buckets;
+    header.heap_size = heap.size;
+    header.num_disc_ids = num_disc_ids;
+
+    sprintf(temp_path, "%.*s.tmp", FILENAME_MAX - 5, path);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to create %s\n", temp_path);
+        goto done;
+    }
+    /* The header is written twice: once to reserve its space and once more
+       when the section offsets are known */
+    header.buckets_offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        !write_section(fp, displace, num_buckets * sizeof(*displace),
+                       &header.buckets_offset) ||
+        !write_section(fp, cd_recs, sb.num_cds * sizeof(*cd_recs),
+                       &header.cds_offset) ||
+        !write_section(fp, track_recs, sb.num_tracks * sizeof(*track_recs),
+                       &header.tracks_offset) ||
+        !write_section(fp, heap.data, heap.size, &header.heap_offset) ||
+        !write_section(fp, disc_ids, num_disc_ids * sizeof(*disc_ids),
+                       &header.disc_ids_offset) ||
+        fseek(fp, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, fp) != 1) {
+        fprintf(stderr, "Failed to write %s\n", temp_path);
+        fclose(fp);
+        unlink(temp_path);
+        goto done;
+    }
+    if (fclose(fp) != 0 || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        unlink(temp_path);
+        goto done;
+    }
+    printf("Snapshot %s: %d CDs, %d tracks, %u bytes of strings\n", path,
+           sb.num_cds, sb.num_tracks, heap.size);
+    ok = 1;
+
+done:
+    free(sb.cds);
+    free(sb.tracks);
+    free(heap.data);
+    free(heap.table);
+    free(displace);
+    free(slot_of);
+    free(cd_recs);
+    free(track_recs);
+    free(disc_ids);
+    return(ok);
+}
+
+static int collect_cd(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    snap_builder *sb = arg;
+    build_cd *bigger_cds;
+    cat_track *bigger_tracks;
+    int count;
+
+    count = catalog_get_tracks(sb->from, cd->catalog, tracks, CATALOG_MAX_TRACKS);
+    if (sb->num_cds == sb->cds_allocated) {
+        sb->cds_allocated = sb->cds_allocated ? sb->cds_allocated * 2 : 1024;
+        bigger_cds = realloc(sb->cds, sb->cds_allocated * sizeof(*sb->cds));
+        if (!bigger_cds) {
+            return(0);
+        }
+        sb->cds = bigger_cds;
+    }
+    while (sb->num_tracks + count > sb->tracks_allocated) {
+        sb->tracks_allocated = sb->tracks_allocated ? sb->tracks_allocated * 2 : 8192;
+        bigger_tracks = realloc(sb->tracks, sb->tracks_allocated * sizeof(*sb->tracks));
+        if (!bigger_tracks) {
+            return(0);
+        }
+        sb->tracks = bigger_tracks;
+    }
+    sb->cds[sb->num_cds].cd = *cd;
+    sb->cds[sb->num_cds].first_track = sb->num_tracks;
+    sb->cds[sb->num_cds].num_tracks = count;
+    memcpy(&sb->tracks[sb->num_tracks], tracks, count * sizeof(*tracks));
+    sb->num_cds++;
+    sb->num_tracks += count;
+    return(1);
+}
+
+static int compare_build_catalog(const void *a, const void *b)
+{
+    return(strcmp(((const build_cd *)a)->cd.catalog,
+                  ((const build_cd *)b)->cd.catalog));
+}
+
+static int compare_bucket_size(const void *a, const void *b)
+{
+    uint32_t size_a = sort_bucket_sizes[*(const uint32_t *)a];
+    uint32_t size_b = sort_bucket_sizes[*(const uint32_t *)b];
+
+    if (size_a != size_b) {
+        return(size_a > size_b ? -1 : 1);
+    }
+    return(*(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1);
+}
+
+static int compare_disc_id_slot(const void *a, const void *b)
+{
+    const snap_cd_rec *rec_a = &sort_cd_recs[*(const uint32_t *)a];
+    const snap_cd_rec *rec_b = &sort_cd_recs[*(const uint32_t *)b];
+    int cmp = strcmp(sort_heap + rec_a->disc_id, sort_heap + rec_b->disc_id);
+
+    if (cmp) {
+        return(cmp);
+    }
+    return(*(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1);
+}
+
+/* Find a displacement for every bucket, biggest buckets first while the
+   table is still empty. slot_of[i] is where cds[i] ends up. */
+static int place_keys(build_cd *cds, int num_cds, uint32_t num_buckets,
+                      uint32_t *displace, uint32_t *slot_of)
+{
+    uint32_t *bucket_size = NULL;
+    uint32_t *bucket_start = NULL;
+    uint32_t *bucket_keys = NULL;
+    uint32_t *order = NULL;
+    uint32_t *fill = NULL;
+    unsigned char *taken = NULL;
+    uint32_t slots[64];
+    uint32_t b, k, m, n, d;
+    uint32_t i;
+    int ok = 0;
+    int fits;
+
+    if (num_cds == 0) {
+        return(1);
+    }
+    bucket_size = calloc(num_buckets, sizeof(*bucket_size));
+    bucket_start = calloc(num_buckets + 1, sizeof(*bucket_start));
+    bucket_keys = calloc(num_cds, sizeof(*bucket_keys));
+    order = calloc(num_buckets, sizeof(*order));
+    fill = calloc(num_buckets, sizeof(*fill));
+    taken = calloc(num_cds, 1);
+    if (!bucket_size || !bucket_start || !bucket_keys || !order || !fill || !taken) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+
+    /* Group the keys by bucket */
+    for (i = 0; i < (uint32_t)num_cds; i++) {
+        cds[i].bucket = snap_hash(cds[i].cd.catalog, 0) % num_buckets;
+        bucket_size[cds[i].bucket]++;
+    }
+    for (b = 0; b < num_buckets; b++) {
+        bucket_start[b + 1] = bucket_start[b] + bucket_size[b];
+        order[b] = b;
+    }
+    for (i = 0; i < (uint32_t)num_cds; i++) {
+        b = cds[i].bucket;
+        bucket_keys[bucket_start[b] + fill[b]++] = i;
+    }
+    sort_bucket_sizes = bucket_size;
+    qsort(order, num_buckets, sizeof(*order), compare_bucket_size);
+
+    for (i = 0; i < num_buckets; i++) {
+        b = order[i];
+        n = bucket_size[b];
+        if (n == 0) {
+            break;
+        }
+        if (n > sizeof(slots) / sizeof(slots[0])) {
+            fprintf(stderr, "Catalog numbers hash too unevenly to build a snapshot\n");
+            goto done;
+        }
+        for (d = 0; d < SNAP_MAX_DISPLACE; d++) {
+            fits = 1;
+            for (k = 0; fits && k < n; k++) {
+                slots[k] = snap_hash(cds[bucket_keys[bucket_start[b] + k]].cd.catalog,
+                                     (uint64_t)d + 1) % num_cds;
+                if (taken[slots[k]]) {
+                    fits = 0;
+                }
+                /* two keys of the same bucket mustn't collide either */
+                for (m = 0; fits && m < k; m++) {
+                    if (slots[m] == slots[k]) {
+                        fits = 0;
+                    }
+                }
+            }
+            if (fits) {
+                break;
+            }
+        }
+        if (d == SNAP_MAX_DISPLACE) {
+            fprintf(stderr, "Unable to build the perfect hash\n");
+            goto done;
+        }
+        displace[b] = d + 1;
+        for (k = 0; k < n; k++) {
+            taken[slots[k]] = 1;
+            slot_of[bucket_keys[bucket_start[b] + k]] = slots[k];
+        }
+    }
+    ok = 1;
+
+done:
+    free(bucket_size);
+    free(bucket_start);
+    free(bucket_keys);
+    free(order);
+    free(fill);
+    free(taken);
+    return(ok);
+}
+
+/* Add a string to the heap, or find the copy already there. On running out
+   of memory heap->data becomes NULL. */
+static uint32_t heap_add(string_heap *heap, const char *str)
+{
+    uint32_t len = strlen(str) + 1;
+    uint32_t pos, offset;
+    char *bigger;
+
+    if (!heap->data && heap->size) {
+        return(0);
+    }
+    if (heap->size && !str[0]) {
+        return(0);
+    }
+    if (heap->used * 2 >= heap->table_size && !heap_grow_table(heap)) {
+        free(heap->data);
+        heap->data = NULL;
+        return(0);
+    }
+
+    pos = snap_hash(str, 0) & (heap->table_size - 1);
+    while ((offset = heap->table[pos]) != 0) {
+        if (strcmp(heap->data + offset, str) == 0) {
+            return(offset);
+        }
+        pos = (pos + 1) & (heap->table_size - 1);
+    }
+
+    if (heap->size + len > heap->allocated) {
+        heap->allocated = heap->allocated ? heap->allocated * 2 : 65536;
+        while (heap->size + len > heap->allocated) {
+            heap->allocated *= 2;
+        }
+        bigger = realloc(heap->data, heap->allocated);
+        if (!bigger) {
+            free(heap->data);
+            heap->data = NULL;
+            return(0);
+        }
+        heap->data = bigger;
+    }
+    offset = heap->size;
+    memcpy(heap->data + offset, str, len);
+    heap->size += len;
+    if (offset) {
+        heap->table[pos] = offset;
+        heap->used++;
+    }
+    return(offset);
+}
+
+static int heap_grow_table(string_heap *heap)
+{
+    uint32_t new_size = heap->table_size ? heap->table_size * 2 : 4096;
+    uint32_t *new_table;
+    uint32_t i, pos;
+
+    new_table = calloc(new_size, sizeof(*new_table));
+    if (!new_table) {
+        return(0);
+    }
+    for (i = 0; i < heap->table_size; i++) {
+        if (heap->table[i]) {
+            pos = snap_hash(heap->data + heap->table[i], 0) & (new_size - 1);
+            while (new_table[pos]) {
+                pos = (pos + 1) & (new_size - 1);
+            }
+            new_table[pos] = heap->table[i];
+        }
+    }
+    free(heap->table);
+    heap->table = new_table;
+    heap->table_size = new_size;
+    return(1);
+}
+
+/* Write one section at the next aligned offset and note where it went */
+static int write_section(FILE *fp, const void *data, size_t size, uint64_t *offset_ptr)
+{
+    static const char padding[SNAP_ALIGN];
+    long pos = ftell(fp);
+
+    if (pos < 0) {
+        return(0);
+    }
+    if (pos % SNAP_ALIGN) {
+        if (fwrite(padding, SNAP_ALIGN - pos % SNAP_ALIGN, 1, fp) != 1) {
+            return(0);
+        }
+        pos += SNAP_ALIGN - pos % SNAP_ALIGN;
+    }
+    *offset_ptr = pos;
+    if (size && fwrite(data, size, 1, fp) != 1) {
+        return(0);
+    }
+    return(1);
+}
+
+/* Map a snapshot and check that its sections lie inside the file, so that
+   lookups need no further checks than the heap offset test in snap_str. */
+cat_snap *snap_open(const char *path)
+{
+    cat_snap *snap;
+    const snap_header *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open snapshot %s\n", path);
+        return(NULL);
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(snap_header)) {
+        fprintf(stderr, "%s is not a catalog snapshot\n", path);
+        close(fd);
+        return(NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map snapshot %s\n", path);
+        return(NULL);
+    }
+
+    hdr = map;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+        hdr->version != SNAP_VERSION || hdr->heap_size == 0 ||
+        hdr->num_buckets == 0 ||
+        hdr->buckets_offset + (uint64_t)hdr->num_buckets * sizeof(uint32_t) > (uint64_t)st.st_size ||
+        hdr->cds_offset + (uint64_t)hdr->num_cds * sizeof(snap_cd_rec) > (uint64_t)st.st_size ||
+        hdr->tracks_offset + (uint64_t)hdr->num_tracks * sizeof(snap_track_rec) > (uint64_t)st.st_size ||
+        hdr->heap_offset + hdr->heap_size > (uint64_t)st.st_size ||
+        hdr->num_disc_ids > hdr->num_cds ||
+        hdr->disc_ids_offset + (uint64_t)hdr->num_disc_ids * sizeof(uint32_t) > (uint64_t)st.st_size ||
+        ((const char *)map)[hdr->heap_offset + hdr->heap_size - 1] != '\0') {
+        fprintf(stderr, "%s is not a valid catalog snapshot\n", path);
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        munmap(map, st.st_size);
+        return(NULL);
+    }
+    snap->map = map;
+    snap->map_size = st.st_size;
+    snap->header = hdr;
+    snap->buckets = (const uint32_t *)(snap->map + hdr->buckets_offset);
+    snap->cds = (const snap_cd_rec *)(snap->map + hdr->cds_offset);
+    snap->tracks = (const snap_track_rec *)(snap->map + hdr->tracks_offset);
+    snap->heap = snap->map + hdr->heap_offset;
+    snap->disc_ids = (const uint32_t *)(snap->map + hdr->disc_ids_offset);
+    return(snap);
+}
+
+void snap_close(cat_snap *snap)
+{
+    if (!snap) {
+        return;
+    }
+    munmap((void *)snap->map, snap->map_size);
+    free(snap);
+}
+
+uint32_t snap_num_cds(const cat_snap *snap)
+{
+    return(snap->header->num_cds);
+}
+
+int snap_get_cd(const cat_snap *snap, const char *catalog, snap_cd_view *dest)
+{
+    uint32_t bucket, slot;
+
+    if (snap->header->num_cds == 0) {
+        return(0);
+    }
+    bucket = snap_hash(catalog, 0) % snap->header->num_buckets;
+    slot = snap_hash(catalog, snap->buckets[bucket]) % snap->header->num_cds;
+
+    /* any string hashes to some slot; only the right one has this key */
+    if (strcmp(snap_str(snap, snap->cds[slot].catalog), catalog) != 0) {
+        return(0);
+    }
+    snap_cd_at(snap, slot, dest);
+    return(1);
+}
+
+/* track_no counts from 1 within the CD's range */
+const char *snap_get_track(const cat_snap *snap, const snap_cd_view *cd,
+                           int track_no)
+{
+    uint32_t index;
+
+    if (track_no < 1 || (uint32_t)track_no > cd->num_tracks) {
+        return(NULL);
+    }
+    index = cd->first_track + track_no - 1;
+    if (index >= snap->header->num_tracks) {
+        return(NULL);
+    }
+    return(snap_str(snap, snap->tracks[index].title));
+}
+
+void snap_cd_at(const cat_snap *snap, uint32_t slot, snap_cd_view *dest)
+{
+    const snap_cd_rec *rec = &snap->cds[slot];
+
+    dest->catalog = snap_str(snap, rec->catalog);
+    dest->title = snap_str(snap, rec->title);
+    dest->type = snap_str(snap, rec->type);
+    dest->artist = snap_str(snap, rec->artist);
+    dest->first_track = rec->first_track;
+    dest->num_tracks = rec->num_tracks;
+    dest->key_catalog = snap_str(snap, rec->key_catalog);
+    dest->key_title = snap_str(snap, rec->key_title);
+    dest->key_type = snap_str(snap, rec->key_type);
+    dest->key_artist = snap_str(snap, rec->key_artist);
+    dest->disc_id = snap_str(snap, rec->disc_id);
+}
+
+static const char *snap_str(const cat_snap *snap, uint32_t offset)
+{
+    if (offset >= snap->header->heap_size) {
+        return("");
+    }
+    return(snap->heap + offset);
+}
+
+/* The snapshot as a read-only backend, "snap:path", so that cdctl and the
+   other tools can read it like any store. */
+
+static int snap_open_store(catalog_backend *be, const char *location, int create);
+static void snap_close_store(catalog_backend *be);
+static int snap_be_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+static int snap_be_get_tracks(catalog_backend *be, const char *catalog,
+                              cat_track *dest, int max_tracks);
+static int snap_be_put_cd(catalog_backend *be, const cat_cd *cd);
+static int snap_be_put_tracks(catalog_backend *be, const char *catalog,
+                              const cat_track *tracks, int count);
+static int snap_be_del_cd(catalog_backend *be, const char *catalog);
+static int snap_be_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+static int snap_be_find(catalog_backend *be, const cat_filter *filter,
+                        cat_scan_fn fn, void *arg);
+static int snap_be_stamp(catalog_backend *be, char *dest, int dest_len);
+static int snap_be_find_disc_id(catalog_backend *be, const char *disc_id,
+                                cat_scan_fn fn, void *arg);
+static void find_in_chunk(pool_group *group, void *arg);
+static void view_to_cd(const snap_cd_view *view, cat_cd *dest);
+
+const struct catalog_ops cat_snap_ops = {
+    "snap",
+    1,
+    snap_open_store,
+    snap_close_store,
+    snap_be_get_cd,
+    snap_be_get_tracks,
+    snap_be_put_cd,
+    snap_be_put_tracks,
+    snap_be_del_cd,
+    snap_be_scan,
+    snap_be_find,
+    snap_be_stamp,
+    NULL,
+    NULL,
+    NULL,
+    snap_be_find_disc_id
+};
+
+static int snap_open_store(catalog_backend *be, const char *location, int create)
+{
+    if (!location || !location[0] || create) {
+        fprintf(stderr, "A snapshot is opened as snap:path, and built with "
+                "cdctl snapshot\n");
+        return(0);
+    }
+    be->state = snap_open(location);
+    return(be->state != NULL);
+}
+
+static void snap_close_store(catalog_backend *be)
+{
+    snap_close(be->state);
+    be->state = NULL;
+}
+
+static int snap_be_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    snap_cd_view view;
+
+    if (!snap_get_cd(be->state, catalog, &view)) {
+        return(0);
+    }
+    view_to_cd(&view, dest);
+    return(1);
+}
+
+static int snap_be_get_tracks(catalog_backend *be, const char *catalog,
+                              cat_track *dest, int max_tracks)
+{
+    const cat_snap *snap = be->state;
+    snap_cd_view view;
+    uint32_t i;
+
+    if (!snap_get_cd(snap, catalog, &view)) {
+        return(0);
+    }
+    for (i = 0; i < view.num_tracks && i < (uint32_t)max_tracks; i++) {
+        if (view.first_track + i >= snap->header->num_tracks) {
+            break;
+        }
+        catalog_set_field(dest[i].catalog, view.catalog, CATALOG_CAT_LEN);
+        dest[i].track_no = snap->tracks[view.first_track + i].track_no;
+        catalog_set_field(dest[i].title,
+                          snap_str(snap, snap->tracks[view.first_track + i].title),
+                          CATALOG_TRACK_LEN);
+    }
+    return(i);
+}
+
+static int snap_be_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    fprintf(stderr, "A snapshot is read-only\n");
+    return(0);
+}
+
+static int snap_be_put_tracks(catalog_backend *be, const char *catalog,
+                              const cat_track *tracks, int count)
+{
+    fprintf(stderr, "A snapshot is read-only\n");
+    return(0);
+}
+
+static int snap_be_del_cd(catalog_backend *be, const char *catalog)
+{
+    fprintf(stderr, "A snapshot is read-only\n");
+    return(0);
+}
+
+static int snap_be_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    const cat_snap *snap = be->state;
+    snap_cd_view view;
+    cat_cd cd;
+    uint32_t slot;
+
+    for (slot = 0; slot < snap->header->num_cds; slot++) {
+        snap_cd_at(snap, slot, &view);
+        view_to_cd(&view, &cd);
+        if (!fn(&cd, arg)) {
+            break;
+        }
+    }
+    return(1);
+}
+
+/* One slice of the slots for a parallel find, and the slots that matched */
+typedef struct {
+    const cat_snap *snap;
+    const cat_filter *filter;
+    uint32_t first;
+    uint32_t count;
+    uint32_t *matches;
+    uint32_t num_matches;
+} find_chunk;
+
+/* Run the filter on the strings in the mapping, the stored keys when it
+   ignores case, and only copy out the CDs that match. The mapping is read
+   only, so the slots are split into chunks filtered on the pool, and the
+   matches then passed to fn in slot order from this thread. */
+static int snap_be_find(catalog_backend *be, const cat_filter *filter,
+                        cat_scan_fn fn, void *arg)
+{
+    const cat_snap *snap = be->state;
+    uint32_t num_chunks, c, i;
+    find_chunk *chunks;
+    pool_group *group = NULL;
+    snap_cd_view view;
+    cat_cd cd;
+    int stop = 0;
+    int ok = 1;
+
+    num_chunks = (snap->header->num_cds + SNAP_FIND_CHUNK - 1) / SNAP_FIND_CHUNK;
+    chunks = calloc(num_chunks, sizeof(*chunks));
+    if (!chunks) {
+        return(0);
+    }
+    if (num_chunks > 1) {
+        group = pool_group_new(pool_default());
+    }
+    for (c = 0; c < num_chunks; c++) {
+        chunks[c].snap = snap;
+        chunks[c].filter = filter;
+        chunks[c].first = c * SNAP_FIND_CHUNK;
+        chunks[c].count = snap->header->num_cds - chunks[c].first;
+        if (chunks[c].count > SNAP_FIND_CHUNK) {
+            chunks[c].count = SNAP_FIND_CHUNK;
+        }
+        if (!group || !pool_spawn(group, find_in_chunk, &chunks[c])) {
+            find_in_chunk(group, &chunks[c]);
+        }
+    }
+    if (group && !pool_join(group)) {
+        ok = 0;
+    }
+
+    for (c = 0; c < num_chunks; c++) {
+        if (ok && !chunks[c].matches && chunks[c].count) {
+            ok = 0;
+        }
+        for (i = 0; ok && !stop && i < chunks[c].num_matches; i++) {
+            snap_cd_at(snap, chunks[c].matches[i], &view);
+            view_to_cd(&view, &cd);
+            stop = !fn(&cd, arg);
+        }
+        free(chunks[c].matches);
+    }
+    free(chunks);
+    return(ok);
+}
+
+static void find_in_chunk(pool_group *group, void *arg)
+{
+    find_chunk *chunk = arg;
+    const char *fields[FILTER_NUM_FIELDS];
+    int ignore_case = filter_ignores_case(chunk->filter);
+    snap_cd_view view;
+    uint32_t slot;
+
+    chunk->matches = malloc(chunk->count * sizeof(*chunk->matches));
+    if (!chunk->matches) {
+        if (group) {
+            pool_cancel(group);
+        }
+        return;
+    }
+    for (slot = chunk->first; slot < chunk->first + chunk->count; slot++) {
+        snap_cd_at(chunk->snap, slot, &view);
+        fields[FILTER_CATALOG] = ignore_case ? view.key_catalog : view.catalog;
+        fields[FILTER_TITLE] = ignore_case ? view.key_title : view.title;
+        fields[FILTER_TYPE] = ignore_case ? view.key_type : view.type;
+        fields[FILTER_ARTIST] = ignore_case ? view.key_artist : view.artist;
+        if (filter_match_fields(chunk->filter, fields)) {
+            chunk->matches[chunk->num_matches++] = slot;
+        }
+    }
+}
+
+/* A snapshot never changes, but a new one can be renamed over it */
+static int snap_be_stamp(catalog_backend *be, char *dest, int dest_len)
+{
+    catalog_stamp_file(dest, dest_len, strchr(be->spec, ':') + 1);
+    return(1);
+}
+
+/* A binary search of the disc ID index for the first slot with the ID,
+   then the slots after it while they have it too. Slots are taken modulo
+   num_cds, so a damaged index can't read past the CD table. */
+static int snap_be_find_disc_id(catalog_backend *be, const char *disc_id,
+                                cat_scan_fn fn, void *arg)
+{
+    const cat_snap *snap = be->state;
+    snap_cd_view view;
+    cat_cd cd;
+    uint32_t low = 0, high = snap->header->num_disc_ids, middle;
+    uint32_t slot;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        slot = snap->disc_ids[middle] % snap->header->num_cds;
+        if (strcmp(snap_str(snap, snap->cds[slot].disc_id), disc_id) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < snap->header->num_disc_ids; low++) {
+        slot = snap->disc_ids[low] % snap->header->num_cds;
+        if (strcmp(snap_str(snap, snap->cds[slot].disc_id), disc_id) != 0) {
+            break;
+        }
+        snap_cd_at(snap, slot, &view);
+        view_to_cd(&view, &cd);
+        if (!fn(&cd, arg)) {
+            break;
+        }
+    }
+    return(1);
+}
+
+static void view_to_cd(const snap_cd_view *view, cat_cd *dest)
+{
+    memset(dest, '\0', sizeof(*dest));
+    catalog_set_field(dest->catalog, view->catalog, CATALOG_CAT_LEN);
+    catalog_set_field(dest->title, view->title, CATALOG_TITLE_LEN);
+    catalog_set_field(dest->type, view->type, CATALOG_TYPE_LEN);
+    catalog_set_field(dest->artist, view->artist, CATALOG_ARTIST_LEN);
+    catalog_set_field(dest->disc_id, view->disc_id, CATALOG_DISCID_LEN);
+}
@@ -0,0 +1,99 @@
+/*
+   A catalog snapshot is an immutable file compiled from any backend for
+   sites that only read between nightly loads. It holds:
+
+   - a minimal perfect hash on catalog number: one displacement per bucket
+     sends every catalog number to its own slot in the CD table
+   - the CD table, one fixed size record per slot
+   - the track table, each CD's tracks stored together as one range
+   - the slots of the CDs with a disc ID, sorted by disc ID
+   - a string heap with every distinct string stored once
+
+   Each CD also has its search keys (see cat_keys), folded when the snapshot
+   is built, so a search ignoring case costs the same as one that doesn't.
+   A key that folds to the field itself shares its string in the heap.
+
+   The reader maps the file and answers lookups straight from the mapping,
+   with no system calls and no allocation after snap_open. The views it
+   returns point into the mapping and stay valid until snap_close.
+ */
+
+#ifndef CAT_SNAP_H
+#define CAT_SNAP_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define SNAP_MAGIC   "CDSNAP1"
+#define SNAP_VERSION 3
+
+/* On-disk layout. All offsets are from the start of the file, all strings
+   are offsets into the heap. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_cds;
+    uint32_t num_tracks;
+    uint32_t num_buckets;
+    uint32_t heap_size;
+    uint32_t num_disc_ids;
+    uint64_t buckets_offset;
+    uint64_t cds_offset;
+    uint64_t tracks_offset;
+    uint64_t heap_offset;
+    uint64_t disc_ids_offset;
+} snap_header;
+
+typedef struct {
+    uint32_t catalog;
+    uint32_t title;
+    uint32_t type;
+    uint32_t artist;
+    uint32_t first_track;
+    uint32_t num_tracks;
+    uint32_t key_catalog;
+    uint32_t key_title;
+    uint32_t key_type;
+    uint32_t key_artist;
+    uint32_t disc_id;
+} snap_cd_rec;
+
+typedef struct {
+    uint32_t title;
+    uint32_t track_no;
+} snap_track_rec;
+
+typedef struct cat_snap cat_snap;
+
+/* A CD as seen through the mapping */
+typedef struct {
+    const char *catalog;
+    const char *title;
+    const char *type;
+    const char *artist;
+    uint32_t first_track;
+    uint32_t num_tracks;
+    const char *key_catalog;
+    const char *key_title;
+    const char *key_type;
+    const char *key_artist;
+    const char *disc_id;
+} snap_cd_view;
+
+/* Building a snapshot from an open store, and reading one */
+int snap_build(catalog_backend *from, const char *path);
+cat_snap *snap_open(const char *path);
+void snap_close(cat_snap *snap);
+uint32_t snap_num_cds(const cat_snap *snap);
+
+/* The get_cdc_entry and get_cdt_entry of a snapshot */
+int snap_get_cd(const cat_snap *snap, const char *catalog, snap_cd_view *dest);
+const char *snap_get_track(const cat_snap *snap, const snap_cd_view *cd,
+                           int track_no);
+/* The CD in a slot, for walking the whole snapshot: 0 <= slot < snap_num_cds */
+void snap_cd_at(const cat_snap *snap, uint32_t slot, snap_cd_view *dest);
+
+extern const struct catalog_ops cat_snap_ops;
+
+#endif
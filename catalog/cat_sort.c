@@ -0,0 +1,545 @@
+/*
+   Building and reading sort files. See cat_sort.h for the layout.
+
+   Each CD is held with the key it sorts by already folded, so the folding
+   is done once per CD rather than once per compare. The runs are written
+   as those records and merged through a heap, each run and the output
+   getting an equal share of mem_limit as their stdio buffer.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_sort.h"
+#include "cat_pool.h"
+
+#define SORT_KEY_LEN  CATALOG_TITLE_LEN   /* the longest field sorted on */
+
+struct cat_sorted {
+    FILE *fp;
+    sort_header header;
+};
+
+/* A CD and the key it sorts by, in memory and in the runs */
+typedef struct {
+    char key[SORT_KEY_LEN + 1];
+    cat_cd cd;
+} sort_rec;
+
+/* Half of the memory. A run is written out from one on the pool while
+   the scan goes on into the other. */
+typedef struct {
+    sort_rec *recs;
+    int num_recs;
+    FILE *fp;                   /* the run being written */
+    pool_group *group;          /* the task writing it */
+    int failed;
+} run_buffer;
+
+typedef struct {
+    sort_key key;
+    size_t mem_limit;
+    const char *temp_dir;
+    cat_pool *pool;
+    run_buffer buffers[2];
+    int filling;                /* the buffer the scan is adding to */
+    int max_recs;
+    char **runs;                /* the runs spilled, oldest first */
+    int num_runs;
+    int runs_allocated;
+    uint32_t num_cds;
+    int failed;
+} sorter;
+
+/* One run being merged, with its next record */
+typedef struct {
+    FILE *fp;
+    sort_rec rec;
+} merge_input;
+
+static const char *const key_names[] = { "catalog", "title", "artist" };
+
+static int collect_cd(const cat_cd *cd, void *arg);
+static int compare_recs(const void *a, const void *b);
+static FILE *new_run(sorter *st);
+static int spill_run(sorter *st);
+static void write_run(pool_group *group, void *arg);
+static int finish_run(sorter *st, run_buffer *buf);
+static int merge_runs(sorter *st, int count, FILE *out, int final);
+static void sift_down(merge_input *inputs, int *heap, int size, int pos);
+static int read_header(FILE *fp, sort_header *header, sort_key key);
+
+/* Scan the store into runs, then merge them into the sort file. The file
+   is written under a temporary name and renamed, so a reader never sees
+   half a sort. */
+int sort_build(catalog_backend *from, sort_key key, const char *path,
+               const sort_options *opts)
+{
+    sorter st;
+    sort_header header;
+    run_buffer *buf;
+    char temp_path[FILENAME_MAX];
+    FILE *fp = NULL;
+    int i;
+    int ok = 0;
+
+    memset(&st, 0, sizeof(st));
+    st.key = key;
+    st.mem_limit = opts && opts->mem_limit ? opts->mem_limit : SORT_DEFAULT_MEM;
+    if (st.mem_limit < SORT_MIN_MEM) {
+        st.mem_limit = SORT_MIN_MEM;
+    }
+    st.temp_dir = opts && opts->temp_dir ? opts->temp_dir : getenv("TMPDIR");
+    if (!st.temp_dir || !st.temp_dir[0]) {
+        st.temp_dir = "/tmp";
+    }
+    st.pool = pool_default();
+    st.max_recs = st.mem_limit / 2 / sizeof(sort_rec);
+    if (!finish_run(&st, &st.buffers[0])) {
+        return(0);
+    }
+
+    /* Take the stamp first, so a change made during the scan shows */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SORT_MAGIC, sizeof(header.magic));
+    header.version = SORT_VERSION;
+    header.key = key;
+    header.record_size = sizeof(cat_cd);
+    catalog_set_field(header.spec, from->spec, sizeof(header.spec) - 1);
+    catalog_stamp(from, header.stamp);
+
+    if (!catalog_scan(from, collect_cd, &st) || st.failed) {
+        goto done;
+    }
+    header.num_cds = st.num_cds;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to create %s\n", temp_path);
+        goto done;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        goto done;
+    }
+
+    buf = &st.buffers[st.filling];
+    if (st.num_runs == 0) {
+        qsort(buf->recs, buf->num_recs, sizeof(*buf->recs), compare_recs);
+        for (i = 0; i < buf->num_recs; i++) {
+            if (fwrite(&buf->recs[i].cd, sizeof(cat_cd), 1, fp) != 1) {
+                goto done;
+            }
+        }
+    } else {
+        if (buf->num_recs && !spill_run(&st)) {
+            goto done;
+        }
+        for (i = 0; i < 2; i++) {
+            if (!finish_run(&st, &st.buffers[i])) {
+                goto done;
+            }
+            free(st.buffers[i].recs);
+            st.buffers[i].recs = NULL;
+        }
+        while (st.num_runs > SORT_MAX_FANIN) {
+            if (!merge_runs(&st, SORT_MAX_FANIN, NULL, 0)) {
+                goto done;
+            }
+        }
+        if (!merge_runs(&st, st.num_runs, fp, 1)) {
+            goto done;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        unlink(temp_path);
+        goto done;
+    }
+    fp = NULL;
+    if (rename(temp_path, path) == -1) {
+        fprintf(stderr, "Unable to rename %s to %s\n", temp_path, path);
+        unlink(temp_path);
+        goto done;
+    }
+    ok = 1;
+
+done:
+    if (fp) {
+        fclose(fp);
+        unlink(temp_path);
+    }
+    for (i = 0; i < 2; i++) {
+        if (st.buffers[i].group) {
+            pool_join(st.buffers[i].group);
+        }
+        free(st.buffers[i].recs);
+    }
+    for (i = 0; i < st.num_runs; i++) {
+        unlink(st.runs[i]);
+        free(st.runs[i]);
+    }
+    free(st.runs);
+    return(ok);
+}
+
+static int collect_cd(const cat_cd *cd, void *arg)
+{
+    sorter *st = arg;
+    run_buffer *buf = &st->buffers[st->filling];
+    sort_rec *rec;
+
+    if (buf->num_recs == st->max_recs) {
+        if (!spill_run(st)) {
+            st->failed = 1;
+            return(0);
+        }
+        buf = &st->buffers[st->filling];
+    }
+    rec = &buf->recs[buf->num_recs++];
+    memset(rec, '\0', sizeof(*rec));
+    rec->cd = *cd;
+    switch (st->key) {
+    case SORT_BY_TITLE:
+        catalog_fold(rec->key, cd->title, SORT_KEY_LEN);
+        break;
+    case SORT_BY_ARTIST:
+        catalog_fold(rec->key, cd->artist, SORT_KEY_LEN);
+        break;
+    default:
+        catalog_set_field(rec->key, cd->catalog, SORT_KEY_LEN);
+        break;
+    }
+    st->num_cds++;
+    return(1);
+}
+
+static int compare_recs(const void *a, const void *b)
+{
+    const sort_rec *rec_a = a;
+    const sort_rec *rec_b = b;
+    int res;
+
+    res = strcmp(rec_a->key, rec_b->key);
+    if (res == 0) {
+        res = strcmp(rec_a->cd.catalog, rec_b->cd.catalog);
+    }
+    return(res);
+}
+
+/* Create a run file and add it to the end of the list */
+static FILE *new_run(sorter *st)
+{
+    char **new_runs;
+    char *name;
+    FILE *fp;
+    int fd;
+
+    if (st->num_runs == st->runs_allocated) {
+        st->runs_allocated = st->runs_allocated ? st->runs_allocated * 2 : 16;
+        new_runs = realloc(st->runs, st->runs_allocated * sizeof(*st->runs));
+        if (!new_runs) {
+            return(NULL);
+        }
+        st->runs = new_runs;
+    }
+    name = malloc(strlen(st->temp_dir) + sizeof("/cdsortXXXXXX"));
+    if (!name) {
+        return(NULL);
+    }
+    sprintf(name, "%s/cdsortXXXXXX", st->temp_dir);
+    fd = mkstemp(name);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create a sort run in %s\n", st->temp_dir);
+        free(name);
+        return(NULL);
+    }
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(name);
+        free(name);
+        return(NULL);
+    }
+    st->runs[st->num_runs++] = name;
+    return(fp);
+}
+
+/* Hand the CDs collected so far to the pool to be written out as a run,
+   and carry on into the other buffer once its own run is written. The
+   run file is made here, so the list of runs stays in run order. */
+static int spill_run(sorter *st)
+{
+    run_buffer *buf = &st->buffers[st->filling];
+
+    buf->fp = new_run(st);
+    if (!buf->fp) {
+        return(0);
+    }
+    buf->group = pool_group_new(st->pool);
+    if (buf->group && !pool_spawn(buf->group, write_run, buf)) {
+        pool_join(buf->group);
+        buf->group = NULL;
+    }
+    if (!buf->group) {
+        write_run(NULL, buf);
+    }
+    st->filling = !st->filling;
+    return(finish_run(st, &st->buffers[st->filling]));
+}
+
+static void write_run(pool_group *group, void *arg)
+{
+    run_buffer *buf = arg;
+    size_t written;
+
+    qsort(buf->recs, buf->num_recs, sizeof(*buf->recs), compare_recs);
+    written = fwrite(buf->recs, sizeof(*buf->recs), buf->num_recs, buf->fp);
+    if (fclose(buf->fp) != 0 || written != (size_t)buf->num_recs) {
+        buf->failed = 1;
+    }
+    buf->fp = NULL;
+    buf->num_recs = 0;
+}
+
+/* Wait for the buffer's run to be written and make it ready to fill */
+static int finish_run(sorter *st, run_buffer *buf)
+{
+    if (buf->group) {
+        pool_join(buf->group);
+        buf->group = NULL;
+    }
+    if (buf->failed) {
+        fprintf(stderr, "Unable to write a sort run\n");
+        return(0);
+    }
+    if (!buf->recs) {
+        buf->recs = malloc(st->max_recs * sizeof(*buf->recs));
+    }
+    return(buf->recs != NULL);
+}
+
+/* Merge the oldest count runs, into out as CDs when final, otherwise into
+   a new run at the end of the list. The merged runs are removed. */
+static int merge_runs(sorter *st, int count, FILE *out, int final)
+{
+    merge_input *inputs;
+    int *heap;
+    size_t buf_size;
+    int size = 0;
+    int i, top;
+    int ok = 0;
+
+    if (!final) {
+        out = new_run(st);
+        if (!out) {
+            return(0);
+        }
+    }
+    buf_size = st->mem_limit / (count + 1);
+    setvbuf(out, NULL, _IOFBF, buf_size);
+
+    inputs = calloc(count, sizeof(*inputs));
+    heap = malloc(count * sizeof(*heap));
+    if (!inputs || !heap) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        inputs[i].fp = fopen(st->runs[i], "r");
+        if (!inputs[i].fp) {
+            fprintf(stderr, "Unable to reopen sort run %s\n", st->runs[i]);
+            goto done;
+        }
+        setvbuf(inputs[i].fp, NULL, _IOFBF, buf_size);
+        if (fread(&inputs[i].rec, sizeof(sort_rec), 1, inputs[i].fp) == 1) {
+            heap[size++] = i;
+        }
+    }
+    for (i = size / 2 - 1; i >= 0; i--) {
+        sift_down(inputs, heap, size, i);
+    }
+
+    while (size > 0) {
+        top = heap[0];
+        if (final) {
+            if (fwrite(&inputs[top].rec.cd, sizeof(cat_cd), 1, out) != 1) {
+                goto done;
+            }
+        } else if (fwrite(&inputs[top].rec, sizeof(sort_rec), 1, out) != 1) {
+            goto done;
+        }
+        if (fread(&inputs[top].rec, sizeof(sort_rec), 1, inputs[top].fp) != 1) {
+            if (ferror(inputs[top].fp)) {
+                goto done;
+            }
+            heap[0] = heap[--size];
+        }
+        sift_down(inputs, heap, size, 0);
+    }
+    ok = 1;
+
+done:
+    if (inputs) {
+        for (i = 0; i < count; i++) {
+            if (inputs[i].fp) {
+                fclose(inputs[i].fp);
+            }
+        }
+    }
+    free(inputs);
+    free(heap);
+    if (!final && fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Unable to merge the sort runs\n");
+        return(0);
+    }
+    for (i = 0; i < count; i++) {
+        unlink(st->runs[i]);
+        free(st->runs[i]);
+    }
+    st->num_runs -= count;
+    memmove(st->runs, st->runs + count, st->num_runs * sizeof(*st->runs));
+    return(1);
+}
+
+/* heap holds input numbers, the one with the smallest record first */
+static void sift_down(merge_input *inputs, int *heap, int size, int pos)
+{
+    int child, swap;
+
+    while ((child = 2 * pos + 1) < size) {
+        if (child + 1 < size &&
+            compare_recs(&inputs[heap[child + 1]].rec, &inputs[heap[child]].rec) < 0) {
+            child++;
+        }
+        if (compare_recs(&inputs[heap[pos]].rec, &inputs[heap[child]].rec) <= 0) {
+            break;
+        }
+        swap = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = swap;
+        pos = child;
+    }
+}
+
+/* Is this a whole sort file of the right key? */
+static int read_header(FILE *fp, sort_header *header, sort_key key)
+{
+    struct stat st;
+
+    if (fread(header, sizeof(*header), 1, fp) != 1 ||
+        memcmp(header->magic, SORT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SORT_VERSION ||
+        header->key != key ||
+        header->record_size != sizeof(cat_cd)) {
+        return(0);
+    }
+    if (fstat(fileno(fp), &st) == -1 ||
+        st.st_size != (off_t)(sizeof(*header) +
+                              (uint64_t)header->num_cds * sizeof(cat_cd))) {
+        return(0);
+    }
+    header->spec[sizeof(header->spec) - 1] = '\0';
+    header->stamp[CATALOG_STAMP_LEN] = '\0';
+    return(1);
+}
+
+cat_sorted *sort_open(catalog_backend *from, sort_key key, const char *path,
+                      const sort_options *opts)
+{
+    cat_sorted *sorted;
+    char stamp[CATALOG_STAMP_LEN + 1];
+    int current = 0;
+
+    sorted = calloc(1, sizeof(*sorted));
+    if (!sorted) {
+        return(NULL);
+    }
+    sorted->fp = fopen(path, "r");
+    if (sorted->fp && read_header(sorted->fp, &sorted->header, key) &&
+        catalog_stamp(from, stamp)) {
+        current = strcmp(sorted->header.spec, from->spec) == 0 &&
+                  strcmp(sorted->header.stamp, stamp) == 0;
+    }
+    if (!current) {
+        if (sorted->fp) {
+            fclose(sorted->fp);
+        }
+        sorted->fp = NULL;
+        if (sort_build(from, key, path, opts)) {
+            sorted->fp = fopen(path, "r");
+        }
+        if (!sorted->fp || !read_header(sorted->fp, &sorted->header, key)) {
+            fprintf(stderr, "Unable to sort the catalog into %s\n", path);
+            sort_close(sorted);
+            return(NULL);
+        }
+    }
+    return(sorted);
+}
+
+void sort_close(cat_sorted *sorted)
+{
+    if (!sorted) {
+        return;
+    }
+    if (sorted->fp) {
+        fclose(sorted->fp);
+    }
+    free(sorted);
+}
+
+uint32_t sort_num_cds(const cat_sorted *sorted)
+{
+    return(sorted->header.num_cds);
+}
+
+int sort_read(cat_sorted *sorted, uint32_t first, cat_cd *dest, int count)
+{
+    off_t offset;
+    int got, i;
+
+    if (first >= sorted->header.num_cds || count <= 0) {
+        return(0);
+    }
+    if ((uint32_t)count > sorted->header.num_cds - first) {
+        count = sorted->header.num_cds - first;
+    }
+    offset = sizeof(sort_header) + (off_t)first * sizeof(cat_cd);
+    if (fseeko(sorted->fp, offset, SEEK_SET) == -1) {
+        return(0);
+    }
+    got = fread(dest, sizeof(cat_cd), count, sorted->fp);
+    for (i = 0; i < got; i++) {
+        dest[i].catalog[CATALOG_CAT_LEN] = '\0';
+        dest[i].title[CATALOG_TITLE_LEN] = '\0';
+        dest[i].type[CATALOG_TYPE_LEN] = '\0';
+        dest[i].artist[CATALOG_ARTIST_LEN] = '\0';
+    }
+    return(got);
+}
+
+int sort_key_from_name(const char *name, sort_key *key)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(key_names) / sizeof(key_names[0])); i++) {
+        if (strcmp(name, key_names[i]) == 0) {
+            *key = i;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+const char *sort_key_name(sort_key key)
+{
+    return(key_names[key]);
+}
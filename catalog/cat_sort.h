@@ -0,0 +1,76 @@
+/*
+   Sorted browsing. A sort file holds the CDs of a store in title, artist
+   or catalog order as fixed size records after a header, so any page of
+   the listing is one seek and one read, however big the catalog is.
+
+   Building one is an external merge sort that keeps at most mem_limit
+   bytes of CDs in memory, in two halves: while the scan fills one half,
+   the run in the other is sorted and spilled to a temporary file on the
+   thread pool (cat_pool.h). The runs are then merged SORT_MAX_FANIN at a
+   time until one is left. A catalog that fits in one run is never
+   spilled.
+
+   Titles and artists sort ignoring case and accents, by their search keys
+   (catalog_fold), and CDs that sort alike are in catalog order.
+
+   The header names the store and holds its stamp (catalog_stamp) from
+   when the file was built. sort_open reuses the file while both still
+   match and sorts again when they don't, or when the store has no stamp.
+ */
+
+#ifndef CAT_SORT_H
+#define CAT_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define SORT_MAGIC        "CDSORT1"
+#define SORT_VERSION      1
+#define SORT_DEFAULT_MEM  (16 * 1024 * 1024)
+#define SORT_MIN_MEM      (64 * 1024)
+#define SORT_MAX_FANIN    16
+
+typedef enum {
+    SORT_BY_CATALOG,
+    SORT_BY_TITLE,
+    SORT_BY_ARTIST
+} sort_key;
+
+/* The header of a sort file; cat_cd records follow */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t key;
+    uint32_t num_cds;
+    uint32_t record_size;
+    char spec[100];
+    char stamp[CATALOG_STAMP_LEN + 1];
+} sort_header;
+
+typedef struct {
+    size_t mem_limit;           /* bytes of CDs in memory, 0 for the default */
+    const char *temp_dir;       /* for the runs, NULL for $TMPDIR or /tmp */
+} sort_options;
+
+typedef struct cat_sorted cat_sorted;
+
+/* opts may be NULL for the defaults */
+int sort_build(catalog_backend *from, sort_key key, const char *path,
+               const sort_options *opts);
+/* Open the sort file at path, building or rebuilding it first if it isn't
+   an up to date sort of the store */
+cat_sorted *sort_open(catalog_backend *from, sort_key key, const char *path,
+                      const sort_options *opts);
+void sort_close(cat_sorted *sorted);
+
+uint32_t sort_num_cds(const cat_sorted *sorted);
+/* Read up to count CDs starting at position first, return how many */
+int sort_read(cat_sorted *sorted, uint32_t first, cat_cd *dest, int count);
+
+/* "catalog", "title" or "artist" */
+int sort_key_from_name(const char *name, sort_key *key);
+const char *sort_key_name(sort_key key);
+
+#endif
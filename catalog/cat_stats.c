@@ -0,0 +1,371 @@
+/*
+   The metrics of cat_stats.h.
+
+   A CPU's counts are added to with relaxed atomic adds, which on lines
+   no other core writes stay in that core's cache. A thread moved to
+   another CPU between sched_getcpu and the add only shares a line for
+   once; the add isn't lost. The writer reads with relaxed loads, so a
+   bucket may be a count ahead of the total for a moment, which
+   Prometheus takes.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "cat_stats.h"
+
+#define STATS_LINE        64        /* bytes in a cache line */
+#define STATS_MAX_SHARDS  64
+#define STATS_SEND_SECONDS 1        /* for a reader of the socket to take them */
+#define STATS_MAX_PATH    1024
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_counts;
+
+typedef struct {
+    stats_counts ops[STATS_NUM_OPS];
+} __attribute__((aligned(STATS_LINE))) stats_shard;
+
+static const char *const op_names[STATS_NUM_OPS] = {
+    "dbm_get_cd", "dbm_get_track", "dbm_add_cd", "dbm_add_track",
+    "dbm_del_cd", "dbm_del_track", "dbm_search", "dbm_find_disc_id",
+    "dbm_set_disc_id",
+    "mini_find", "mini_count", "mini_list_tracks", "mini_remove_titles",
+    "mini_remove_tracks", "mini_edit_track",
+    "serve_find", "serve_list", "serve_get", "serve_tracks", "serve_count",
+    "serve_complete", "serve_put", "serve_put_tracks", "serve_del",
+    "serve_unknown", "serve_commit"
+};
+
+/* Untouched shards cost no memory, as the pages are never written */
+static stats_shard shards[STATS_MAX_SHARDS];
+static int num_shards;
+static int collecting;
+
+static char program_name[100];
+static char file_path[STATS_MAX_PATH];
+static char socket_file[STATS_MAX_PATH];
+static int listen_fd = -1;
+static int wake_fds[2] = { -1, -1 };
+static pthread_t writer;
+
+static int open_listener(const char *path);
+static void *write_metrics(void *arg);
+static int write_file(void);
+static void answer_reader(int fd);
+static void print_metrics(FILE *fp);
+static int bucket_of(uint64_t ns);
+
+int stats_start(const char *program, const char *file, const char *socket_path)
+{
+    sigset_t all, old;
+    int failed;
+
+    if (collecting || (!file && !socket_path)) {
+        return(0);
+    }
+    num_shards = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_shards < 1) {
+        num_shards = 1;
+    }
+    if (num_shards > STATS_MAX_SHARDS) {
+        num_shards = STATS_MAX_SHARDS;
+    }
+    snprintf(program_name, sizeof(program_name), "%s", program);
+    file_path[0] = '\0';
+    if (file) {
+        if (strlen(file) + 5 > sizeof(file_path)) {
+            fprintf(stderr, "Metrics file name too long: %s\n", file);
+            return(0);
+        }
+        strcpy(file_path, file);
+    }
+    socket_file[0] = '\0';
+    if (socket_path) {
+        listen_fd = open_listener(socket_path);
+        if (listen_fd == -1) {
+            return(0);
+        }
+        strcpy(socket_file, socket_path);
+    }
+    if (pipe(wake_fds) == -1) {
+        perror("pipe");
+        stats_stop();
+        return(0);
+    }
+
+    /* The writer takes no signals, so they still interrupt the program's
+       own waits, as cdserve's epoll_wait */
+    collecting = 1;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    failed = pthread_create(&writer, NULL, write_metrics, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed) {
+        fprintf(stderr, "Unable to start the metrics thread\n");
+        collecting = 0;
+        stats_stop();
+        return(0);
+    }
+    return(1);
+}
+
+void stats_stop(void)
+{
+    if (collecting) {
+        (void)write(wake_fds[1], "", 1);
+        pthread_join(writer, NULL);
+        collecting = 0;
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+        unlink(socket_file);
+        listen_fd = -1;
+    }
+    if (wake_fds[0] != -1) {
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+        wake_fds[0] = wake_fds[1] = -1;
+    }
+}
+
+uint64_t stats_clock(void)
+{
+    struct timespec ts;
+
+    if (!collecting) {
+        return(0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void stats_record(stats_op op, uint64_t start, int ok)
+{
+    stats_counts *counts;
+    uint64_t ns;
+    int cpu;
+
+    if (!collecting || !start || op < 0 || op >= STATS_NUM_OPS) {
+        return;
+    }
+    ns = stats_clock() - start;
+    cpu = sched_getcpu();
+    counts = &shards[cpu > 0 ? cpu % num_shards : 0].ops[op];
+    __atomic_fetch_add(&counts->count, 1, __ATOMIC_RELAXED);
+    if (!ok) {
+        __atomic_fetch_add(&counts->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&counts->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counts->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* As cdserve's socket: another program answering on it is left alone */
+static int open_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || strlen(path) >= sizeof(socket_file)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return(-1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return(-1);
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Something is already answering on %s\n", path);
+        close(fd);
+        return(-1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+/* The writer thread: the file when it is due, a reader whenever one
+   connects, and the file once more when woken to stop */
+static void *write_metrics(void *arg)
+{
+    struct pollfd fds[2];
+    struct timespec now;
+    time_t due;
+    int n, timeout, fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    due = now.tv_sec + STATS_WRITE_SECONDS;
+    fds[0].fd = wake_fds[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = now.tv_sec >= due ? 0 : (int)(due - now.tv_sec) * 1000;
+        n = poll(fds, listen_fd == -1 ? 1 : 2, file_path[0] ? timeout : -1);
+        if (n == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (n > 0 && fds[0].revents) {
+            break;
+        }
+        if (n > 0 && fds[1].revents & POLLIN) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd != -1) {
+                answer_reader(fd);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (file_path[0] && now.tv_sec >= due) {
+            write_file();
+            due = now.tv_sec + STATS_WRITE_SECONDS;
+        }
+    }
+    if (file_path[0]) {
+        write_file();
+    }
+    return(NULL);
+}
+
+static int write_file(void)
+{
+    char temp[STATS_MAX_PATH + 5];
+    FILE *fp;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", file_path);
+    fp = fopen(temp, "w");
+    if (!fp) {
+        return(0);
+    }
+    print_metrics(fp);
+    if (fclose(fp) != 0 || rename(temp, file_path) == -1) {
+        unlink(temp);
+        return(0);
+    }
+    return(1);
+}
+
+/* A reader that doesn't take them in time is cut off, so it can't hold
+   up the file */
+static void answer_reader(int fd)
+{
+    struct timeval limit;
+    FILE *fp;
+
+    limit.tv_sec = STATS_SEND_SECONDS;
+    limit.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        return;
+    }
+    print_metrics(fp);
+    fclose(fp);
+}
+
+/* Only the operations that have happened, as the rest would be a page
+   of zeroes for each program */
+static void print_metrics(FILE *fp)
+{
+    stats_counts total[STATS_NUM_OPS];
+    const stats_counts *counts;
+    uint64_t cumulative;
+    int s, op, b;
+
+    memset(total, 0, sizeof(total));
+    for (s = 0; s < num_shards; s++) {
+        for (op = 0; op < STATS_NUM_OPS; op++) {
+            counts = &shards[s].ops[op];
+            total[op].count += __atomic_load_n(&counts->count, __ATOMIC_RELAXED);
+            total[op].errors += __atomic_load_n(&counts->errors, __ATOMIC_RELAXED);
+            total[op].sum_ns += __atomic_load_n(&counts->sum_ns, __ATOMIC_RELAXED);
+            for (b = 0; b < STATS_BUCKETS; b++) {
+                total[op].buckets[b] += __atomic_load_n(&counts->buckets[b],
+                                                        __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    fprintf(fp, "# HELP cd_operations_total Catalog operations done.\n"
+                "# TYPE cd_operations_total counter\n");
+    for (op = 0; op < STATS_NUM_OPS; op++) {
+        if (total[op].count) {
+            fprintf(fp, "cd_operations_total{program=\"%s\",op=\"%s\"} %llu\n",
+                    program_name, op_names[op], (unsigned long long)total[op].count);
+        }
+    }
+    fprintf(fp, "# HELP cd_operation_errors_total Catalog operations that failed.\n"
+                "# TYPE cd_operation_errors_total counter\n");
+    for (op = 0; op < STATS_NUM_OPS; op++) {
+        if (total[op].count) {
+            fprintf(fp, "cd_operation_errors_total{program=\"%s\",op=\"%s\"} %llu\n",
+                    program_name, op_names[op], (unsigned long long)total[op].errors);
+        }
+    }
+    fprintf(fp, "# HELP cd_operation_seconds How long catalog operations took.\n"
+                "# TYPE cd_operation_seconds histogram\n");
+    for (op = 0; op < STATS_NUM_OPS; op++) {
+        if (!total[op].count) {
+            continue;
+        }
+        cumulative = 0;
+        for (b = 0; b < STATS_BUCKETS; b++) {
+            cumulative += total[op].buckets[b];
+            if (b < STATS_BUCKETS - 1) {
+                fprintf(fp, "cd_operation_seconds_bucket{program=\"%s\",op=\"%s\","
+                            "le=\"%.6f\"} %llu\n", program_name, op_names[op],
+                        (double)(1u << b) / 1000000, (unsigned long long)cumulative);
+            } else {
+                fprintf(fp, "cd_operation_seconds_bucket{program=\"%s\",op=\"%s\","
+                            "le=\"+Inf\"} %llu\n", program_name, op_names[op],
+                        (unsigned long long)cumulative);
+            }
+        }
+        fprintf(fp, "cd_operation_seconds_sum{program=\"%s\",op=\"%s\"} %.9f\n",
+                program_name, op_names[op], total[op].sum_ns / 1e9);
+        fprintf(fp, "cd_operation_seconds_count{program=\"%s\",op=\"%s\"} %llu\n",
+                program_name, op_names[op], (unsigned long long)cumulative);
+    }
+}
+
+/* Bucket b holds the times up to 2^b microseconds */
+static int bucket_of(uint64_t ns)
+{
+    uint64_t us = (ns + 999) / 1000;
+    int b;
+
+    if (us <= 1) {
+        return(0);
+    }
+    b = 64 - __builtin_clzll(us - 1);
+    return(b < STATS_BUCKETS - 1 ? b : STATS_BUCKETS - 1);
+}
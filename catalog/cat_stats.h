@@ -0,0 +1,74 @@
+/*
+   Operation counts and latencies of the long-running CD programs, for
+   monitoring, in the Prometheus text format.
+
+   stats_start starts a thread that writes the metrics to a file every
+   STATS_WRITE_SECONDS, renaming a new copy over the old so a reader never
+   sees half of one (node_exporter's textfile collector reads it as it
+   is), and that answers each connection to a Unix socket with the metrics
+   as they are at that moment, then closes it:
+
+       socat - UNIX-CONNECT:SOCKET
+
+   Each operation is counted, failures separately, and its time goes into
+   a histogram with buckets doubling from 1us. Before stats_start,
+   stats_clock returns 0 and stats_record does nothing, so an operation
+   costs a test of one flag while nobody is collecting.
+
+   The counts are kept per CPU, each CPU's on cache lines of their own,
+   so threads on different cores never write to the same line; the thread
+   writing the metrics out adds them up.
+ */
+
+#ifndef CAT_STATS_H
+#define CAT_STATS_H
+
+#include <stdint.h>
+
+#define STATS_WRITE_SECONDS 10
+#define STATS_BUCKETS       24      /* up to 2^22us, about 4s, then +Inf */
+
+typedef enum {
+    /* cd_access.c, for application and the dbm backend */
+    STATS_DBM_GET_CD,
+    STATS_DBM_GET_TRACK,
+    STATS_DBM_ADD_CD,
+    STATS_DBM_ADD_TRACK,
+    STATS_DBM_DEL_CD,
+    STATS_DBM_DEL_TRACK,
+    STATS_DBM_SEARCH,
+    STATS_DBM_FIND_DISC_ID,
+    STATS_DBM_SET_DISC_ID,
+    /* mini_cd_manager, on the files or through cdserve */
+    STATS_MINI_FIND,
+    STATS_MINI_COUNT,
+    STATS_MINI_LIST_TRACKS,
+    STATS_MINI_REMOVE_TITLES,
+    STATS_MINI_REMOVE_TRACKS,
+    STATS_MINI_EDIT_TRACK,
+    /* cdserve's requests, and its writes of the files */
+    STATS_SERVE_FIND,
+    STATS_SERVE_LIST,
+    STATS_SERVE_GET,
+    STATS_SERVE_TRACKS,
+    STATS_SERVE_COUNT,
+    STATS_SERVE_COMPLETE,
+    STATS_SERVE_PUT,
+    STATS_SERVE_PUT_TRACKS,
+    STATS_SERVE_DEL,
+    STATS_SERVE_UNKNOWN,
+    STATS_SERVE_COMMIT,
+    STATS_NUM_OPS
+} stats_op;
+
+/* program labels the metrics. file or socket_path may be NULL; 0 if
+   neither could be set up. */
+int stats_start(const char *program, const char *file, const char *socket_path);
+/* Write the file a last time and stop answering */
+void stats_stop(void);
+
+/* The start of an operation, in nanoseconds, for stats_record */
+uint64_t stats_clock(void);
+void stats_record(stats_op op, uint64_t start, int ok);
+
+#endif
@@ -0,0 +1,1278 @@
+/*
+   The text backend reads and writes the files of mini_cd_manager:
+
+   title.cdb   one line per CD:    catalog,title,type,artist
+   tracks.cdb  one line per track: catalog,track_no,track
+   discid.cdb  one line per CD with a disc ID: catalog,discid
+
+   As in mini_cd_manager, changing or removing lines means copying the file
+   to a temporary one without them, then renaming it over the original.
+   The exception is a single track: the lines of tracks.cdb are slots
+   (see cat_text.h), and text_set_track rewrites just one.
+   Unlike mini_cd_manager, a catalog number must match the first field
+   exactly, so removing "B1" doesn't also remove "B10".
+
+   Every lookup is a scan of a whole file, so the files are read and the
+   copies written through cat_io.h, a block at a time with reads queued
+   ahead and writes behind.
+
+   The one exception is finding CDs by disc ID. discid.idx is a hash table
+   on disk from disc IDs to the offsets of their lines in title.cdb, so a
+   lookup reads a slot or two and a line. The index records the stamps of
+   title.cdb and discid.cdb, and the first lookup after either changes
+   builds it again. mini_cd_manager knows nothing of discid.cdb, and any
+   lines it leaves behind for CDs it removes are ignored.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_text.h"
+#include "cat_io.h"
+
+#define TEXT_TEMP_FILE   "cdb.tmp"
+#define MAX_ENTRY        1024
+#define MAX_PATH         1024
+#define INDEX_MAGIC      "cdidx01"
+
+typedef struct {
+    char title_file[MAX_PATH];
+    char tracks_file[MAX_PATH];
+    char disc_id_file[MAX_PATH];
+    char index_file[MAX_PATH];
+    char temp_file[MAX_PATH];
+} text_state;
+
+/* discid.idx is this header, then num_slots slots */
+typedef struct {
+    char magic[8];
+    char stamp[CATALOG_STAMP_LEN + 1];  /* of title.cdb and discid.cdb */
+    uint32_t num_slots;                 /* a power of two */
+    uint32_t num_ids;
+} index_header;
+
+typedef struct {
+    uint64_t offset;        /* of the CD's line in title.cdb */
+    uint32_t disc_id;
+    uint32_t used;
+} index_slot;
+
+/* The disc IDs of discid.cdb by catalog number */
+typedef struct {
+    char *names;            /* the catalog numbers, one after another */
+    size_t names_len;
+    size_t names_size;
+    size_t *slots;          /* offset in names + 1, 0 if empty */
+    uint32_t *ids;
+    int size;               /* a power of two */
+    int count;
+} disc_id_map;
+
+/* The catalog numbers of a batch, by open addressing on their hash */
+typedef struct {
+    const cat_entry *entries;
+    int count;
+    int *slots;             /* index into entries, -1 if empty */
+    int size;               /* a power of two */
+} batch_set;
+
+static int text_open(catalog_backend *be, const char *location, int create);
+static void text_close(catalog_backend *be);
+static int text_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+static int text_get_tracks(catalog_backend *be, const char *catalog,
+                           cat_track *dest, int max_tracks);
+static int text_put_cd(catalog_backend *be, const cat_cd *cd);
+static int text_put_tracks(catalog_backend *be, const char *catalog,
+                           const cat_track *tracks, int count);
+static int text_del_cd(catalog_backend *be, const char *catalog);
+static int text_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+static int text_stamp(catalog_backend *be, char *dest, int dest_len);
+static int text_scan_tracks(catalog_backend *be, int part, int num_parts,
+                            cat_track_fn fn, void *arg);
+static int text_del_tracks(catalog_backend *be, const char *catalog);
+static int text_put_batch(catalog_backend *be, const cat_entry *entries, int count);
+static int text_find_disc_id(catalog_backend *be, const char *disc_id,
+                             cat_scan_fn fn, void *arg);
+
+static int storable(const cat_cd *cd);
+static int line_is_for(const char *line, const char *catalog);
+static int batch_add(batch_set *set, int index);
+static int batch_find(const batch_set *set, const char *catalog, size_t len);
+static unsigned int batch_hash(const char *catalog, size_t len);
+static int remove_batch(const text_state *ts, const char *path,
+                        const batch_set *set);
+static int append_batch(const text_state *ts, const batch_set *set);
+static cat_writer *copy_without(const text_state *ts, const char *path,
+                                const char *catalog);
+static int finish_copy(const text_state *ts, const char *path,
+                       cat_writer *temp);
+static int compare_track_no(const void *a, const void *b);
+static int copy_with_track(const char *path, const char *catalog, int track_no,
+                           const char *line, int len);
+static void read_disc_id(const text_state *ts, const char *catalog, char *dest);
+static int put_disc_id(const text_state *ts, const cat_cd *cd, int is_new);
+static int parse_disc_id(const char *line, size_t *cat_len, uint32_t *id);
+static int load_disc_ids(const text_state *ts, disc_id_map *map);
+static int map_put(disc_id_map *map, const char *catalog, size_t len, uint32_t id);
+static int map_get(const disc_id_map *map, const char *catalog, size_t len,
+                   uint32_t *id);
+static void map_free(disc_id_map *map);
+static int index_stamp(const text_state *ts, char *dest);
+static int build_index(const text_state *ts, const char *stamp);
+static uint32_t slot_hash(uint32_t disc_id);
+
+const struct catalog_ops cat_text_ops = {
+    "text",
+    1,
+    text_open,
+    text_close,
+    text_get_cd,
+    text_get_tracks,
+    text_put_cd,
+    text_put_tracks,
+    text_del_cd,
+    text_scan,
+    NULL,
+    text_stamp,
+    text_scan_tracks,
+    text_del_tracks,
+    text_put_batch,
+    text_find_disc_id
+};
+
+/* location is the directory holding the files. The files need not exist:
+   a missing file is an empty catalog, as in mini_cd_manager. */
+static int text_open(catalog_backend *be, const char *location, int create)
+{
+    text_state *ts;
+    FILE *fp;
+
+    if (!location || !location[0]) {
+        location = ".";
+    }
+    ts = calloc(1, sizeof(*ts));
+    if (!ts) {
+        return(0);
+    }
+    snprintf(ts->title_file, MAX_PATH, "%s/%s", location, TEXT_TITLE_FILE);
+    snprintf(ts->tracks_file, MAX_PATH, "%s/%s", location, TEXT_TRACKS_FILE);
+    snprintf(ts->disc_id_file, MAX_PATH, "%s/%s", location, TEXT_DISCID_FILE);
+    snprintf(ts->index_file, MAX_PATH, "%s/%s", location, TEXT_DISCID_INDEX);
+    snprintf(ts->temp_file, MAX_PATH, "%s/%s", location, TEXT_TEMP_FILE);
+
+    if (create) {
+        fp = fopen(ts->title_file, "w");
+        if (fp) {
+            fclose(fp);
+            fp = fopen(ts->tracks_file, "w");
+        }
+        if (!fp) {
+            fprintf(stderr, "Unable to create %s\n", ts->title_file);
+            free(ts);
+            return(0);
+        }
+        fclose(fp);
+        unlink(ts->disc_id_file);
+    }
+    be->state = ts;
+    return(1);
+}
+
+static void text_close(catalog_backend *be)
+{
+    free(be->state);
+    be->state = NULL;
+}
+
+static int text_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    text_state *ts = be->state;
+    char entry[MAX_ENTRY];
+    cat_reader *titles;
+    int found = 0;
+
+    titles = io_open_read(ts->title_file);
+    if (!titles) {
+        return(0);
+    }
+    while (!found && io_gets(entry, MAX_ENTRY, titles)) {
+        if (line_is_for(entry, catalog)) {
+            found = text_parse_title(entry, dest);
+        }
+    }
+    io_close_read(titles);
+    if (found) {
+        read_disc_id(ts, dest->catalog, dest->disc_id);
+    }
+    return(found);
+}
+
+/* Tracks are normally written in order, but sort them to be sure */
+static int text_get_tracks(catalog_backend *be, const char *catalog,
+                           cat_track *dest, int max_tracks)
+{
+    text_state *ts = be->state;
+    char entry[MAX_ENTRY];
+    cat_reader *tracks;
+    int count = 0;
+
+    tracks = io_open_read(ts->tracks_file);
+    if (!tracks) {
+        return(0);
+    }
+    while (count < max_tracks && io_gets(entry, MAX_ENTRY, tracks)) {
+        if (line_is_for(entry, catalog) && text_parse_track(entry, &dest[count])) {
+            count++;
+        }
+    }
+    io_close_read(tracks);
+    qsort(dest, count, sizeof(*dest), compare_track_no);
+    return(count);
+}
+
+/* The file format has no quoting, so only the last field of a line may
+   contain a comma. A new CD is appended, which needs no copy. */
+static int text_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    text_state *ts = be->state;
+    cat_cd existing;
+    cat_writer *temp;
+    FILE *fp;
+
+    if (!storable(cd)) {
+        fprintf(stderr, "The text catalog can't store commas in %s\n", cd->catalog);
+        return(0);
+    }
+
+    if (text_get_cd(be, cd->catalog, &existing)) {
+        temp = copy_without(ts, ts->title_file, cd->catalog);
+        if (!temp) {
+            return(0);
+        }
+        io_printf(temp, "%s,%s,%s,%s\n", cd->catalog, cd->title, cd->type,
+                  cd->artist);
+        if (!finish_copy(ts, ts->title_file, temp)) {
+            return(0);
+        }
+        if (strcmp(existing.disc_id, cd->disc_id) == 0) {
+            return(1);
+        }
+        return(put_disc_id(ts, cd, 0));
+    }
+    fp = fopen(ts->title_file, "a");
+    if (!fp) {
+        return(0);
+    }
+    fprintf(fp, "%s,%s,%s,%s\n", cd->catalog, cd->title, cd->type, cd->artist);
+    if (fclose(fp) != 0) {
+        return(0);
+    }
+    return(put_disc_id(ts, cd, 1));
+}
+
+static int text_put_tracks(catalog_backend *be, const char *catalog,
+                           const cat_track *tracks, int count)
+{
+    text_state *ts = be->state;
+    char line[MAX_ENTRY];
+    cat_writer *temp;
+    int i, len;
+
+    for (i = 0; i < count; i++) {
+        if (strchr(tracks[i].title, '\n')) {
+            return(0);
+        }
+    }
+    temp = copy_without(ts, ts->tracks_file, catalog);
+    if (!temp) {
+        return(0);
+    }
+    for (i = 0; i < count; i++) {
+        len = text_track_line(line, sizeof(line), catalog, tracks[i].track_no,
+                              tracks[i].title);
+        io_write(temp, line, len);
+    }
+    return(finish_copy(ts, ts->tracks_file, temp));
+}
+
+static int text_del_cd(catalog_backend *be, const char *catalog)
+{
+    text_state *ts = be->state;
+    cat_cd existing;
+    cat_writer *temp;
+
+    if (!text_get_cd(be, catalog, &existing)) {
+        return(0);
+    }
+    temp = copy_without(ts, ts->title_file, catalog);
+    if (!temp || !finish_copy(ts, ts->title_file, temp)) {
+        return(0);
+    }
+    if (existing.disc_id[0]) {
+        temp = copy_without(ts, ts->disc_id_file, catalog);
+        if (!temp || !finish_copy(ts, ts->disc_id_file, temp)) {
+            return(0);
+        }
+    }
+    temp = copy_without(ts, ts->tracks_file, catalog);
+    if (!temp) {
+        return(0);
+    }
+    return(finish_copy(ts, ts->tracks_file, temp));
+}
+
+/* The disc IDs are read into memory first, rather than looked up a CD
+   at a time */
+static int text_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    text_state *ts = be->state;
+    char entry[MAX_ENTRY];
+    cat_reader *titles;
+    disc_id_map map;
+    uint32_t id;
+    cat_cd cd;
+
+    if (!load_disc_ids(ts, &map)) {
+        return(0);
+    }
+    titles = io_open_read(ts->title_file);
+    if (!titles) {
+        map_free(&map);
+        return(1);
+    }
+    while (io_gets(entry, MAX_ENTRY, titles)) {
+        if (!text_parse_title(entry, &cd)) {
+            continue;
+        }
+        if (map_get(&map, cd.catalog, strlen(cd.catalog), &id)) {
+            snprintf(cd.disc_id, sizeof(cd.disc_id), "%08x", id);
+        }
+        if (!fn(&cd, arg)) {
+            break;
+        }
+    }
+    io_close_read(titles);
+    map_free(&map);
+    return(1);
+}
+
+/* Every change renames a copy over one of the files */
+static int text_stamp(catalog_backend *be, char *dest, int dest_len)
+{
+    text_state *ts = be->state;
+
+    catalog_stamp_file(dest, dest_len, ts->title_file);
+    catalog_stamp_file(dest, dest_len, ts->tracks_file);
+    catalog_stamp_file(dest, dest_len, ts->disc_id_file);
+    return(1);
+}
+
+/* Each part is the lines starting in its share of the bytes of the file.
+   A part other than the first opens a byte early and skips to the end of
+   that line, so a line starting exactly on its boundary is its own. */
+static int text_scan_tracks(catalog_backend *be, int part, int num_parts,
+                            cat_track_fn fn, void *arg)
+{
+    text_state *ts = be->state;
+    char entry[MAX_ENTRY];
+    cat_reader *tracks;
+    cat_track track;
+    struct stat st;
+    off_t start, end;
+
+    if (stat(ts->tracks_file, &st) == -1) {
+        return(1);
+    }
+    start = st.st_size / num_parts * part;
+    end = part == num_parts - 1 ? st.st_size : st.st_size / num_parts * (part + 1);
+    if (part > 0) {
+        start--;
+    }
+    tracks = io_open_at(ts->tracks_file, start);
+    if (!tracks) {
+        return(0);
+    }
+    if (part > 0) {
+        while (io_gets(entry, MAX_ENTRY, tracks) && !strchr(entry, '\n')) {
+        }
+    }
+    while (start + io_read_offset(tracks) < end &&
+           io_gets(entry, MAX_ENTRY, tracks)) {
+        /* a line with a bad track number is still a record to check */
+        if ((text_parse_track(entry, &track) || track.catalog[0]) &&
+            !fn(&track, arg)) {
+            break;
+        }
+    }
+    return(io_close_read(tracks));
+}
+
+static int text_del_tracks(catalog_backend *be, const char *catalog)
+{
+    text_state *ts = be->state;
+    cat_writer *temp;
+
+    temp = copy_without(ts, ts->tracks_file, catalog);
+    if (!temp) {
+        return(0);
+    }
+    return(finish_copy(ts, ts->tracks_file, temp));
+}
+
+/* One pass over title.cdb finds whether any of the CDs are there already.
+   If none are, as when importing, their lines are just appended to both
+   files; otherwise both files are first copied without them. Tracks left
+   behind by a CD no longer in title.cdb are only dropped by a copy, so an
+   appended CD can end up with some of them (see cat_fsck.h). */
+static int text_put_batch(catalog_backend *be, const cat_entry *entries, int count)
+{
+    text_state *ts = be->state;
+    char entry[MAX_ENTRY];
+    batch_set set;
+    cat_reader *titles;
+    int i, t, put = 0, found = 0, ok = 1;
+
+    set.entries = entries;
+    set.count = count;
+    set.size = 16;
+    while (set.size < count * 2) {
+        set.size *= 2;
+    }
+    set.slots = malloc(set.size * sizeof(*set.slots));
+    if (!set.slots) {
+        return(0);
+    }
+    for (i = 0; i < set.size; i++) {
+        set.slots[i] = -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (!storable(&entries[i].cd)) {
+            continue;
+        }
+        for (t = 0; t < entries[i].num_tracks; t++) {
+            if (strchr(entries[i].tracks[t].title, '\n')) {
+                break;
+            }
+        }
+        if (t == entries[i].num_tracks) {
+            put += batch_add(&set, i);
+        }
+    }
+
+    titles = io_open_read(ts->title_file);
+    if (titles) {
+        while (!found && io_gets(entry, MAX_ENTRY, titles)) {
+            found = batch_find(&set, entry, strcspn(entry, ",\n")) >= 0;
+        }
+        ok = io_close_read(titles);
+    }
+    if (ok && found) {
+        ok = remove_batch(ts, ts->title_file, &set) &&
+             remove_batch(ts, ts->tracks_file, &set) &&
+             remove_batch(ts, ts->disc_id_file, &set);
+    }
+    ok = ok && append_batch(ts, &set);
+    free(set.slots);
+    return(ok ? put : 0);
+}
+
+/* Hash the disc ID to its first slot and read slots until an empty one.
+   The index is built first if it is missing or out of date. */
+static int text_find_disc_id(catalog_backend *be, const char *disc_id,
+                             cat_scan_fn fn, void *arg)
+{
+    text_state *ts = be->state;
+    char stamp[CATALOG_STAMP_LEN + 1];
+    char entry[MAX_ENTRY];
+    index_header header;
+    index_slot slot;
+    uint32_t id, pos;
+    ssize_t got;
+    cat_cd cd;
+    int index_fd, titles_fd, ok = 1;
+
+    if (!index_stamp(ts, stamp)) {
+        return(1);
+    }
+    index_fd = open(ts->index_file, O_RDONLY);
+    if (index_fd == -1 ||
+        pread(index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        strcmp(header.stamp, stamp) != 0) {
+        if (index_fd != -1) {
+            close(index_fd);
+        }
+        if (!build_index(ts, stamp)) {
+            return(0);
+        }
+        index_fd = open(ts->index_file, O_RDONLY);
+        if (index_fd == -1 ||
+            pread(index_fd, &header, sizeof(header), 0) != sizeof(header)) {
+            if (index_fd != -1) {
+                close(index_fd);
+            }
+            return(0);
+        }
+    }
+    titles_fd = open(ts->title_file, O_RDONLY);
+    if (titles_fd == -1) {
+        close(index_fd);
+        return(0);
+    }
+
+    id = (uint32_t)strtoul(disc_id, NULL, 16);
+    pos = slot_hash(id) & (header.num_slots - 1);
+    while (1) {
+        if (pread(index_fd, &slot, sizeof(slot),
+                  sizeof(header) + (off_t)pos * sizeof(slot)) != sizeof(slot)) {
+            ok = 0;
+            break;
+        }
+        if (!slot.used) {
+            break;
+        }
+        if (slot.disc_id == id) {
+            got = pread(titles_fd, entry, MAX_ENTRY - 1, (off_t)slot.offset);
+            if (got <= 0) {
+                ok = 0;
+                break;
+            }
+            entry[got] = '\0';
+            if (text_parse_title(entry, &cd)) {
+                strcpy(cd.disc_id, disc_id);
+                if (!fn(&cd, arg)) {
+                    break;
+                }
+            }
+        }
+        pos = (pos + 1) & (header.num_slots - 1);
+    }
+    close(titles_fd);
+    close(index_fd);
+    return(ok);
+}
+
+/* The file format has no quoting, so only the last field may hold a comma */
+static int storable(const cat_cd *cd)
+{
+    return(!strpbrk(cd->catalog, ",\n") && !strpbrk(cd->title, ",\n") &&
+           !strpbrk(cd->type, ",\n") && !strchr(cd->artist, '\n'));
+}
+
+/* Is the first field of this line exactly the catalog number? */
+static int line_is_for(const char *line, const char *catalog)
+{
+    size_t cat_length = strlen(catalog);
+
+    return(strncmp(line, catalog, cat_length) == 0 && line[cat_length] == ',');
+}
+
+/* Split "catalog,title,type,artist" in place. The artist is the rest of the
+   line, commas and all. */
+int text_parse_title(char *line, cat_cd *cd)
+{
+    char *fields[4];
+    char *comma;
+    int i;
+
+    memset(cd, '\0', sizeof(*cd));
+    line[strcspn(line, "\n")] = '\0';
+    fields[0] = line;
+    for (i = 1; i < 4; i++) {
+        comma = strchr(fields[i - 1], ',');
+        if (!comma) {
+            return(0);
+        }
+        *comma = '\0';
+        fields[i] = comma + 1;
+    }
+    catalog_set_field(cd->catalog, fields[0], CATALOG_CAT_LEN);
+    catalog_set_field(cd->title, fields[1], CATALOG_TITLE_LEN);
+    catalog_set_field(cd->type, fields[2], CATALOG_TYPE_LEN);
+    catalog_set_field(cd->artist, fields[3], CATALOG_ARTIST_LEN);
+    return(cd->catalog[0] != '\0');
+}
+
+/* Split "catalog,track_no,track" in place, without the padding of its
+   slot */
+int text_parse_track(char *line, cat_track *track)
+{
+    char *number, *title;
+    size_t len;
+
+    memset(track, '\0', sizeof(*track));
+    len = strcspn(line, "\n");
+    while (len > 0 && line[len - 1] == ' ') {
+        len--;
+    }
+    line[len] = '\0';
+    number = strchr(line, ',');
+    if (!number) {
+        return(0);
+    }
+    *number++ = '\0';
+    title = strchr(number, ',');
+    if (!title) {
+        return(0);
+    }
+    *title++ = '\0';
+    catalog_set_field(track->catalog, line, CATALOG_CAT_LEN);
+    track->track_no = atoi(number);
+    catalog_set_field(track->title, title, CATALOG_TRACK_LEN);
+    return(track->track_no > 0);
+}
+
+int text_track_line(char *dest, int dest_len, const char *catalog,
+                    int track_no, const char *title)
+{
+    int len, padded;
+
+    len = snprintf(dest, dest_len, "%s,%d,%s", catalog, track_no, title);
+    if (len >= dest_len - 1) {
+        len = dest_len - 2;
+    }
+    /* rounded up with the newline */
+    padded = (len + TEXT_SLOT) / TEXT_SLOT * TEXT_SLOT - 1;
+    if (padded < dest_len - 1) {
+        memset(dest + len, ' ', padded - len);
+        len = padded;
+    }
+    dest[len++] = '\n';
+    dest[len] = '\0';
+    return(len);
+}
+
+int text_free_slot(const char *line)
+{
+    size_t blanks = strspn(line, " ");
+
+    return(blanks > 0 && (line[blanks] == '\n' || line[blanks] == '\0'));
+}
+
+/* One pass finds the track's slot, and the first free slot the new line
+   fits within a page. The line is written over its own slot, or the free
+   one, or on the end, padded to the length of what it replaces, so that
+   each change is one write. On the end, a line that would cross into the
+   next page goes at its start, after a free slot to the end of this one.
+   Only a track that has outgrown its slot, or a file whose last line has
+   no newline, is changed by copying the file. */
+int text_set_track(const char *path, const char *catalog, int track_no,
+                   const char *title)
+{
+    char entry[MAX_ENTRY];
+    char line[MAX_ENTRY + TEXT_PAGE];
+    cat_reader *tracks;
+    cat_track track;
+    off_t offset = 0;
+    off_t found = -1;
+    off_t free_slot = -1;
+    size_t entry_len;
+    int found_len = 0, free_len = 0;
+    int len = 0, needed = 0;
+    int terminated = 1;
+    int filler = 0;
+    int fd, ok;
+
+    if (title) {
+        if (strchr(title, '\n')) {
+            return(0);
+        }
+        needed = snprintf(line, MAX_ENTRY, "%s,%d,%s", catalog, track_no, title) + 1;
+        if (needed >= MAX_ENTRY) {
+            fprintf(stderr, "Track %d of %s is too long\n", track_no, catalog);
+            return(0);
+        }
+        len = text_track_line(line, MAX_ENTRY, catalog, track_no, title);
+    }
+
+    tracks = io_open_read(path);
+    if (tracks) {
+        while (io_gets(entry, MAX_ENTRY, tracks)) {
+            entry_len = strlen(entry);
+            terminated = entry_len > 0 && entry[entry_len - 1] == '\n';
+            if (text_free_slot(entry)) {
+                if (free_slot < 0 && terminated && title && (int)entry_len >= needed &&
+                    offset % TEXT_PAGE + entry_len <= TEXT_PAGE) {
+                    free_slot = offset;
+                    free_len = entry_len;
+                }
+            } else if (found < 0 && terminated && line_is_for(entry, catalog) &&
+                       text_parse_track(entry, &track) && track.track_no == track_no) {
+                found = offset;
+                found_len = entry_len;
+            }
+            offset = io_read_offset(tracks);
+        }
+        if (!io_close_read(tracks)) {
+            return(0);
+        }
+    } else if (errno != ENOENT) {
+        return(0);
+    }
+
+    if (!title) {
+        if (found < 0) {
+            return(1);
+        }
+        /* the slot becomes free */
+        memset(line, ' ', found_len - 1);
+        line[found_len - 1] = '\n';
+        len = found_len;
+    } else if (found >= 0 && needed <= found_len) {
+        len = found_len;
+    } else if (found < 0 && free_slot >= 0) {
+        found = free_slot;
+        len = free_len;
+    } else if (found < 0 && terminated) {
+        found = offset;
+        if (offset % TEXT_PAGE + len > TEXT_PAGE && TEXT_PAGE - offset % TEXT_PAGE >= 2) {
+            filler = TEXT_PAGE - offset % TEXT_PAGE;
+        }
+    } else {
+        return(copy_with_track(path, catalog, track_no, line, len));
+    }
+    /* pad the line out to the slot it goes in */
+    if (title) {
+        memset(line + needed - 1, ' ', len - needed);
+        line[len - 1] = '\n';
+    }
+    if (filler) {
+        memmove(line + filler, line, len);
+        memset(line, ' ', filler - 1);
+        line[filler - 1] = '\n';
+        len += filler;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1) {
+        return(0);
+    }
+    ok = pwrite(fd, line, len, found) == len;
+    ok &= close(fd) == 0;
+    return(ok);
+}
+
+/* Copy a file to the temporary file, leaving out the lines of one CD.
+   Returns the temporary file, still open so more lines can be appended. */
+static cat_writer *copy_without(const text_state *ts, const char *path,
+                                const char *catalog)
+{
+    char entry[MAX_ENTRY];
+    cat_reader *from;
+    cat_writer *temp;
+
+    temp = io_open_write(ts->temp_file);
+    if (!temp) {
+        return(NULL);
+    }
+    from = io_open_read(path);
+    if (!from) {
+        return(temp);
+    }
+    while (io_gets(entry, MAX_ENTRY, from)) {
+        if (!line_is_for(entry, catalog) && !text_free_slot(entry)) {
+            io_puts(entry, temp);
+        }
+    }
+    if (!io_close_read(from)) {
+        io_close_write(temp);
+        unlink(ts->temp_file);
+        return(NULL);
+    }
+    return(temp);
+}
+
+/* Replace the file with the temporary one */
+static int finish_copy(const text_state *ts, const char *path,
+                       cat_writer *temp)
+{
+    if (!io_close_write(temp)) {
+        unlink(ts->temp_file);
+        return(0);
+    }
+    return(rename(ts->temp_file, path) == 0);
+}
+
+/* A later entry for the same catalog number replaces the earlier one.
+   1 if the catalog number is new to the batch. */
+static int batch_add(batch_set *set, int index)
+{
+    const char *catalog = set->entries[index].cd.catalog;
+    size_t len = strlen(catalog);
+    unsigned int pos = batch_hash(catalog, len) & (set->size - 1);
+    int added = 1;
+
+    while (set->slots[pos] >= 0) {
+        if (strcmp(set->entries[set->slots[pos]].cd.catalog, catalog) == 0) {
+            added = 0;
+            break;
+        }
+        pos = (pos + 1) & (set->size - 1);
+    }
+    set->slots[pos] = index;
+    return(added);
+}
+
+/* The entry for the len bytes of catalog, or -1 */
+static int batch_find(const batch_set *set, const char *catalog, size_t len)
+{
+    unsigned int pos = batch_hash(catalog, len) & (set->size - 1);
+    const char *found;
+
+    while (set->slots[pos] >= 0) {
+        found = set->entries[set->slots[pos]].cd.catalog;
+        if (strncmp(found, catalog, len) == 0 && found[len] == '\0') {
+            return(set->slots[pos]);
+        }
+        pos = (pos + 1) & (set->size - 1);
+    }
+    return(-1);
+}
+
+/* FNV-1a */
+static unsigned int batch_hash(const char *catalog, size_t len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*catalog++;
+        hash *= 16777619u;
+    }
+    return(hash);
+}
+
+/* Copy a file leaving out every line of the batch's CDs */
+static int remove_batch(const text_state *ts, const char *path,
+                        const batch_set *set)
+{
+    char entry[MAX_ENTRY];
+    cat_reader *from;
+    cat_writer *temp;
+
+    from = io_open_read(path);
+    if (!from) {
+        return(1);
+    }
+    temp = io_open_write(ts->temp_file);
+    if (!temp) {
+        io_close_read(from);
+        return(0);
+    }
+    while (io_gets(entry, MAX_ENTRY, from)) {
+        if (batch_find(set, entry, strcspn(entry, ",\n")) < 0 &&
+            !text_free_slot(entry)) {
+            io_puts(entry, temp);
+        }
+    }
+    if (!io_close_read(from)) {
+        io_close_write(temp);
+        unlink(ts->temp_file);
+        return(0);
+    }
+    return(finish_copy(ts, path, temp));
+}
+
+/* The lines of the batch, in the order of its entries, on the end of the
+   files */
+static int append_batch(const text_state *ts, const batch_set *set)
+{
+    const cat_entry *entries = set->entries;
+    char line[MAX_ENTRY];
+    FILE *titles, *tracks, *disc_ids;
+    int i, t, ok;
+
+    titles = fopen(ts->title_file, "a");
+    tracks = fopen(ts->tracks_file, "a");
+    disc_ids = fopen(ts->disc_id_file, "a");
+    if (!titles || !tracks || !disc_ids) {
+        if (titles) {
+            fclose(titles);
+        }
+        if (tracks) {
+            fclose(tracks);
+        }
+        if (disc_ids) {
+            fclose(disc_ids);
+        }
+        return(0);
+    }
+    setvbuf(titles, NULL, _IOFBF, 1 << 16);
+    setvbuf(tracks, NULL, _IOFBF, 1 << 16);
+    setvbuf(disc_ids, NULL, _IOFBF, 1 << 16);
+    for (i = 0; i < set->count; i++) {
+        /* a refused or replaced entry isn't in the set under its own index */
+        if (batch_find(set, entries[i].cd.catalog, strlen(entries[i].cd.catalog)) != i) {
+            continue;
+        }
+        fprintf(titles, "%s,%s,%s,%s\n", entries[i].cd.catalog, entries[i].cd.title,
+                entries[i].cd.type, entries[i].cd.artist);
+        if (entries[i].cd.disc_id[0]) {
+            fprintf(disc_ids, "%s,%s\n", entries[i].cd.catalog, entries[i].cd.disc_id);
+        }
+        for (t = 0; t < entries[i].num_tracks; t++) {
+            text_track_line(line, sizeof(line), entries[i].cd.catalog,
+                            entries[i].tracks[t].track_no, entries[i].tracks[t].title);
+            fputs(line, tracks);
+        }
+    }
+    ok = !ferror(titles) && !ferror(tracks) && !ferror(disc_ids);
+    ok = (fclose(titles) == 0) && ok;
+    ok = (fclose(tracks) == 0) && ok;
+    ok = (fclose(disc_ids) == 0) && ok;
+    return(ok);
+}
+
+static int compare_track_no(const void *a, const void *b)
+{
+    return(((const cat_track *)a)->track_no - ((const cat_track *)b)->track_no);
+}
+
+/* Copy tracks.cdb with the track's line replaced by line, or added at
+   the end if it wasn't there, leaving out the free slots */
+static int copy_with_track(const char *path, const char *catalog, int track_no,
+                           const char *line, int len)
+{
+    char temp_path[MAX_PATH + 8];
+    char entry[MAX_ENTRY];
+    char parsed[MAX_ENTRY];
+    cat_reader *from;
+    cat_writer *temp;
+    cat_track track;
+    size_t entry_len;
+    int terminated = 1;
+    int found = 0;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    from = io_open_read(path);
+    if (!from) {
+        return(0);
+    }
+    temp = io_open_write(temp_path);
+    if (!temp) {
+        io_close_read(from);
+        return(0);
+    }
+    while (io_gets(entry, MAX_ENTRY, from)) {
+        if (text_free_slot(entry)) {
+            continue;
+        }
+        strcpy(parsed, entry);
+        if (!found && line_is_for(entry, catalog) &&
+            text_parse_track(parsed, &track) && track.track_no == track_no) {
+            found = 1;
+            io_write(temp, line, len);
+            continue;
+        }
+        io_puts(entry, temp);
+        entry_len = strlen(entry);
+        terminated = entry_len > 0 && entry[entry_len - 1] == '\n';
+    }
+    if (!found) {
+        /* a last line without a newline gets one, for the line after it */
+        if (!terminated) {
+            io_puts("\n", temp);
+        }
+        io_write(temp, line, len);
+    }
+    if (!io_close_read(from)) {
+        io_close_write(temp);
+        unlink(temp_path);
+        return(0);
+    }
+    if (!io_close_write(temp)) {
+        unlink(temp_path);
+        return(0);
+    }
+    return(rename(temp_path, path) == 0);
+}
+
+/* The last line of discid.cdb for the CD, or "" */
+static void read_disc_id(const text_state *ts, const char *catalog, char *dest)
+{
+    char entry[MAX_ENTRY];
+    cat_reader *disc_ids;
+    uint32_t id;
+    size_t len;
+
+    dest[0] = '\0';
+    disc_ids = io_open_read(ts->disc_id_file);
+    if (!disc_ids) {
+        return;
+    }
+    while (io_gets(entry, MAX_ENTRY, disc_ids)) {
+        if (line_is_for(entry, catalog) && parse_disc_id(entry, &len, &id)) {
+            snprintf(dest, CATALOG_DISCID_LEN + 1, "%08x", id);
+        }
+    }
+    io_close_read(disc_ids);
+}
+
+/* A new CD with a disc ID only needs a line appended. Otherwise the file
+   is copied without the CD's line, which may have been left behind by
+   mini_cd_manager for a new one. */
+static int put_disc_id(const text_state *ts, const cat_cd *cd, int is_new)
+{
+    cat_writer *temp;
+    FILE *fp;
+
+    if (is_new && cd->disc_id[0]) {
+        fp = fopen(ts->disc_id_file, "a");
+        if (!fp) {
+            return(0);
+        }
+        fprintf(fp, "%s,%s\n", cd->catalog, cd->disc_id);
+        return(fclose(fp) == 0);
+    }
+    if (!cd->disc_id[0] && access(ts->disc_id_file, F_OK) == -1) {
+        return(1);
+    }
+    temp = copy_without(ts, ts->disc_id_file, cd->catalog);
+    if (!temp) {
+        return(0);
+    }
+    if (cd->disc_id[0]) {
+        io_printf(temp, "%s,%s\n", cd->catalog, cd->disc_id);
+    }
+    return(finish_copy(ts, ts->disc_id_file, temp));
+}
+
+/* Split "catalog,discid" into the length of the catalog number and the ID */
+static int parse_disc_id(const char *line, size_t *cat_len, uint32_t *id)
+{
+    char disc_id[CATALOG_DISCID_LEN + 1];
+    const char *comma;
+
+    comma = strchr(line, ',');
+    if (!comma || strcspn(comma + 1, "\n") != CATALOG_DISCID_LEN) {
+        return(0);
+    }
+    memcpy(disc_id, comma + 1, CATALOG_DISCID_LEN);
+    disc_id[CATALOG_DISCID_LEN] = '\0';
+    if (!catalog_disc_id_ok(disc_id)) {
+        return(0);
+    }
+    *cat_len = comma - line;
+    *id = (uint32_t)strtoul(disc_id, NULL, 16);
+    return(*cat_len > 0);
+}
+
+/* A later line for a CD replaces an earlier one. A missing file is an
+   empty map. */
+static int load_disc_ids(const text_state *ts, disc_id_map *map)
+{
+    char entry[MAX_ENTRY];
+    cat_reader *disc_ids;
+    uint32_t id;
+    size_t len;
+    int ok = 1;
+
+    memset(map, '\0', sizeof(*map));
+    disc_ids = io_open_read(ts->disc_id_file);
+    if (!disc_ids) {
+        return(1);
+    }
+    while (ok && io_gets(entry, MAX_ENTRY, disc_ids)) {
+        if (parse_disc_id(entry, &len, &id)) {
+            ok = map_put(map, entry, len, id);
+        }
+    }
+    ok = io_close_read(disc_ids) && ok;
+    if (!ok) {
+        map_free(map);
+    }
+    return(ok);
+}
+
+/* Doubles the table when it is half full */
+static int map_put(disc_id_map *map, const char *catalog, size_t len, uint32_t id)
+{
+    size_t *old_slots = map->slots;
+    uint32_t *old_ids = map->ids;
+    int old_size = map->size;
+    const char *name;
+    unsigned int pos;
+    char *names;
+    int i;
+
+    if (map->count * 2 >= map->size) {
+        map->size = old_size ? old_size * 2 : 1024;
+        map->slots = calloc(map->size, sizeof(*map->slots));
+        map->ids = malloc(map->size * sizeof(*map->ids));
+        if (!map->slots || !map->ids) {
+            free(map->slots);
+            free(map->ids);
+            map->slots = old_slots;
+            map->ids = old_ids;
+            map->size = old_size;
+            return(0);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old_slots[i]) {
+                name = map->names + old_slots[i] - 1;
+                pos = batch_hash(name, strlen(name)) & (map->size - 1);
+                while (map->slots[pos]) {
+                    pos = (pos + 1) & (map->size - 1);
+                }
+                map->slots[pos] = old_slots[i];
+                map->ids[pos] = old_ids[i];
+            }
+        }
+        free(old_slots);
+        free(old_ids);
+    }
+
+    pos = batch_hash(catalog, len) & (map->size - 1);
+    while (map->slots[pos]) {
+        name = map->names + map->slots[pos] - 1;
+        if (strncmp(name, catalog, len) == 0 && name[len] == '\0') {
+            map->ids[pos] = id;
+            return(1);
+        }
+        pos = (pos + 1) & (map->size - 1);
+    }
+    if (map->names_len + len + 1 > map->names_size) {
+        map->names_size = map->names_size ? map->names_size * 2 : 1 << 16;
+        while (map->names_len + len + 1 > map->names_size) {
+            map->names_size *= 2;
+        }
+        names = realloc(map->names, map->names_size);
+        if (!names) {
+            return(0);
+        }
+        map->names = names;
+    }
+    memcpy(map->names + map->names_len, catalog, len);
+    map->names[map->names_len + len] = '\0';
+    map->slots[pos] = map->names_len + 1;
+    map->ids[pos] = id;
+    map->names_len += len + 1;
+    map->count++;
+    return(1);
+}
+
+static int map_get(const disc_id_map *map, const char *catalog, size_t len,
+                   uint32_t *id)
+{
+    const char *name;
+    unsigned int pos;
+
+    if (!map->count) {
+        return(0);
+    }
+    pos = batch_hash(catalog, len) & (map->size - 1);
+    while (map->slots[pos]) {
+        name = map->names + map->slots[pos] - 1;
+        if (strncmp(name, catalog, len) == 0 && name[len] == '\0') {
+            *id = map->ids[pos];
+            return(1);
+        }
+        pos = (pos + 1) & (map->size - 1);
+    }
+    return(0);
+}
+
+static void map_free(disc_id_map *map)
+{
+    free(map->names);
+    free(map->slots);
+    free(map->ids);
+    memset(map, '\0', sizeof(*map));
+}
+
+/* The stamps of the files the index is built from. 0 if there are no
+   disc IDs to look up. */
+static int index_stamp(const text_state *ts, char *dest)
+{
+    if (access(ts->title_file, F_OK) == -1 || access(ts->disc_id_file, F_OK) == -1) {
+        return(0);
+    }
+    dest[0] = '\0';
+    catalog_stamp_file(dest, CATALOG_STAMP_LEN, ts->title_file);
+    catalog_stamp_file(dest, CATALOG_STAMP_LEN, ts->disc_id_file);
+    return(1);
+}
+
+/* One pass over title.cdb, noting where the line of each CD with a disc
+   ID starts. The table is kept at most half full. */
+static int build_index(const text_state *ts, const char *stamp)
+{
+    char entry[MAX_ENTRY];
+    index_header header;
+    index_slot *slots;
+    disc_id_map map;
+    cat_reader *titles;
+    cat_writer *temp;
+    off_t offset;
+    uint32_t id, pos;
+    int ok;
+
+    if (!load_disc_ids(ts, &map)) {
+        return(0);
+    }
+    memset(&header, '\0', sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    strcpy(header.stamp, stamp);
+    header.num_slots = 16;
+    while (header.num_slots < (uint32_t)map.count * 2) {
+        header.num_slots *= 2;
+    }
+    slots = calloc(header.num_slots, sizeof(*slots));
+    titles = io_open_read(ts->title_file);
+    if (!slots || !titles) {
+        free(slots);
+        if (titles) {
+            io_close_read(titles);
+        }
+        map_free(&map);
+        return(0);
+    }
+    offset = 0;
+    while (io_gets(entry, MAX_ENTRY, titles)) {
+        if (map_get(&map, entry, strcspn(entry, ",\n"), &id) &&
+            header.num_ids < (uint32_t)map.count) {
+            pos = slot_hash(id) & (header.num_slots - 1);
+            while (slots[pos].used) {
+                pos = (pos + 1) & (header.num_slots - 1);
+            }
+            slots[pos].offset = offset;
+            slots[pos].disc_id = id;
+            slots[pos].used = 1;
+            header.num_ids++;
+        }
+        offset = io_read_offset(titles);
+    }
+    ok = io_close_read(titles);
+    map_free(&map);
+
+    temp = ok ? io_open_write(ts->temp_file) : NULL;
+    if (temp) {
+        io_write(temp, &header, sizeof(header));
+        io_write(temp, slots, header.num_slots * sizeof(*slots));
+        ok = finish_copy(ts, ts->index_file, temp);
+    } else {
+        ok = 0;
+    }
+    free(slots);
+    if (!ok) {
+        fprintf(stderr, "Unable to write %s\n", ts->index_file);
+    }
+    return(ok);
+}
+
+/* The finalizer of MurmurHash3, since CDDB disc IDs share their low bits */
+static uint32_t slot_hash(uint32_t disc_id)
+{
+    disc_id ^= disc_id >> 16;
+    disc_id *= 0x85ebca6bu;
+    disc_id ^= disc_id >> 13;
+    disc_id *= 0xc2b2ae35u;
+    disc_id ^= disc_id >> 16;
+    return(disc_id);
+}
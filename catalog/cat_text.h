@@ -0,0 +1,51 @@
+/*
+   The files of mini_cd_manager, as the text backend reads them, for the
+   other code that keeps the same files (cdserve).
+ */
+
+#ifndef CAT_TEXT_H
+#define CAT_TEXT_H
+
+#include "catalog.h"
+
+#define TEXT_TITLE_FILE  "title.cdb"
+#define TEXT_TRACKS_FILE "tracks.cdb"
+#define TEXT_DISCID_FILE "discid.cdb"
+#define TEXT_DISCID_INDEX "discid.idx"
+
+/* Each line of tracks.cdb is padded with spaces to a multiple of TEXT_SLOT
+   bytes, newline and all, leaving a title some room to grow. Any line is
+   a slot that one track can be rewritten in, where it is, if its new line
+   is no longer; unpadded lines, of older files or of mini_cd_manager.sh,
+   are slots as good as any. A line of spaces is the slot of a removed
+   track, free for the next one added that fits; copies of the file leave
+   them out. A CD's tracks need not be in order in the file, so readers
+   sort them by number.
+
+   A slot may straddle two TEXT_PAGE pages, so rewriting a track is one
+   write but not always of one page. The lines text_set_track adds are
+   kept within a page, by a free slot filling out the page before them if
+   need be, and the free slots it reuses are those within one; the lines
+   written by a copy of the file, by cdserve or by mini_cd_manager's add
+   are not, and a line longer than TEXT_SLOT may cross. */
+#define TEXT_SLOT        32
+#define TEXT_PAGE        4096
+
+/* Split a line of title.cdb or tracks.cdb in place into a record. 0 if the
+   line isn't one. */
+int text_parse_title(char *line, cat_cd *cd);
+int text_parse_track(char *line, cat_track *track);
+
+/* Write a line of tracks.cdb into dest, padded to a multiple of TEXT_SLOT
+   if it fits, and return its length */
+int text_track_line(char *dest, int dest_len, const char *catalog,
+                    int track_no, const char *title);
+int text_free_slot(const char *line);
+
+/* Change or add track track_no of a CD in the tracks.cdb at path, or
+   with title NULL remove it, in place. A track that outgrows its slot is
+   changed by copying the file. */
+int text_set_track(const char *path, const char *catalog, int track_no,
+                   const char *title);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+   Recording and reading workload traces. See cat_trace.h.
+
+   This file uses nothing else of the library, so a client of one of the
+   stores, such as cd_mysql/app_test, can record by compiling it in.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cat_trace.h"
+
+#define MAX_VARINT 10
+
+struct cat_trace {
+    FILE *fp;
+    struct timespec started;
+    unsigned long long last_us;
+    int error;
+};
+
+struct trace_reader {
+    FILE *fp;
+    const char *path;
+    unsigned long long at_us;
+};
+
+static const char *const op_names[TRACE_NUM_OPS] = {
+    NULL, "get", "tracks", "find", "list", "count", "put", "put-tracks", "del"
+};
+
+static void begin_record(cat_trace *trace, trace_op op);
+static void end_record(cat_trace *trace);
+static void put_varint(cat_trace *trace, unsigned long long value);
+static void put_string(cat_trace *trace, const char *str, int max_len);
+static int get_varint(trace_reader *reader, unsigned long long *value);
+static int get_string(trace_reader *reader, char *dest, int dest_len);
+
+cat_trace *trace_start(const char *path)
+{
+    cat_trace *trace;
+
+    trace = calloc(1, sizeof(*trace));
+    if (!trace) {
+        return(NULL);
+    }
+    trace->fp = fopen(path, "wb");
+    if (!trace->fp || fwrite(TRACE_MAGIC, 1, 8, trace->fp) != 8) {
+        fprintf(stderr, "Unable to record a trace to %s\n", path);
+        if (trace->fp) {
+            fclose(trace->fp);
+        }
+        free(trace);
+        return(NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace->started);
+    return(trace);
+}
+
+int trace_stop(cat_trace *trace)
+{
+    int ok;
+
+    if (!trace) {
+        return(1);
+    }
+    ok = !trace->error;
+    if (fclose(trace->fp) != 0) {
+        ok = 0;
+    }
+    free(trace);
+    return(ok);
+}
+
+void trace_key(cat_trace *trace, trace_op op, const char *catalog)
+{
+    if (!trace) {
+        return;
+    }
+    begin_record(trace, op);
+    if (op != TRACE_LIST && op != TRACE_COUNT) {
+        put_string(trace, catalog, CATALOG_CAT_LEN);
+    }
+    end_record(trace);
+}
+
+void trace_find(cat_trace *trace, int field, const char *text)
+{
+    if (!trace) {
+        return;
+    }
+    begin_record(trace, TRACE_FIND);
+    put_varint(trace, field);
+    put_string(trace, text, TRACE_TEXT_LEN);
+    end_record(trace);
+}
+
+void trace_put(cat_trace *trace, const char *catalog, const char *title,
+               const char *type, const char *artist)
+{
+    if (!trace) {
+        return;
+    }
+    begin_record(trace, TRACE_PUT);
+    put_string(trace, catalog, CATALOG_CAT_LEN);
+    put_string(trace, title, CATALOG_TITLE_LEN);
+    put_string(trace, type, CATALOG_TYPE_LEN);
+    put_string(trace, artist, CATALOG_ARTIST_LEN);
+    end_record(trace);
+}
+
+void trace_put_tracks(cat_trace *trace, const char *catalog,
+                      const char *titles, int title_size, int count)
+{
+    int i;
+
+    if (!trace) {
+        return;
+    }
+    if (count > CATALOG_MAX_TRACKS) {
+        count = CATALOG_MAX_TRACKS;
+    }
+    begin_record(trace, TRACE_PUT_TRACKS);
+    put_string(trace, catalog, CATALOG_CAT_LEN);
+    put_varint(trace, count);
+    for (i = 0; i < count; i++) {
+        put_string(trace, titles + i * title_size, CATALOG_TRACK_LEN);
+    }
+    end_record(trace);
+}
+
+/* The time is kept as the gap since the last record, which is usually a
+   byte or two */
+static void begin_record(cat_trace *trace, trace_op op)
+{
+    struct timespec now;
+    unsigned long long at_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    at_us = (now.tv_sec - trace->started.tv_sec) * 1000000ULL +
+            (now.tv_nsec - trace->started.tv_nsec) / 1000;
+    if (at_us < trace->last_us) {
+        at_us = trace->last_us;
+    }
+    put_varint(trace, at_us - trace->last_us);
+    put_varint(trace, op);
+    trace->last_us = at_us;
+}
+
+static void end_record(cat_trace *trace)
+{
+    if (fflush(trace->fp) != 0 || ferror(trace->fp)) {
+        trace->error = 1;
+    }
+}
+
+static void put_varint(cat_trace *trace, unsigned long long value)
+{
+    unsigned char bytes[MAX_VARINT];
+    int len = 0;
+
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value);
+    fwrite(bytes, 1, len, trace->fp);
+}
+
+static void put_string(cat_trace *trace, const char *str, int max_len)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    if (len > (size_t)max_len) {
+        len = max_len;
+    }
+    put_varint(trace, len);
+    fwrite(str, 1, len, trace->fp);
+}
+
+trace_reader *trace_open(const char *path)
+{
+    trace_reader *reader;
+    char magic[8];
+
+    reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        return(NULL);
+    }
+    reader->path = path;
+    reader->fp = fopen(path, "rb");
+    if (!reader->fp) {
+        fprintf(stderr, "Unable to open trace %s\n", path);
+        free(reader);
+        return(NULL);
+    }
+    if (fread(magic, 1, 8, reader->fp) != 8 ||
+        memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a catalog trace\n", path);
+        trace_close(reader);
+        return(NULL);
+    }
+    return(reader);
+}
+
+void trace_close(trace_reader *reader)
+{
+    if (reader) {
+        fclose(reader->fp);
+        free(reader);
+    }
+}
+
+int trace_read(trace_reader *reader, trace_rec *rec)
+{
+    unsigned long long gap, value;
+    int c, i, ok;
+
+    /* A clean end comes between records */
+    c = getc(reader->fp);
+    if (c == EOF) {
+        return(0);
+    }
+    ungetc(c, reader->fp);
+
+    memset(rec, '\0', sizeof(*rec));
+    ok = get_varint(reader, &gap) && get_varint(reader, &value) &&
+         value > 0 && value < TRACE_NUM_OPS;
+    if (ok) {
+        reader->at_us += gap;
+        rec->at_us = reader->at_us;
+        rec->op = value;
+    }
+
+    if (ok) {
+        switch (rec->op) {
+        case TRACE_GET:
+        case TRACE_TRACKS:
+        case TRACE_DEL:
+            ok = get_string(reader, rec->text, CATALOG_CAT_LEN);
+            break;
+        case TRACE_FIND:
+            ok = get_varint(reader, &value) &&
+                 (value & ~TRACE_IGNORE_CASE) <= TRACE_ANY_FIELD &&
+                 get_string(reader, rec->text, TRACE_TEXT_LEN);
+            rec->field = value & ~TRACE_IGNORE_CASE;
+            rec->ignore_case = (value & TRACE_IGNORE_CASE) != 0;
+            break;
+        case TRACE_PUT:
+            ok = get_string(reader, rec->cd.catalog, CATALOG_CAT_LEN) &&
+                 get_string(reader, rec->cd.title, CATALOG_TITLE_LEN) &&
+                 get_string(reader, rec->cd.type, CATALOG_TYPE_LEN) &&
+                 get_string(reader, rec->cd.artist, CATALOG_ARTIST_LEN);
+            break;
+        case TRACE_PUT_TRACKS:
+            ok = get_string(reader, rec->text, CATALOG_CAT_LEN) &&
+                 get_varint(reader, &value) && value <= CATALOG_MAX_TRACKS;
+            rec->num_tracks = ok ? value : 0;
+            for (i = 0; ok && i < rec->num_tracks; i++) {
+                strcpy(rec->tracks[i].catalog, rec->text);
+                rec->tracks[i].track_no = i + 1;
+                ok = get_string(reader, rec->tracks[i].title, CATALOG_TRACK_LEN);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Trace %s is damaged at byte %ld\n", reader->path,
+                ftell(reader->fp));
+        return(-1);
+    }
+    return(1);
+}
+
+const char *trace_op_name(trace_op op)
+{
+    if (op <= 0 || op >= TRACE_NUM_OPS) {
+        return("?");
+    }
+    return(op_names[op]);
+}
+
+static int get_varint(trace_reader *reader, unsigned long long *value)
+{
+    int shift, c;
+
+    *value = 0;
+    for (shift = 0; shift < 7 * MAX_VARINT; shift += 7) {
+        c = getc(reader->fp);
+        if (c == EOF) {
+            return(0);
+        }
+        *value |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/* Strings longer than the field were cut when recorded, so one that
+   doesn't fit now means the trace is damaged */
+static int get_string(trace_reader *reader, char *dest, int dest_len)
+{
+    unsigned long long len;
+
+    if (!get_varint(reader, &len) || len > (unsigned long long)dest_len) {
+        return(0);
+    }
+    if (fread(dest, 1, len, reader->fp) != len) {
+        return(0);
+    }
+    dest[len] = '\0';
+    return(1);
+}
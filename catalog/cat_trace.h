@@ -0,0 +1,83 @@
+/*
+   Workload traces. A frontend started with -r FILE records each catalog
+   operation its user makes, and when, so that cdctl replay can run the
+   same traffic against any store later: at the pace it was recorded, some
+   times faster, or as fast as the store will go.
+
+   A trace is TRACE_MAGIC and then one record per operation: the
+   microseconds since the previous one, the operation, and its arguments,
+   with numbers as base 128 varints and strings as a length and the bytes.
+   Recording appends a few bytes per operation and flushes them, so a
+   frontend that is killed loses nothing.
+
+   The operations are those of the catalog library rather than of any one
+   frontend. A title search in mini_cd_manager and a catalog search in
+   application are both TRACE_FIND, with the field searched; replay turns
+   it into the cat_filter substring test on that field, ignoring case if
+   the field has TRACE_IGNORE_CASE, as mini_cd_manager's does.
+
+   The recording functions do nothing when the trace is NULL, so a
+   frontend calls them whether or not it is recording.
+ */
+
+#ifndef CAT_TRACE_H
+#define CAT_TRACE_H
+
+#include "catalog.h"
+#include "cat_filter.h"
+
+#define TRACE_MAGIC     "CDTRACE1"
+#define TRACE_TEXT_LEN  255
+#define TRACE_ANY_FIELD FILTER_NUM_FIELDS  /* catalog, title or artist */
+#define TRACE_IGNORE_CASE 0x40      /* or'ed into the field of a TRACE_FIND */
+
+typedef enum {
+    TRACE_GET = 1,      /* text is a catalog number */
+    TRACE_TRACKS,       /* its tracks */
+    TRACE_FIND,         /* CDs with text in field */
+    TRACE_LIST,         /* every CD */
+    TRACE_COUNT,        /* every CD and its tracks */
+    TRACE_PUT,          /* cd */
+    TRACE_PUT_TRACKS,   /* tracks replace those of the CD text */
+    TRACE_DEL,          /* text and its tracks */
+    TRACE_NUM_OPS
+} trace_op;
+
+/* One operation read back from a trace */
+typedef struct {
+    trace_op op;
+    unsigned long long at_us;       /* since recording began */
+    int field;                      /* TRACE_FIND: a filter_field or TRACE_ANY_FIELD */
+    int ignore_case;                /* and whether it ignored case */
+    char text[TRACE_TEXT_LEN + 1];
+    cat_cd cd;
+    int num_tracks;                 /* numbered from 1 in order */
+    cat_track tracks[CATALOG_MAX_TRACKS];
+} trace_rec;
+
+typedef struct cat_trace cat_trace;
+typedef struct trace_reader trace_reader;
+
+/* Recording. trace_stop returns 0 if anything failed to be written. */
+cat_trace *trace_start(const char *path);
+int trace_stop(cat_trace *trace);
+/* TRACE_GET, TRACE_TRACKS and TRACE_DEL with a catalog number,
+   TRACE_LIST and TRACE_COUNT with NULL */
+void trace_key(cat_trace *trace, trace_op op, const char *catalog);
+void trace_find(cat_trace *trace, int field, const char *text);
+void trace_put(cat_trace *trace, const char *catalog, const char *title,
+               const char *type, const char *artist);
+/* titles holds count strings title_size bytes apart */
+void trace_put_tracks(cat_trace *trace, const char *catalog,
+                      const char *titles, int title_size, int count);
+
+/* Reading. trace_read returns 1 for each record, 0 at the end, and -1,
+   with a message on stderr, where the trace is damaged. */
+trace_reader *trace_open(const char *path);
+int trace_read(trace_reader *reader, trace_rec *rec);
+void trace_close(trace_reader *reader);
+
+/* "get", "tracks", "find" and so on */
+const char *trace_op_name(trace_op op);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+   Backend selection and the common entry points of the catalog library.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "cat_snap.h"
+#include "cat_lsm.h"
+#include "cat_filter.h"
+
+/* catalog_find over a plain scan */
+typedef struct {
+    const cat_filter *filter;
+    cat_scan_fn fn;
+    void *arg;
+} find_state;
+
+/* catalog_find_disc_id over a plain scan */
+typedef struct {
+    const char *disc_id;
+    cat_scan_fn fn;
+    void *arg;
+} disc_id_state;
+
+static int find_matching(const cat_cd *cd, void *arg);
+static int disc_id_matching(const cat_cd *cd, void *arg);
+
+/* What catalog_fold turns U+00C0 to U+017F into. NULL leaves the
+   character as it is. */
+static const char *const latin_folds[] = {
+    "a", "a", "a", "a", "a", "a", "ae", "c",    /* U+00C0 */
+    "e", "e", "e", "e", "i", "i", "i", "i",     /* U+00C8 */
+    "d", "n", "o", "o", "o", "o", "o", NULL,    /* U+00D0 */
+    "o", "u", "u", "u", "u", "y", "th", "ss",   /* U+00D8 */
+    "a", "a", "a", "a", "a", "a", "ae", "c",    /* U+00E0 */
+    "e", "e", "e", "e", "i", "i", "i", "i",     /* U+00E8 */
+    "d", "n", "o", "o", "o", "o", "o", NULL,    /* U+00F0 */
+    "o", "u", "u", "u", "u", "y", "th", "y",    /* U+00F8 */
+    "a", "a", "a", "a", "a", "a", "c", "c",     /* U+0100 */
+    "c", "c", "c", "c", "c", "c", "d", "d",     /* U+0108 */
+    "d", "d", "e", "e", "e", "e", "e", "e",     /* U+0110 */
+    "e", "e", "e", "e", "g", "g", "g", "g",     /* U+0118 */
+    "g", "g", "g", "g", "h", "h", "h", "h",     /* U+0120 */
+    "i", "i", "i", "i", "i", "i", "i", "i",     /* U+0128 */
+    "i", "i", "ij", "ij", "j", "j", "k", "k",   /* U+0130 */
+    "k", "l", "l", "l", "l", "l", "l", "l",     /* U+0138 */
+    "l", "l", "l", "n", "n", "n", "n", "n",     /* U+0140 */
+    "n", "n", "n", "n", "o", "o", "o", "o",     /* U+0148 */
+    "o", "o", "oe", "oe", "r", "r", "r", "r",   /* U+0150 */
+    "r", "r", "s", "s", "s", "s", "s", "s",     /* U+0158 */
+    "s", "s", "t", "t", "t", "t", "t", "t",     /* U+0160 */
+    "u", "u", "u", "u", "u", "u", "u", "u",     /* U+0168 */
+    "u", "u", "u", "u", "w", "w", "y", "y",     /* U+0170 */
+    "y", "z", "z", "z", "z", "z", "z", "s"      /* U+0178 */
+};
+
+static const struct catalog_ops *backends[] = {
+    &cat_text_ops,
+    &cat_dbm_ops,
+    &cat_snap_ops,
+    &cat_lsm_ops,
+#ifdef HAVE_MYSQL
+    &cat_mysql_ops,
+#endif
+    NULL
+};
+
+/* Open the store named by spec, "name[:location]". Returns NULL if the name
+   is unknown or the store can't be opened. */
+catalog_backend *catalog_open(const char *spec, int create)
+{
+    const struct catalog_ops **ops_ptr;
+    catalog_backend *be;
+    const char *location = NULL;
+    size_t name_len;
+
+    if (!spec) {
+        return(NULL);
+    }
+    name_len = strcspn(spec, ":");
+    if (spec[name_len] == ':') {
+        location = spec + name_len + 1;
+    }
+
+    for (ops_ptr = backends; *ops_ptr; ops_ptr++) {
+        if (strlen((*ops_ptr)->name) == name_len &&
+            strncmp((*ops_ptr)->name, spec, name_len) == 0) {
+            break;
+        }
+    }
+    if (!*ops_ptr) {
+        fprintf(stderr, "Unknown catalog backend %s, expected one of: %s\n",
+                spec, catalog_backend_names());
+        return(NULL);
+    }
+
+    be = calloc(1, sizeof(*be));
+    if (!be) {
+        return(NULL);
+    }
+    be->ops = *ops_ptr;
+    catalog_set_field(be->spec, spec, sizeof(be->spec) - 1);
+    if (!be->ops->open(be, location, create)) {
+        free(be);
+        return(NULL);
+    }
+    return(be);
+}
+
+void catalog_close(catalog_backend *be)
+{
+    if (!be) {
+        return;
+    }
+    be->ops->close(be);
+    free(be);
+}
+
+/* A space separated list of the backends built in, for usage messages */
+const char *catalog_backend_names(void)
+{
+    static char names[100];
+    const struct catalog_ops **ops_ptr;
+
+    names[0] = '\0';
+    for (ops_ptr = backends; *ops_ptr; ops_ptr++) {
+        if (names[0]) {
+            strcat(names, " ");
+        }
+        strcat(names, (*ops_ptr)->name);
+    }
+    return(names);
+}
+
+/* The same sanity checks as cd_access.c: a store must be open and a catalog
+   number must fit the record. Backends can then rely on them. */
+static int catalog_ok(catalog_backend *be, const char *catalog)
+{
+    if (!be || !catalog || !catalog[0]) {
+        return(0);
+    }
+    if (strlen(catalog) >= CATALOG_CAT_LEN) {
+        return(0);
+    }
+    return(1);
+}
+
+int catalog_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest)
+{
+    memset(dest, '\0', sizeof(*dest));
+    if (!catalog_ok(be, catalog)) {
+        return(0);
+    }
+    return(be->ops->get_cd(be, catalog, dest));
+}
+
+int catalog_get_tracks(catalog_backend *be, const char *catalog,
+                       cat_track *dest, int max_tracks)
+{
+    if (!catalog_ok(be, catalog) || max_tracks <= 0) {
+        return(0);
+    }
+    memset(dest, '\0', max_tracks * sizeof(*dest));
+    return(be->ops->get_tracks(be, catalog, dest, max_tracks));
+}
+
+int catalog_put_cd(catalog_backend *be, const cat_cd *cd)
+{
+    if (!cd || !catalog_ok(be, cd->catalog) || !catalog_disc_id_ok(cd->disc_id)) {
+        return(0);
+    }
+    return(be->ops->put_cd(be, cd));
+}
+
+int catalog_put_tracks(catalog_backend *be, const char *catalog,
+                       const cat_track *tracks, int count)
+{
+    if (!catalog_ok(be, catalog) || count < 0 || count > CATALOG_MAX_TRACKS) {
+        return(0);
+    }
+    return(be->ops->put_tracks(be, catalog, tracks, count));
+}
+
+int catalog_del_cd(catalog_backend *be, const char *catalog)
+{
+    if (!catalog_ok(be, catalog)) {
+        return(0);
+    }
+    return(be->ops->del_cd(be, catalog));
+}
+
+int catalog_scan(catalog_backend *be, cat_scan_fn fn, void *arg)
+{
+    if (!be || !fn) {
+        return(0);
+    }
+    return(be->ops->scan(be, fn, arg));
+}
+
+int catalog_find(catalog_backend *be, const cat_filter *filter,
+                 cat_scan_fn fn, void *arg)
+{
+    find_state fs;
+
+    if (!be || !filter || !fn) {
+        return(0);
+    }
+    if (be->ops->find) {
+        return(be->ops->find(be, filter, fn, arg));
+    }
+    fs.filter = filter;
+    fs.fn = fn;
+    fs.arg = arg;
+    return(be->ops->scan(be, find_matching, &fs));
+}
+
+int catalog_stamp(catalog_backend *be, char *dest)
+{
+    dest[0] = '\0';
+    if (!be || !be->ops->stamp) {
+        return(0);
+    }
+    return(be->ops->stamp(be, dest, CATALOG_STAMP_LEN));
+}
+
+int catalog_scan_tracks(catalog_backend *be, int part, int num_parts,
+                        cat_track_fn fn, void *arg)
+{
+    if (!be || !fn || num_parts < 1 || part < 0 || part >= num_parts ||
+        !be->ops->scan_tracks) {
+        return(0);
+    }
+    return(be->ops->scan_tracks(be, part, num_parts, fn, arg));
+}
+
+int catalog_del_tracks(catalog_backend *be, const char *catalog)
+{
+    if (!catalog_ok(be, catalog) || !be->ops->del_tracks) {
+        return(0);
+    }
+    return(be->ops->del_tracks(be, catalog));
+}
+
+int catalog_put_batch(catalog_backend *be, const cat_entry *entries, int count)
+{
+    int i, put = 0;
+
+    if (!be || count < 0) {
+        return(0);
+    }
+    for (i = 0; i < count; i++) {
+        if (!catalog_ok(be, entries[i].cd.catalog) ||
+            !catalog_disc_id_ok(entries[i].cd.disc_id) || entries[i].num_tracks < 0 ||
+            entries[i].num_tracks > CATALOG_MAX_TRACKS) {
+            return(0);
+        }
+    }
+    if (be->ops->put_batch) {
+        return(be->ops->put_batch(be, entries, count));
+    }
+    for (i = 0; i < count; i++) {
+        if (be->ops->put_cd(be, &entries[i].cd) &&
+            be->ops->put_tracks(be, entries[i].cd.catalog, entries[i].tracks,
+                                entries[i].num_tracks)) {
+            put++;
+        }
+    }
+    return(put);
+}
+
+int catalog_find_disc_id(catalog_backend *be, const char *disc_id,
+                         cat_scan_fn fn, void *arg)
+{
+    char folded[CATALOG_DISCID_LEN + 1];
+    disc_id_state ds;
+    int i;
+
+    if (!be || !disc_id || !fn || strlen(disc_id) != CATALOG_DISCID_LEN) {
+        return(0);
+    }
+    for (i = 0; i <= CATALOG_DISCID_LEN; i++) {
+        folded[i] = tolower((unsigned char)disc_id[i]);
+    }
+    if (!catalog_disc_id_ok(folded)) {
+        return(0);
+    }
+    if (be->ops->find_disc_id) {
+        return(be->ops->find_disc_id(be, folded, fn, arg));
+    }
+    ds.disc_id = folded;
+    ds.fn = fn;
+    ds.arg = arg;
+    return(be->ops->scan(be, disc_id_matching, &ds));
+}
+
+int catalog_disc_id_ok(const char *disc_id)
+{
+    int i;
+
+    if (!disc_id[0]) {
+        return(1);
+    }
+    for (i = 0; i < CATALOG_DISCID_LEN; i++) {
+        if (!isdigit((unsigned char)disc_id[i]) && (disc_id[i] < 'a' || disc_id[i] > 'f')) {
+            return(0);
+        }
+    }
+    return(disc_id[i] == '\0');
+}
+
+static int find_matching(const cat_cd *cd, void *arg)
+{
+    find_state *fs = arg;
+
+    if (!filter_match(fs->filter, cd)) {
+        return(1);
+    }
+    return(fs->fn(cd, fs->arg));
+}
+
+static int disc_id_matching(const cat_cd *cd, void *arg)
+{
+    disc_id_state *ds = arg;
+
+    if (strcmp(cd->disc_id, ds->disc_id) != 0) {
+        return(1);
+    }
+    return(ds->fn(cd, ds->arg));
+}
+
+void catalog_set_field(char *field, const char *value, int field_len)
+{
+    strncpy(field, value, field_len);
+    field[field_len] = '\0';
+}
+
+void catalog_fold(char *dest, const char *src, int dest_len)
+{
+    const unsigned char *from = (const unsigned char *)src;
+    const char *fold;
+    unsigned int code;
+    int len = 0;
+
+    while (*from && len < dest_len) {
+        fold = NULL;
+        /* two byte UTF-8 sequences C3 80 to C5 BF are U+00C0 to U+017F */
+        if (from[0] >= 0xC3 && from[0] <= 0xC5 && (from[1] & 0xC0) == 0x80) {
+            code = ((from[0] & 0x1F) << 6) | (from[1] & 0x3F);
+            fold = latin_folds[code - 0xC0];
+        }
+        if (fold) {
+            while (*fold && len < dest_len) {
+                dest[len++] = *fold++;
+            }
+            from += 2;
+        } else {
+            dest[len++] = tolower(*from++);
+        }
+    }
+    dest[len] = '\0';
+}
+
+void catalog_make_keys(const cat_cd *cd, cat_keys *keys)
+{
+    catalog_fold(keys->catalog, cd->catalog, CATALOG_CAT_LEN);
+    catalog_fold(keys->title, cd->title, CATALOG_TITLE_LEN);
+    catalog_fold(keys->type, cd->type, CATALOG_TYPE_LEN);
+    catalog_fold(keys->artist, cd->artist, CATALOG_ARTIST_LEN);
+}
+
+/* The change time rather than the modification time, as it can't be set
+   back by hand. Both stores replace their files by renaming, which shows
+   up in the inode number. */
+void catalog_stamp_file(char *dest, int dest_len, const char *path)
+{
+    struct stat st;
+    size_t len = strlen(dest);
+
+    if (len >= (size_t)dest_len) {
+        return;
+    }
+    if (stat(path, &st) == -1) {
+        snprintf(dest + len, dest_len + 1 - len, "%s-", len ? "/" : "");
+        return;
+    }
+    snprintf(dest + len, dest_len + 1 - len, "%s%lu.%lld.%lld.%09ld",
+             len ? "/" : "", (unsigned long)st.st_ino, (long long)st.st_size,
+             (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+}
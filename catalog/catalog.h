@@ -0,0 +1,186 @@
+/*
+   The catalog library gives the three CD stores one record model and one
+   interface. The text files of mini_cd_manager, the dbm files of cd_dbm and
+   the MySQL database of cd_mysql each sit behind a backend: a table of
+   functions (struct catalog_ops) that maps the common operations onto that
+   store. Tools written against this header, such as cdctl, work with any of
+   them.
+
+   A backend is named by a spec string "name[:location]":
+       text[:directory]          title.cdb and tracks.cdb, default "."
+       dbm[:options]             cdc_data and cdt_data in the current directory,
+                                 options as for application -g
+       mysql[:user[:password]]   the blpcd database on localhost
+       snap:path                 a read-only snapshot, see cat_snap.h
+       lsm[:directory]           a log-structured store, see cat_lsm.h
+
+   The dbm and MySQL code keep their connection in file scope variables, so
+   only one backend of each of those kinds can be open at a time.
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+/* Field sizes follow the dbm store, the most restrictive of the three */
+#define CATALOG_CAT_LEN     30
+#define CATALOG_TITLE_LEN   70
+#define CATALOG_TYPE_LEN    30
+#define CATALOG_ARTIST_LEN  70
+#define CATALOG_TRACK_LEN   70
+#define CATALOG_MAX_TRACKS  99
+#define CATALOG_STAMP_LEN   100
+#define CATALOG_DISCID_LEN  8
+
+/* One CD, without its tracks. The disc ID is the CDDB one, eight lower
+   case hex digits, and is optional: "" when the CD hasn't got one. */
+typedef struct {
+    char catalog[CATALOG_CAT_LEN + 1];
+    char title[CATALOG_TITLE_LEN + 1];
+    char type[CATALOG_TYPE_LEN + 1];
+    char artist[CATALOG_ARTIST_LEN + 1];
+    char disc_id[CATALOG_DISCID_LEN + 1];
+} cat_cd;
+
+/* One track of a CD. Tracks are numbered from 1. */
+typedef struct {
+    char catalog[CATALOG_CAT_LEN + 1];
+    int track_no;
+    char title[CATALOG_TRACK_LEN + 1];
+} cat_track;
+
+/* A CD and its tracks, for putting many CDs at once */
+typedef struct {
+    cat_cd cd;
+    const cat_track *tracks;
+    int num_tracks;
+} cat_entry;
+
+/* The search keys of a CD: its fields folded by catalog_fold, so that a
+   search ignoring case and accents can compare bytes */
+typedef struct {
+    char catalog[CATALOG_CAT_LEN + 1];
+    char title[CATALOG_TITLE_LEN + 1];
+    char type[CATALOG_TYPE_LEN + 1];
+    char artist[CATALOG_ARTIST_LEN + 1];
+} cat_keys;
+
+typedef struct catalog_backend catalog_backend;
+typedef struct cat_filter cat_filter;     /* see cat_filter.h */
+
+/* Called once per CD by scan. Return 0 to stop the scan early. */
+typedef int (*cat_scan_fn)(const cat_cd *cd, void *arg);
+/* Called once per track record by scan_tracks, the same way */
+typedef int (*cat_track_fn)(const cat_track *track, void *arg);
+
+/* What a backend has to provide. All functions return 1 (or a count) on
+   success and 0 on failure or when nothing was found, like cd_access.c. */
+struct catalog_ops {
+    const char *name;
+    int has_type;       /* does the store keep the CD type? */
+
+    int (*open)(catalog_backend *be, const char *location, int create);
+    void (*close)(catalog_backend *be);
+
+    int (*get_cd)(catalog_backend *be, const char *catalog, cat_cd *dest);
+    /* fill dest with up to max_tracks tracks in order, return how many */
+    int (*get_tracks)(catalog_backend *be, const char *catalog,
+                      cat_track *dest, int max_tracks);
+
+    /* add a CD, or replace the details of an existing one, keeping its tracks */
+    int (*put_cd)(catalog_backend *be, const cat_cd *cd);
+    /* replace all the tracks of a CD */
+    int (*put_tracks)(catalog_backend *be, const char *catalog,
+                      const cat_track *tracks, int count);
+    /* remove a CD and all its tracks */
+    int (*del_cd)(catalog_backend *be, const char *catalog);
+
+    /* call fn for every CD, in whatever order the store keeps them */
+    int (*scan)(catalog_backend *be, cat_scan_fn fn, void *arg);
+    /* optional: call fn for the CDs matching filter, filtering in the store.
+       Without it catalog_find runs the filter over scan. */
+    int (*find)(catalog_backend *be, const cat_filter *filter,
+                cat_scan_fn fn, void *arg);
+    /* optional: write a short string into dest that changes whenever the
+       CDs do, so that anything derived from them can tell it is stale */
+    int (*stamp)(catalog_backend *be, char *dest, int dest_len);
+
+    /* optional, for checking the store (cat_fsck.h): call fn for every
+       track record as stored, whether or not its CD exists. The records
+       are split into num_parts parts, which may be scanned at once from
+       different threads; a store that can't split them gives them all to
+       part 0. fn may be called from several threads at once. */
+    int (*scan_tracks)(catalog_backend *be, int part, int num_parts,
+                       cat_track_fn fn, void *arg);
+    /* optional: remove every track record of a catalog number, whatever
+       their numbers and whether or not the CD exists */
+    int (*del_tracks)(catalog_backend *be, const char *catalog);
+
+    /* optional: put_cd and put_tracks for each of count CDs, which the
+       store may do in one pass rather than one per CD. Returns how many
+       it put; it couldn't store the others. */
+    int (*put_batch)(catalog_backend *be, const cat_entry *entries, int count);
+
+    /* optional: call fn for each CD with the disc ID, found by an index
+       rather than a scan. More than one CD can have the same ID. */
+    int (*find_disc_id)(catalog_backend *be, const char *disc_id,
+                        cat_scan_fn fn, void *arg);
+};
+
+struct catalog_backend {
+    const struct catalog_ops *ops;
+    char spec[100];
+    void *state;        /* private to the backend */
+};
+
+/* Opening and closing a store. create nonzero starts an empty store. */
+catalog_backend *catalog_open(const char *spec, int create);
+void catalog_close(catalog_backend *be);
+const char *catalog_backend_names(void);
+
+/* The operations, which check their arguments before calling the backend */
+int catalog_get_cd(catalog_backend *be, const char *catalog, cat_cd *dest);
+int catalog_get_tracks(catalog_backend *be, const char *catalog,
+                       cat_track *dest, int max_tracks);
+int catalog_put_cd(catalog_backend *be, const cat_cd *cd);
+int catalog_put_tracks(catalog_backend *be, const char *catalog,
+                       const cat_track *tracks, int count);
+int catalog_del_cd(catalog_backend *be, const char *catalog);
+int catalog_scan(catalog_backend *be, cat_scan_fn fn, void *arg);
+int catalog_find(catalog_backend *be, const cat_filter *filter,
+                 cat_scan_fn fn, void *arg);
+/* dest holds CATALOG_STAMP_LEN + 1 chars. 0 if the store can't tell. */
+int catalog_stamp(catalog_backend *be, char *dest);
+/* 0 if the store doesn't have them */
+int catalog_scan_tracks(catalog_backend *be, int part, int num_parts,
+                        cat_track_fn fn, void *arg);
+int catalog_del_tracks(catalog_backend *be, const char *catalog);
+/* How many of the CDs were put, going one at a time for a store without
+   put_batch. 0 if any of them has a bad catalog number or track count. */
+int catalog_put_batch(catalog_backend *be, const cat_entry *entries, int count);
+/* The CDs with a disc ID, in either case, by scanning a store that has no
+   index of them */
+int catalog_find_disc_id(catalog_backend *be, const char *disc_id,
+                         cat_scan_fn fn, void *arg);
+/* Is it eight lower case hex digits, or ""? */
+int catalog_disc_id_ok(const char *disc_id);
+
+/* Copy a string into a fixed size record field, always terminating it */
+void catalog_set_field(char *field, const char *value, int field_len);
+
+/* Fold a string for searching: ASCII to lower case, and the accented
+   Latin letters of UTF-8 to their plain lower case letters */
+void catalog_fold(char *dest, const char *src, int dest_len);
+void catalog_make_keys(const cat_cd *cd, cat_keys *keys);
+
+/* For stamp: append the inode, size and change time of a file to dest,
+   or "-" if there is no such file */
+void catalog_stamp_file(char *dest, int dest_len, const char *path);
+
+/* The backends */
+extern const struct catalog_ops cat_text_ops;
+extern const struct catalog_ops cat_dbm_ops;
+#ifdef HAVE_MYSQL
+extern const struct catalog_ops cat_mysql_ops;
+#endif
+
+#endif
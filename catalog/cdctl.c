@@ -0,0 +1,1189 @@
+/*
+   cdctl runs catalog commands against any of the CD stores through the
+   catalog library. The same command line works for every store, so it can
+   also copy a catalog from one store to another, check that two stores
+   hold the same CDs, and time one workload on each of them.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "catalog.h"
+#include "cat_snap.h"
+#include "cat_cols.h"
+#include "cat_filter.h"
+#include "cat_sort.h"
+#include "cat_complete.h"
+#include "cat_trace.h"
+#include "cat_mem.h"
+#include "cat_fsck.h"
+#include "cat_freedb.h"
+
+#define DEFAULT_BACKEND  "text"
+#define BENCH_CDS        1000
+#define BENCH_TRACKS     10
+#define BENCH_ARTISTS    50
+#define MAX_PREDICATES   20
+#define SORT_FILE        "cdsort.%s"    /* in the current directory */
+#define PAGE_SIZE        20
+#define EXPORT_CHUNK     256
+#define COMPLETIONS      10
+#define FILTER_LEN       (TRACE_TEXT_LEN * 2 + 20)
+
+typedef int (*command_fn)(catalog_backend *be, int argc, char *argv[]);
+
+/* What compare and copy need while walking the first store */
+typedef struct {
+    catalog_backend *from;
+    catalog_backend *to;
+    int count;
+    int tracks;
+    int differences;
+    int failures;
+} walk_state;
+
+/* The latencies of one kind of replayed operation */
+typedef struct {
+    double *ms;
+    int count;
+    int size;
+    int failed;
+} replay_stats;
+
+/* How browse and export sort, from the -m and -t options */
+static sort_options sort_opts;
+
+static int cmd_init(catalog_backend *be, int argc, char *argv[]);
+static int cmd_list(catalog_backend *be, int argc, char *argv[]);
+static int cmd_get(catalog_backend *be, int argc, char *argv[]);
+static int cmd_add(catalog_backend *be, int argc, char *argv[]);
+static int cmd_del(catalog_backend *be, int argc, char *argv[]);
+static int cmd_find(catalog_backend *be, int argc, char *argv[]);
+static int cmd_count(catalog_backend *be, int argc, char *argv[]);
+static int cmd_copy(catalog_backend *be, int argc, char *argv[]);
+static int cmd_compare(catalog_backend *be, int argc, char *argv[]);
+static int cmd_bench(catalog_backend *be, int argc, char *argv[]);
+static int cmd_snapshot(catalog_backend *be, int argc, char *argv[]);
+static int cmd_columns(catalog_backend *be, int argc, char *argv[]);
+static int cmd_query(catalog_backend *be, int argc, char *argv[]);
+static int cmd_browse(catalog_backend *be, int argc, char *argv[]);
+static int cmd_export(catalog_backend *be, int argc, char *argv[]);
+static int cmd_complete(catalog_backend *be, int argc, char *argv[]);
+static int cmd_replay(catalog_backend *be, int argc, char *argv[]);
+static int cmd_load(catalog_backend *be, int argc, char *argv[]);
+static int cmd_fsck(catalog_backend *be, int argc, char *argv[]);
+static int cmd_import(catalog_backend *be, int argc, char *argv[]);
+static int cmd_disc(catalog_backend *be, int argc, char *argv[]);
+
+static int print_cd(const cat_cd *cd, void *arg);
+static int count_cd(const cat_cd *cd, void *arg);
+static int copy_cd(const cat_cd *cd, void *arg);
+static int compare_cd(const cat_cd *cd, void *arg);
+static int missing_cd(const cat_cd *cd, void *arg);
+static int match_cd(const cat_cd *cd, void *arg);
+static void print_problem(const char *catalog, const char *problem, void *arg);
+static void print_progress(const freedb_result *so_far, void *arg);
+static void bench_one(const char *spec, int num_cds);
+static int replay_one(catalog_backend *be, const trace_rec *rec);
+static void find_expr(char *expr, int field, const char *text);
+static int add_latency(replay_stats *stats, double ms, int ok);
+static void print_latencies(const char *name, replay_stats *stats);
+static int compare_ms(const void *a, const void *b);
+static int parse_predicate(const char *arg, cols_pred *pred);
+static cat_sorted *open_sorted(catalog_backend *be, const char *key_name);
+static double now_ms(void);
+static void usage(const char *prog_name);
+
+static struct {
+    const char *name;
+    command_fn fn;
+    int create;         /* open the store empty */
+    const char *help;
+} commands[] = {
+    { "init",    cmd_init,    1, "init                       create an empty catalog" },
+    { "list",    cmd_list,    0, "list                       list every CD" },
+    { "get",     cmd_get,     0, "get CATALOG                show a CD and its tracks" },
+    { "add",     cmd_add,     0, "add [-d DISCID] CATALOG TITLE TYPE ARTIST [TRACK...]" },
+    { "disc",    cmd_disc,    0, "disc DISCID                CDs with a CDDB disc ID" },
+    { "del",     cmd_del,     0, "del CATALOG                delete a CD and its tracks" },
+    { "find",    cmd_find,    0, "find [-i] FILTER           CDs matching FILTER, e.g. type=Jazz and artist~Davis;\n"
+      "                           -i ignores case and accents" },
+    { "count",   cmd_count,   0, "count                      count CDs and tracks" },
+    { "copy",    cmd_copy,    0, "copy SPEC                  copy every CD into another store" },
+    { "compare", cmd_compare, 0, "compare SPEC               report CDs that differ from another store" },
+    { "bench",   cmd_bench,   0, "bench [N] [SPEC...]        time the same workload on each store" },
+    { "snapshot", cmd_snapshot, 0, "snapshot FILE              compile the catalog into a read-only snapshot" },
+    { "columns", cmd_columns, 0, "columns FILE               export the catalog in columns for query" },
+    { "query",   cmd_query,   0, "query FILE [PRED...] [list|by-type|by-artist]\n"
+      "                           PRED is FIELD=VALUE, FIELD~SUBSTRING or tracks<N, tracks>N" },
+    { "browse",  cmd_browse,  0, "browse KEY [PAGE [SIZE]]   one page of CDs sorted by title, artist or catalog" },
+    { "export",  cmd_export,  0, "export KEY                 every CD sorted by title, artist or catalog" },
+    { "complete", cmd_complete, 0, "complete PREFIX [N]        the first N catalog numbers and titles starting PREFIX" },
+    { "replay",  cmd_replay,  0, "replay TRACE [SPEED]       run a recorded workload SPEED times as fast, or max,\n"
+      "                           as recorded by the -r option of mini_cd_manager or application" },
+    { "load",    cmd_load,    0, "load                       time loading the catalog into memory, looking up every CD and freeing it" },
+    { "fsck",    cmd_fsck,    0, "fsck [-r] [-j N]           check that every track belongs to a CD; -r repairs" },
+    { "import",  cmd_import,  0, "import DIR [-j N] [-B N]   add every disc of a freedb dump, N discs to a batch" },
+    { NULL,      NULL,        0, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    const char *spec = DEFAULT_BACKEND;
+    catalog_backend *be;
+    int c, i;
+    int result;
+
+    while ((c = getopt(argc, argv, "+:b:m:t:")) != -1) {
+        switch (c) {
+        case 'b':
+            spec = optarg;
+            break;
+        case 'm':
+            sort_opts.mem_limit = (size_t)atol(optarg) * 1024;
+            break;
+        case 't':
+            sort_opts.temp_dir = optarg;
+            break;
+        case ':':
+        case '?':
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; commands[i].name; i++) {
+        if (strcmp(commands[i].name, argv[optind]) == 0) {
+            break;
+        }
+    }
+    if (!commands[i].name) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* bench opens its own stores, one after the other, and query reads
+       an export rather than a store */
+    if (commands[i].fn == cmd_bench || commands[i].fn == cmd_query) {
+        result = commands[i].fn(NULL, argc - optind, argv + optind);
+        exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    be = catalog_open(spec, commands[i].create);
+    if (!be) {
+        fprintf(stderr, "Sorry, unable to open catalog %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    result = commands[i].fn(be, argc - optind, argv + optind);
+    catalog_close(be);
+    exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static int cmd_init(catalog_backend *be, int argc, char *argv[])
+{
+    return(1);
+}
+
+static int cmd_list(catalog_backend *be, int argc, char *argv[])
+{
+    return(catalog_scan(be, print_cd, NULL));
+}
+
+static int cmd_get(catalog_backend *be, int argc, char *argv[])
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    cat_cd cd;
+    int count, i;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: get CATALOG\n");
+        return(0);
+    }
+    if (!catalog_get_cd(be, argv[1], &cd)) {
+        fprintf(stderr, "Sorry, %s not found\n", argv[1]);
+        return(0);
+    }
+    printf("Catalog: %s\n", cd.catalog);
+    printf("\t title: %s\n", cd.title);
+    printf("\t  type: %s\n", cd.type);
+    printf("\tartist: %s\n", cd.artist);
+    if (cd.disc_id[0]) {
+        printf("\t  disc: %s\n", cd.disc_id);
+    }
+    count = catalog_get_tracks(be, cd.catalog, tracks, CATALOG_MAX_TRACKS);
+    for (i = 0; i < count; i++) {
+        printf("\t%d: %s\n", tracks[i].track_no, tracks[i].title);
+    }
+    return(1);
+}
+
+static int cmd_add(catalog_backend *be, int argc, char *argv[])
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    const char *disc_id = "";
+    cat_cd cd;
+    int count, i;
+
+    if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+        disc_id = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 5 || argc - 5 > CATALOG_MAX_TRACKS) {
+        fprintf(stderr, "Usage: add [-d DISCID] CATALOG TITLE TYPE ARTIST [TRACK...]\n");
+        return(0);
+    }
+    memset(&cd, '\0', sizeof(cd));
+    catalog_set_field(cd.disc_id, disc_id, CATALOG_DISCID_LEN);
+    if (strlen(disc_id) > CATALOG_DISCID_LEN || !catalog_disc_id_ok(cd.disc_id)) {
+        fprintf(stderr, "A disc ID is eight lower case hex digits\n");
+        return(0);
+    }
+    catalog_set_field(cd.catalog, argv[1], CATALOG_CAT_LEN);
+    catalog_set_field(cd.title, argv[2], CATALOG_TITLE_LEN);
+    catalog_set_field(cd.type, argv[3], CATALOG_TYPE_LEN);
+    catalog_set_field(cd.artist, argv[4], CATALOG_ARTIST_LEN);
+
+    count = argc - 5;
+    memset(tracks, '\0', sizeof(tracks));
+    for (i = 0; i < count; i++) {
+        catalog_set_field(tracks[i].catalog, cd.catalog, CATALOG_CAT_LEN);
+        tracks[i].track_no = i + 1;
+        catalog_set_field(tracks[i].title, argv[5 + i], CATALOG_TRACK_LEN);
+    }
+    if (!catalog_put_cd(be, &cd) || !catalog_put_tracks(be, cd.catalog, tracks, count)) {
+        fprintf(stderr, "Failed to add %s\n", cd.catalog);
+        return(0);
+    }
+    return(1);
+}
+
+static int cmd_del(catalog_backend *be, int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: del CATALOG\n");
+        return(0);
+    }
+    if (!catalog_del_cd(be, argv[1])) {
+        fprintf(stderr, "Failed to delete %s\n", argv[1]);
+        return(0);
+    }
+    return(1);
+}
+
+static int cmd_disc(catalog_backend *be, int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: disc DISCID\n");
+        return(0);
+    }
+    if (!catalog_find_disc_id(be, argv[1], print_cd, NULL)) {
+        fprintf(stderr, "Sorry, %s is not a disc ID\n", argv[1]);
+        return(0);
+    }
+    return(1);
+}
+
+/* The words of the command line make up one filter, see cat_filter.h */
+static int cmd_find(catalog_backend *be, int argc, char *argv[])
+{
+    cat_filter *filter;
+    char expr[1000];
+    int flags = 0;
+    int first = 1;
+    int i, result;
+
+    if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+        flags = FILTER_IGNORE_CASE;
+        first = 2;
+    }
+    if (argc <= first) {
+        fprintf(stderr, "Usage: find [-i] FILTER\n");
+        return(0);
+    }
+    expr[0] = '\0';
+    for (i = first; i < argc; i++) {
+        if (strlen(expr) + strlen(argv[i]) + 2 > sizeof(expr)) {
+            fprintf(stderr, "Filter too long\n");
+            return(0);
+        }
+        if (i > first) {
+            strcat(expr, " ");
+        }
+        strcat(expr, argv[i]);
+    }
+    filter = filter_compile(expr, flags);
+    if (!filter) {
+        return(0);
+    }
+    result = catalog_find(be, filter, print_cd, NULL);
+    filter_free(filter);
+    return(result);
+}
+
+static int cmd_count(catalog_backend *be, int argc, char *argv[])
+{
+    walk_state ws;
+
+    memset(&ws, 0, sizeof(ws));
+    ws.from = be;
+    if (!catalog_scan(be, count_cd, &ws)) {
+        return(0);
+    }
+    printf("Catalog contains %d CDs, with a total of %d tracks\n",
+           ws.count, ws.tracks);
+    return(1);
+}
+
+static int cmd_copy(catalog_backend *be, int argc, char *argv[])
+{
+    walk_state ws;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: copy SPEC\n");
+        return(0);
+    }
+    memset(&ws, 0, sizeof(ws));
+    ws.from = be;
+    ws.to = catalog_open(argv[1], 0);
+    if (!ws.to) {
+        return(0);
+    }
+    catalog_scan(be, copy_cd, &ws);
+    catalog_close(ws.to);
+    printf("Copied %d CDs to %s, %d failed\n", ws.count, argv[1], ws.failures);
+    return(ws.failures == 0);
+}
+
+/* Walk both stores: every CD of the first must be the same in the second,
+   and the second must have no CDs the first lacks. */
+static int cmd_compare(catalog_backend *be, int argc, char *argv[])
+{
+    walk_state ws;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: compare SPEC\n");
+        return(0);
+    }
+    memset(&ws, 0, sizeof(ws));
+    ws.from = be;
+    ws.to = catalog_open(argv[1], 0);
+    if (!ws.to) {
+        return(0);
+    }
+    catalog_scan(be, compare_cd, &ws);
+    ws.from = ws.to;
+    ws.to = be;
+    catalog_scan(ws.from, missing_cd, &ws);
+    catalog_close(ws.from);
+    printf("Compared %d CDs, %d differences\n", ws.count, ws.differences);
+    return(ws.differences == 0);
+}
+
+static int cmd_bench(catalog_backend *be, int argc, char *argv[])
+{
+    int num_cds = BENCH_CDS;
+    int first_spec = 1;
+    int i;
+
+    if (argc > 1 && atoi(argv[1]) > 0) {
+        num_cds = atoi(argv[1]);
+        first_spec = 2;
+    }
+    printf("%-20s %10s %10s %10s %10s\n", "backend", "put/s", "get/s",
+           "scan ms", "del/s");
+    if (first_spec >= argc) {
+        bench_one(DEFAULT_BACKEND, num_cds);
+    }
+    for (i = first_spec; i < argc; i++) {
+        bench_one(argv[i], num_cds);
+    }
+    return(1);
+}
+
+static int cmd_snapshot(catalog_backend *be, int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: snapshot FILE\n");
+        return(0);
+    }
+    return(snap_build(be, argv[1]));
+}
+
+static int cmd_columns(catalog_backend *be, int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: columns FILE\n");
+        return(0);
+    }
+    return(cols_build(be, argv[1]));
+}
+
+/* Run the predicates over a columnar export, then list the matches, count
+   them by type or artist, or just count them */
+static int cmd_query(catalog_backend *be, int argc, char *argv[])
+{
+    cols_pred preds[MAX_PREDICATES];
+    const char *action = NULL;
+    cat_cols *cols;
+    cols_bitmap *sel;
+    cols_field group_by;
+    uint32_t *counts;
+    uint32_t matched, code;
+    uint64_t tracks;
+    double start, query_ms;
+    int num_preds = 0;
+    cat_cd cd;
+    long row;
+    int i, n;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: query FILE [PRED...] [list|by-type|by-artist]\n");
+        return(0);
+    }
+    for (i = 2; i < argc; i++) {
+        if (strpbrk(argv[i], "=~<>")) {
+            if (num_preds == MAX_PREDICATES || !parse_predicate(argv[i], &preds[num_preds])) {
+                fprintf(stderr, "Bad predicate %s\n", argv[i]);
+                return(0);
+            }
+            num_preds++;
+        } else if (!action && (strcmp(argv[i], "list") == 0 ||
+                               strcmp(argv[i], "by-type") == 0 ||
+                               strcmp(argv[i], "by-artist") == 0)) {
+            action = argv[i];
+        } else {
+            fprintf(stderr, "Unknown query word %s\n", argv[i]);
+            return(0);
+        }
+    }
+
+    cols = cols_open(argv[1]);
+    if (!cols) {
+        return(0);
+    }
+    sel = cols_select_all(cols);
+    if (!sel) {
+        cols_close(cols);
+        return(0);
+    }
+    start = now_ms();
+    if (!cols_query(cols, sel, preds, num_preds)) {
+        fprintf(stderr, "A predicate doesn't apply to its field\n");
+        cols_bitmap_free(sel);
+        cols_close(cols);
+        return(0);
+    }
+    matched = cols_count(sel);
+    tracks = cols_sum_tracks(cols, sel);
+    query_ms = now_ms() - start;
+
+    if (action && strcmp(action, "list") == 0) {
+        for (row = cols_next(sel, 0); row != -1; row = cols_next(sel, row + 1)) {
+            cols_row(cols, row, &cd, &n);
+            printf("%s,%s,%s,%s,%d\n", cd.catalog, cd.title, cd.type, cd.artist, n);
+        }
+    } else if (action) {
+        group_by = strcmp(action, "by-type") == 0 ? COLS_TYPE : COLS_ARTIST;
+        counts = malloc((cols_dict_size(cols, group_by) + 1) * sizeof(*counts));
+        if (counts) {
+            start = now_ms();
+            cols_group_count(cols, sel, group_by, counts);
+            query_ms += now_ms() - start;
+            for (code = 0; code < cols_dict_size(cols, group_by); code++) {
+                if (counts[code]) {
+                    printf("%8u  %s\n", counts[code],
+                           cols_dict_entry(cols, group_by, code));
+                }
+            }
+            free(counts);
+        }
+    }
+    printf("%u of %u CDs match, %llu tracks, in %.2f ms\n", matched,
+           cols_num_cds(cols), (unsigned long long)tracks, query_ms);
+    cols_bitmap_free(sel);
+    cols_close(cols);
+    return(1);
+}
+
+/* Pages are numbered from 1 */
+static int cmd_browse(catalog_backend *be, int argc, char *argv[])
+{
+    cat_cd cds[PAGE_SIZE * 10];
+    cat_sorted *sorted;
+    uint32_t num_pages;
+    int page = 1;
+    int page_size = PAGE_SIZE;
+    int got, i;
+
+    if (argc >= 3) {
+        page = atoi(argv[2]);
+    }
+    if (argc >= 4) {
+        page_size = atoi(argv[3]);
+    }
+    if (argc < 2 || argc > 4 || page < 1 || page_size < 1 ||
+        page_size > PAGE_SIZE * 10) {
+        fprintf(stderr, "Usage: browse title|artist|catalog [PAGE [SIZE]], "
+                "SIZE up to %d\n", PAGE_SIZE * 10);
+        return(0);
+    }
+    sorted = open_sorted(be, argv[1]);
+    if (!sorted) {
+        return(0);
+    }
+    got = sort_read(sorted, (uint32_t)(page - 1) * page_size, cds, page_size);
+    for (i = 0; i < got; i++) {
+        print_cd(&cds[i], NULL);
+    }
+    num_pages = (sort_num_cds(sorted) + page_size - 1) / page_size;
+    printf("Page %d of %u, %u CDs by %s\n", page, num_pages,
+           sort_num_cds(sorted), argv[1]);
+    sort_close(sorted);
+    return(1);
+}
+
+/* Every CD in order, as the lines of title.cdb */
+static int cmd_export(catalog_backend *be, int argc, char *argv[])
+{
+    cat_cd cds[EXPORT_CHUNK];
+    cat_sorted *sorted;
+    uint32_t next = 0;
+    int got, i, result;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: export title|artist|catalog\n");
+        return(0);
+    }
+    sorted = open_sorted(be, argv[1]);
+    if (!sorted) {
+        return(0);
+    }
+    while ((got = sort_read(sorted, next, cds, EXPORT_CHUNK)) > 0) {
+        for (i = 0; i < got; i++) {
+            print_cd(&cds[i], NULL);
+        }
+        next += got;
+    }
+    result = next == sort_num_cds(sorted);
+    sort_close(sorted);
+    return(result);
+}
+
+/* The index is built for each run, so show how long that took apart
+   from the completion itself */
+static int cmd_complete(catalog_backend *be, int argc, char *argv[])
+{
+    complete_match matches[COMPLETIONS * 10];
+    cat_complete *index;
+    uint32_t total;
+    double start, build_ms, complete_ms;
+    int max_matches = COMPLETIONS;
+    int count, i;
+
+    if (argc == 3) {
+        max_matches = atoi(argv[2]);
+    }
+    if (argc < 2 || argc > 3 || max_matches < 1 || max_matches > COMPLETIONS * 10) {
+        fprintf(stderr, "Usage: complete PREFIX [N], N up to %d\n", COMPLETIONS * 10);
+        return(0);
+    }
+    start = now_ms();
+    index = complete_build(be);
+    if (!index) {
+        return(0);
+    }
+    build_ms = now_ms() - start;
+    start = now_ms();
+    count = complete_prefix(index, argv[1], matches, max_matches, &total);
+    complete_ms = now_ms() - start;
+    for (i = 0; i < count; i++) {
+        if (matches[i].is_title) {
+            printf("%s\t(%s)\n", matches[i].text, matches[i].catalog);
+        } else {
+            printf("%s\t%s\n", matches[i].text, matches[i].title);
+        }
+    }
+    printf("%d of %u matches from %u keys, indexed in %.1f ms, completed in %.1f us\n",
+           count, total, complete_num_keys(index), build_ms, complete_ms * 1000.0);
+    complete_free(index);
+    return(1);
+}
+
+/* Run the operations of a trace against the store, keeping to the times
+   they were recorded at divided by SPEED, or one after another with max.
+   Falling behind is reported rather than made up for, so a slow store
+   shows up as lag as well as in the latencies. */
+static int cmd_replay(catalog_backend *be, int argc, char *argv[])
+{
+    static trace_rec rec;
+    /* stats[0], which no operation uses, gathers them all */
+    replay_stats stats[TRACE_NUM_OPS];
+    trace_reader *reader;
+    double speed = 1.0;
+    double begun, due, wait, start, elapsed;
+    double max_lag = 0.0;
+    int i, got, ok;
+    int result = 1;
+
+    if (argc == 3) {
+        speed = strcmp(argv[2], "max") == 0 ? 0.0 : atof(argv[2]);
+    }
+    if (argc < 2 || argc > 3 || speed < 0.0) {
+        fprintf(stderr, "Usage: replay TRACE [SPEED|max]\n");
+        return(0);
+    }
+    reader = trace_open(argv[1]);
+    if (!reader) {
+        return(0);
+    }
+
+    memset(stats, 0, sizeof(stats));
+    begun = now_ms();
+    while ((got = trace_read(reader, &rec)) == 1) {
+        if (speed > 0.0) {
+            due = begun + rec.at_us / 1000.0 / speed;
+            wait = due - now_ms();
+            if (wait > 0.0) {
+                usleep((useconds_t)(wait * 1000.0));
+            } else if (-wait > max_lag) {
+                max_lag = -wait;
+            }
+        }
+        start = now_ms();
+        ok = replay_one(be, &rec);
+        elapsed = now_ms() - start;
+        if (!add_latency(&stats[rec.op], elapsed, ok) ||
+            !add_latency(&stats[0], elapsed, ok)) {
+            fprintf(stderr, "Out of memory\n");
+            got = -1;
+            break;
+        }
+    }
+    elapsed = now_ms() - begun;
+    trace_close(reader);
+    if (got < 0) {
+        result = 0;
+    }
+
+    printf("Replayed %d operations on %s in %.1f ms, %.0f operations/s\n",
+           stats[0].count, be->spec, elapsed,
+           stats[0].count * 1000.0 / (elapsed > 0 ? elapsed : 1));
+    if (speed > 0.0) {
+        printf("At %g times the recorded speed, up to %.1f ms behind\n",
+               speed, max_lag);
+    }
+    printf("%-10s %8s %8s %10s %10s %10s %10s %10s\n", "operation", "count",
+           "failed", "mean ms", "p50", "p95", "p99", "max");
+    for (i = 1; i < TRACE_NUM_OPS; i++) {
+        print_latencies(trace_op_name(i), &stats[i]);
+    }
+    print_latencies("all", &stats[0]);
+    for (i = 0; i < TRACE_NUM_OPS; i++) {
+        free(stats[i].ms);
+    }
+    return(result);
+}
+
+/* Looking every CD up again checks the index as well as timing it. The
+   size of the same CDs and tracks as catalog records is shown alongside. */
+static int cmd_load(catalog_backend *be, int argc, char *argv[])
+{
+    const mem_cd *cd;
+    mem_stats stats;
+    cat_mem *mem;
+    double start, load_ms, lookup_ms, free_ms;
+    uint32_t n;
+    int misses = 0;
+
+    start = now_ms();
+    mem = mem_load(be);
+    if (!mem) {
+        return(0);
+    }
+    load_ms = now_ms() - start;
+    mem_get_stats(mem, &stats);
+
+    start = now_ms();
+    for (n = 0; n < mem_num_cds(mem); n++) {
+        cd = mem_cd_at(mem, n);
+        if (mem_get_cd(mem, cd->catalog) != cd) {
+            misses++;
+        }
+    }
+    lookup_ms = now_ms() - start;
+
+    start = now_ms();
+    mem_free(mem);
+    free_ms = now_ms() - start;
+
+    printf("Loaded %u CDs and %u tracks in %.1f ms\n", stats.num_cds,
+           stats.num_tracks, load_ms);
+    printf("%u distinct strings for %u fields, %.0f KB in %d blocks "
+           "(%.0f KB as catalog records)\n", stats.num_strings,
+           stats.string_refs, stats.arena_size / 1024.0, stats.arena_blocks,
+           (stats.num_cds * (double)sizeof(cat_cd) +
+            stats.num_tracks * (double)sizeof(cat_track)) / 1024.0);
+    printf("Looked up every CD in %.1f ms, freed in %.1f us\n", lookup_ms,
+           free_ms * 1000.0);
+    if (misses) {
+        printf("%d CDs not found again\n", misses);
+    }
+    return(misses == 0);
+}
+
+/* Succeeds if the store was clean, or everything found was repaired */
+static int cmd_fsck(catalog_backend *be, int argc, char *argv[])
+{
+    fsck_result result;
+    double start, check_ms;
+    int repair = 0, num_threads = 0, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: fsck [-r] [-j N]\n");
+            return(0);
+        }
+    }
+
+    start = now_ms();
+    if (!fsck_run(be, num_threads, repair, print_problem, NULL, &result)) {
+        fprintf(stderr, "Sorry, unable to check the catalog\n");
+        return(0);
+    }
+    check_ms = now_ms() - start;
+
+    printf("%u CDs", result.num_cds);
+    if (result.tracks_checked) {
+        printf(" and %llu tracks", (unsigned long long)result.num_tracks);
+    }
+    printf(" checked in %.1f ms\n", check_ms);
+    if (!result.tracks_checked) {
+        printf("This store can't list its tracks, so only the CDs were checked\n");
+    }
+    if (!fsck_problems(&result)) {
+        printf("No problems found\n");
+        return(1);
+    }
+    printf("%u CDs stored more than once, %llu tracks of %u missing CDs, "
+           "%u CDs with a track number used twice, %u with tracks not numbered "
+           "from 1, %llu tracks numbered outside 1-%d\n",
+           result.duplicate_cds, (unsigned long long)result.orphan_tracks,
+           result.orphan_catalogs, result.repeated_cds, result.gapped_cds,
+           (unsigned long long)result.bad_numbers, CATALOG_MAX_TRACKS);
+    if (!repair) {
+        return(0);
+    }
+    printf("Repaired %u, %u failed\n", result.repaired, result.repair_failures);
+    return(result.repair_failures == 0);
+}
+
+static int cmd_import(catalog_backend *be, int argc, char *argv[])
+{
+    freedb_result result;
+    int num_threads = 0, batch_size = 0, i;
+
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            batch_size = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (argc < 2 || i < argc) {
+        fprintf(stderr, "Usage: import DIR [-j N] [-B N]\n");
+        return(0);
+    }
+
+    if (!freedb_import(be, argv[1], num_threads, batch_size, print_progress, NULL,
+                       &result)) {
+        fprintf(stderr, "Sorry, unable to read %s\n", argv[1]);
+        return(0);
+    }
+    printf("Read %llu files in %.1f s, %.0f files/s\n",
+           (unsigned long long)result.files, result.elapsed_ms / 1000.0,
+           result.elapsed_ms > 0 ? result.files * 1000.0 / result.elapsed_ms : 0.0);
+    printf("Imported %llu discs, %llu tracks read; %llu files unreadable, "
+           "%llu discs refused by the store\n",
+           (unsigned long long)result.discs, (unsigned long long)result.tracks,
+           (unsigned long long)result.unreadable, (unsigned long long)result.refused);
+    return(result.files > 0 && result.discs > 0);
+}
+
+/* The sort file for the key, sorted again first if the store changed */
+static cat_sorted *open_sorted(catalog_backend *be, const char *key_name)
+{
+    char path[FILENAME_MAX];
+    sort_key key;
+
+    if (!sort_key_from_name(key_name, &key)) {
+        fprintf(stderr, "Can only sort by title, artist or catalog\n");
+        return(NULL);
+    }
+    snprintf(path, sizeof(path), SORT_FILE, key_name);
+    return(sort_open(be, key, path, &sort_opts));
+}
+
+/* FIELD=VALUE, FIELD~SUBSTRING, tracks<N or tracks>N */
+static int parse_predicate(const char *arg, cols_pred *pred)
+{
+    static const struct {
+        const char *name;
+        cols_field field;
+    } fields[] = {
+        { "catalog", COLS_CATALOG },
+        { "title",   COLS_TITLE },
+        { "type",    COLS_TYPE },
+        { "artist",  COLS_ARTIST },
+        { "tracks",  COLS_TRACKS },
+        { NULL,      COLS_CATALOG }
+    };
+    size_t name_len = strcspn(arg, "=~<>");
+    int i;
+
+    for (i = 0; fields[i].name; i++) {
+        if (strlen(fields[i].name) == name_len &&
+            strncmp(fields[i].name, arg, name_len) == 0) {
+            break;
+        }
+    }
+    if (!fields[i].name) {
+        return(0);
+    }
+    pred->field = fields[i].field;
+    switch (arg[name_len]) {
+    case '=': pred->op = COLS_EQ; break;
+    case '~': pred->op = COLS_CONTAINS; break;
+    case '<': pred->op = COLS_LT; break;
+    case '>': pred->op = COLS_GT; break;
+    default: return(0);
+    }
+    pred->value = arg + name_len + 1;
+    return(1);
+}
+
+static int print_cd(const cat_cd *cd, void *arg)
+{
+    printf("%s,%s,%s,%s\n", cd->catalog, cd->title, cd->type, cd->artist);
+    return(1);
+}
+
+static int count_cd(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    walk_state *ws = arg;
+
+    ws->count++;
+    ws->tracks += catalog_get_tracks(ws->from, cd->catalog, tracks,
+                                          CATALOG_MAX_TRACKS);
+    return(1);
+}
+
+static int match_cd(const cat_cd *cd, void *arg)
+{
+    (*(int *)arg)++;
+    return(1);
+}
+
+static void print_problem(const char *catalog, const char *problem, void *arg)
+{
+    printf("%s: %s\n", catalog, problem);
+}
+
+static void print_progress(const freedb_result *so_far, void *arg)
+{
+    fprintf(stderr, "%llu files, %llu discs, %.0f files/s\n",
+            (unsigned long long)so_far->files, (unsigned long long)so_far->discs,
+            so_far->files * 1000.0 / so_far->elapsed_ms);
+}
+
+static int copy_cd(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    walk_state *ws = arg;
+    int count;
+
+    count = catalog_get_tracks(ws->from, cd->catalog, tracks, CATALOG_MAX_TRACKS);
+    if (catalog_put_cd(ws->to, cd) &&
+        catalog_put_tracks(ws->to, cd->catalog, tracks, count)) {
+        ws->count++;
+    } else {
+        fprintf(stderr, "Failed to copy %s\n", cd->catalog);
+        ws->failures++;
+    }
+    return(1);
+}
+
+static int compare_cd(const cat_cd *cd, void *arg)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS], other_tracks[CATALOG_MAX_TRACKS];
+    walk_state *ws = arg;
+    cat_cd other;
+    int count, other_count, i;
+    int same;
+
+    ws->count++;
+    if (!catalog_get_cd(ws->to, cd->catalog, &other)) {
+        printf("%s: only in %s\n", cd->catalog, ws->from->spec);
+        ws->differences++;
+        return(1);
+    }
+
+    same = strcmp(cd->title, other.title) == 0 &&
+           strcmp(cd->artist, other.artist) == 0 &&
+           strcmp(cd->disc_id, other.disc_id) == 0;
+    /* a store without types can't disagree about them */
+    if (ws->from->ops->has_type && ws->to->ops->has_type &&
+        strcmp(cd->type, other.type) != 0) {
+        same = 0;
+    }
+    count = catalog_get_tracks(ws->from, cd->catalog, tracks, CATALOG_MAX_TRACKS);
+    other_count = catalog_get_tracks(ws->to, cd->catalog, other_tracks,
+                                     CATALOG_MAX_TRACKS);
+    if (count != other_count) {
+        same = 0;
+    }
+    for (i = 0; same && i < count; i++) {
+        if (strcmp(tracks[i].title, other_tracks[i].title) != 0) {
+            same = 0;
+        }
+    }
+    if (!same) {
+        printf("%s: differs\n", cd->catalog);
+        ws->differences++;
+    }
+    return(1);
+}
+
+static int missing_cd(const cat_cd *cd, void *arg)
+{
+    walk_state *ws = arg;
+    cat_cd other;
+
+    if (!catalog_get_cd(ws->to, cd->catalog, &other)) {
+        printf("%s: only in %s\n", cd->catalog, ws->from->spec);
+        ws->count++;
+        ws->differences++;
+    }
+    return(1);
+}
+
+/* Add num_cds CDs of BENCH_TRACKS tracks, read them all back in a scattered
+   order, scan the catalog, then delete them again. The CDs are named
+   BENCHnnnnnn, so an existing catalog is left as it was. */
+static void bench_one(const char *spec, int num_cds)
+{
+    cat_track tracks[BENCH_TRACKS];
+    cat_track got[CATALOG_MAX_TRACKS];
+    catalog_backend *be;
+    walk_state ws;
+    double start, put_ms, get_ms, scan_ms, del_ms;
+    char key[CATALOG_CAT_LEN + 1];
+    cat_cd cd;
+    int i, j, n;
+
+    be = catalog_open(spec, 0);
+    if (!be) {
+        printf("%-20s %10s\n", spec, "unavailable");
+        return;
+    }
+
+    start = now_ms();
+    for (i = 0; i < num_cds; i++) {
+        memset(&cd, '\0', sizeof(cd));
+        sprintf(cd.catalog, "BENCH%06d", i);
+        sprintf(cd.title, "Bench title %d", i);
+        strcpy(cd.type, "bench");
+        sprintf(cd.artist, "Bench artist %d", i % BENCH_ARTISTS);
+        memset(tracks, '\0', sizeof(tracks));
+        for (j = 0; j < BENCH_TRACKS; j++) {
+            strcpy(tracks[j].catalog, cd.catalog);
+            tracks[j].track_no = j + 1;
+            sprintf(tracks[j].title, "Track %d of %s", j + 1, cd.catalog);
+        }
+        catalog_put_cd(be, &cd);
+        catalog_put_tracks(be, cd.catalog, tracks, BENCH_TRACKS);
+    }
+    put_ms = now_ms() - start;
+
+    /* visit every CD once, in an order unrelated to insertion */
+    start = now_ms();
+    for (i = 0; i < num_cds; i++) {
+        n = (int)(((long long)i * 7919) % num_cds);
+        sprintf(key, "BENCH%06d", n);
+        catalog_get_cd(be, key, &cd);
+        catalog_get_tracks(be, key, got, CATALOG_MAX_TRACKS);
+    }
+    get_ms = now_ms() - start;
+
+    memset(&ws, 0, sizeof(ws));
+    ws.from = be;
+    start = now_ms();
+    catalog_scan(be, count_cd, &ws);
+    scan_ms = now_ms() - start;
+
+    start = now_ms();
+    for (i = 0; i < num_cds; i++) {
+        sprintf(key, "BENCH%06d", i);
+        catalog_del_cd(be, key);
+    }
+    del_ms = now_ms() - start;
+    catalog_close(be);
+
+    printf("%-20s %10.0f %10.0f %10.1f %10.0f\n", spec,
+           num_cds * 1000.0 / (put_ms > 0 ? put_ms : 1),
+           num_cds * 1000.0 / (get_ms > 0 ? get_ms : 1),
+           scan_ms,
+           num_cds * 1000.0 / (del_ms > 0 ? del_ms : 1));
+}
+
+/* Each operation the way the frontend that recorded it would do it. Not
+   finding a CD or track list counts as failing, as it did there. */
+static int replay_one(catalog_backend *be, const trace_rec *rec)
+{
+    cat_track tracks[CATALOG_MAX_TRACKS];
+    char expr[FILTER_LEN];
+    cat_filter *filter;
+    walk_state ws;
+    cat_cd cd;
+    int matches = 0;
+    int result;
+
+    switch (rec->op) {
+    case TRACE_GET:
+        return(catalog_get_cd(be, rec->text, &cd));
+    case TRACE_TRACKS:
+        return(catalog_get_tracks(be, rec->text, tracks, CATALOG_MAX_TRACKS) > 0);
+    case TRACE_FIND:
+        find_expr(expr, rec->field, rec->text);
+        filter = filter_compile(expr, rec->ignore_case ? FILTER_IGNORE_CASE : 0);
+        if (!filter) {
+            return(0);
+        }
+        result = catalog_find(be, filter, match_cd, &matches);
+        filter_free(filter);
+        return(result && matches > 0);
+    case TRACE_LIST:
+        return(catalog_scan(be, match_cd, &matches));
+    case TRACE_COUNT:
+        memset(&ws, 0, sizeof(ws));
+        ws.from = be;
+        return(catalog_scan(be, count_cd, &ws));
+    case TRACE_PUT:
+        return(catalog_put_cd(be, &rec->cd));
+    case TRACE_PUT_TRACKS:
+        return(catalog_put_tracks(be, rec->text, rec->tracks, rec->num_tracks));
+    case TRACE_DEL:
+        return(catalog_del_cd(be, rec->text));
+    default:
+        return(0);
+    }
+}
+
+/* A substring test on one field, or a bare word for any of them, with the
+   text quoted so that nothing in it is taken for the filter syntax */
+static void find_expr(char *expr, int field, const char *text)
+{
+    static const char *const field_names[FILTER_NUM_FIELDS] = {
+        "catalog", "title", "type", "artist"
+    };
+    char *out = expr;
+
+    if (field < TRACE_ANY_FIELD) {
+        out += sprintf(out, "%s~", field_names[field]);
+    }
+    *out++ = '"';
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            *out++ = '\\';
+        }
+        *out++ = *text;
+    }
+    *out++ = '"';
+    *out = '\0';
+}
+
+static int add_latency(replay_stats *stats, double ms, int ok)
+{
+    double *bigger;
+
+    if (stats->count == stats->size) {
+        stats->size = stats->size ? stats->size * 2 : 1024;
+        bigger = realloc(stats->ms, stats->size * sizeof(double));
+        if (!bigger) {
+            return(0);
+        }
+        stats->ms = bigger;
+    }
+    stats->ms[stats->count++] = ms;
+    if (!ok) {
+        stats->failed++;
+    }
+    return(1);
+}
+
+/* Percentiles by nearest rank, which sorts the latencies in place */
+static void print_latencies(const char *name, replay_stats *stats)
+{
+    static const double ranks[] = { 0.50, 0.95, 0.99 };
+    double total = 0.0;
+    int i, rank;
+
+    if (stats->count == 0) {
+        return;
+    }
+    qsort(stats->ms, stats->count, sizeof(double), compare_ms);
+    for (i = 0; i < stats->count; i++) {
+        total += stats->ms[i];
+    }
+    printf("%-10s %8d %8d %10.3f", name, stats->count, stats->failed,
+           total / stats->count);
+    for (i = 0; i < 3; i++) {
+        rank = (int)(ranks[i] * stats->count + 0.999999) - 1;
+        printf(" %10.3f", stats->ms[rank < 0 ? 0 : rank]);
+    }
+    printf(" %10.3f\n", stats->ms[stats->count - 1]);
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return((x > y) - (x < y));
+}
+
+static double now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return(tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0);
+}
+
+static void usage(const char *prog_name)
+{
+    int i;
+
+    fprintf(stderr, "Usage: %s [-b backend[:location]] [-m KB] [-t DIR] command [args]\n",
+            prog_name);
+    fprintf(stderr, "  -m KB   memory browse and export sort in, -t DIR  where they spill to\n");
+    fprintf(stderr, "Backends: %s\n", catalog_backend_names());
+    fprintf(stderr, "Commands:\n");
+    for (i = 0; commands[i].name; i++) {
+        fprintf(stderr, "  %s\n", commands[i].help);
+    }
+}
@@ -0,0 +1,1177 @@
+/*
+   cdserve holds the text catalog of a directory in memory and answers
+   clients over a Unix socket (see cat_client.h), so that every
+   mini_cd_manager -s shares one copy of the files, parsed once, instead
+   of each reading them again for every find and count.
+
+       cdserve [-d DIR] [-s SOCKET] [-w MS] [-m METRICS_FILE] [-M METRICS_SOCKET]
+
+   DIR holds title.cdb and tracks.cdb, "." by default, and the socket is
+   DIR/cdserve.sock unless -s says otherwise. The counts and times of the
+   requests and commits go to the metrics file and socket (see
+   cat_stats.h).
+
+   It is one thread around epoll. Each connection's requests are answered
+   in order as they arrive, as many as have arrived, and the replies go
+   out together. A change is made in memory at once, so any request after
+   it sees it, but its reply, and any reply after it on that connection,
+   is held back until the change is in the files. The files are rewritten
+   from memory, at most once every MS milliseconds (5 by default), for
+   all the changes made since the last time: group commit. A CD that
+   hasn't been changed keeps the lines it was read from, so fields longer
+   than a cat_cd holds aren't cut, and so do lines of title.cdb that
+   aren't a CD or repeat one.
+
+   While it runs cdserve owns the files; mini_cd_manager without -s
+   shouldn't change them at the same time.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "catalog.h"
+#include "cat_text.h"
+#include "cat_io.h"
+#include "cat_client.h"
+#include "cat_complete.h"
+#include "cat_stats.h"
+
+#define COMMIT_MS       5
+#define MAX_EVENTS      64
+#define READ_SIZE       65536
+#define OUT_LIMIT       (4 * 1024 * 1024)   /* stop reading a client this far behind */
+#define MIN_BUCKETS     1024
+#define MAX_ENTRY       1024
+#define MAX_PATH        1024
+#define MAX_COMPLETIONS 100
+
+typedef struct {
+    int track_no;
+    char title[CATALOG_TRACK_LEN + 1];
+} serve_track;
+
+/* A slot whose catalog is empty is only a line of title.cdb, kept as it
+   was; it isn't in a bucket */
+typedef struct serve_cd {
+    cat_cd cd;
+    char title_key[CATALOG_TITLE_LEN + 1];  /* folded, for SERVE_FIND */
+    int slot;                   /* its place in title.cdb */
+    int num_tracks;
+    serve_track *tracks;
+    char *line;                 /* of title.cdb as read, until it changes */
+    char *track_lines;          /* of tracks.cdb as read, until they change */
+    struct serve_cd *next;      /* in its hash bucket */
+} serve_cd;
+
+/* A client. Replies are added to out as requests are answered; only the
+   first sendable bytes may go, the rest wait for a commit. */
+typedef struct {
+    int fd;
+    int index;                  /* in conns */
+    uint32_t events;            /* those epoll is watching for */
+    int waiting_commit;
+    int failed;                 /* out of memory for its replies */
+    char *in;
+    size_t in_len;
+    size_t in_size;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    size_t out_sent;
+    size_t sendable;
+    size_t reply_start;         /* of the reply being built */
+} serve_conn;
+
+/* The catalog. slots is in file order, with NULL where a CD was removed. */
+static serve_cd **slots;
+static int num_slots;
+static int slots_size;
+static serve_cd **buckets;
+static int num_buckets;
+static int num_cds;
+static int num_tracks;
+/* Lines of tracks.cdb for no CD, kept as they were */
+static char **orphans;
+static int num_orphans;
+static cat_complete *completions;
+
+static char title_path[MAX_PATH];
+static char tracks_path[MAX_PATH];
+static int commit_ms = COMMIT_MS;
+static int dirty;
+static double dirty_since;
+
+static int epoll_fd;
+static serve_conn **conns;
+static int num_conns;
+static int conns_size;
+static volatile sig_atomic_t stopping;
+
+static int load_catalog(void);
+static int add_track_line(char *line);
+static int commit(void);
+static int write_titles(const char *path);
+static int write_tracks(const char *path);
+static int sync_rename(FILE *fp, const char *temp, const char *path);
+static serve_cd *find_cd(const char *catalog);
+static serve_cd *insert_cd(const cat_cd *cd);
+static serve_cd *add_slot(void);
+static void remove_cd(serve_cd *cd);
+static int grow_buckets(void);
+static uint32_t cd_hash(const char *catalog);
+static int compare_serve_track(const void *a, const void *b);
+static int open_socket(const char *path);
+static void accept_clients(int listen_fd);
+static void close_conn(serve_conn *conn);
+static void read_requests(serve_conn *conn);
+static int answer_requests(serve_conn *conn);
+static void answer(serve_conn *conn, char *body, size_t len);
+static stats_op request_op(int op);
+static void answer_complete(serve_conn *conn, const char *prefix, int max);
+static void changed(serve_conn *conn);
+static int reply_begin(serve_conn *conn, int status);
+static void reply_field(serve_conn *conn, const char *field);
+static void reply_cd(serve_conn *conn, const cat_cd *cd);
+static void reply_end(serve_conn *conn);
+static void reply_error(serve_conn *conn, const char *reason);
+static int reserve(serve_conn *conn, size_t extra);
+static int send_replies(serve_conn *conn);
+static void watch(serve_conn *conn);
+static double now_ms(void);
+static void stop(int sig);
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    struct sigaction sa;
+    char socket_path[MAX_PATH];
+    const char *dir = ".";
+    const char *sock = NULL;
+    const char *metrics_file = NULL;
+    const char *metrics_socket = NULL;
+    double since;
+    int listen_fd;
+    int c, i, n, timeout;
+
+    while ((c = getopt(argc, argv, "d:s:w:m:M:")) != -1) {
+        switch (c) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            sock = optarg;
+            break;
+        case 'w':
+            commit_ms = atoi(optarg);
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'M':
+            metrics_socket = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d DIR] [-s SOCKET] [-w MS] [-m METRICS_FILE] "
+                    "[-M METRICS_SOCKET]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(title_path, sizeof(title_path), "%s/%s", dir, TEXT_TITLE_FILE);
+    snprintf(tracks_path, sizeof(tracks_path), "%s/%s", dir, TEXT_TRACKS_FILE);
+    if (sock) {
+        snprintf(socket_path, sizeof(socket_path), "%s", sock);
+    } else {
+        snprintf(socket_path, sizeof(socket_path), "%s/%s", dir, SERVE_SOCKET);
+    }
+
+    if (!load_catalog()) {
+        exit(EXIT_FAILURE);
+    }
+    listen_fd = open_socket(socket_path);
+    if (listen_fd == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if ((metrics_file || metrics_socket) &&
+        !stats_start("cdserve", metrics_file, metrics_socket)) {
+        unlink(socket_path);
+        exit(EXIT_FAILURE);
+    }
+    epoll_fd = epoll_create1(0);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("epoll");
+        unlink(socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* No SA_RESTART, so a signal ends epoll_wait */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving %d CDs and %d tracks from %s on %s\n", num_cds, num_tracks,
+           dir, socket_path);
+    fflush(stdout);
+
+    while (!stopping) {
+        timeout = -1;
+        if (dirty) {
+            since = now_ms() - dirty_since;
+            timeout = since >= commit_ms ? 0 : (int)(commit_ms - since) + 1;
+        }
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr) {
+                accept_clients(listen_fd);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+                       !(events[i].events & EPOLLIN)) {
+                close_conn(events[i].data.ptr);
+            } else {
+                if (events[i].events & EPOLLOUT && !send_replies(events[i].data.ptr)) {
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    read_requests(events[i].data.ptr);
+                }
+            }
+        }
+        if (dirty && now_ms() - dirty_since >= commit_ms) {
+            commit();
+        }
+    }
+
+    if (dirty && !commit()) {
+        fprintf(stderr, "The last changes were not written\n");
+    }
+    stats_stop();
+    unlink(socket_path);
+    exit(dirty ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Missing files are an empty catalog, as in mini_cd_manager */
+static int load_catalog(void)
+{
+    char line[MAX_ENTRY];
+    char copy[MAX_ENTRY];
+    cat_reader *reader;
+    serve_cd *added;
+    cat_cd cd;
+    int i, kept = 0;
+
+    num_buckets = MIN_BUCKETS;
+    buckets = calloc(num_buckets, sizeof(*buckets));
+    if (!buckets) {
+        return(0);
+    }
+
+    reader = io_open_read(title_path);
+    if (reader) {
+        while (io_gets(line, sizeof(line), reader)) {
+            strcpy(copy, line);
+            copy[strcspn(copy, "\n")] = '\0';
+            if (!text_parse_title(line, &cd) || find_cd(cd.catalog)) {
+                kept += copy[0] != '\0';
+                added = add_slot();
+            } else {
+                added = insert_cd(&cd);
+            }
+            if (!added || !(added->line = strdup(copy))) {
+                io_close_read(reader);
+                return(0);
+            }
+        }
+        if (!io_close_read(reader)) {
+            fprintf(stderr, "Unable to read %s\n", title_path);
+            return(0);
+        }
+    } else if (errno != ENOENT) {
+        perror(title_path);
+        return(0);
+    }
+
+    reader = io_open_read(tracks_path);
+    if (reader) {
+        while (io_gets(line, sizeof(line), reader)) {
+            if (!add_track_line(line)) {
+                io_close_read(reader);
+                return(0);
+            }
+        }
+        if (!io_close_read(reader)) {
+            fprintf(stderr, "Unable to read %s\n", tracks_path);
+            return(0);
+        }
+    } else if (errno != ENOENT) {
+        perror(tracks_path);
+        return(0);
+    }
+
+    for (i = 0; i < num_slots; i++) {
+        qsort(slots[i]->tracks, slots[i]->num_tracks, sizeof(serve_track),
+              compare_serve_track);
+    }
+    if (kept) {
+        fprintf(stderr, "%d lines of %s aren't CDs or repeat a catalog number; "
+                "they are kept but not served\n", kept, title_path);
+    }
+    return(1);
+}
+
+static int add_track_line(char *line)
+{
+    char copy[MAX_ENTRY];
+    serve_track *bigger;
+    cat_track track;
+    serve_cd *cd;
+    char **more;
+    char *lines;
+    size_t len, old_len;
+
+    if (text_free_slot(line)) {
+        return(1);
+    }
+    strcpy(copy, line);
+    copy[strcspn(copy, "\n")] = '\0';
+    if (text_parse_track(line, &track) && (cd = find_cd(track.catalog)) != NULL) {
+        len = strlen(copy);
+        old_len = cd->track_lines ? strlen(cd->track_lines) : 0;
+        lines = realloc(cd->track_lines, old_len + len + 2);
+        if (!lines) {
+            return(0);
+        }
+        memcpy(lines + old_len, copy, len);
+        strcpy(lines + old_len + len, "\n");
+        cd->track_lines = lines;
+        if ((cd->num_tracks & (cd->num_tracks - 1)) == 0) {
+            bigger = realloc(cd->tracks, (cd->num_tracks ? cd->num_tracks * 2 : 1) *
+                             sizeof(*bigger));
+            if (!bigger) {
+                return(0);
+            }
+            cd->tracks = bigger;
+        }
+        cd->tracks[cd->num_tracks].track_no = track.track_no;
+        strcpy(cd->tracks[cd->num_tracks].title, track.title);
+        cd->num_tracks++;
+        num_tracks++;
+        return(1);
+    }
+    if ((num_orphans & (num_orphans - 1)) == 0) {
+        more = realloc(orphans, (num_orphans ? num_orphans * 2 : 1) * sizeof(*more));
+        if (!more) {
+            return(0);
+        }
+        orphans = more;
+    }
+    orphans[num_orphans] = strdup(copy);
+    return(orphans[num_orphans++] != NULL);
+}
+
+/* Write both files from memory, then let the clients waiting on it have
+   their replies. On failure the changes stay pending and are tried again
+   after another commit_ms. */
+static int commit(void)
+{
+    char temp[MAX_PATH + 8];
+    uint64_t started = stats_clock();
+    int i, j;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", title_path);
+    if (!write_titles(temp)) {
+        dirty_since = now_ms();
+        stats_record(STATS_SERVE_COMMIT, started, 0);
+        return(0);
+    }
+    snprintf(temp, sizeof(temp), "%s.tmp", tracks_path);
+    if (!write_tracks(temp)) {
+        dirty_since = now_ms();
+        stats_record(STATS_SERVE_COMMIT, started, 0);
+        return(0);
+    }
+    dirty = 0;
+    stats_record(STATS_SERVE_COMMIT, started, 1);
+
+    /* close up the slots of removed CDs once they are a quarter */
+    if (num_slots - num_cds > num_slots / 4) {
+        for (i = 0, j = 0; i < num_slots; i++) {
+            if (slots[i]) {
+                slots[i]->slot = j;
+                slots[j++] = slots[i];
+            }
+        }
+        num_slots = j;
+    }
+
+    /* from the end, as a client that has gone is closed on the way */
+    for (i = num_conns - 1; i >= 0; i--) {
+        if (conns[i]->waiting_commit) {
+            conns[i]->waiting_commit = 0;
+            conns[i]->sendable = conns[i]->out_len;
+            send_replies(conns[i]);
+        }
+    }
+    return(1);
+}
+
+static int write_titles(const char *path)
+{
+    const cat_cd *cd;
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return(0);
+    }
+    setvbuf(fp, NULL, _IOFBF, IO_BLOCK);
+    for (i = 0; i < num_slots; i++) {
+        if (slots[i] && slots[i]->line) {
+            fprintf(fp, "%s\n", slots[i]->line);
+        } else if (slots[i]) {
+            cd = &slots[i]->cd;
+            fprintf(fp, "%s,%s,%s,%s\n", cd->catalog, cd->title, cd->type, cd->artist);
+        }
+    }
+    return(sync_rename(fp, path, title_path));
+}
+
+static int write_tracks(const char *path)
+{
+    char line[MAX_ENTRY];
+    const serve_cd *cd;
+    FILE *fp;
+    int i, j;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return(0);
+    }
+    setvbuf(fp, NULL, _IOFBF, IO_BLOCK);
+    for (i = 0; i < num_slots; i++) {
+        cd = slots[i];
+        if (cd && cd->track_lines) {
+            fputs(cd->track_lines, fp);
+            continue;
+        }
+        for (j = 0; cd && j < cd->num_tracks; j++) {
+            text_track_line(line, sizeof(line), cd->cd.catalog,
+                            cd->tracks[j].track_no, cd->tracks[j].title);
+            fputs(line, fp);
+        }
+    }
+    for (i = 0; i < num_orphans; i++) {
+        fprintf(fp, "%s\n", orphans[i]);
+    }
+    return(sync_rename(fp, path, tracks_path));
+}
+
+/* A reply promises the change is on disk, so the file is synced before it
+   replaces the old one */
+static int sync_rename(FILE *fp, const char *temp, const char *path)
+{
+    int ok;
+
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(temp, path) != 0) {
+        perror(path);
+        unlink(temp);
+        return(0);
+    }
+    return(1);
+}
+
+static serve_cd *find_cd(const char *catalog)
+{
+    serve_cd *cd;
+
+    for (cd = buckets[cd_hash(catalog) & (num_buckets - 1)]; cd; cd = cd->next) {
+        if (strcmp(cd->cd.catalog, catalog) == 0) {
+            return(cd);
+        }
+    }
+    return(NULL);
+}
+
+static serve_cd *insert_cd(const cat_cd *cd)
+{
+    serve_cd *new_cd;
+    uint32_t bucket;
+
+    if (num_cds >= num_buckets && !grow_buckets()) {
+        return(NULL);
+    }
+    new_cd = add_slot();
+    if (!new_cd) {
+        return(NULL);
+    }
+    new_cd->cd = *cd;
+    catalog_fold(new_cd->title_key, cd->title, CATALOG_TITLE_LEN);
+    bucket = cd_hash(cd->catalog) & (num_buckets - 1);
+    new_cd->next = buckets[bucket];
+    buckets[bucket] = new_cd;
+    num_cds++;
+    return(new_cd);
+}
+
+/* An empty one at the end of title.cdb */
+static serve_cd *add_slot(void)
+{
+    serve_cd **bigger;
+    serve_cd *new_cd;
+
+    if (num_slots == slots_size) {
+        slots_size = slots_size ? slots_size * 2 : 1024;
+        bigger = realloc(slots, slots_size * sizeof(*slots));
+        if (!bigger) {
+            return(NULL);
+        }
+        slots = bigger;
+    }
+    new_cd = calloc(1, sizeof(*new_cd));
+    if (!new_cd) {
+        return(NULL);
+    }
+    new_cd->slot = num_slots;
+    slots[num_slots++] = new_cd;
+    return(new_cd);
+}
+
+static void remove_cd(serve_cd *cd)
+{
+    serve_cd **link;
+
+    link = &buckets[cd_hash(cd->cd.catalog) & (num_buckets - 1)];
+    while (*link != cd) {
+        link = &(*link)->next;
+    }
+    *link = cd->next;
+    slots[cd->slot] = NULL;
+    num_cds--;
+    num_tracks -= cd->num_tracks;
+    free(cd->tracks);
+    free(cd->line);
+    free(cd->track_lines);
+    free(cd);
+}
+
+static int grow_buckets(void)
+{
+    int new_size = num_buckets * 2;
+    serve_cd **new_buckets;
+    serve_cd *cd, *next;
+    uint32_t bucket;
+    int i;
+
+    new_buckets = calloc(new_size, sizeof(*new_buckets));
+    if (!new_buckets) {
+        return(0);
+    }
+    for (i = 0; i < num_buckets; i++) {
+        for (cd = buckets[i]; cd; cd = next) {
+            next = cd->next;
+            bucket = cd_hash(cd->cd.catalog) & (new_size - 1);
+            cd->next = new_buckets[bucket];
+            new_buckets[bucket] = cd;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    num_buckets = new_size;
+    return(1);
+}
+
+/* FNV-1a */
+static uint32_t cd_hash(const char *catalog)
+{
+    uint32_t h = 2166136261u;
+
+    while (*catalog) {
+        h ^= (unsigned char)*catalog++;
+        h *= 16777619u;
+    }
+    return(h ^ (h >> 16));
+}
+
+static int compare_serve_track(const void *a, const void *b)
+{
+    return(((const serve_track *)a)->track_no - ((const serve_track *)b)->track_no);
+}
+
+/* A socket left by a server that has gone is removed; one that answers
+   belongs to a server still running */
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return(-1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return(-1);
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A server is already running on %s\n", path);
+        close(fd);
+        return(-1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        perror(path);
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+static void accept_clients(int listen_fd)
+{
+    struct epoll_event ev;
+    serve_conn **bigger;
+    serve_conn *conn;
+    int fd;
+
+    while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (num_conns == conns_size) {
+            conns_size = conns_size ? conns_size * 2 : 64;
+            bigger = realloc(conns, conns_size * sizeof(*conns));
+            if (!bigger) {
+                close(fd);
+                return;
+            }
+            conns = bigger;
+        }
+        conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            return;
+        }
+        conn->fd = fd;
+        conn->index = num_conns;
+        conn->events = EPOLLIN;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conns[num_conns++] = conn;
+    }
+}
+
+/* Any change it made stays, and is committed with the others */
+static void close_conn(serve_conn *conn)
+{
+    close(conn->fd);
+    conns[conn->index] = conns[--num_conns];
+    conns[conn->index]->index = conn->index;
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void read_requests(serve_conn *conn)
+{
+    char *bigger;
+    ssize_t got;
+
+    if (conn->in_size - conn->in_len < READ_SIZE) {
+        bigger = realloc(conn->in, conn->in_len + READ_SIZE);
+        if (!bigger) {
+            close_conn(conn);
+            return;
+        }
+        conn->in = bigger;
+        conn->in_size = conn->in_len + READ_SIZE;
+    }
+    do {
+        got = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1 && errno == EAGAIN) {
+        return;
+    }
+    if (got <= 0) {
+        close_conn(conn);
+        return;
+    }
+    conn->in_len += got;
+    answer_requests(conn);
+}
+
+/* Answer every whole request received, as long as the client is keeping
+   up with the replies. Epoll is level triggered, so what is left to read
+   is read on the next round. */
+static int answer_requests(serve_conn *conn)
+{
+    size_t pos = 0;
+    size_t out_before;
+    uint64_t started;
+    uint32_t len;
+    unsigned char *p;
+
+    while (conn->in_len - pos >= 4 && conn->out_len - conn->out_sent < OUT_LIMIT) {
+        p = (unsigned char *)conn->in + pos;
+        len = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        if (len == 0 || len > SERVE_MAX_FRAME) {
+            close_conn(conn);
+            return(0);
+        }
+        if (conn->in_len - pos - 4 < len) {
+            break;
+        }
+        /* a request fails if its reply is an error */
+        started = stats_clock();
+        out_before = conn->out_len;
+        answer(conn, conn->in + pos + 4, len);
+        stats_record(request_op(conn->in[pos + 4]), started,
+                     conn->out_len == out_before ||
+                     conn->out[conn->reply_start + 4] != SERVE_ERROR);
+        pos += 4 + len;
+        if (conn->failed) {
+            close_conn(conn);
+            return(0);
+        }
+    }
+    if (pos) {
+        memmove(conn->in, conn->in + pos, conn->in_len - pos);
+        conn->in_len -= pos;
+    }
+    return(send_replies(conn));
+}
+
+static void answer(serve_conn *conn, char *body, size_t len)
+{
+    char *args[SERVE_MAX_ARGS];
+    char number[20];
+    char key[CATALOG_TITLE_LEN + 1];
+    serve_cd *cd;
+    cat_cd new_cd;
+    serve_track *tracks = NULL;
+    int num_args, i;
+
+    num_args = serve_split(body + 1, len - 1, args, SERVE_MAX_ARGS);
+    if (num_args < 0) {
+        reply_error(conn, "malformed request");
+        return;
+    }
+
+    switch (body[0]) {
+    case SERVE_FIND:
+    case SERVE_LIST:
+        if (body[0] == SERVE_FIND && num_args != 1) {
+            break;
+        }
+        if (!reply_begin(conn, SERVE_OK)) {
+            return;
+        }
+        if (body[0] == SERVE_FIND) {
+            catalog_fold(key, args[0], CATALOG_TITLE_LEN);
+        }
+        for (i = 0; i < num_slots; i++) {
+            if (slots[i] && slots[i]->cd.catalog[0] &&
+                (body[0] == SERVE_LIST || strstr(slots[i]->title_key, key))) {
+                reply_cd(conn, &slots[i]->cd);
+            }
+        }
+        reply_end(conn);
+        return;
+
+    case SERVE_GET:
+    case SERVE_TRACKS:
+        if (num_args != 1) {
+            break;
+        }
+        cd = find_cd(args[0]);
+        if (!cd) {
+            reply_error(conn, "no such CD");
+            return;
+        }
+        if (!reply_begin(conn, SERVE_OK)) {
+            return;
+        }
+        if (body[0] == SERVE_GET) {
+            reply_cd(conn, &cd->cd);
+        } else {
+            for (i = 0; i < cd->num_tracks; i++) {
+                sprintf(number, "%d", cd->tracks[i].track_no);
+                reply_field(conn, number);
+                reply_field(conn, cd->tracks[i].title);
+            }
+        }
+        reply_end(conn);
+        return;
+
+    case SERVE_COUNT:
+        if (!reply_begin(conn, SERVE_OK)) {
+            return;
+        }
+        sprintf(number, "%d", num_cds);
+        reply_field(conn, number);
+        sprintf(number, "%d", num_tracks);
+        reply_field(conn, number);
+        reply_end(conn);
+        return;
+
+    case SERVE_COMPLETE:
+        if (num_args != 2) {
+            break;
+        }
+        answer_complete(conn, args[0], atoi(args[1]));
+        return;
+
+    /* As the text backend, which can only store commas in the artist */
+    case SERVE_PUT:
+        if (num_args != 4 || !args[0][0]) {
+            break;
+        }
+        if (strpbrk(args[0], ",\n") || strpbrk(args[1], ",\n") ||
+            strpbrk(args[2], ",\n") || strchr(args[3], '\n')) {
+            reply_error(conn, "only the artist may contain a comma");
+            return;
+        }
+        memset(&new_cd, '\0', sizeof(new_cd));
+        catalog_set_field(new_cd.catalog, args[0], CATALOG_CAT_LEN);
+        catalog_set_field(new_cd.title, args[1], CATALOG_TITLE_LEN);
+        catalog_set_field(new_cd.type, args[2], CATALOG_TYPE_LEN);
+        catalog_set_field(new_cd.artist, args[3], CATALOG_ARTIST_LEN);
+        cd = find_cd(new_cd.catalog);
+        if (cd) {
+            cd->cd = new_cd;
+            catalog_fold(cd->title_key, new_cd.title, CATALOG_TITLE_LEN);
+            free(cd->line);
+            cd->line = NULL;
+        } else if (!insert_cd(&new_cd)) {
+            reply_error(conn, "out of memory");
+            return;
+        }
+        changed(conn);
+        return;
+
+    case SERVE_PUT_TRACKS:
+        if (num_args < 1 || num_args - 1 > CATALOG_MAX_TRACKS) {
+            break;
+        }
+        cd = find_cd(args[0]);
+        if (!cd) {
+            reply_error(conn, "no such CD");
+            return;
+        }
+        for (i = 1; i < num_args; i++) {
+            if (strchr(args[i], '\n')) {
+                reply_error(conn, "track titles are one line");
+                return;
+            }
+        }
+        if (num_args > 1) {
+            tracks = malloc((num_args - 1) * sizeof(*tracks));
+            if (!tracks) {
+                reply_error(conn, "out of memory");
+                return;
+            }
+        }
+        for (i = 1; i < num_args; i++) {
+            tracks[i - 1].track_no = i;
+            catalog_set_field(tracks[i - 1].title, args[i], CATALOG_TRACK_LEN);
+        }
+        free(cd->tracks);
+        free(cd->track_lines);
+        cd->track_lines = NULL;
+        num_tracks += num_args - 1 - cd->num_tracks;
+        cd->tracks = tracks;
+        cd->num_tracks = num_args - 1;
+        changed(conn);
+        return;
+
+    case SERVE_DEL:
+        if (num_args != 1) {
+            break;
+        }
+        cd = find_cd(args[0]);
+        if (!cd) {
+            reply_error(conn, "no such CD");
+            return;
+        }
+        remove_cd(cd);
+        changed(conn);
+        return;
+    }
+    reply_error(conn, "unknown request");
+}
+
+static stats_op request_op(int op)
+{
+    switch (op) {
+    case SERVE_FIND:
+        return(STATS_SERVE_FIND);
+    case SERVE_LIST:
+        return(STATS_SERVE_LIST);
+    case SERVE_GET:
+        return(STATS_SERVE_GET);
+    case SERVE_TRACKS:
+        return(STATS_SERVE_TRACKS);
+    case SERVE_COUNT:
+        return(STATS_SERVE_COUNT);
+    case SERVE_COMPLETE:
+        return(STATS_SERVE_COMPLETE);
+    case SERVE_PUT:
+        return(STATS_SERVE_PUT);
+    case SERVE_PUT_TRACKS:
+        return(STATS_SERVE_PUT_TRACKS);
+    case SERVE_DEL:
+        return(STATS_SERVE_DEL);
+    }
+    return(STATS_SERVE_UNKNOWN);
+}
+
+/* The index is built again on the first completion after a change, which
+   is when a user starts typing a new search */
+static void answer_complete(serve_conn *conn, const char *prefix, int max)
+{
+    complete_match matches[MAX_COMPLETIONS];
+    uint32_t total;
+    char number[20];
+    int count, i;
+
+    if (!completions) {
+        completions = complete_new();
+        for (i = 0; completions && i < num_slots; i++) {
+            if (slots[i] && slots[i]->cd.catalog[0] &&
+                !complete_add(completions, &slots[i]->cd)) {
+                complete_free(completions);
+                completions = NULL;
+            }
+        }
+        if (completions && !complete_finish(completions)) {
+            complete_free(completions);
+            completions = NULL;
+        }
+        if (!completions) {
+            reply_error(conn, "out of memory");
+            return;
+        }
+    }
+    if (max < 0 || max > MAX_COMPLETIONS) {
+        max = MAX_COMPLETIONS;
+    }
+    count = complete_prefix(completions, prefix, matches, max, &total);
+    if (!reply_begin(conn, SERVE_OK)) {
+        return;
+    }
+    sprintf(number, "%u", total);
+    reply_field(conn, number);
+    for (i = 0; i < count; i++) {
+        reply_field(conn, matches[i].text);
+        reply_field(conn, matches[i].catalog);
+        reply_field(conn, matches[i].title);
+    }
+    reply_end(conn);
+}
+
+/* The reply to a change, and to anything after it, waits for the commit */
+static void changed(serve_conn *conn)
+{
+    conn->waiting_commit = 1;
+    if (reply_begin(conn, SERVE_OK)) {
+        reply_end(conn);
+    }
+    complete_free(completions);
+    completions = NULL;
+    if (!dirty) {
+        dirty = 1;
+        dirty_since = now_ms();
+    }
+}
+
+/* Replies are built in place: the length is filled in by reply_end */
+static int reply_begin(serve_conn *conn, int status)
+{
+    if (!reserve(conn, 5)) {
+        return(0);
+    }
+    conn->reply_start = conn->out_len;
+    conn->out[conn->out_len + 4] = status;
+    conn->out_len += 5;
+    return(1);
+}
+
+static void reply_field(serve_conn *conn, const char *field)
+{
+    size_t len = strlen(field) + 1;
+
+    if (reserve(conn, len)) {
+        memcpy(conn->out + conn->out_len, field, len);
+        conn->out_len += len;
+    }
+}
+
+static void reply_cd(serve_conn *conn, const cat_cd *cd)
+{
+    reply_field(conn, cd->catalog);
+    reply_field(conn, cd->title);
+    reply_field(conn, cd->type);
+    reply_field(conn, cd->artist);
+}
+
+static void reply_end(serve_conn *conn)
+{
+    unsigned char *p;
+    size_t len;
+
+    if (conn->failed) {
+        return;
+    }
+    len = conn->out_len - conn->reply_start - 4;
+    if (len > SERVE_MAX_FRAME) {
+        conn->out_len = conn->reply_start;
+        reply_error(conn, "reply too long");
+        return;
+    }
+    p = (unsigned char *)conn->out + conn->reply_start;
+    p[0] = (len >> 24) & 0xff;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+    if (!conn->waiting_commit) {
+        conn->sendable = conn->out_len;
+    }
+}
+
+static void reply_error(serve_conn *conn, const char *reason)
+{
+    if (reply_begin(conn, SERVE_ERROR)) {
+        reply_field(conn, reason);
+        reply_end(conn);
+    }
+}
+
+/* A client whose replies can't be held is dropped once its request has
+   been answered */
+static int reserve(serve_conn *conn, size_t extra)
+{
+    size_t new_size = conn->out_size ? conn->out_size : 4096;
+    char *bigger;
+
+    if (conn->failed) {
+        return(0);
+    }
+    if (conn->out_len + extra <= conn->out_size) {
+        return(1);
+    }
+    while (new_size < conn->out_len + extra) {
+        new_size *= 2;
+    }
+    bigger = realloc(conn->out, new_size);
+    if (!bigger) {
+        conn->failed = 1;
+        return(0);
+    }
+    conn->out = bigger;
+    conn->out_size = new_size;
+    return(1);
+}
+
+/* Send what may be sent and move the rest up. The client has fallen
+   behind if the socket is full, and is watched for room to send more.
+   0 if the client has gone. */
+static int send_replies(serve_conn *conn)
+{
+    ssize_t sent;
+
+    while (conn->out_sent < conn->sendable) {
+        sent = send(conn->fd, conn->out + conn->out_sent,
+                    conn->sendable - conn->out_sent, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && errno == EAGAIN) {
+            break;
+        }
+        if (sent <= 0) {
+            close_conn(conn);
+            return(0);
+        }
+        conn->out_sent += sent;
+    }
+    if (conn->out_sent && conn->out_sent == conn->sendable) {
+        memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        conn->out_len -= conn->out_sent;
+        conn->sendable -= conn->out_sent;
+        conn->out_sent = 0;
+        /* requests left unanswered while it was behind */
+        if (conn->in_len >= 4 && conn->out_len < OUT_LIMIT) {
+            return(answer_requests(conn));
+        }
+    }
+    watch(conn);
+    return(1);
+}
+
+/* Read while the client is keeping up with its replies, and wait for
+   room to send while some are ready */
+static void watch(serve_conn *conn)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (conn->out_len - conn->out_sent < OUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (conn->out_sent < conn->sendable) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+static void stop(int sig)
+{
+    stopping = 1;
+}
@@ -0,0 +1,99 @@
+#!/bin/bash
+#
+# Checks of cdctl against stores made up for them, for "make check":
+#
+#   check.sh [CDCTL]
+#
+# Each check prints its name and ok or FAILED, and the script exits
+# nonzero if any failed.
+
+cdctl=$(cd "$(dirname "${1:-./cdctl}")" && pwd)/$(basename "${1:-./cdctl}")
+work_dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$work_dir"' EXIT
+failed=0
+
+# check NAME COMMAND...: the command must succeed
+check()
+{
+    local name=$1
+    shift
+
+    if "$@" > "$work_dir/out" 2>&1; then
+        echo "$name: ok"
+    else
+        echo "$name: FAILED"
+        sed 's/^/    /' "$work_dir/out"
+        failed=1
+    fi
+}
+
+# The output of cdctl must have a line matching PATTERN
+has_line()
+{
+    local pattern=$1
+    shift
+
+    "$cdctl" "$@" | grep -q -- "$pattern"
+}
+
+# and COUNT lines matching it
+has_lines()
+{
+    local count=$1 pattern=$2
+    shift 2
+
+    [ "$("$cdctl" "$@" | grep -c -- "$pattern")" = "$count" ]
+}
+
+text="text:$work_dir/text"
+snap="snap:$work_dir/cds.snap"
+mkdir "$work_dir/text"
+"$cdctl" -b "$text" init > /dev/null &&
+"$cdctl" -b "$text" add -d 8a0b3c0d CD101 "Kind of Blue" Jazz "Miles Davis" \
+    "So What" "Freddie Freeloader" > /dev/null &&
+"$cdctl" -b "$text" add -d 8a0b3c0d CD102 "Kind of Blue (Legacy)" Jazz "Miles Davis" \
+    "So What" > /dev/null &&
+"$cdctl" -b "$text" add -d 1f2e3d4c CD103 "Blue Train" Jazz "John Coltrane" \
+    "Blue Train" > /dev/null &&
+"$cdctl" -b "$text" add CD104 "Giant Steps" Jazz "John Coltrane" \
+    "Giant Steps" > /dev/null &&
+"$cdctl" -b "$text" snapshot "$work_dir/cds.snap" > /dev/null || {
+    echo "Unable to make up the catalog" >&2
+    exit 1
+}
+
+# A snapshot keeps the disc IDs, and finds the CDs by them
+check "snapshot disc lookup" has_lines 1 "^CD103," -b "$snap" disc 1f2e3d4c
+check "snapshot disc lookup, shared ID" has_lines 2 "^CD10[12]," -b "$snap" disc 8a0b3c0d
+check "snapshot disc lookup, unknown ID" has_lines 0 "^CD" -b "$snap" disc 00000000
+check "snapshot get shows the disc ID" has_line "8a0b3c0d" -b "$snap" get CD101
+check "snapshot compares equal" "$cdctl" -b "$text" compare "$snap"
+
+# and compare notices a disc ID that changed
+"$cdctl" -b "$text" del CD104 > /dev/null
+"$cdctl" -b "$text" add -d 2a3b4c5d CD104 "Giant Steps" Jazz "John Coltrane" \
+    "Giant Steps" > /dev/null
+check "compare sees a disc ID" has_line "^CD104: differs" -b "$text" compare "$snap"
+
+# The lsm store keeps its disc ID index with the CDs
+lsm="lsm:$work_dir/lsm"
+mkdir "$work_dir/lsm"
+"$cdctl" -b "$lsm" init > /dev/null
+"$cdctl" -b "$lsm" add -d 8a0b3c0d CD101 "Kind of Blue" Jazz "Miles Davis" \
+    "So What" > /dev/null
+"$cdctl" -b "$lsm" add -d 8a0b3c0d CD102 "Kind of Blue (Legacy)" Jazz "Miles Davis" \
+    "So What" > /dev/null
+check "lsm disc lookup, shared ID" has_lines 2 "^CD10[12]," -b "$lsm" disc 8a0b3c0d
+"$cdctl" -b "$lsm" add -d 1f2e3d4c CD101 "Kind of Blue" Jazz "Miles Davis" \
+    "So What" > /dev/null
+"$cdctl" -b "$lsm" del CD102 > /dev/null
+check "lsm disc lookup, ID changed" has_lines 1 "^CD101," -b "$lsm" disc 1f2e3d4c
+check "lsm disc lookup, old ID" has_lines 0 "^CD" -b "$lsm" disc 8a0b3c0d
+
+# and track numbers past 255, as a text store may have
+printf 'CD201,Box Set,Rock,Various\n' > "$work_dir/text/title.cdb"
+printf 'CD201,1,First\nCD201,300,Three Hundred\n' > "$work_dir/text/tracks.cdb"
+"$cdctl" -b "$text" copy "$lsm" > /dev/null
+check "lsm keeps track 300" has_line "300: Three Hundred" -b "$lsm" get CD201
+
+exit $failed
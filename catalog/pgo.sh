@@ -0,0 +1,238 @@
+#!/bin/bash
+#
+# Profile-guided build of one of the frontends, for "make pgo" in its
+# directory:
+#
+#   pgo.sh application|mini_cd_manager|app [VARIABLE=VALUE...]
+#
+# The frontend is built as "make" builds it and timed on its workload,
+# built again instrumented and run on the workload to profile it, then
+# built with -O2, link-time optimization and the profile and timed again.
+# The workloads drive the frontends through their menus, as a user would,
+# against a catalog made up for them. Times are the CPU seconds of the
+# frontend alone, the best of three runs, so neither making up its input
+# nor the pauses mini_cd_manager needs between keys count.
+# The variables go to make, for instance INCLUDE= and LIBS= where gdbm is
+# somewhere else.
+
+OPT_CFLAGS="-O2 -flto=auto"
+WORKLOAD_CDS=2000       # application adds these one at a time
+CATALOG_CDS=20000       # mini_cd_manager starts with these
+TRACKS_PER_CD=10
+SESSION_CDS=40          # mini_cd_manager finds, updates and removes
+APP_RUNS=50             # of the app test, which needs the MySQL server
+
+target=$1
+shift
+case "$target" in
+application|mini_cd_manager|app) ;;
+*)
+    echo "Usage: $0 application|mini_cd_manager|app [VARIABLE=VALUE...]" >&2
+    exit 1
+    ;;
+esac
+
+catalog_dir=$(cd "$(dirname "$0")" && pwd)
+binary=$(pwd)/$target
+work_dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$work_dir"; rm -f *.gcda "$catalog_dir"/*.gcda' EXIT
+
+# build CFLAGS: the target and the catalog library from scratch
+build()
+{
+    make -s clean "${make_args[@]}" > /dev/null &&
+    make -s -C "$catalog_dir" clean > /dev/null &&
+    rm -f "$binary" &&
+    make -s "$target" CFLAGS="$1" AR=gcc-ar "${make_args[@]}" > /dev/null
+}
+
+# Track titles that repeat across CDs, as they do
+track_title()
+{
+    local titles=("Intro" "Interlude" "Outro" "Love Song" "Blue Night" "Home Again")
+
+    if (( ($1 + $2) % 3 == 0 )); then
+        echo "${titles[($1 + $2) % 6]}"
+    else
+        echo "Track $2 of CD $1"
+    fi
+}
+
+# timing COMMAND...: run it, adding its CPU seconds to the run's times
+timing()
+{
+    { time "$@" > /dev/null 2>&1; } 2>> times
+}
+
+# application reads its menus with fgets, so the whole session is piped in
+prepare_application()
+{
+    local cd track
+
+    for (( cd = 0; cd < WORKLOAD_CDS; cd++ )); do
+        printf '1\nCAT%05d\nTitle %d\nRock\nArtist %d\ny\n4\n' $cd $cd $((cd % 100))
+        for (( track = 1; track <= TRACKS_PER_CD; track++ )); do
+            track_title $cd $track
+        done
+        printf '\n'
+    done > session
+    for (( cd = 0; cd < WORKLOAD_CDS; cd += 10 )); do
+        printf '2\nCAT%05d\ny\n6\n\n' $cd
+    done >> session
+    for (( cd = 0; cd < 10; cd++ )); do
+        printf '3\n\n'
+    done >> session
+    for (( cd = 1; cd < WORKLOAD_CDS; cd += 20 )); do
+        printf '2\nCAT%05d\ny\n5\ny\n' $cd
+    done >> session
+    printf 'q\n' >> session
+}
+
+work_application()
+{
+    timing "$binary" -i &&
+    timing timeout 600 "$binary" < "$work_dir"/session &&
+    [ "$(printf '3\n\nq\n' | "$binary" | grep -o 'Found [0-9]* CDs')" = \
+      "Found $((WORKLOAD_CDS - WORKLOAD_CDS / 20)) CDs" ]
+}
+
+# The keys to move the highlight of mini_cd_manager's menu from row
+# $menu_row to row $1 of $2, and press Return. In keypad mode a vt100 sends
+# ESC O B for the down arrow.
+menu_keys()
+{
+    while (( menu_row != $1 )); do
+        printf '\033OB'
+        menu_row=$(( (menu_row + 1) % $2 ))
+    done
+    printf '\n'
+}
+
+# The keys of a mini_cd_manager session. curses reads a key at a time, but
+# "Press return" reads with getchar, which would take any keys sent with
+# it, so each step waits until the last is surely done.
+mini_cd_keys()
+{
+    local menu_row=0
+    local cd track
+
+    for (( cd = 0; cd < SESSION_CDS; cd++ )); do
+        # find a CD by typing its whole title, then list, re-enter,
+        # edit one of and list its tracks, count the catalog, and remove
+        # the CD
+        menu_keys 1 4
+        printf 'Title %05d\n' $((cd * 397 % CATALOG_CDS))
+        sleep 0.1
+        menu_keys 3 8
+        printf '\n'
+        sleep 0.1
+        menu_keys 5 8
+        printf 'y'
+        for (( track = 1; track <= TRACKS_PER_CD; track++ )); do
+            printf '%s\n' "$(track_title $cd $track)"
+        done
+        printf '\n'
+        sleep 0.1
+        menu_keys 6 8
+        printf '%d\nEdited %d\n' $((cd % TRACKS_PER_CD + 1)) $cd
+        sleep 0.1
+        menu_keys 3 8
+        printf '\n'
+        sleep 0.1
+        menu_keys 2 8
+        sleep 0.1
+        printf '\n'
+        sleep 0.5
+        menu_keys 4 8
+        printf 'y'
+        sleep 0.1
+        # the shorter menu starts at the top again
+        menu_row=0
+        menu_keys 0 4
+        printf 'NEW%05d\nNew title %d\nRock\nNew artist\ny' $cd $cd
+        sleep 0.1
+        menu_row=0
+    done
+    printf 'q'
+}
+
+# mini_cd_manager is curses, so it gets the keys one step at a time
+prepare_mini_cd_manager()
+{
+    awk -v cds=$CATALOG_CDS -v tracks=$TRACKS_PER_CD 'BEGIN {
+        for (cd = 0; cd < cds; cd++) {
+            printf "CAT%05d,Title %05d,Rock,Artist %d\n", cd, cd, cd % 100 > "title.cdb"
+            for (track = 1; track <= tracks; track++) {
+                printf "CAT%05d,%d,Track %d of CD %d\n", cd, track, track, cd > "tracks.cdb"
+            }
+        }
+    }'
+}
+
+work_mini_cd_manager()
+{
+    cp "$work_dir"/title.cdb "$work_dir"/tracks.cdb . &&
+    mini_cd_keys | TERM=vt100 timing timeout 600 "$binary"
+    [ "$(wc -l < title.cdb)" -eq $CATALOG_CDS ] &&
+    [ "$(grep -c '^NEW' title.cdb)" -eq $SESSION_CDS ]
+}
+
+# The app test adds a CD, finds it, and deletes it again
+prepare_app()
+{
+    :
+}
+
+work_app()
+{
+    local run
+
+    for (( run = 0; run < APP_RUNS; run++ )); do
+        timing "$binary" || return 1
+    done
+}
+
+# run: the workload in an empty directory, and the CPU seconds it took
+# on stdout
+run()
+{
+    rm -rf "$work_dir"/run && mkdir "$work_dir"/run &&
+    (cd "$work_dir"/run && work_$target > /dev/null 2>&1 &&
+     awk '{ seconds += $1 + $2 } END { print seconds }' times)
+}
+
+# timed: the best of three runs
+timed()
+{
+    local best="" seconds i
+
+    for i in 1 2 3; do
+        seconds=$(run) || return 1
+        if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+            best=$seconds
+        fi
+    done
+    echo $best
+}
+
+make_args=("$@")
+TIMEFORMAT='%3U %3S'
+rm -f *.gcda "$catalog_dir"/*.gcda
+(cd "$work_dir" && prepare_$target) || exit 1
+
+echo "Building $target as make does" >&2
+build "" || exit 1
+plain=$(timed) || { echo "The $target workload failed" >&2; exit 1; }
+
+echo "Profiling $target" >&2
+build "$OPT_CFLAGS -fprofile-generate" || exit 1
+run > /dev/null || { echo "The $target workload failed" >&2; exit 1; }
+
+echo "Building $target with the profile" >&2
+build "$OPT_CFLAGS -fprofile-use -fprofile-correction -Wno-missing-profile" || exit 1
+optimized=$(timed) || { echo "The $target workload failed" >&2; exit 1; }
+
+awk -v name=$target -v plain=$plain -v optimized=$optimized 'BEGIN {
+    printf "%s: %.2f s as make builds it, %.2f s with the profile, %.2f times as fast\n",
+           name, plain, optimized, (optimized > 0 ? plain / optimized : 0)
+}'
@@ -6,9 +6,15 @@
 #include <string.h>
 
 #include "cd_data.h"
+#include "catalog.h"
+#include "cat_complete.h"
+#include "cat_trace.h"
+#include "cat_stats.h"
 
 #define TMP_STRING_LEN 125 /* this number must be larger than the biggest
                               single string in any database structure */
+#define COMPLETIONS 10     /* how many completions -c prints */
+#define COMPLETE_FILE "cdcomplete.dbm"  /* -c's index, with the database */
 
 /* Menu options */
 typedef enum {
@@ -38,6 +44,16 @@ static void count_all_entries(void);
 static void display_cdc(const cdc_entry *cdc_to_show);
 static void display_cdt(const cdt_entry *cdt_to_show);
 static void strip_return(char *string_to_strip);
+static int print_completions(const char *prefix);
+static void record_tracks(const char *catalog);
+
+/* The workload trace, recorded with -r for cdctl replay */
+static cat_trace *recording;
+/* Where -m and -M put the metrics of the database operations */
+static const char *metrics_file;
+static const char *metrics_socket;
+/* Whether -g set how the database is opened */
+static int gdbm_options;
 
 /* This starts by ensuring that the current_cdc_entry, which you use to 
    keep track of the currently selected CD catalog entry, is initialized. 
@@ -51,9 +67,14 @@ int main(int argc, char *argv[])
 
     memset(&current_cdc_entry, '\0', sizeof(current_cdc_entry));
 
+    /* Only -r, -m, -M and -g go on to the menu */
     if (argc > 1) {
         command_result = command_mode(argc, argv);
-        exit(command_result);
+        if (command_result != EXIT_SUCCESS ||
+            (!recording && !metrics_file && !metrics_socket && !gdbm_options)) {
+            trace_stop(recording);
+            exit(command_result);
+        }
     }
 
     announce();
@@ -74,6 +95,10 @@ int main(int argc, char *argv[])
                 if (!add_cdc_entry(current_cdc_entry)) {
                     fprintf(stderr, "Failed to add new entry\n");
                     memset(&current_cdc_entry, '\0', sizeof(current_cdc_entry));
+                } else {
+                    trace_put(recording, current_cdc_entry.catalog,
+                              current_cdc_entry.title, current_cdc_entry.type,
+                              current_cdc_entry.artist);
                 }
             }
             break;
@@ -104,9 +129,21 @@ int main(int argc, char *argv[])
         default:
             break;
         } /* end of switch */
+
+        /* each change is written without syncing, and synced once done */
+        if ((current_option == mo_add_cat || current_option == mo_add_tracks ||
+             current_option == mo_del_cat || current_option == mo_del_tracks) &&
+            !database_sync()) {
+            fprintf(stderr, "Failed to write the database to disk\n");
+        }
     } /* end of while */
 
     database_close();
+    stats_stop();
+    if (!trace_stop(recording)) {
+        fprintf(stderr, "The trace was not all written\n");
+        exit(EXIT_FAILURE);
+    }
     exit(EXIT_SUCCESS);
 } /* end of main */
 
@@ -288,6 +325,7 @@ static void enter_new_track_entries(const cdc_entry *entry_to_add_to)
         }
         track_no++;
     } /* end of while */
+    record_tracks(entry_to_add_to->catalog);
 }
 
 /* Deletes a catalog entry. Never allow tracks for a nonexistent catalog entry
@@ -299,6 +337,7 @@ static int del_cat_entry(const cdc_entry *entry_to_delete)
 
     display_cdc(entry_to_delete);
     if (get_confirm("Delete this entry and all it's tracks?")) {
+        trace_key(recording, TRACE_DEL, entry_to_delete->catalog);
         do {
             delete_ok = del_cdt_entry(entry_to_delete->catalog, track_no);
             track_no++;
@@ -321,6 +360,7 @@ static void del_track_entries(const cdc_entry *entry_to_delete)
 
     display_cdc(entry_to_delete);
     if (get_confirm("Delete tracks for this entry?")) {
+        trace_put_tracks(recording, entry_to_delete->catalog, NULL, 0, 0);
         do {
             delete_ok = del_cdt_entry(entry_to_delete->catalog, track_no);
             track_no++;
@@ -350,6 +390,7 @@ static cdc_entry find_cat(void)
             string_ok = 0;
         }
     } while (!string_ok);
+    trace_find(recording, FILTER_CATALOG, tmp_str);
 
     while (!entry_selected) {
         item_found = search_cdc_entry(tmp_str, &first_call);
@@ -378,6 +419,7 @@ static void list_tracks(const cdc_entry *entry_to_use)
     int track_no = 1;
     cdt_entry entry_found;
 
+    trace_key(recording, TRACE_TRACKS, entry_to_use->catalog);
     display_cdc(entry_to_use);
     printf("\nTracks\n");
     do {
@@ -401,6 +443,7 @@ static void count_all_entries(void)
     int first_time = 1;
     char *search_string = "";
 
+    trace_key(recording, TRACE_COUNT, NULL);
     do {
         cdc_found = search_cdc_entry(search_string, &first_time);
         if (cdc_found.catalog[0]) {
@@ -451,6 +494,8 @@ static void strip_return(char *string_to_strip)
    that your program accepts arguments conforming to standard Linux conventions. */
 static int command_mode(int argc, char *argv[])
 {
+    cd_db_options options;
+    int new_database = 0;
     int c;
     int result = EXIT_SUCCESS;
     char *prog_name = argv[0];
@@ -459,21 +504,116 @@ static int command_mode(int argc, char *argv[])
     extern char *optarg;
     extern optind, opterr, optopt;
 
-    while ((c = getopt(argc, argv, ":i")) != -1) {
+    database_get_options(&options);
+    while ((c = getopt(argc, argv, ":ic:r:m:M:g:")) != -1) {
         switch (c) {
         case 'i':
-            if (!database_initialize(1)) {
+            new_database = 1;
+            break;
+        case 'g':
+            if (database_parse_options(optarg, &options)) {
+                database_set_options(&options);
+            } else {
                 result = EXIT_FAILURE;
-                fprintf(stderr, "Failed to initialize database\n");
             }
+            gdbm_options = 1;
+            break;
+        case 'c':
+            if (!print_completions(optarg)) {
+                result = EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            recording = trace_start(optarg);
+            if (!recording) {
+                result = EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'M':
+            metrics_socket = optarg;
             break;
         case ':':
         case '?':
         default:
-            fprintf(stderr, "Usage: %s [-i]\n", prog_name);
+            fprintf(stderr, "Usage: %s [-g gdbm_options] [-i] [-c prefix] [-r trace_file] "
+                    "[-m metrics_file] [-M metrics_socket]\n", prog_name);
+            fprintf(stderr, "  gdbm_options: cache=BUCKETS, block=BYTES, mmap or nommap, "
+                    "sync or nosync\n");
             result = EXIT_FAILURE;
             break;
         } /* end of switch */
     } /* end of while */
+    /* -i is done here, so that a -g after it still counts */
+    if (result == EXIT_SUCCESS && new_database) {
+        if (database_initialize(1)) {
+            database_close();
+        } else {
+            result = EXIT_FAILURE;
+            fprintf(stderr, "Failed to initialize database\n");
+        }
+    }
+    if (result == EXIT_SUCCESS && (metrics_file || metrics_socket) &&
+        !stats_start("application", metrics_file, metrics_socket)) {
+        result = EXIT_FAILURE;
+    }
     return(result);
 }
+
+/* Print the catalog numbers and titles that start with prefix, one per line,
+   for a shell to complete with. The database is opened through the catalog
+   library, and its index for completion kept in COMPLETE_FILE, which is
+   only built again once the database has changed. */
+static int print_completions(const char *prefix)
+{
+    complete_match matches[COMPLETIONS * 4];
+    catalog_backend *be;
+    cat_complete *index;
+    int count, printed, i;
+
+    be = catalog_open("dbm", 0);
+    if (!be) {
+        fprintf(stderr, "Sorry, unable to open the database\n");
+        return(0);
+    }
+    index = complete_open(be, COMPLETE_FILE);
+    catalog_close(be);
+    if (!index) {
+        return(0);
+    }
+    count = complete_prefix(index, prefix, matches, COMPLETIONS * 4, NULL);
+    for (i = 0, printed = 0; i < count && printed < COMPLETIONS; i++) {
+        /* a title shared by several CDs only needs completing once */
+        if (i > 0 && strcmp(matches[i].text, matches[i - 1].text) == 0) {
+            continue;
+        }
+        printf("%s\n", matches[i].text);
+        printed++;
+    }
+    complete_free(index);
+    return(1);
+}
+
+/* Record the tracks of a CD after they have been edited. Only what the
+   user ended up with is recorded, as one replacement of them all, which is
+   how the other stores take tracks. */
+static void record_tracks(const char *catalog)
+{
+    char titles[CATALOG_MAX_TRACKS][TRACK_TTEXT_LEN + 1];
+    cdt_entry track;
+    int count = 0;
+
+    if (!recording) {
+        return;
+    }
+    while (count < CATALOG_MAX_TRACKS) {
+        track = get_cdt_entry(catalog, count + 1);
+        if (!track.catalog[0]) {
+            break;
+        }
+        strcpy(titles[count++], track.track_txt);
+    }
+    trace_put_tracks(recording, catalog, titles[0], TRACK_TTEXT_LEN + 1, count);
+}
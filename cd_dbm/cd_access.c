@@ -1,5 +1,28 @@
 /*
    This file provides the functions for accessing the CD database.
+
+   Track titles repeat a great deal ("Intro", the same song live), so each
+   distinct title is stored once, in a dictionary file, and a track is
+   stored as the number of its title. The number is a hash of the title,
+   moved on to the next free one if another title has it, so adding a
+   track looks its title up with no index from titles to numbers. A title
+   leaves the dictionary with the last track using it, unless a title
+   moved on past it needs its number taken, when it stays with no uses
+   until a new title is given its number or the titles after it go.
+   Recently used titles are kept decoded in memory. Tracks written before
+   the dictionary, as whole cdt_entry records, are still read, and are
+   converted as they are rewritten.
+
+   A fifth file keeps a digest of each CD for cd_sync, which it computes
+   and stores itself. The digest goes whenever the CD or one of its tracks
+   is written or deleted, so one that is there is up to date.
+
+   The files are gdbm databases, opened with gdbm's own interface so that
+   its bucket size and cache, memory mapping and syncing can be set
+   through database_set_options. Built with USE_NDBM (make NDBM=1), it goes
+   through the ndbm interface of gdbm_compat instead, as it first did, and
+   the options are ignored. Either way the data is in the .pag files, so
+   each build reads what the other wrote.
  */
 
 #define _XOPEN_SOURCE
@@ -10,21 +33,99 @@
 #include <fcntl.h>
 #include <string.h>
 
+#ifdef USE_NDBM
 //#include <ndbm.h>
 #include <gdbm-ndbm.h>  /* may need to be changed to gdbm-ndbm.h on some distributions */
+#else
+#include <gdbm.h>
+#endif
 
 #include "cd_data.h"
+#include "cat_probe.h"      /* in ../catalog */
+#include "cat_stats.h"
 
 #define CDC_FILE_BASE "cdc_data"
 #define CDT_FILE_BASE "cdt_data"
+#define CDI_FILE_BASE "cdi_data"
+#define CDD_FILE_BASE "cdd_data"
+#define CDS_FILE_BASE "cds_data"
 #define CDC_FILE_DIR  "cdc_data.dir"
 #define CDC_FILE_PAG  "cdc_data.pag"
 #define CDT_FILE_DIR  "cdt_data.dir"
 #define CDT_FILE_PAG  "cdt_data.pag"
+#define CDI_FILE_DIR  "cdi_data.dir"
+#define CDI_FILE_PAG  "cdi_data.pag"
+#define CDD_FILE_DIR  "cdd_data.dir"
+#define CDD_FILE_PAG  "cdd_data.pag"
+#define CDS_FILE_DIR  "cds_data.dir"
+#define CDS_FILE_PAG  "cds_data.pag"
+
+#define TITLE_CACHE      1024   /* decoded titles kept, a power of two */
+#define DB_BLOCK_SIZE    16384  /* of a new gdbm file, by default */
+
+#ifdef USE_NDBM
+typedef DBM db_file;
+#else
+/* A gdbm file, with what ndbm keeps for the caller: the data of the last
+   fetch and the key a walk is at, each freed when the next replaces it */
+typedef struct {
+    GDBM_FILE dbf;
+    datum fetched;
+    datum walk_key;
+} db_file;
+#endif
+
+/* use these file scope variables to keep track of the current database */
+static db_file *cdc_dbm_ptr = NULL;
+static db_file *cdt_dbm_ptr = NULL;
+static db_file *cdi_dbm_ptr = NULL;
+static db_file *cdd_dbm_ptr = NULL;
+static db_file *cds_dbm_ptr = NULL;
+
+/* For large catalogs: buckets of a few hundred keys, so the directory
+   splits less often, gdbm's cache, which grows as the file does where a
+   fixed size falls behind, and writes synced by database_sync and on close */
+static cd_db_options db_options = { 0, DB_BLOCK_SIZE, 1, 0 };
+
+/* A track as stored: its catalog and number are in the key */
+typedef struct {
+    int track_no;
+    unsigned int title_id;      /* 0 for an empty title */
+} cdt_record;
+
+/* A title in the dictionary, under its number. Only as much of track_txt
+   as the title needs is stored. refs is 0 for a title kept only because
+   the numbers after it were moved on past it. */
+typedef struct {
+    int refs;
+    char track_txt[TRACK_TTEXT_LEN + 1];
+} cdd_entry;
+
+static struct {
+    unsigned int title_id;      /* 0 if the slot is empty */
+    char track_txt[TRACK_TTEXT_LEN + 1];
+} title_cache[TITLE_CACHE];
 
-/* use these two file scope variables to keep track of the current database */
-static DBM *cdc_dbm_ptr = NULL;
-static DBM *cdt_dbm_ptr = NULL;
+static int store_cdi_entry(const cdi_entry *entry);
+static int read_cdt_data(datum key_datum, datum data_datum, cdt_entry *entry);
+static int get_title(unsigned int title_id, char *track_txt);
+static int add_title(const char *track_txt, unsigned int *title_id);
+static void release_title(unsigned int title_id);
+static int fetch_title(unsigned int title_id, cdd_entry *entry);
+static int store_title(unsigned int title_id, const cdd_entry *entry);
+static datum cdd_key(unsigned int *title_id_ptr);
+static unsigned int next_title_id(unsigned int title_id);
+static unsigned int prev_title_id(unsigned int title_id);
+static void forget_title(unsigned int title_id);
+static void drop_cdc_digest(const char *cd_catalog_ptr);
+static db_file *db_open(const char *base);
+static void db_close(db_file *db);
+static datum db_fetch(db_file *db, datum key);
+static int db_store(db_file *db, datum key, datum data);
+static int db_delete(db_file *db, datum key);
+static datum db_firstkey(db_file *db);
+static datum db_nextkey(db_file *db);
+static int db_sync(db_file *db);
 
 /* By default, the function opens an existing database, but by passing a 
    nonzero parameter, you can force it to create a new empty database,
@@ -33,15 +134,13 @@ static DBM *cdt_dbm_ptr = NULL;
    a database is open.*/
 int database_initialize(const int new_database)
 {
-    int open_mode = O_CREAT | O_RDWR;
-
     /* If any existing database is open then close it */
-    if (cdc_dbm_ptr) {
-        dbm_close(cdc_dbm_ptr);
-    }
-    if (cdt_dbm_ptr) {
-        dbm_close(cdt_dbm_ptr);
-    }
+    db_close(cdc_dbm_ptr);
+    db_close(cdt_dbm_ptr);
+    db_close(cdi_dbm_ptr);
+    db_close(cdd_dbm_ptr);
+    db_close(cds_dbm_ptr);
+    memset(title_cache, '\0', sizeof(title_cache));
 
     if (new_database) {
         /* delete old files */
@@ -49,16 +148,34 @@ int database_initialize(const int new_database)
         (void) unlink(CDC_FILE_DIR);
         (void) unlink(CDT_FILE_PAG);
         (void) unlink(CDT_FILE_DIR);
+        (void) unlink(CDI_FILE_PAG);
+        (void) unlink(CDI_FILE_DIR);
+        (void) unlink(CDD_FILE_PAG);
+        (void) unlink(CDD_FILE_DIR);
+        (void) unlink(CDS_FILE_PAG);
+        (void) unlink(CDS_FILE_DIR);
     }
 
     /* Open some new files, creating them if required */
-    cdc_dbm_ptr = dbm_open(CDC_FILE_BASE, open_mode, 0644);
-    cdt_dbm_ptr = dbm_open(CDT_FILE_BASE, open_mode, 0644);
-    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+    CD_PROBE(cd_dbm, open_start, new_database);
+    cdc_dbm_ptr = db_open(CDC_FILE_BASE);
+    cdt_dbm_ptr = db_open(CDT_FILE_BASE);
+    cdi_dbm_ptr = db_open(CDI_FILE_BASE);
+    cdd_dbm_ptr = db_open(CDD_FILE_BASE);
+    cds_dbm_ptr = db_open(CDS_FILE_BASE);
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdi_dbm_ptr || !cdd_dbm_ptr ||
+        !cds_dbm_ptr) {
         fprintf(stderr, "Unable to create database\n");
-        cdc_dbm_ptr = cdt_dbm_ptr = NULL;
+        db_close(cdc_dbm_ptr);
+        db_close(cdt_dbm_ptr);
+        db_close(cdi_dbm_ptr);
+        db_close(cdd_dbm_ptr);
+        db_close(cds_dbm_ptr);
+        cdc_dbm_ptr = cdt_dbm_ptr = cdi_dbm_ptr = cdd_dbm_ptr = cds_dbm_ptr = NULL;
+        CD_PROBE(cd_dbm, open_done, new_database, 0);
         return(0);
     }
+    CD_PROBE(cd_dbm, open_done, new_database, 1);
     return(1);
 }
 
@@ -66,13 +183,72 @@ int database_initialize(const int new_database)
    to indicate that no database is currently open. */
 void database_close(void)
 {
-    if (cdc_dbm_ptr) {
-        dbm_close(cdc_dbm_ptr);
+    db_close(cdc_dbm_ptr);
+    db_close(cdt_dbm_ptr);
+    db_close(cdi_dbm_ptr);
+    db_close(cdd_dbm_ptr);
+    db_close(cds_dbm_ptr);
+    cdc_dbm_ptr = cdt_dbm_ptr = cdi_dbm_ptr = cdd_dbm_ptr = cds_dbm_ptr = NULL;
+}
+
+void database_get_options(cd_db_options *options)
+{
+    *options = db_options;
+}
+
+/* Used by the next database_initialize */
+void database_set_options(const cd_db_options *options)
+{
+    db_options = *options;
+}
+
+int database_parse_options(const char *spec, cd_db_options *options)
+{
+    char word[30];
+    int len;
+    int value;
+
+    while (*spec) {
+        len = strcspn(spec, ",");
+        if (len >= (int)sizeof(word)) {
+            fprintf(stderr, "Unknown database option %.*s\n", len, spec);
+            return(0);
+        }
+        memcpy(word, spec, len);
+        word[len] = '\0';
+        spec += spec[len] ? len + 1 : len;
+
+        if (sscanf(word, "cache=%d", &value) == 1 && value >= 0) {
+            options->cache_size = value;
+        } else if (sscanf(word, "block=%d", &value) == 1 && value >= 512) {
+            options->block_size = value;
+        } else if (strcmp(word, "mmap") == 0 || strcmp(word, "nommap") == 0) {
+            options->mmap = word[0] == 'm';
+        } else if (strcmp(word, "sync") == 0 || strcmp(word, "nosync") == 0) {
+            options->sync = word[0] == 's';
+        } else if (word[0]) {
+            fprintf(stderr, "Unknown database option %s\n", word);
+            return(0);
+        }
     }
-    if (cdt_dbm_ptr) {
-        dbm_close(cdt_dbm_ptr);
+    return(1);
+}
+
+/* Put every write so far on disk. The digests go first, so a dropped
+   one can't be found again after a crash that kept the change. */
+int database_sync(void)
+{
+    int result = 1;
+
+    if (!cdc_dbm_ptr) {
+        return(0);
     }
-    cdc_dbm_ptr = cdt_dbm_ptr = NULL;
+    result &= db_sync(cds_dbm_ptr);
+    result &= db_sync(cdc_dbm_ptr);
+    result &= db_sync(cdt_dbm_ptr);
+    result &= db_sync(cdi_dbm_ptr);
+    result &= db_sync(cdd_dbm_ptr);
+    return(result);
 }
 
 /* Retrieve a single catalog entry when passed a pointer pointing to a catalog text string. If the entry isn't found, the returned data has an empty catalog field. */
@@ -82,6 +258,7 @@ cdc_entry get_cdc_entry(const char *cd_catalog_ptr)
     char entry_to_find[CAT_CAT_LEN + 1];
     datum local_data_datum;
     datum local_key_datum;
+    uint64_t started;
 
     memset(&entry_to_return, '\0', sizeof(entry_to_return));
 
@@ -102,16 +279,21 @@ cdc_entry get_cdc_entry(const char *cd_catalog_ptr)
     strcpy(entry_to_find, cd_catalog_ptr);
 
     /* set up the datum structure the dbm functions require, and then
-       use dbm_fetch to retrieve the data. If no data was retrieved,
+       use db_fetch to retrieve the data. If no data was retrieved,
        return the empty entry_to_return structure */
     local_key_datum.dptr = (void *)entry_to_find;
     local_key_datum.dsize = sizeof(entry_to_find);
 
+    /* done gives the bytes fetched, 0 if there was no such CD */
+    CD_PROBE(cd_dbm, get_cd_start, entry_to_find);
+    started = stats_clock();
     memset(&local_data_datum, '\0', sizeof(local_data_datum));
-    local_data_datum = dbm_fetch(cdc_dbm_ptr, local_key_datum);
+    local_data_datum = db_fetch(cdc_dbm_ptr, local_key_datum);
     if (local_data_datum.dptr) {
         memcpy(&entry_to_return, (char *)local_data_datum.dptr, local_data_datum.dsize);
     }
+    stats_record(STATS_DBM_GET_CD, started, 1);
+    CD_PROBE(cd_dbm, get_cd_done, entry_to_find, local_data_datum.dsize);
     return(entry_to_return);
 }
 
@@ -123,6 +305,7 @@ cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
     char entry_to_find[CAT_CAT_LEN + 10];
     datum local_data_datum;
     datum local_key_datum;
+    uint64_t started;
 
     memset(&entry_to_return, '\0', sizeof(entry_to_return));
 
@@ -144,11 +327,16 @@ cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
     local_key_datum.dptr = (void *)entry_to_find;
     local_key_datum.dsize = sizeof(entry_to_find);
 
+    CD_PROBE(cd_dbm, get_track_start, cd_catalog_ptr, track_no);
+    started = stats_clock();
     memset(&local_data_datum, '\0', sizeof(local_data_datum));
-    local_data_datum = dbm_fetch(cdt_dbm_ptr, local_key_datum);
+    local_data_datum = db_fetch(cdt_dbm_ptr, local_key_datum);
     if (local_data_datum.dptr) {
-        memcpy(&entry_to_return, (char *)local_data_datum.dptr, local_data_datum.dsize);
+        (void) read_cdt_data(local_key_datum, local_data_datum, &entry_to_return);
     }
+    stats_record(STATS_DBM_GET_TRACK, started, 1);
+    CD_PROBE(cd_dbm, get_track_done, cd_catalog_ptr, track_no,
+             local_data_datum.dsize);
     return(entry_to_return);
 }
 
@@ -158,6 +346,7 @@ int add_cdc_entry(const cdc_entry entry_to_add)
     char key_to_add[CAT_CAT_LEN + 1];
     datum local_data_datum;
     datum local_key_datum;
+    uint64_t started;
     int result;
 
     if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
@@ -169,15 +358,20 @@ int add_cdc_entry(const cdc_entry entry_to_add)
 
     memset(&key_to_add, '\0', sizeof(key_to_add));
     strcpy(key_to_add, entry_to_add.catalog);
+    drop_cdc_digest(key_to_add);
 
     local_key_datum.dptr = (void *)key_to_add;
     local_key_datum.dsize = sizeof(key_to_add);
     local_data_datum.dptr = (void *)&entry_to_add;
     local_data_datum.dsize = sizeof(entry_to_add);
 
-    result = dbm_store(cdc_dbm_ptr, local_key_datum, local_data_datum, DBM_REPLACE); 
+    CD_PROBE(cd_dbm, add_cd_start, key_to_add, local_data_datum.dsize);
+    started = stats_clock();
+    result = db_store(cdc_dbm_ptr, local_key_datum, local_data_datum); 
+    stats_record(STATS_DBM_ADD_CD, started, result == 0);
+    CD_PROBE(cd_dbm, add_cd_done, key_to_add, result);
     
-    /*dbm_store() uses 0 for success */
+    /*db_store() uses 0 for success */
     if (result == 0) {
         return(1);
     }
@@ -185,14 +379,19 @@ int add_cdc_entry(const cdc_entry entry_to_add)
     return(0);
 }
 
+/* The title is added to the dictionary before the track replaces any
+   old one, so rewriting a track with the same title keeps its number */
 int add_cdt_entry(const cdt_entry entry_to_add)
 {
     char key_to_add[CAT_CAT_LEN + 10];
+    cdt_record record;
+    cdt_record old_record;
     datum local_data_datum;
     datum local_key_datum;
+    uint64_t started;
     int result;
 
-    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdd_dbm_ptr) {
         return(0);
     }
     if (strlen(entry_to_add.catalog) >= CAT_CAT_LEN) {
@@ -201,18 +400,39 @@ int add_cdt_entry(const cdt_entry entry_to_add)
 
     memset(&key_to_add, '\0', sizeof(key_to_add));
     sprintf(key_to_add, "%s %d", entry_to_add.catalog, entry_to_add.track_no);
+    drop_cdc_digest(entry_to_add.catalog);
 
     local_key_datum.dptr = (void *)key_to_add;
     local_key_datum.dsize = sizeof(key_to_add);
-    local_data_datum.dptr = (void *)&entry_to_add;
-    local_data_datum.dsize = sizeof(entry_to_add);
 
-    result = dbm_store(cdt_dbm_ptr, local_key_datum, local_data_datum, DBM_REPLACE); 
+    memset(&old_record, '\0', sizeof(old_record));
+    local_data_datum = db_fetch(cdt_dbm_ptr, local_key_datum);
+    if (local_data_datum.dptr && local_data_datum.dsize == sizeof(old_record)) {
+        memcpy(&old_record, (char *)local_data_datum.dptr, sizeof(old_record));
+    }
+
+    memset(&record, '\0', sizeof(record));
+    record.track_no = entry_to_add.track_no;
+    if (!add_title(entry_to_add.track_txt, &record.title_id)) {
+        return(0);
+    }
+    local_data_datum.dptr = (void *)&record;
+    local_data_datum.dsize = sizeof(record);
+
+    CD_PROBE(cd_dbm, add_track_start, entry_to_add.catalog, entry_to_add.track_no,
+             local_data_datum.dsize);
+    started = stats_clock();
+    result = db_store(cdt_dbm_ptr, local_key_datum, local_data_datum); 
+    stats_record(STATS_DBM_ADD_TRACK, started, result == 0);
+    CD_PROBE(cd_dbm, add_track_done, entry_to_add.catalog, entry_to_add.track_no,
+             result);
     
-    /*dbm_store() uses 0 for success */
+    /*db_store() uses 0 for success */
     if (result == 0) {
+        release_title(old_record.title_id);
         return(1);
     }
+    release_title(record.title_id);
     return(0);
 }
 
@@ -221,6 +441,7 @@ int del_cdc_entry(const char *cd_catalog_ptr)
 {
     char key_to_del[CAT_CAT_LEN + 1];
     datum local_key_datum;
+    uint64_t started;
     int result;
 
     if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
@@ -236,9 +457,18 @@ int del_cdc_entry(const char *cd_catalog_ptr)
     local_key_datum.dptr = (void *)key_to_del;
     local_key_datum.dsize = sizeof(key_to_del);
 
-    result = dbm_delete(cdc_dbm_ptr, local_key_datum); 
+    /* the CD goes from the disc IDs too */
+    (void) set_cdc_disc_id(cd_catalog_ptr, "");
+    drop_cdc_digest(cd_catalog_ptr);
+
+    /* a missing key is no failure, and db_delete can't tell it from one */
+    CD_PROBE(cd_dbm, del_cd_start, key_to_del);
+    started = stats_clock();
+    result = db_delete(cdc_dbm_ptr, local_key_datum); 
+    stats_record(STATS_DBM_DEL_CD, started, 1);
+    CD_PROBE(cd_dbm, del_cd_done, key_to_del, result);
     
-    /*dbm_store() uses 0 for success */
+    /*db_store() uses 0 for success */
     if (result == 0) {
         return(1);
     }
@@ -249,10 +479,13 @@ int del_cdc_entry(const char *cd_catalog_ptr)
 int del_cdt_entry(const char *cd_catalog_ptr, const int track_no)
 {
     char key_to_del[CAT_CAT_LEN + 10];
+    cdt_record old_record;
+    datum local_data_datum;
     datum local_key_datum;
+    uint64_t started;
     int result;
 
-    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdd_dbm_ptr) {
         return(0);
     }
     if (strlen(cd_catalog_ptr) >= CAT_CAT_LEN) {
@@ -261,14 +494,27 @@ int del_cdt_entry(const char *cd_catalog_ptr, const int track_no)
 
     memset(&key_to_del, '\0', sizeof(key_to_del));
     sprintf(key_to_del,"%s %d", cd_catalog_ptr, track_no);
+    drop_cdc_digest(cd_catalog_ptr);
 
     local_key_datum.dptr = (void *)key_to_del;
     local_key_datum.dsize = sizeof(key_to_del);
 
-    result = dbm_delete(cdt_dbm_ptr, local_key_datum); 
+    /* the title goes when no other track has it */
+    memset(&old_record, '\0', sizeof(old_record));
+    local_data_datum = db_fetch(cdt_dbm_ptr, local_key_datum);
+    if (local_data_datum.dptr && local_data_datum.dsize == sizeof(old_record)) {
+        memcpy(&old_record, (char *)local_data_datum.dptr, sizeof(old_record));
+    }
+
+    CD_PROBE(cd_dbm, del_track_start, cd_catalog_ptr, track_no);
+    started = stats_clock();
+    result = db_delete(cdt_dbm_ptr, local_key_datum); 
+    stats_record(STATS_DBM_DEL_TRACK, started, 1);
+    CD_PROBE(cd_dbm, del_track_done, cd_catalog_ptr, track_no, result);
     
-    /*dbm_store() uses 0 for success */
+    /*db_store() uses 0 for success */
     if (result == 0) {
+        release_title(old_record.title_id);
         return(1);
     }
     return(0);
@@ -284,6 +530,8 @@ cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr)
     cdc_entry entry_to_return;
     datum local_data_datum;
     static datum local_key_datum;    /* notice this must be static */
+    uint64_t started;
+    int keys_read = 0;
 
     memset(&entry_to_return, '\0', sizeof(entry_to_return));
 
@@ -303,32 +551,630 @@ cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr)
         *first_call_ptr = 1;
     }
 
+    /* done gives the catalog found, empty at the end, and how many keys
+       were looked at to find it */
+    CD_PROBE(cd_dbm, search_start, cd_catalog_ptr, *first_call_ptr);
+    started = stats_clock();
+
     /* If this function has been called with *first_call_ptr set to true, need to
        restart searching from the beginning of the database. If *first_call_ptr
        isn't true, then simply move on to the next key in the database. */
     if (*first_call_ptr) {
         *first_call_ptr = 0;
-        local_key_datum = dbm_firstkey(cdc_dbm_ptr);
+        local_key_datum = db_firstkey(cdc_dbm_ptr);
     } else {
-        local_key_datum = dbm_nextkey(cdc_dbm_ptr);
+        local_key_datum = db_nextkey(cdc_dbm_ptr);
     }
 
     do {
         if (local_key_datum.dptr != NULL) {
             /* an entry was found  */
-            local_data_datum = dbm_fetch(cdc_dbm_ptr, local_key_datum);
+            keys_read++;
+            local_data_datum = db_fetch(cdc_dbm_ptr, local_key_datum);
             if (local_data_datum.dptr) {
                 memcpy(&entry_to_return, (char *)local_data_datum.dptr,
                        local_data_datum.dsize);
                 /* check if search string occurs in the entry */
                 if (!strstr(entry_to_return.catalog, cd_catalog_ptr)) {
                     memset(&entry_to_return, '\0', sizeof(entry_to_return));
-                    local_key_datum = dbm_nextkey(cdc_dbm_ptr);
+                    local_key_datum = db_nextkey(cdc_dbm_ptr);
                 }
             }
         }
     } while (local_key_datum.dptr && local_data_datum.dptr &&
              (entry_to_return.catalog[0] == '\0'));
 
+    stats_record(STATS_DBM_SEARCH, started, 1);
+    CD_PROBE(cd_dbm, search_done, cd_catalog_ptr, entry_to_return.catalog,
+             keys_read);
+    return(entry_to_return);
+}
+
+/* Return each track entry in turn, in the order the dbm file keeps them,
+   and an empty entry after the last. @first_call_ptr works as in
+   search_cdc_entry. Nothing may be added or deleted until the walk ends. */
+cdt_entry next_cdt_entry(int *first_call_ptr)
+{
+    cdt_entry entry_to_return;
+    datum local_data_datum;
+    datum local_key_datum;
+
+    memset(&entry_to_return, '\0', sizeof(entry_to_return));
+
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+        return(entry_to_return);
+    }
+    if (!first_call_ptr) {
+        return(entry_to_return);
+    }
+
+    if (*first_call_ptr) {
+        *first_call_ptr = 0;
+        local_key_datum = db_firstkey(cdt_dbm_ptr);
+    } else {
+        local_key_datum = db_nextkey(cdt_dbm_ptr);
+    }
+
+    /* skip a key whose data has gone */
+    while (local_key_datum.dptr) {
+        local_data_datum = db_fetch(cdt_dbm_ptr, local_key_datum);
+        if (local_data_datum.dptr) {
+            (void) read_cdt_data(local_key_datum, local_data_datum, &entry_to_return);
+            break;
+        }
+        local_key_datum = db_nextkey(cdt_dbm_ptr);
+    }
+    return(entry_to_return);
+}
+
+/* The CDs with a disc ID. If there are none, the returned entry has an
+   empty disc_id and a count of 0. */
+cdi_entry get_cdi_entry(const char *disc_id_ptr)
+{
+    cdi_entry entry_to_return;
+    char entry_to_find[CDI_ID_LEN + 2];
+    datum local_data_datum;
+    datum local_key_datum;
+    uint64_t started;
+
+    memset(&entry_to_return, '\0', sizeof(entry_to_return));
+
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdi_dbm_ptr) {
+        return(entry_to_return);
+    }
+    if (!disc_id_ptr || strlen(disc_id_ptr) != CDI_ID_LEN) {
+        return(entry_to_return);
+    }
+
+    /* the "=" keeps the key apart from those of the catalogs */
+    memset(&entry_to_find, '\0', sizeof(entry_to_find));
+    sprintf(entry_to_find, "=%s", disc_id_ptr);
+
+    local_key_datum.dptr = (void *)entry_to_find;
+    local_key_datum.dsize = sizeof(entry_to_find);
+
+    CD_PROBE(cd_dbm, find_disc_id_start, disc_id_ptr);
+    started = stats_clock();
+    local_data_datum = db_fetch(cdi_dbm_ptr, local_key_datum);
+    if (local_data_datum.dptr && local_data_datum.dsize == sizeof(entry_to_return)) {
+        memcpy(&entry_to_return, (char *)local_data_datum.dptr, local_data_datum.dsize);
+    }
+    stats_record(STATS_DBM_FIND_DISC_ID, started, 1);
+    CD_PROBE(cd_dbm, find_disc_id_done, disc_id_ptr, entry_to_return.count);
     return(entry_to_return);
 }
+
+/* Copy the disc ID of a CD into disc_id_ptr, which holds CDI_ID_LEN + 1
+   chars. 0, with an empty ID, if the CD hasn't got one. */
+int get_cdc_disc_id(const char *cd_catalog_ptr, char *disc_id_ptr)
+{
+    char entry_to_find[CAT_CAT_LEN + 1];
+    datum local_data_datum;
+    datum local_key_datum;
+
+    disc_id_ptr[0] = '\0';
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdi_dbm_ptr) {
+        return(0);
+    }
+    if (!cd_catalog_ptr || strlen(cd_catalog_ptr) >= CAT_CAT_LEN) {
+        return(0);
+    }
+
+    memset(&entry_to_find, '\0', sizeof(entry_to_find));
+    strcpy(entry_to_find, cd_catalog_ptr);
+
+    local_key_datum.dptr = (void *)entry_to_find;
+    local_key_datum.dsize = sizeof(entry_to_find);
+
+    local_data_datum = db_fetch(cdi_dbm_ptr, local_key_datum);
+    if (!local_data_datum.dptr || local_data_datum.dsize != CDI_ID_LEN + 1) {
+        return(0);
+    }
+    memcpy(disc_id_ptr, (char *)local_data_datum.dptr, CDI_ID_LEN + 1);
+    disc_id_ptr[CDI_ID_LEN] = '\0';
+    return(1);
+}
+
+/* Give a CD a disc ID, taking it off the list of the one it had before.
+   Fails if CDI_MAX_CDS CDs have the ID already. */
+int set_cdc_disc_id(const char *cd_catalog_ptr, const char *disc_id_ptr)
+{
+    char key_to_set[CAT_CAT_LEN + 1];
+    char old_disc_id[CDI_ID_LEN + 1];
+    char new_disc_id[CDI_ID_LEN + 1];
+    cdi_entry entry;
+    datum local_data_datum;
+    datum local_key_datum;
+    uint64_t started;
+    int result;
+    int i;
+
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr || !cdi_dbm_ptr) {
+        return(0);
+    }
+    if (!cd_catalog_ptr || strlen(cd_catalog_ptr) >= CAT_CAT_LEN) {
+        return(0);
+    }
+    if (!disc_id_ptr || (disc_id_ptr[0] && strlen(disc_id_ptr) != CDI_ID_LEN)) {
+        return(0);
+    }
+    memset(&new_disc_id, '\0', sizeof(new_disc_id));
+    strcpy(new_disc_id, disc_id_ptr);
+
+    get_cdc_disc_id(cd_catalog_ptr, old_disc_id);
+    if (strcmp(old_disc_id, new_disc_id) == 0) {
+        return(1);
+    }
+
+    /* add the CD to the list of its new ID first, which is what can fail */
+    CD_PROBE(cd_dbm, set_disc_id_start, cd_catalog_ptr, new_disc_id);
+    started = stats_clock();
+    if (new_disc_id[0]) {
+        entry = get_cdi_entry(new_disc_id);
+        if (entry.count == CDI_MAX_CDS) {
+            stats_record(STATS_DBM_SET_DISC_ID, started, 0);
+            CD_PROBE(cd_dbm, set_disc_id_done, cd_catalog_ptr, new_disc_id, 0);
+            return(0);
+        }
+        strcpy(entry.disc_id, new_disc_id);
+        strcpy(entry.catalog[entry.count++], cd_catalog_ptr);
+        if (!store_cdi_entry(&entry)) {
+            stats_record(STATS_DBM_SET_DISC_ID, started, 0);
+            CD_PROBE(cd_dbm, set_disc_id_done, cd_catalog_ptr, new_disc_id, 0);
+            return(0);
+        }
+    }
+    if (old_disc_id[0]) {
+        entry = get_cdi_entry(old_disc_id);
+        for (i = 0; i < entry.count; i++) {
+            if (strcmp(entry.catalog[i], cd_catalog_ptr) == 0) {
+                entry.count--;
+                memmove(entry.catalog[i], entry.catalog[i + 1],
+                        (entry.count - i) * sizeof(entry.catalog[0]));
+                memset(entry.catalog[entry.count], '\0', sizeof(entry.catalog[0]));
+                break;
+            }
+        }
+        if (entry.disc_id[0] && !store_cdi_entry(&entry)) {
+            stats_record(STATS_DBM_SET_DISC_ID, started, 0);
+            CD_PROBE(cd_dbm, set_disc_id_done, cd_catalog_ptr, new_disc_id, 0);
+            return(0);
+        }
+    }
+
+    memset(&key_to_set, '\0', sizeof(key_to_set));
+    strcpy(key_to_set, cd_catalog_ptr);
+    local_key_datum.dptr = (void *)key_to_set;
+    local_key_datum.dsize = sizeof(key_to_set);
+    if (!new_disc_id[0]) {
+        /* db_delete() fails if there was nothing to delete, which is fine */
+        (void) db_delete(cdi_dbm_ptr, local_key_datum);
+        stats_record(STATS_DBM_SET_DISC_ID, started, 1);
+        CD_PROBE(cd_dbm, set_disc_id_done, cd_catalog_ptr, new_disc_id, 1);
+        return(1);
+    }
+    local_data_datum.dptr = (void *)new_disc_id;
+    local_data_datum.dsize = sizeof(new_disc_id);
+    result = db_store(cdi_dbm_ptr, local_key_datum, local_data_datum);
+    stats_record(STATS_DBM_SET_DISC_ID, started, result == 0);
+    CD_PROBE(cd_dbm, set_disc_id_done, cd_catalog_ptr, new_disc_id, result == 0);
+    return(result == 0);
+}
+
+/* The digest cd_sync stored for a CD. 0 if there is none, as nothing
+   was stored or the CD has changed since. */
+int get_cdc_digest(const char *cd_catalog_ptr, unsigned int *digest_ptr)
+{
+    char entry_to_find[CAT_CAT_LEN + 1];
+    datum local_data_datum;
+    datum local_key_datum;
+
+    if (!cds_dbm_ptr || !cd_catalog_ptr || strlen(cd_catalog_ptr) >= CAT_CAT_LEN) {
+        return(0);
+    }
+
+    memset(&entry_to_find, '\0', sizeof(entry_to_find));
+    strcpy(entry_to_find, cd_catalog_ptr);
+    local_key_datum.dptr = (void *)entry_to_find;
+    local_key_datum.dsize = sizeof(entry_to_find);
+
+    local_data_datum = db_fetch(cds_dbm_ptr, local_key_datum);
+    if (!local_data_datum.dptr || local_data_datum.dsize != sizeof(*digest_ptr)) {
+        return(0);
+    }
+    memcpy(digest_ptr, (char *)local_data_datum.dptr, sizeof(*digest_ptr));
+    return(1);
+}
+
+/* Keep a digest with a CD, until the CD next changes */
+int set_cdc_digest(const char *cd_catalog_ptr, const unsigned int digest)
+{
+    char key_to_set[CAT_CAT_LEN + 1];
+    datum local_data_datum;
+    datum local_key_datum;
+
+    if (!cds_dbm_ptr || !cd_catalog_ptr || strlen(cd_catalog_ptr) >= CAT_CAT_LEN) {
+        return(0);
+    }
+
+    memset(&key_to_set, '\0', sizeof(key_to_set));
+    strcpy(key_to_set, cd_catalog_ptr);
+    local_key_datum.dptr = (void *)key_to_set;
+    local_key_datum.dsize = sizeof(key_to_set);
+    local_data_datum.dptr = (void *)&digest;
+    local_data_datum.dsize = sizeof(digest);
+    return(db_store(cds_dbm_ptr, local_key_datum, local_data_datum) == 0);
+}
+
+/* Store the list of CDs with a disc ID, or remove it once it is empty */
+static int store_cdi_entry(const cdi_entry *entry)
+{
+    char key_to_store[CDI_ID_LEN + 2];
+    datum local_data_datum;
+    datum local_key_datum;
+
+    memset(&key_to_store, '\0', sizeof(key_to_store));
+    sprintf(key_to_store, "=%s", entry->disc_id);
+
+    local_key_datum.dptr = (void *)key_to_store;
+    local_key_datum.dsize = sizeof(key_to_store);
+    if (entry->count == 0) {
+        return(db_delete(cdi_dbm_ptr, local_key_datum) == 0);
+    }
+    local_data_datum.dptr = (void *)entry;
+    local_data_datum.dsize = sizeof(*entry);
+    return(db_store(cdi_dbm_ptr, local_key_datum, local_data_datum) == 0);
+}
+
+/* Fill in a track from its key and data, in either the old layout or the
+   new. 0 if the data is neither. */
+static int read_cdt_data(datum key_datum, datum data_datum, cdt_entry *entry)
+{
+    cdt_record record;
+    char *space;
+
+    memset(entry, '\0', sizeof(*entry));
+    if (data_datum.dsize == sizeof(*entry)) {
+        memcpy(entry, (char *)data_datum.dptr, sizeof(*entry));
+        return(1);
+    }
+    if (data_datum.dsize != sizeof(record) || key_datum.dsize != CAT_CAT_LEN + 10) {
+        return(0);
+    }
+    memcpy(&record, (char *)data_datum.dptr, sizeof(record));
+
+    /* the key is "catalog track_no", and a catalog may hold spaces */
+    memcpy(entry->catalog, (char *)key_datum.dptr, TRACK_CAT_LEN);
+    space = strrchr(entry->catalog, ' ');
+    if (space) {
+        *space = '\0';
+    }
+    entry->track_no = record.track_no;
+    if (!get_title(record.title_id, entry->track_txt)) {
+        entry->catalog[0] = '\0';
+        return(0);
+    }
+    return(1);
+}
+
+/* Copy a title from the cache, or from the dictionary into the cache */
+static int get_title(unsigned int title_id, char *track_txt)
+{
+    unsigned int slot = title_id & (TITLE_CACHE - 1);
+    cdd_entry entry;
+
+    if (title_id == 0) {
+        track_txt[0] = '\0';
+        return(1);
+    }
+    if (title_cache[slot].title_id == title_id) {
+        strcpy(track_txt, title_cache[slot].track_txt);
+        return(1);
+    }
+    if (!fetch_title(title_id, &entry)) {
+        return(0);
+    }
+    strcpy(track_txt, entry.track_txt);
+    title_cache[slot].title_id = title_id;
+    strcpy(title_cache[slot].track_txt, entry.track_txt);
+    return(1);
+}
+
+/* Count one more use of a title, adding it if it is new. Its number is
+   its FNV-1a hash, or the first after that not taken by another title,
+   or the first on the way there kept with no uses, once it is clear the
+   title isn't further on. */
+static int add_title(const char *track_txt, unsigned int *title_id)
+{
+    unsigned int hash = 2166136261u;
+    size_t len = strlen(track_txt);
+    size_t i;
+    unsigned int unused_id = 0;
+    cdd_entry entry;
+
+    *title_id = 0;
+    if (len == 0) {
+        return(1);
+    }
+    if (len > TRACK_TTEXT_LEN) {
+        len = TRACK_TTEXT_LEN;
+    }
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)track_txt[i];
+        hash *= 16777619u;
+    }
+    *title_id = hash ? hash : 1;
+
+    while (fetch_title(*title_id, &entry)) {
+        if (strncmp(entry.track_txt, track_txt, len) == 0 && entry.track_txt[len] == '\0') {
+            entry.refs++;
+            return(store_title(*title_id, &entry));
+        }
+        if (entry.refs == 0 && unused_id == 0) {
+            unused_id = *title_id;
+        }
+        *title_id = next_title_id(*title_id);
+    }
+    if (unused_id != 0) {
+        *title_id = unused_id;
+        forget_title(unused_id);
+    }
+    memset(&entry, '\0', sizeof(entry));
+    entry.refs = 1;
+    memcpy(entry.track_txt, track_txt, len);
+    return(store_title(*title_id, &entry));
+}
+
+/* Count one less use of a title. After the last it is removed, unless
+   the next number is taken, when it may be on the way to a title moved
+   on past it and has to stay. Once it is removed, any kept only for it
+   before it go too. */
+static void release_title(unsigned int title_id)
+{
+    unsigned int next_id = next_title_id(title_id);
+    cdd_entry entry;
+
+    if (title_id == 0 || !fetch_title(title_id, &entry)) {
+        return;
+    }
+    if (entry.refs > 0) {
+        entry.refs--;
+    }
+    if (entry.refs > 0 || db_fetch(cdd_dbm_ptr, cdd_key(&next_id)).dptr) {
+        (void) store_title(title_id, &entry);
+        return;
+    }
+    do {
+        (void) db_delete(cdd_dbm_ptr, cdd_key(&title_id));
+        forget_title(title_id);
+        title_id = prev_title_id(title_id);
+    } while (fetch_title(title_id, &entry) && entry.refs == 0);
+}
+
+/* Drop a number's title from the cache, for one removed or given away */
+static void forget_title(unsigned int title_id)
+{
+    if (title_cache[title_id & (TITLE_CACHE - 1)].title_id == title_id) {
+        title_cache[title_id & (TITLE_CACHE - 1)].title_id = 0;
+    }
+}
+
+static int fetch_title(unsigned int title_id, cdd_entry *entry)
+{
+    datum local_data_datum;
+
+    memset(entry, '\0', sizeof(*entry));
+    local_data_datum = db_fetch(cdd_dbm_ptr, cdd_key(&title_id));
+    if (!local_data_datum.dptr || local_data_datum.dsize <= sizeof(entry->refs) ||
+        local_data_datum.dsize > sizeof(*entry)) {
+        return(0);
+    }
+    memcpy(entry, (char *)local_data_datum.dptr, local_data_datum.dsize);
+    entry->track_txt[TRACK_TTEXT_LEN] = '\0';
+    return(1);
+}
+
+static int store_title(unsigned int title_id, const cdd_entry *entry)
+{
+    datum local_data_datum;
+
+    local_data_datum.dptr = (void *)entry;
+    local_data_datum.dsize = sizeof(entry->refs) + strlen(entry->track_txt) + 1;
+    return(db_store(cdd_dbm_ptr, cdd_key(&title_id), local_data_datum) == 0);
+}
+
+/* The dictionary is keyed by the bytes of the number */
+static datum cdd_key(unsigned int *title_id_ptr)
+{
+    datum key_datum;
+
+    key_datum.dptr = (void *)title_id_ptr;
+    key_datum.dsize = sizeof(*title_id_ptr);
+    return(key_datum);
+}
+
+/* 0 stands for the empty title, so it is skipped */
+static unsigned int next_title_id(unsigned int title_id)
+{
+    return(title_id == 0xffffffffu ? 1 : title_id + 1);
+}
+
+static unsigned int prev_title_id(unsigned int title_id)
+{
+    return(title_id == 1 ? 0xffffffffu : title_id - 1);
+}
+
+/* Forget the digest of a CD that is about to change */
+static void drop_cdc_digest(const char *cd_catalog_ptr)
+{
+    char key_to_del[CAT_CAT_LEN + 1];
+    datum local_key_datum;
+
+    if (!cds_dbm_ptr) {
+        return;
+    }
+    memset(&key_to_del, '\0', sizeof(key_to_del));
+    strcpy(key_to_del, cd_catalog_ptr);
+    local_key_datum.dptr = (void *)key_to_del;
+    local_key_datum.dsize = sizeof(key_to_del);
+
+    /* db_delete() fails if there was no digest, which is fine */
+    (void) db_delete(cds_dbm_ptr, local_key_datum);
+}
+
+/* The file operations, each returning what its dbm_ namesake does.
+   db_store always replaces. */
+#ifdef USE_NDBM
+
+static db_file *db_open(const char *base)
+{
+    return(dbm_open((char *)base, O_CREAT | O_RDWR, 0644));
+}
+
+static void db_close(db_file *db)
+{
+    if (db) {
+        dbm_close(db);
+    }
+}
+
+static datum db_fetch(db_file *db, datum key)
+{
+    return(dbm_fetch(db, key));
+}
+
+static int db_store(db_file *db, datum key, datum data)
+{
+    return(dbm_store(db, key, data, DBM_REPLACE));
+}
+
+static int db_delete(db_file *db, datum key)
+{
+    return(dbm_delete(db, key));
+}
+
+static datum db_firstkey(db_file *db)
+{
+    return(dbm_firstkey(db));
+}
+
+static datum db_nextkey(db_file *db)
+{
+    return(dbm_nextkey(db));
+}
+
+/* gdbm_compat writes each change through to the .pag file, so syncing
+   that is enough */
+static int db_sync(db_file *db)
+{
+    return(fsync(dbm_pagfno(db)) == 0);
+}
+
+#else
+
+/* The .pag file that gdbm_compat would open. Like it, no lock is taken,
+   so cdctl can read the files while application has them open. */
+static db_file *db_open(const char *base)
+{
+    char path[100];
+    size_t cache_size = db_options.cache_size;
+    db_file *db;
+    int flags = GDBM_WRCREAT | GDBM_NOLOCK;
+
+    if (db_options.sync) {
+        flags |= GDBM_SYNC;
+    }
+    if (!db_options.mmap) {
+        flags |= GDBM_NOMMAP;
+    }
+    db = calloc(1, sizeof(*db));
+    if (!db) {
+        return(NULL);
+    }
+    snprintf(path, sizeof(path), "%s.pag", base);
+    db->dbf = gdbm_open(path, db_options.block_size, flags, 0644, NULL);
+    if (!db->dbf) {
+        fprintf(stderr, "%s: %s\n", path, gdbm_strerror(gdbm_errno));
+        free(db);
+        return(NULL);
+    }
+    if (cache_size > 0 &&
+        gdbm_setopt(db->dbf, GDBM_SETCACHESIZE, &cache_size, sizeof(cache_size)) != 0) {
+        fprintf(stderr, "%s: can't cache %d buckets\n", path, db_options.cache_size);
+    }
+    return(db);
+}
+
+static void db_close(db_file *db)
+{
+    if (db) {
+        gdbm_close(db->dbf);
+        free(db->fetched.dptr);
+        free(db->walk_key.dptr);
+        free(db);
+    }
+}
+
+static datum db_fetch(db_file *db, datum key)
+{
+    free(db->fetched.dptr);
+    db->fetched = gdbm_fetch(db->dbf, key);
+    return(db->fetched);
+}
+
+static int db_store(db_file *db, datum key, datum data)
+{
+    return(gdbm_store(db->dbf, key, data, GDBM_REPLACE));
+}
+
+static int db_delete(db_file *db, datum key)
+{
+    return(gdbm_delete(db->dbf, key));
+}
+
+static datum db_firstkey(db_file *db)
+{
+    free(db->walk_key.dptr);
+    db->walk_key = gdbm_firstkey(db->dbf);
+    return(db->walk_key);
+}
+
+static datum db_nextkey(db_file *db)
+{
+    datum next_key;
+
+    if (!db->walk_key.dptr) {
+        return(db->walk_key);
+    }
+    next_key = gdbm_nextkey(db->dbf, db->walk_key);
+    free(db->walk_key.dptr);
+    db->walk_key = next_key;
+    return(db->walk_key);
+}
+
+static int db_sync(db_file *db)
+{
+    return(gdbm_sync(db->dbf) == 0);
+}
+
+#endif
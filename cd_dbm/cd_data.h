@@ -21,10 +21,40 @@ typedef struct {
     char track_txt[TRACK_TTEXT_LEN + 1];
 } cdt_entry;
 
+/* The disc IDs table, one entry per CDDB disc ID listing the CDs with it,
+   so that they can be found without a search. The ID of each CD is kept
+   in the same file, under its catalog. */
+#define CDI_ID_LEN         8
+#define CDI_MAX_CDS        16
+
+typedef struct {
+    char disc_id[CDI_ID_LEN + 1];
+    int count;
+    char catalog[CDI_MAX_CDS][CAT_CAT_LEN + 1];
+} cdi_entry;
+
+/* How the gdbm files are opened, by the next database_initialize. The
+   ndbm build (make NDBM=1) opens them its own way and ignores these. */
+typedef struct {
+    int cache_size;     /* buckets of each file kept in memory, 0 for gdbm's
+                           own choice, which grows with the file */
+    int block_size;     /* bytes of a bucket, for a file being created */
+    int mmap;           /* map the files into memory rather than read them */
+    int sync;           /* sync each write, not only on database_sync and close */
+} cd_db_options;
+
 /* Initialization and termination functions */
 int database_initialize(const int new_database);
 void database_close(void);
 
+/* and four for the gdbm options and syncing. database_parse_options
+   changes options by a list such as "cache=4096,block=8192,nommap,sync",
+   and is 0 if a word is unknown. */
+void database_get_options(cd_db_options *options);
+void database_set_options(const cd_db_options *options);
+int database_parse_options(const char *spec, cd_db_options *options);
+int database_sync(void);
+
 /* two for simple data retrieval */
 cdc_entry get_cdc_entry(const char *cd_catalog_ptr);
 cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no);
@@ -39,3 +69,16 @@ int del_cdt_entry(const char *cd_catalog_ptr, const int track_no);
 
 /* one search function */
 cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr);
+
+/* and one to walk every track, whether or not its CD is there */
+cdt_entry next_cdt_entry(int *first_call_ptr);
+
+/* and three for the disc IDs. An empty ID removes the CD's. */
+cdi_entry get_cdi_entry(const char *disc_id_ptr);
+int get_cdc_disc_id(const char *cd_catalog_ptr, char *disc_id_ptr);
+int set_cdc_disc_id(const char *cd_catalog_ptr, const char *disc_id_ptr);
+
+/* and two for the digests cd_sync keeps with the CDs, each dropped when
+   its CD or one of the CD's tracks is written or deleted */
+int get_cdc_digest(const char *cd_catalog_ptr, unsigned int *digest_ptr);
+int set_cdc_digest(const char *cd_catalog_ptr, const unsigned int digest);
@@ -0,0 +1,2 @@
+--  Add the disc ID column to a cd table created before it had one
+ALTER TABLE cd ADD disc_id CHAR(8), ADD INDEX(disc_id);
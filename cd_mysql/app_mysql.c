@@ -2,13 +2,49 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <unistd.h>
+#include <time.h>
+
 #include "mysql.h"
+#include "errmsg.h"
 #include "app_mysql.h"
+#include "cat_probe.h"      /* in ../catalog */
+
+/* Reconnect policy. A statement that finds the server gone makes one quick
+   attempt, REQUEST_CONNECT_SECS at most, and after a failed one the next
+   statements fail at once for RETRY_AFTER_SECS rather than each waiting
+   again. database_ping, called where a frontend can afford to wait, backs
+   off between attempts: each waits twice as long as the one before, from
+   RECONNECT_FIRST_DELAY_MS to RECONNECT_MAX_DELAY_MS, for no longer than
+   RECONNECT_BUDGET_MS in all. The read/write timeouts keep a dead server
+   from stalling a single call for minutes. */
+#define RECONNECT_TRIES          6
+#define RECONNECT_FIRST_DELAY_MS 100
+#define RECONNECT_MAX_DELAY_MS   3200
+#define RECONNECT_BUDGET_MS      15000
+#define CONNECT_TIMEOUT_SECS     5
+#define REQUEST_CONNECT_SECS     2
+#define RETRY_AFTER_SECS         5
+#define IO_TIMEOUT_SECS          30
+#define PING_IDLE_SECS           10
 
 static MYSQL my_connection;
 static int dbconnected = 0;
 
+/* Kept so that a dropped connection can be re-established transparently */
+static char db_user[100];
+static char db_pwd[100];
+static int link_open = 0;
+static time_t last_used;
+static time_t last_failed;      /* of a reconnect, 0 if the last one worked */
+
 static int get_artist_id(char *artist);
+static int connect_db(unsigned int connect_timeout);
+static void close_db(void);
+static int reconnect_db(int tries, unsigned int connect_timeout);
+static int reconnect_in_request(void);
+static long elapsed_ms(const struct timespec *start);
+static int run_query(const char *qs);
 
 int database_start(char *name, char *pwd)
 {
@@ -16,11 +52,12 @@ int database_start(char *name, char *pwd)
         return(1);
     }
 
-    mysql_init(&my_connection);
-    if (!mysql_real_connect(&my_connection, "localhost", name, pwd, "blpcd", 0,
-                            NULL, 0)) {
+    strncpy(db_user, name, sizeof(db_user) - 1);
+    strncpy(db_pwd, pwd, sizeof(db_pwd) - 1);
+    if (!connect_db(CONNECT_TIMEOUT_SECS)) {
         fprintf(stderr, "Database connection failure: %d, %s\n",
                 mysql_errno(&my_connection), mysql_error(&my_connection));
+        close_db();
         return(0);
     }
     dbconnected = 1;
@@ -30,18 +67,167 @@ int database_start(char *name, char *pwd)
 void database_end()
 {
     if (dbconnected) {
-        mysql_close(&my_connection);
+        close_db();
     }
     dbconnected = 0;
 }
 
+/* Check the connection and re-establish it if the server has gone away.
+   Meant to be called from the idle points of a frontend (waiting for the
+   user, between batches of a nightly job), so that a failover is noticed
+   there rather than on the next real query. */
+int database_ping(void)
+{
+    if (!dbconnected) {
+        return(0);
+    }
+    if (link_open && time(NULL) - last_used < PING_IDLE_SECS) {
+        /* recently used successfully, no need for a round trip */
+        return(1);
+    }
+    if (link_open && mysql_ping(&my_connection) == 0) {
+        last_used = time(NULL);
+        return(1);
+    }
+    return(reconnect_db(RECONNECT_TRIES, CONNECT_TIMEOUT_SECS));
+}
+
+/* Open my_connection with the saved credentials. The timeouts make a dead
+   server fail fast instead of blocking in the client library. */
+static int connect_db(unsigned int connect_timeout)
+{
+    unsigned int io_timeout = IO_TIMEOUT_SECS;
+
+    mysql_init(&my_connection);
+    link_open = 1;
+    mysql_options(&my_connection, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
+    mysql_options(&my_connection, MYSQL_OPT_READ_TIMEOUT, &io_timeout);
+    mysql_options(&my_connection, MYSQL_OPT_WRITE_TIMEOUT, &io_timeout);
+    if (!mysql_real_connect(&my_connection, "localhost", db_user, db_pwd, "blpcd", 0,
+                            NULL, 0)) {
+        return(0);
+    }
+    /* Session settings are lost with the connection, so they are set here.
+       The digest queries concatenate all track titles of a CD. */
+    if (mysql_query(&my_connection, "SET SESSION group_concat_max_len = 65536")) {
+        fprintf(stderr, "SET error: %s\n", mysql_error(&my_connection));
+    }
+    last_used = time(NULL);
+    return(1);
+}
+
+static void close_db(void)
+{
+    if (link_open) {
+        mysql_close(&my_connection);
+    }
+    link_open = 0;
+}
+
+/* Drop the broken connection and make up to tries attempts to open a new
+   one, backing off exponentially between them, within RECONNECT_BUDGET_MS.
+   On failure the database stays "started", so a later call tries again
+   instead of failing until a restart. */
+static int reconnect_db(int tries, unsigned int connect_timeout)
+{
+    struct timespec start;
+    int attempt;
+    int delay_ms = RECONNECT_FIRST_DELAY_MS;
+
+    close_db();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CD_PROBE(cd_mysql, reconnect_start);
+    for (attempt = 0; attempt < tries; attempt++) {
+        if (connect_db(connect_timeout)) {
+            last_failed = 0;
+            CD_PROBE(cd_mysql, reconnect_done, attempt + 1, 1);
+            return(1);
+        }
+        fprintf(stderr, "Reconnect attempt %d failed: %d, %s\n", attempt + 1,
+                mysql_errno(&my_connection), mysql_error(&my_connection));
+        close_db();
+        if (attempt + 1 == tries ||
+            elapsed_ms(&start) + delay_ms + connect_timeout * 1000 > RECONNECT_BUDGET_MS) {
+            attempt++;
+            break;
+        }
+        usleep(delay_ms * 1000);
+        delay_ms *= 2;
+        if (delay_ms > RECONNECT_MAX_DELAY_MS) {
+            delay_ms = RECONNECT_MAX_DELAY_MS;
+        }
+    }
+    last_failed = time(NULL);
+    CD_PROBE(cd_mysql, reconnect_done, attempt, 0);
+    return(0);
+}
+
+/* One quick attempt from inside a statement, unless one failed just now */
+static int reconnect_in_request(void)
+{
+    if (last_failed && time(NULL) - last_failed < RETRY_AFTER_SECS) {
+        return(0);
+    }
+    return(reconnect_db(1, REQUEST_CONNECT_SECS));
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+/* Every statement goes through here. If the server has gone away the
+   connection is re-established and the statement issued once more.
+   CR_SERVER_GONE_ERROR means the statement never reached the server, so it
+   is always safe to resend. CR_SERVER_LOST may happen after the server ran
+   it, so only SELECTs are retried in that case to avoid double inserts.
+   The query probes give the statement, and done the MySQL error or 0. */
+static int run_query(const char *qs)
+{
+    int res;
+    unsigned int err;
+
+    if (!link_open && !reconnect_in_request()) {
+        /* a previous reconnect gave up, try again before failing the call */
+        return(1);
+    }
+    CD_PROBE(cd_mysql, query_start, qs);
+    res = mysql_query(&my_connection, qs);
+    if (res == 0) {
+        last_used = time(NULL);
+        CD_PROBE(cd_mysql, query_done, qs, 0);
+        return(0);
+    }
+
+    err = mysql_errno(&my_connection);
+    if (err != CR_SERVER_GONE_ERROR &&
+        !(err == CR_SERVER_LOST && strncmp(qs, "SELECT", 6) == 0)) {
+        CD_PROBE(cd_mysql, query_done, qs, err);
+        return(res);
+    }
+    if (!reconnect_in_request()) {
+        CD_PROBE(cd_mysql, query_done, qs, err);
+        return(res);
+    }
+    res = mysql_query(&my_connection, qs);
+    err = 0;
+    if (res == 0) {
+        last_used = time(NULL);
+    } else {
+        err = mysql_errno(&my_connection);
+    }
+    CD_PROBE(cd_mysql, query_done, qs, err);
+    return(res);
+}
+
 /* You need a sanity check to ensure that you're connected to the database.
    The code would take care of artist names automatically. */
 int add_cd(char *artist, char *title, char *catalogue, int *cd_id)
 {
-    MYSQL_RES *res_ptr;
-    MYSQL_ROW mysqlrow;
-
     int res;
     char is[250];
     char es[250];
@@ -51,6 +237,7 @@ int add_cd(char *artist, char *title, char *catalogue, int *cd_id)
     if (!dbconnected) {
         return(0);
     }
+    CD_PROBE(cd_mysql, add_cd_start, catalogue);
 
     /* The next thing is to check if the artist already exists; if not, create one.
        This is all taken care of in the function get_artist_id*/
@@ -61,36 +248,29 @@ int add_cd(char *artist, char *title, char *catalogue, int *cd_id)
     mysql_escape_string(es, title, strlen(title));
     sprintf(is, "INSERT INTO cd(title, artist_id, catalogue) VALUES('%s', %d, '%s')",
             es, artist_id, catalogue);
-    res = mysql_query(&my_connection, is);
+    res = run_query(is);
     if (res) {
         fprintf(stderr, "Insert error %d: %s\n",
                 mysql_errno(&my_connection), mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, add_cd_done, catalogue, -1);
         return(0);
     }
 
     /* When you come to add the tracks for this CD, you will need to know the 
        ID that was used when the CD record was inserted. You made the field an 
-       auto-increment field, so the database has automatically assigned an ID,
-       but you need to explicitly retrieve the value, with LAST_INSERT_ID. */
-    res = mysql_query(&my_connection, "SELECT LAST_INSERT_ID()");
-    if (res) {
-        printf("SELECT error: %s\n", mysql_error(&my_connection));
-        return(0);
-    } else {
-        res_ptr = mysql_use_result(&my_connection);
-        if (res_ptr) {
-            if ((mysqlrow = mysql_fetch_row(res_ptr))) {
-                sscanf(mysqlrow[0], "%d", &new_cd_id);
-            }
-            mysql_free_result(res_ptr);
-        }
-        /* Last, but no least, set the ID of the newly added row */
-        *cd_id = new_cd_id;
-        if (new_cd_id != -1) {
-            return(1);
-        }
-        return(0);
+       auto-increment field, so the database has automatically assigned an ID.
+       Take it from the INSERT's own reply with mysql_insert_id rather than a
+       second SELECT LAST_INSERT_ID() query: if the connection were
+       re-established in between, the new session would report 0. */
+    new_cd_id = (int)mysql_insert_id(&my_connection);
+
+    /* Last, but no least, set the ID of the newly added row */
+    *cd_id = new_cd_id;
+    CD_PROBE(cd_mysql, add_cd_done, catalogue, new_cd_id);
+    if (new_cd_id > 0) {
+        return(1);
     }
+    return(0);
 }
 
 /* Find or create an artist_id for the given string */
@@ -109,7 +289,7 @@ static int get_artist_id(char *artist)
     mysql_escape_string(es, artist, strlen(artist));
     sprintf(qs, "SELECT id FROM artist WHERE name='%s'", es);
 
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "SELECT error %s\n", mysql_error(&my_connection));
         return(0);
@@ -130,26 +310,14 @@ static int get_artist_id(char *artist)
     }
 
     sprintf(is, "INSERT INTO artist(name) VALUES('%s')", es);
-    res = mysql_query(&my_connection, is);
+    res = run_query(is);
     if (res) {
         fprintf(stderr, "Insert error %d: %s\n",
                 mysql_errno(&my_connection), mysql_error(&my_connection));
         return(0);
     }
 
-    res = mysql_query(&my_connection, "SELECT LAST_INSERT_ID()");
-    if (res) {
-        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
-        return(0);    
-    } else {
-        res_ptr = mysql_use_result(&my_connection);
-        if (res_ptr) {
-            if ((mysqlrow = mysql_fetch_row(res_ptr))) {
-                sscanf(mysqlrow[0], "%d", &artist_id);
-            }
-            mysql_free_result(res_ptr);
-        }
-    }
+    artist_id = (int)mysql_insert_id(&my_connection);
     return(artist_id);
 }
 
@@ -164,19 +332,22 @@ int add_tracks(struct current_tracks_st *tracks)
         return(0);
     }
 
+    CD_PROBE(cd_mysql, add_tracks_start, tracks->cd_id);
     i = 0;
     while (tracks->track[i][0]) {
         mysql_escape_string(es, tracks->track[i], strlen(tracks->track[i]));
         sprintf(is, "INSERT INTO track(cd_id, track_id, title) VALUES(%d, %d, '%s')",
                 tracks->cd_id, i + 1, es);
-        res = mysql_query(&my_connection, is);
+        res = run_query(is);
         if (res) {
             fprintf(stderr, "Insert error %d: %s\n",
                     mysql_errno(&my_connection), mysql_error(&my_connection));
+            CD_PROBE(cd_mysql, add_tracks_done, tracks->cd_id, i, 0);
             return(0);
         }
         i++;
     }
+    CD_PROBE(cd_mysql, add_tracks_done, tracks->cd_id, i, 1);
     return(1);
 }
 
@@ -197,10 +368,11 @@ int get_cd(int cd_id, struct current_cd_st *dest)
     memset(dest, 0, sizeof(*dest));
     dest->artist_id = -1;
 
-    sprintf(qs, "SELECT artist.id, cd.id, artist.name, cd.title, cd.catalogue \
-            FROM artist, cd WHERE artist.id = cd.artist_id and cd.id = %d", cd_id);
+    sprintf(qs, "SELECT artist.id, cd.id, artist.name, cd.title, cd.catalogue, \
+            cd.disc_id FROM artist, cd WHERE artist.id = cd.artist_id and cd.id = %d", cd_id);
+    CD_PROBE(cd_mysql, get_cd_start, cd_id);
 
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
     } else {
@@ -213,11 +385,16 @@ int get_cd(int cd_id, struct current_cd_st *dest)
                     strcpy(dest->artist_name, mysqlrow[2]);
                     strcpy(dest->title, mysqlrow[3]);
                     strcpy(dest->catalogue, mysqlrow[4]);
+                    /* NULL for a CD without one */
+                    if (mysqlrow[5]) {
+                        snprintf(dest->disc_id, sizeof(dest->disc_id), "%s", mysqlrow[5]);
+                    }
                 }
             }
             mysql_free_result(res_ptr);
         }
     }
+    CD_PROBE(cd_mysql, get_cd_done, cd_id, dest->artist_id != -1);
     if (dest->artist_id != -1) {
         return(1);
     }
@@ -241,15 +418,16 @@ int get_cd_tracks(int cd_id, struct current_tracks_st *dest)
 
     sprintf(qs, "SELECT track_id, title FROM track WHERE track.cd_id = %d \
             ORDER BY track_id", cd_id);
+    CD_PROBE(cd_mysql, get_cd_tracks_start, cd_id);
 
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
     } else {
         res_ptr = mysql_store_result(&my_connection);
         if (res_ptr) {
             if ((num_tracks = mysql_num_rows(res_ptr)) > 0) {
-                while ((mysqlrow = mysql_fetch_row(res_ptr))) {
+                while ((mysqlrow = mysql_fetch_row(res_ptr)) && (i < MAX_CD_TRACKS)) {
                     strcpy(dest->track[i], mysqlrow[1]);
                     i++;
                 }
@@ -258,6 +436,7 @@ int get_cd_tracks(int cd_id, struct current_tracks_st *dest)
             mysql_free_result(res_ptr);
         }
     }
+    CD_PROBE(cd_mysql, get_cd_tracks_done, cd_id, num_tracks);
     return(num_tracks);
 }
 
@@ -286,8 +465,9 @@ int find_cds(char *search_str, struct cd_search_st *dest)
             artist.name LIKE '%%%s%%' OR \ 
             cd.title LIKE '%%%s%%' OR \ 
             cd.catalogue LIKE '%%%s%%')", ss, ss, ss);
+    CD_PROBE(cd_mysql, find_cds_start, search_str);
 
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
     } else {
@@ -302,6 +482,7 @@ int find_cds(char *search_str, struct cd_search_st *dest)
             mysql_free_result(res_ptr);
         }
     }
+    CD_PROBE(cd_mysql, find_cds_done, search_str, num_rows);
     return(num_rows);
 }
 
@@ -322,9 +503,10 @@ int delete_cd(int cd_id)
         return(0);
     }
 
+    CD_PROBE(cd_mysql, delete_cd_start, cd_id);
     sprintf(qs, "SELECT artist_id FROM cd WHERE artist_id = \ 
             (SELECT artist_id FROM cd WHERE id = '%d')", cd_id);
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "SELECT erro: %s\n", mysql_error(&my_connection));
     } else {
@@ -340,31 +522,429 @@ int delete_cd(int cd_id)
     }
 
     sprintf(qs, "DELETE FROM track WHERE cd_id = '%d'", cd_id);
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "DELETE erro (track) %d: %s\n",
                 mysql_errno(&my_connection), mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, delete_cd_done, cd_id, 0);
         return(0);
     }
 
     sprintf(qs, "DELETE FROM cd WHERE id = '%d'", cd_id);
-    res = mysql_query(&my_connection, qs);
+    res = run_query(qs);
     if (res) {
         fprintf(stderr, "DELETE erro (cd) %d: %s\n",
                 mysql_errno(&my_connection), mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, delete_cd_done, cd_id, 0);
         return(0);
     }
 
     if (artist_id != -1) {
         /* artist entry is now unrelated to any CDs, delete it*/
         sprintf(qs, "DELETE FROM artist WHERE id = '%d'", artist_id);
-        res = mysql_query(&my_connection, qs);
+        res = run_query(qs);
         if (res) {
             fprintf(stderr, "DELETE erro (artist) %d: %s\n",
                     mysql_errno(&my_connection), mysql_error(&my_connection));
         }
     }
 
+    CD_PROBE(cd_mysql, delete_cd_done, cd_id, 1);
+    return(1);
+}
+
+
+/* Look a CD up by its exact catalogue number. Returns the cd_id, or -1 if
+   there is no such CD. */
+int find_cd_by_catalogue(char *catalogue)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char qs[250];
+    char es[250];
+    int cd_id = -1;
+
+    if (!dbconnected) {
+        return(-1);
+    }
+    mysql_escape_string(es, catalogue, strlen(catalogue));
+    sprintf(qs, "SELECT id FROM cd WHERE catalogue = '%s' ORDER BY id LIMIT 1", es);
+    CD_PROBE(cd_mysql, find_catalogue_start, catalogue);
+
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+    } else {
+        res_ptr = mysql_store_result(&my_connection);
+        if (res_ptr) {
+            if ((mysqlrow = mysql_fetch_row(res_ptr))) {
+                sscanf(mysqlrow[0], "%d", &cd_id);
+            }
+            mysql_free_result(res_ptr);
+        }
+    }
+    CD_PROBE(cd_mysql, find_catalogue_done, catalogue, cd_id);
+    return(cd_id);
+}
+
+/* Walk the whole cd table a page at a time: returns up to MAX_CD_RESULT ids
+   greater than after_cd_id, in id order, and the number returned. Start with
+   after_cd_id 0 and pass the last id of each page to get the next one. */
+int list_cds(int after_cd_id, struct cd_search_st *dest)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char qs[250];
+    int i = 0;
+
+    if (!dbconnected) {
+        return(0);
+    }
+    memset(dest, -1, sizeof(*dest));
+
+    sprintf(qs, "SELECT id FROM cd WHERE id > %d ORDER BY id LIMIT %d",
+            after_cd_id, MAX_CD_RESULT);
+    CD_PROBE(cd_mysql, list_cds_start, after_cd_id);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+    } else {
+        res_ptr = mysql_store_result(&my_connection);
+        if (res_ptr) {
+            while ((mysqlrow = mysql_fetch_row(res_ptr)) && (i < MAX_CD_RESULT)) {
+                sscanf(mysqlrow[0], "%d", &dest->cd_id[i]);
+                i++;
+            }
+            mysql_free_result(res_ptr);
+        }
+    }
+    CD_PROBE(cd_mysql, list_cds_done, after_cd_id, i);
+    return(i);
+}
+
+/* The CDs with a disc ID, up to MAX_CD_RESULT of them in id order, by the
+   index on the column. Returns how many. */
+int find_cds_by_disc_id(const char *disc_id, struct cd_search_st *dest)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char qs[250];
+    char es[20];
+    int i = 0;
+
+    if (!dbconnected || strlen(disc_id) > 8) {
+        return(0);
+    }
+    memset(dest, -1, sizeof(*dest));
+
+    mysql_escape_string(es, disc_id, strlen(disc_id));
+    sprintf(qs, "SELECT id FROM cd WHERE disc_id = '%s' ORDER BY id LIMIT %d",
+            es, MAX_CD_RESULT);
+    CD_PROBE(cd_mysql, find_disc_id_start, disc_id);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+    } else {
+        res_ptr = mysql_store_result(&my_connection);
+        if (res_ptr) {
+            while ((mysqlrow = mysql_fetch_row(res_ptr)) && (i < MAX_CD_RESULT)) {
+                sscanf(mysqlrow[0], "%d", &dest->cd_id[i]);
+                i++;
+            }
+            mysql_free_result(res_ptr);
+        }
+    }
+    CD_PROBE(cd_mysql, find_disc_id_done, disc_id, i);
+    return(i);
+}
+
+/* Like list_cds, but only the CDs meeting an SQL condition on the cd and
+   artist tables. The caller builds the condition and must escape it. */
+int list_cds_matching(const char *condition, int after_cd_id,
+                      struct cd_search_st *dest)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char *qs;
+    int i = 0;
+
+    if (!dbconnected) {
+        return(0);
+    }
+    memset(dest, -1, sizeof(*dest));
+
+    qs = malloc(strlen(condition) + 250);
+    if (!qs) {
+        return(0);
+    }
+    sprintf(qs, "SELECT cd.id FROM cd, artist WHERE artist.id = cd.artist_id \
+            AND cd.id > %d AND %s ORDER BY cd.id LIMIT %d",
+            after_cd_id, condition, MAX_CD_RESULT);
+    CD_PROBE(cd_mysql, list_matching_start, condition, after_cd_id);
+    res = run_query(qs);
+    free(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+    } else {
+        res_ptr = mysql_store_result(&my_connection);
+        if (res_ptr) {
+            while ((mysqlrow = mysql_fetch_row(res_ptr)) && (i < MAX_CD_RESULT)) {
+                sscanf(mysqlrow[0], "%d", &dest->cd_id[i]);
+                i++;
+            }
+            mysql_free_result(res_ptr);
+        }
+    }
+    CD_PROBE(cd_mysql, list_matching_done, condition, after_cd_id, i);
+    return(i);
+}
+
+/* Change the artist, title and catalogue of an existing CD, keeping its id
+   and tracks. */
+int update_cd(int cd_id, char *artist, char *title, char *catalogue)
+{
+    int res;
+    char qs[500];
+    char es[250];
+    char cs[100];
+    int artist_id;
+
+    if (!dbconnected) {
+        return(0);
+    }
+    CD_PROBE(cd_mysql, update_cd_start, cd_id);
+    artist_id = get_artist_id(artist);
+
+    mysql_escape_string(es, title, strlen(title));
+    mysql_escape_string(cs, catalogue, strlen(catalogue));
+    sprintf(qs, "UPDATE cd SET title = '%s', artist_id = %d, catalogue = '%s' \
+            WHERE id = %d", es, artist_id, cs, cd_id);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "UPDATE error %d: %s\n",
+                mysql_errno(&my_connection), mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, update_cd_done, cd_id, 0);
+        return(0);
+    }
+    CD_PROBE(cd_mysql, update_cd_done, cd_id, 1);
+    return(1);
+}
+
+/* Set the disc ID of a CD, or clear it with an empty one */
+int set_disc_id(int cd_id, const char *disc_id)
+{
+    int res;
+    char qs[250];
+    char es[20];
+
+    if (!dbconnected || strlen(disc_id) > 8) {
+        return(0);
+    }
+    CD_PROBE(cd_mysql, set_disc_id_start, cd_id);
+    if (disc_id[0]) {
+        mysql_escape_string(es, disc_id, strlen(disc_id));
+        sprintf(qs, "UPDATE cd SET disc_id = '%s' WHERE id = %d", es, cd_id);
+    } else {
+        sprintf(qs, "UPDATE cd SET disc_id = NULL WHERE id = %d", cd_id);
+    }
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "UPDATE error %d: %s\n",
+                mysql_errno(&my_connection), mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, set_disc_id_done, cd_id, 0);
+        return(0);
+    }
+    CD_PROBE(cd_mysql, set_disc_id_done, cd_id, 1);
+    return(1);
+}
+
+/* Remove all the tracks of a CD, ready for add_tracks to enter new ones */
+int delete_tracks(int cd_id)
+{
+    int res;
+    char qs[250];
+
+    if (!dbconnected) {
+        return(0);
+    }
+    sprintf(qs, "DELETE FROM track WHERE cd_id = %d", cd_id);
+    CD_PROBE(cd_mysql, delete_tracks_start, cd_id);
+    res = run_query(qs);
+    CD_PROBE(cd_mysql, delete_tracks_done, cd_id, res == 0);
+    if (res) {
+        fprintf(stderr, "DELETE error (track) %d: %s\n",
+                mysql_errno(&my_connection), mysql_error(&my_connection));
+        return(0);
+    }
+    return(1);
+}
+
+/* The digest of a CD is the CRC32 of its catalogue, title, artist and track
+   titles, laid out as "catalogue\ttitle\tartist\ttrack1\ntrack2...". A CD lives
+   in bucket CRC32(catalogue) % num_buckets. Both are computed by the server so
+   that comparing a whole bucket costs one row on the wire. cd_sync computes
+   the same values for the dbm store; keep the two in step. */
+#define CD_DIGEST_SQL "SELECT cd.id, cd.catalogue, \
+            CRC32(cd.catalogue) %% %d AS bucket, \
+            CRC32(CONCAT_WS('\\t', cd.catalogue, cd.title, artist.name, \
+            IFNULL(GROUP_CONCAT(track.title ORDER BY track.track_id SEPARATOR '\\n'), ''))) \
+            AS digest \
+            FROM cd JOIN artist ON artist.id = cd.artist_id \
+            LEFT JOIN track ON track.cd_id = cd.id %s \
+            GROUP BY cd.id, cd.catalogue, cd.title, artist.name"
+
+/* Fill digests[0..num_buckets-1] with the XOR of the digests of all CDs in
+   each bucket. Empty buckets are left as 0. */
+int get_bucket_digests(int num_buckets, unsigned int *digests)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char cds[1024];
+    char qs[1200];
+    int bucket;
+    unsigned int digest;
+
+    if (!dbconnected) {
+        return(0);
+    }
+    memset(digests, 0, num_buckets * sizeof(*digests));
+
+    sprintf(cds, CD_DIGEST_SQL, num_buckets, "");
+    sprintf(qs, "SELECT bucket, BIT_XOR(digest) FROM (%s) AS d GROUP BY bucket", cds);
+
+    CD_PROBE(cd_mysql, bucket_digests_start, num_buckets);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, bucket_digests_done, num_buckets, 0);
+        return(0);
+    }
+    res_ptr = mysql_use_result(&my_connection);
+    if (res_ptr) {
+        while ((mysqlrow = mysql_fetch_row(res_ptr))) {
+            if (sscanf(mysqlrow[0], "%d", &bucket) == 1 &&
+                sscanf(mysqlrow[1], "%u", &digest) == 1 &&
+                bucket >= 0 && bucket < num_buckets) {
+                digests[bucket] = digest;
+            }
+        }
+        mysql_free_result(res_ptr);
+    }
+    CD_PROBE(cd_mysql, bucket_digests_done, num_buckets, 1);
     return(1);
 }
 
+/* Retrieve the per-CD digests of one bucket. The array is allocated here and
+   must be freed by the caller. Returns the number of entries, or -1 on error. */
+int get_cd_digests(int num_buckets, int bucket, struct cd_digest_st **dest)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char where[100];
+    char qs[1200];
+    int i = 0, num_rows = 0;
+
+    *dest = NULL;
+    if (!dbconnected) {
+        return(-1);
+    }
+
+    sprintf(where, "WHERE CRC32(cd.catalogue) %% %d = %d", num_buckets, bucket);
+    sprintf(qs, CD_DIGEST_SQL, num_buckets, where);
+
+    CD_PROBE(cd_mysql, cd_digests_start, num_buckets, bucket);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, cd_digests_done, num_buckets, bucket, -1);
+        return(-1);
+    }
+    res_ptr = mysql_store_result(&my_connection);
+    if (res_ptr) {
+        num_rows = mysql_num_rows(res_ptr);
+        if (num_rows > 0) {
+            *dest = calloc(num_rows, sizeof(**dest));
+            if (!*dest) {
+                mysql_free_result(res_ptr);
+                CD_PROBE(cd_mysql, cd_digests_done, num_buckets, bucket, -1);
+                return(-1);
+            }
+            while ((mysqlrow = mysql_fetch_row(res_ptr)) && i < num_rows) {
+                sscanf(mysqlrow[0], "%d", &(*dest)[i].cd_id);
+                strncpy((*dest)[i].catalogue, mysqlrow[1],
+                        sizeof((*dest)[i].catalogue) - 1);
+                sscanf(mysqlrow[3], "%u", &(*dest)[i].digest);
+                i++;
+            }
+        }
+        mysql_free_result(res_ptr);
+    }
+    CD_PROBE(cd_mysql, cd_digests_done, num_buckets, bucket, i);
+    return(i);
+}
+
+/* Fill *dest with the rows of the track table whose cd_id is in the bucket
+   cd_id % num_buckets, so that a big table comes back a part at a time.
+   Returns how many, or -1 on error. The caller frees *dest. */
+int get_track_rows(int num_buckets, int bucket, struct track_row_st **dest)
+{
+    MYSQL_RES *res_ptr;
+    MYSQL_ROW mysqlrow;
+
+    int res;
+    char qs[400];
+    int i = 0, num_rows = 0;
+
+    *dest = NULL;
+    if (!dbconnected) {
+        return(-1);
+    }
+
+    sprintf(qs, "SELECT track.cd_id, track.track_id, IFNULL(cd.catalogue, ''), "
+            "IFNULL(track.title, '') FROM track LEFT JOIN cd ON cd.id = track.cd_id "
+            "WHERE track.cd_id %% %d = %d", num_buckets, bucket);
+
+    CD_PROBE(cd_mysql, track_rows_start, num_buckets, bucket);
+    res = run_query(qs);
+    if (res) {
+        fprintf(stderr, "SELECT error: %s\n", mysql_error(&my_connection));
+        CD_PROBE(cd_mysql, track_rows_done, num_buckets, bucket, -1);
+        return(-1);
+    }
+    res_ptr = mysql_store_result(&my_connection);
+    if (res_ptr) {
+        num_rows = mysql_num_rows(res_ptr);
+        if (num_rows > 0) {
+            *dest = calloc(num_rows, sizeof(**dest));
+            if (!*dest) {
+                mysql_free_result(res_ptr);
+                CD_PROBE(cd_mysql, track_rows_done, num_buckets, bucket, -1);
+                return(-1);
+            }
+            while ((mysqlrow = mysql_fetch_row(res_ptr)) && i < num_rows) {
+                sscanf(mysqlrow[0], "%d", &(*dest)[i].cd_id);
+                sscanf(mysqlrow[1], "%d", &(*dest)[i].track_id);
+                strncpy((*dest)[i].catalogue, mysqlrow[2],
+                        sizeof((*dest)[i].catalogue) - 1);
+                strncpy((*dest)[i].title, mysqlrow[3],
+                        sizeof((*dest)[i].title) - 1);
+                i++;
+            }
+        }
+        mysql_free_result(res_ptr);
+    }
+    CD_PROBE(cd_mysql, track_rows_done, num_buckets, bucket, i);
+    return(i);
+}
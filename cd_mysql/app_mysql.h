@@ -6,12 +6,14 @@ struct current_cd_st {
     char artist_name[100];
     char title[100];
     char catalogue[100];
+    char disc_id[9];        /* the CDDB disc ID, or empty */
 };
 
 /* A simplistic track details structure */
+#define MAX_CD_TRACKS 20
 struct current_tracks_st {
     int cd_id;
-    char track[20][100];
+    char track[MAX_CD_TRACKS][100];
 };
 
 #define MAX_CD_RESULT 10
@@ -19,9 +21,26 @@ struct cd_search_st {
     int cd_id[MAX_CD_RESULT];
 };
 
+/* Content digest of one CD, used to compare stores without moving rows */
+struct cd_digest_st {
+    int cd_id;
+    char catalogue[100];
+    unsigned int digest;
+};
+
+/* One row of the track table, with the catalogue of its CD, or an empty
+   one if there is no such CD */
+struct track_row_st {
+    int cd_id;
+    int track_id;
+    char catalogue[100];
+    char title[100];
+};
+
 /* Database backend functions */
 int database_start(char *name, char *password);
 void database_end();
+int database_ping(void);
 
 /* Functions for adding a CD */
 int add_cd(char *artist, char *title, char *catalogue, int *cd_id);
@@ -31,6 +50,23 @@ int add_tracks(struct current_tracks_st *tracks);
 int find_cds(char *search_str, struct cd_search_st *results);
 int get_cd(int cd_id, struct current_cd_st *dest);
 int get_cd_tracks(int cd_id, struct current_tracks_st *dest);
+int find_cd_by_catalogue(char *catalogue);
+int list_cds(int after_cd_id, struct cd_search_st *dest);
+int list_cds_matching(const char *condition, int after_cd_id,
+                      struct cd_search_st *dest);
+int find_cds_by_disc_id(const char *disc_id, struct cd_search_st *dest);
+
+/* Functions for changing a CD */
+int update_cd(int cd_id, char *artist, char *title, char *catalogue);
+int delete_tracks(int cd_id);
+int set_disc_id(int cd_id, const char *disc_id);
 
 /* Function for deleting items */
 int delete_cd(int cd_id);
+
+/* Functions for comparing the catalog with another store */
+int get_bucket_digests(int num_buckets, unsigned int *digests);
+int get_cd_digests(int num_buckets, int bucket, struct cd_digest_st **dest);
+
+/* Function for checking the tracks against the CDs */
+int get_track_rows(int num_buckets, int bucket, struct track_row_st **dest);
@@ -2,9 +2,12 @@
 #include <stdio.h>
 #include <string.h>
 #include "app_mysql.h"
+#include "cat_trace.h"
 
-int main()
+/* "app trace_file" records what it does for cdctl replay */
+int main(int argc, char *argv[])
 {
+    cat_trace *recording = NULL;
     struct current_cd_st cd;
     struct cd_search_st cd_res;
     struct current_tracks_st ct;
@@ -14,10 +17,17 @@ int main()
     /* The first thing your app must always do is initialize a database connection,
        providing a valid user name and password */
     database_start("root", "weiyi");
+    if (argc > 1) {
+        recording = trace_start(argv[1]);
+        if (!recording) {
+            return EXIT_FAILURE;
+        }
+    }
     
     /* Then you test adding a CD: */
     res = add_cd("Bu Yi", "He Bu Wan De Jiu", "201407301321", &cd_id);
     printf("Result of adding a cd was %d, cd_id is %d\n", res, cd_id);
+    trace_put(recording, "201407301321", "He Bu Wan De Jiu", "", "Bu Yi");
 
     memset(&ct, 0, sizeof(ct));
     ct.cd_id = cd_id;
@@ -25,17 +35,21 @@ int main()
     strcpy(ct.track[1], "Yang Rou Mian");
     strcpy(ct.track[2], "Na Me Jiu");
     add_tracks(&ct);
+    trace_put_tracks(recording, "201407301321", ct.track[0], sizeof(ct.track[0]), 3);
 
     /* Now search for the CD and retrieve information from the first CD found */
     res = find_cds("Jiu", &cd_res);
+    trace_find(recording, TRACE_ANY_FIELD, "Jiu");
     printf("Found %d cds, first has ID %d\n", res, cd_res.cd_id[0]);
 
     res = get_cd(cd_res.cd_id[0], &cd);
     printf("get_cd returned %d\n", res);
+    trace_key(recording, TRACE_GET, cd.catalogue);
 
     memset(&ct, 0, sizeof(ct));
     res = get_cd_tracks(cd_res.cd_id[0], &ct);
     printf("get_cd_tracks returned %d\n", res);
+    trace_key(recording, TRACE_TRACKS, cd.catalogue);
     printf("Title: %s\n", cd.title);
     i = 0;
     while (i < res) {
@@ -46,8 +60,12 @@ int main()
     /* Finally, delete the CD */
     res = delete_cd(cd_res.cd_id[0]);
     printf("delete_cd returned %d\n", res);
+    trace_key(recording, TRACE_DEL, cd.catalogue);
 
     /* Then disconnect and exit */
     database_end();
+    if (!trace_stop(recording)) {
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
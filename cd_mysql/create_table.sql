@@ -3,7 +3,9 @@ CREATE TABLE cd (
     title VARCHAR(70) NOT NULL,
     artist_id INTEGER NOT NULL,
     catalogue VARCHAR(30) NOT NULL,
-    notes VARCHAR(100)
+    notes VARCHAR(100),
+    disc_id CHAR(8),
+    INDEX(disc_id)
 );
 
 CREATE TABLE artist (
@@ -0,0 +1,805 @@
+/*
+   cd_sync keeps the dbm catalog (cd_dbm) and the MySQL catalog (cd_mysql) in
+   step, so that the two no longer have to be reconciled by hand.
+
+   Rather than comparing every record, both stores are split into buckets by
+   CRC32(catalog) % buckets. Each CD gets a content digest, and each bucket the
+   XOR of the digests of its CDs. MySQL computes its digests itself, so only
+   one row per bucket crosses the wire. Only buckets whose digests differ are
+   then compared CD by CD, and only the CDs that differ are transferred. After
+   a small change a sync touches a handful of CDs, not the whole catalog.
+
+   Two-way syncs remember the digest each CD had when it was last synced, in
+   a state file. That tells which side changed a CD, or deleted it, since the
+   previous run; only a CD changed on both sides is a conflict.
+
+   Reading a dbm CD means reading each of its tracks, so the digest of each
+   is kept with the dbm data, which drops it when the CD changes. A scan
+   then only reads the CDs changed since the previous one.
+
+   The dbm store keeps a type for each CD which the MySQL schema does not have,
+   so the type is not part of the digest and is preserved when a CD is copied
+   from MySQL into an existing dbm entry.
+ */
+
+#define _XOPEN_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cd_data.h"
+#include "app_mysql.h"
+
+#define DEFAULT_BUCKETS 256
+#define MAX_BUCKETS     65536
+#define MAX_TRACKS      MAX_CD_TRACKS
+#define STATE_FILE      "cd_sync.state"
+
+typedef enum {
+    side_none,
+    side_dbm,
+    side_mysql
+} store_side;
+
+/* What needs to be kept of a dbm CD while comparing: not the record itself.
+   synced is the digest to remember for the next run, or dropped if the CD
+   is not to be remembered. */
+typedef struct {
+    char catalog[CAT_CAT_LEN + 1];
+    unsigned int digest;
+    int bucket;
+    unsigned int synced;
+    int dropped;
+} local_digest;
+
+/* One line of the state file: a CD and its digest when it was last synced */
+typedef struct {
+    char catalog[CAT_CAT_LEN + 1];
+    unsigned int digest;
+} synced_digest;
+
+/* The running totals printed at the end */
+static struct {
+    int buckets_differing;
+    int cds_local;
+    int cds_read;
+    int cds_examined;
+    int copied_to_mysql;
+    int copied_to_dbm;
+    int deleted_from_mysql;
+    int deleted_from_dbm;
+    int conflicts;
+    int too_long;
+    int failures;
+} stats;
+
+static int num_buckets = DEFAULT_BUCKETS;
+static store_side master = side_none;   /* -m: mirror this store onto the other */
+static store_side prefer = side_none;   /* -p: winner when both sides changed */
+static int dry_run = 0;
+static char *state_file = STATE_FILE;
+
+/* the state as read at start, and the CDs first seen in MySQL this run */
+static synced_digest *previous;
+static int previous_count;
+static synced_digest *added;
+static int added_count;
+static int added_allocated;
+
+static unsigned int crc_table[256];
+
+static void crc_init(void);
+static unsigned int crc_update(unsigned int crc, const char *buf, size_t len);
+static unsigned int dbm_cd_digest(const cdc_entry *cdc);
+static local_digest *scan_dbm(int *count_ptr, unsigned int *bucket_digests);
+static int compare_local(const void *a, const void *b);
+static int compare_remote(const void *a, const void *b);
+static void sync_bucket(int bucket, local_digest *local, int local_count);
+static void resolve(local_digest *local, const struct cd_digest_st *remote);
+static void keep_base(local_digest *local, const synced_digest *base);
+static void remember(const char *catalog, unsigned int digest);
+static void load_state(void);
+static void save_state(const local_digest *local, int local_count);
+static const synced_digest *find_previous(const char *catalog);
+static int compare_synced(const void *a, const void *b);
+static int copy_to_mysql(const char *catalog, int old_cd_id);
+static int copy_to_dbm(int cd_id, unsigned int digest);
+static const char *dbm_misfit(const struct current_cd_st *cd,
+                              const struct current_tracks_st *tracks, int num_tracks);
+static void delete_from_mysql(const struct cd_digest_st *remote);
+static void delete_from_dbm(const char *catalog);
+static void delete_dbm_tracks(const char *catalog);
+static store_side parse_side(const char *name);
+
+int main(int argc, char *argv[])
+{
+    char *user = "root";
+    char *password = "";
+    unsigned int *local_buckets;
+    unsigned int *remote_buckets;
+    local_digest *local;
+    int local_count;
+    int first, last;
+    int bucket;
+    int aborted = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, ":b:m:p:s:u:w:n")) != -1) {
+        switch (c) {
+        case 'b':
+            num_buckets = atoi(optarg);
+            break;
+        case 'm':
+            master = parse_side(optarg);
+            break;
+        case 'p':
+            prefer = parse_side(optarg);
+            break;
+        case 's':
+            state_file = optarg;
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        case 'w':
+            password = optarg;
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        case ':':
+        case '?':
+        default:
+            fprintf(stderr, "Usage: %s [-n] [-b buckets] [-m dbm|mysql] "
+                    "[-p dbm|mysql] [-s state] [-u user] [-w password]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_buckets < 1 || num_buckets > MAX_BUCKETS) {
+        fprintf(stderr, "Bucket count must be between 1 and %d\n", MAX_BUCKETS);
+        exit(EXIT_FAILURE);
+    }
+
+    crc_init();
+    local_buckets = calloc(num_buckets, sizeof(*local_buckets));
+    remote_buckets = calloc(num_buckets, sizeof(*remote_buckets));
+    if (!local_buckets || !remote_buckets) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!database_initialize(0)) {
+        fprintf(stderr, "Sorry, unable to open the dbm catalog\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!database_start(user, password)) {
+        fprintf(stderr, "Sorry, unable to connect to the MySQL catalog\n");
+        database_close();
+        exit(EXIT_FAILURE);
+    }
+
+    load_state();
+
+    /* Top level of the tree: one digest per bucket on each side */
+    local = scan_dbm(&local_count, local_buckets);
+    /* The scan can take a while; make sure the link survived it */
+    if (!database_ping() || !get_bucket_digests(num_buckets, remote_buckets)) {
+        fprintf(stderr, "Failed to read the MySQL bucket digests\n");
+        database_end();
+        database_close();
+        exit(EXIT_FAILURE);
+    }
+
+    /* local is sorted by bucket, so each bucket is one contiguous run */
+    first = 0;
+    for (bucket = 0; bucket < num_buckets; bucket++) {
+        last = first;
+        while (last < local_count && local[last].bucket == bucket) {
+            last++;
+        }
+        if (local_buckets[bucket] != remote_buckets[bucket]) {
+            stats.buckets_differing++;
+            /* Each bucket is a batch: a failover is waited out here, between
+               batches, rather than inside one of its queries */
+            if (!database_ping()) {
+                fprintf(stderr, "Lost the MySQL connection at bucket %d\n", bucket);
+                stats.failures++;
+                aborted = 1;
+                break;
+            }
+            sync_bucket(bucket, local + first, last - first);
+        }
+        first = last;
+    }
+
+    printf("%d of %d local CDs read in full, the rest had not changed\n",
+           stats.cds_read, stats.cds_local);
+    printf("%d of %d buckets differed, %d of %d local CDs examined\n",
+           stats.buckets_differing, num_buckets, stats.cds_examined,
+           stats.cds_local);
+    printf("%s %d CDs to MySQL, %d CDs to dbm\n", dry_run ? "Would copy" : "Copied",
+           stats.copied_to_mysql, stats.copied_to_dbm);
+    printf("%s %d CDs from MySQL, %d CDs from dbm\n",
+           dry_run ? "Would delete" : "Deleted",
+           stats.deleted_from_mysql, stats.deleted_from_dbm);
+    if (stats.conflicts) {
+        printf("%d CDs changed on both sides were skipped, use -p to choose\n",
+               stats.conflicts);
+    }
+    if (stats.too_long) {
+        printf("%d CDs do not fit the other store and were skipped\n",
+               stats.too_long);
+    }
+    if (stats.failures) {
+        printf("%d CDs could not be transferred\n", stats.failures);
+    }
+    if (aborted) {
+        printf("Stopped early, the sync state was left as it was\n");
+    } else if (!dry_run) {
+        save_state(local, local_count);
+    }
+
+    free(previous);
+    free(added);
+    free(local);
+    free(local_buckets);
+    free(remote_buckets);
+    database_end();
+    database_close();
+    exit(stats.failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* The standard (zlib, and MySQL CRC32()) polynomial, table driven */
+static void crc_init(void)
+{
+    unsigned int c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (unsigned int)n;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+/* Start with crc 0 and feed the data in as many pieces as convenient */
+static unsigned int crc_update(unsigned int crc, const char *buf, size_t len)
+{
+    crc = crc ^ 0xFFFFFFFFU;
+    while (len--) {
+        crc = crc_table[(crc ^ (unsigned char)*buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return(crc ^ 0xFFFFFFFFU);
+}
+
+/* Digest of a dbm CD, laid out exactly as CD_DIGEST_SQL in app_mysql.c:
+   "catalog\ttitle\tartist\ttrack1\ntrack2..." */
+static unsigned int dbm_cd_digest(const cdc_entry *cdc)
+{
+    unsigned int crc = 0;
+    cdt_entry cdt;
+    int track_no = 1;
+
+    crc = crc_update(crc, cdc->catalog, strlen(cdc->catalog));
+    crc = crc_update(crc, "\t", 1);
+    crc = crc_update(crc, cdc->title, strlen(cdc->title));
+    crc = crc_update(crc, "\t", 1);
+    crc = crc_update(crc, cdc->artist, strlen(cdc->artist));
+    crc = crc_update(crc, "\t", 1);
+    do {
+        cdt = get_cdt_entry(cdc->catalog, track_no);
+        if (cdt.catalog[0]) {
+            if (track_no > 1) {
+                crc = crc_update(crc, "\n", 1);
+            }
+            crc = crc_update(crc, cdt.track_txt, strlen(cdt.track_txt));
+            track_no++;
+        }
+    } while (cdt.catalog[0]);
+    return(crc);
+}
+
+/* Read the whole dbm catalog once, keeping only the catalog, digest and bucket
+   of each CD, and fold the digests into the per-bucket XORs. The result is
+   sorted by bucket, then catalog. Only a CD without a kept digest has its
+   tracks read, and its digest is kept for the next run. */
+static local_digest *scan_dbm(int *count_ptr, unsigned int *bucket_digests)
+{
+    local_digest *local = NULL;
+    local_digest *bigger;
+    int allocated = 0;
+    int count = 0;
+    int first_call = 1;
+    cdc_entry cdc;
+
+    do {
+        cdc = search_cdc_entry("", &first_call);
+        if (cdc.catalog[0]) {
+            if (count == allocated) {
+                allocated = allocated ? allocated * 2 : 1024;
+                bigger = realloc(local, allocated * sizeof(*local));
+                if (!bigger) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                local = bigger;
+            }
+            strcpy(local[count].catalog, cdc.catalog);
+            if (!get_cdc_digest(cdc.catalog, &local[count].digest)) {
+                local[count].digest = dbm_cd_digest(&cdc);
+                stats.cds_read++;
+                if (!dry_run) {
+                    (void) set_cdc_digest(cdc.catalog, local[count].digest);
+                }
+            }
+            local[count].synced = local[count].digest;
+            local[count].dropped = 0;
+            local[count].bucket = crc_update(0, cdc.catalog, strlen(cdc.catalog))
+                                  % num_buckets;
+            bucket_digests[local[count].bucket] ^= local[count].digest;
+            count++;
+        }
+    } while (cdc.catalog[0]);
+
+    if (count) {
+        qsort(local, count, sizeof(*local), compare_local);
+    }
+    stats.cds_local = count;
+    *count_ptr = count;
+    return(local);
+}
+
+static int compare_local(const void *a, const void *b)
+{
+    const local_digest *la = a;
+    const local_digest *lb = b;
+
+    if (la->bucket != lb->bucket) {
+        return(la->bucket < lb->bucket ? -1 : 1);
+    }
+    return(strcmp(la->catalog, lb->catalog));
+}
+
+static int compare_remote(const void *a, const void *b)
+{
+    const struct cd_digest_st *ra = a;
+    const struct cd_digest_st *rb = b;
+
+    return(strcmp(ra->catalogue, rb->catalogue));
+}
+
+/* Second level: fetch the per-CD digests of one bucket from MySQL and merge
+   them against the local run, both sorted by catalog. */
+static void sync_bucket(int bucket, local_digest *local, int local_count)
+{
+    struct cd_digest_st *remote;
+    int remote_count;
+    int i = 0, j = 0;
+    int cmp;
+
+    remote_count = get_cd_digests(num_buckets, bucket, &remote);
+    if (remote_count < 0) {
+        fprintf(stderr, "Failed to read the MySQL digests of bucket %d\n", bucket);
+        stats.failures++;
+        return;
+    }
+    if (remote_count) {
+        qsort(remote, remote_count, sizeof(*remote), compare_remote);
+    }
+    stats.cds_examined += local_count;
+
+    while (i < local_count || j < remote_count) {
+        /* The MySQL schema doesn't make catalogue unique; leave extra rows
+           alone rather than guess which of them is the real one */
+        if (j > 0 && j < remote_count &&
+            strcmp(remote[j].catalogue, remote[j - 1].catalogue) == 0) {
+            fprintf(stderr, "Duplicate catalogue %s in MySQL (cd %d), skipped\n",
+                    remote[j].catalogue, remote[j].cd_id);
+            j++;
+            continue;
+        }
+
+        if (i == local_count) {
+            cmp = 1;
+        } else if (j == remote_count) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(local[i].catalog, remote[j].catalogue);
+        }
+
+        if (cmp < 0) {
+            resolve(&local[i++], NULL);
+        } else if (cmp > 0) {
+            resolve(NULL, &remote[j++]);
+        } else {
+            if (local[i].digest != remote[j].digest) {
+                resolve(&local[i], &remote[j]);
+            }
+            i++;
+            j++;
+        }
+    }
+    free(remote);
+}
+
+/* Decide what to do about a CD that is missing from, or differs between, the
+   two stores. With a master (-m) the other side is simply made to match it.
+   Otherwise the digest from the last sync tells which side changed: a CD that
+   still has its old digest on one side was changed, or deleted, on the other.
+   A CD never synced before is new, and is copied across. */
+static void resolve(local_digest *local, const struct cd_digest_st *remote)
+{
+    const synced_digest *base = NULL;
+    store_side winner = master;
+
+    if (master == side_none) {
+        base = find_previous(local ? local->catalog : remote->catalogue);
+        if (!remote) {
+            if (!base) {
+                winner = side_dbm;          /* new in dbm */
+            } else if (base->digest == local->digest) {
+                winner = side_mysql;        /* deleted from MySQL */
+            } else {
+                winner = prefer;            /* changed here, deleted there */
+            }
+        } else if (!local) {
+            if (!base) {
+                winner = side_mysql;        /* new in MySQL */
+            } else if (base->digest == remote->digest) {
+                winner = side_dbm;          /* deleted from dbm */
+            } else {
+                winner = prefer;
+            }
+        } else if (base && base->digest == local->digest) {
+            winner = side_mysql;            /* only MySQL changed */
+        } else if (base && base->digest == remote->digest) {
+            winner = side_dbm;              /* only dbm changed */
+        } else {
+            winner = prefer;
+        }
+    }
+
+    switch (winner) {
+    case side_dbm:
+        if (local) {
+            if (!copy_to_mysql(local->catalog, remote ? remote->cd_id : -1)) {
+                keep_base(local, base);
+            }
+        } else {
+            delete_from_mysql(remote);
+        }
+        break;
+    case side_mysql:
+        if (remote) {
+            if (!copy_to_dbm(remote->cd_id, remote->digest)) {
+                keep_base(local, base);
+            } else if (local) {
+                local->synced = remote->digest;
+            } else {
+                remember(remote->catalogue, remote->digest);
+            }
+        } else {
+            delete_from_dbm(local->catalog);
+            local->dropped = 1;
+        }
+        break;
+    case side_none:
+        printf("Conflict: %s was changed in both stores\n",
+               local ? local->catalog : remote->catalogue);
+        stats.conflicts++;
+        keep_base(local, base);
+        break;
+    }
+}
+
+/* For a CD left as it was, or only partly copied: remember the digest from
+   the last sync, if any, so that the next run sees a conflict again rather
+   than taking the side that wasn't copied for a deletion or a change */
+static void keep_base(local_digest *local, const synced_digest *base)
+{
+    if (local) {
+        if (base) {
+            local->synced = base->digest;
+        } else {
+            local->dropped = 1;
+        }
+    } else if (base) {
+        remember(base->catalog, base->digest);
+    }
+}
+
+/* Note a CD that is not in the local scan but must go into the state file */
+static void remember(const char *catalog, unsigned int digest)
+{
+    synced_digest *bigger;
+
+    if (added_count == added_allocated) {
+        added_allocated = added_allocated ? added_allocated * 2 : 64;
+        bigger = realloc(added, added_allocated * sizeof(*added));
+        if (!bigger) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        added = bigger;
+    }
+    memset(&added[added_count], '\0', sizeof(added[added_count]));
+    strncpy(added[added_count].catalog, catalog, CAT_CAT_LEN);
+    added[added_count].digest = digest;
+    added_count++;
+}
+
+/* The state file has one "digest catalog" line per CD. A missing file just
+   means that nothing has been synced yet. */
+static void load_state(void)
+{
+    FILE *state_fp;
+    char line[CAT_CAT_LEN + 20];
+    int allocated = 0;
+    synced_digest *bigger;
+    unsigned int digest;
+    char *catalog;
+
+    state_fp = fopen(state_file, "r");
+    if (!state_fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), state_fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        catalog = strchr(line, ' ');
+        if (!catalog || sscanf(line, "%x", &digest) != 1) {
+            continue;
+        }
+        if (previous_count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            bigger = realloc(previous, allocated * sizeof(*previous));
+            if (!bigger) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            previous = bigger;
+        }
+        memset(&previous[previous_count], '\0', sizeof(previous[previous_count]));
+        strncpy(previous[previous_count].catalog, catalog + 1, CAT_CAT_LEN);
+        previous[previous_count].digest = digest;
+        previous_count++;
+    }
+    fclose(state_fp);
+    if (previous_count) {
+        qsort(previous, previous_count, sizeof(*previous), compare_synced);
+    }
+}
+
+/* Write the digests both stores now agree on. Buckets that matched were not
+   looked at, and their local digests are the synced ones. */
+static void save_state(const local_digest *local, int local_count)
+{
+    FILE *state_fp;
+    char temp_name[FILENAME_MAX];
+    int i;
+
+    sprintf(temp_name, "%.*s.tmp", FILENAME_MAX - 5, state_file);
+    state_fp = fopen(temp_name, "w");
+    if (!state_fp) {
+        fprintf(stderr, "Unable to write %s\n", temp_name);
+        return;
+    }
+    for (i = 0; i < local_count; i++) {
+        if (!local[i].dropped) {
+            fprintf(state_fp, "%08x %s\n", local[i].synced, local[i].catalog);
+        }
+    }
+    for (i = 0; i < added_count; i++) {
+        fprintf(state_fp, "%08x %s\n", added[i].digest, added[i].catalog);
+    }
+    fclose(state_fp);
+    rename(temp_name, state_file);
+}
+
+static const synced_digest *find_previous(const char *catalog)
+{
+    synced_digest key;
+
+    if (!previous_count) {
+        return(NULL);
+    }
+    memset(&key, '\0', sizeof(key));
+    strncpy(key.catalog, catalog, CAT_CAT_LEN);
+    return(bsearch(&key, previous, previous_count, sizeof(*previous),
+                   compare_synced));
+}
+
+static int compare_synced(const void *a, const void *b)
+{
+    return(strcmp(((const synced_digest *)a)->catalog,
+                  ((const synced_digest *)b)->catalog));
+}
+
+/* Replace (or create) the MySQL copy of a dbm CD. The MySQL wrapper has no
+   update, so any old row is deleted and the CD inserted afresh. A CD with
+   more tracks than MySQL holds is reported and left alone, as copy_to_dbm
+   does the other way. Returns 0 if the CD was not copied, or only partly. */
+static int copy_to_mysql(const char *catalog, int old_cd_id)
+{
+    struct current_tracks_st tracks;
+    cdc_entry cdc;
+    cdt_entry cdt;
+    int track_no;
+    int cd_id;
+
+    cdc = get_cdc_entry(catalog);
+    if (!cdc.catalog[0]) {
+        stats.failures++;
+        return(0);
+    }
+    memset(&tracks, 0, sizeof(tracks));
+    for (track_no = 1; track_no <= MAX_TRACKS; track_no++) {
+        cdt = get_cdt_entry(catalog, track_no);
+        if (!cdt.catalog[0]) {
+            break;
+        }
+        strcpy(tracks.track[track_no - 1], cdt.track_txt);
+    }
+    if (track_no > MAX_TRACKS && get_cdt_entry(catalog, track_no).catalog[0]) {
+        fprintf(stderr, "%s has more than %d tracks for MySQL, skipped\n",
+                catalog, MAX_TRACKS);
+        stats.too_long++;
+        return(0);
+    }
+    printf("%s -> MySQL\n", catalog);
+    stats.copied_to_mysql++;
+    if (dry_run) {
+        return(1);
+    }
+
+    if (old_cd_id != -1 && !delete_cd(old_cd_id)) {
+        stats.failures++;
+        return(0);
+    }
+    if (!add_cd(cdc.artist, cdc.title, cdc.catalog, &cd_id)) {
+        stats.failures++;
+        return(0);
+    }
+    tracks.cd_id = cd_id;
+    if (!add_tracks(&tracks)) {
+        stats.failures++;
+        return(0);
+    }
+    return(1);
+}
+
+/* Replace (or create) the dbm copy of a MySQL CD, keeping any dbm-only type.
+   A CD that doesn't fit the fixed dbm records is reported and left alone:
+   a cut-down copy would never match the MySQL digest, and would be copied
+   again on every run. The copy has the MySQL digest, which is kept with
+   it. Returns 0 if the CD was not copied, or only partly. */
+static int copy_to_dbm(int cd_id, unsigned int digest)
+{
+    struct current_cd_st cd;
+    struct current_tracks_st tracks;
+    cdc_entry cdc, existing;
+    cdt_entry cdt;
+    const char *misfit;
+    int num_tracks;
+    int i;
+
+    if (!get_cd(cd_id, &cd)) {
+        stats.failures++;
+        return(0);
+    }
+    num_tracks = get_cd_tracks(cd_id, &tracks);
+    misfit = dbm_misfit(&cd, &tracks, num_tracks);
+    if (misfit) {
+        fprintf(stderr, "%s (cd %d) has %s for dbm, skipped\n",
+                cd.catalogue, cd_id, misfit);
+        stats.too_long++;
+        return(0);
+    }
+    printf("%s -> dbm\n", cd.catalogue);
+    stats.copied_to_dbm++;
+    if (dry_run) {
+        return(1);
+    }
+
+    memset(&cdc, '\0', sizeof(cdc));
+    strcpy(cdc.catalog, cd.catalogue);
+    strcpy(cdc.title, cd.title);
+    strcpy(cdc.artist, cd.artist_name);
+    existing = get_cdc_entry(cdc.catalog);
+    if (existing.catalog[0]) {
+        strcpy(cdc.type, existing.type);
+    }
+
+    delete_dbm_tracks(cdc.catalog);
+    if (!add_cdc_entry(cdc)) {
+        stats.failures++;
+        return(0);
+    }
+    for (i = 0; i < num_tracks; i++) {
+        memset(&cdt, '\0', sizeof(cdt));
+        strcpy(cdt.catalog, cdc.catalog);
+        cdt.track_no = i + 1;
+        strcpy(cdt.track_txt, tracks.track[i]);
+        if (!add_cdt_entry(cdt)) {
+            stats.failures++;
+            return(0);
+        }
+    }
+    (void) set_cdc_digest(cdc.catalog, digest);
+    return(1);
+}
+
+/* What of a MySQL CD is too big for the dbm records, or NULL if it fits */
+static const char *dbm_misfit(const struct current_cd_st *cd,
+                              const struct current_tracks_st *tracks, int num_tracks)
+{
+    int i;
+
+    /* the dbm keys hold a catalog of up to CAT_CAT_LEN - 1 chars */
+    if (strlen(cd->catalogue) >= CAT_CAT_LEN) {
+        return("a catalogue number too long");
+    }
+    if (strlen(cd->title) > CAT_TITLE_LEN) {
+        return("a title too long");
+    }
+    if (strlen(cd->artist_name) > CAT_ARTIST_LEN) {
+        return("an artist name too long");
+    }
+    if (num_tracks > MAX_TRACKS) {
+        return("too many tracks");
+    }
+    for (i = 0; i < num_tracks; i++) {
+        if (strlen(tracks->track[i]) > TRACK_TTEXT_LEN) {
+            return("a track title too long");
+        }
+    }
+    return(NULL);
+}
+
+static void delete_from_mysql(const struct cd_digest_st *remote)
+{
+    printf("%s deleted from MySQL\n", remote->catalogue);
+    stats.deleted_from_mysql++;
+    if (!dry_run && !delete_cd(remote->cd_id)) {
+        stats.failures++;
+    }
+}
+
+static void delete_from_dbm(const char *catalog)
+{
+    printf("%s deleted from dbm\n", catalog);
+    stats.deleted_from_dbm++;
+    if (dry_run) {
+        return;
+    }
+    delete_dbm_tracks(catalog);
+    if (!del_cdc_entry(catalog)) {
+        stats.failures++;
+    }
+}
+
+/* Same approach as the dbm application: tracks are numbered from 1 with
+   no gaps, so delete until one is missing */
+static void delete_dbm_tracks(const char *catalog)
+{
+    int track_no = 1;
+
+    while (del_cdt_entry(catalog, track_no)) {
+        track_no++;
+    }
+}
+
+static store_side parse_side(const char *name)
+{
+    if (strcmp(name, "dbm") == 0) {
+        return(side_dbm);
+    }
+    if (strcmp(name, "mysql") == 0) {
+        return(side_mysql);
+    }
+    fprintf(stderr, "Unknown store %s, expected dbm or mysql\n", name);
+    exit(EXIT_FAILURE);
+}
@@ -54,17 +54,49 @@ int getch(void); 获取键盘输入，
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <curses.h>
 
+/* Completion in find, the block reads and writes of the files, the
+   workload trace that "mini_cd_manager -r FILE" records for cdctl replay,
+   and the client of cdserve that "mini_cd_manager -s SOCKET" uses instead
+   of the files, come from the catalog library, which "make" builds first,
+   as does the slotted layout of tracks.cdb that lets one track be edited
+   in place.
+   "make opt" builds both optimized, and "make pgo" for the workload too. */
+#include "catalog.h"
+#include "cat_complete.h"
+#include "cat_io.h"
+#include "cat_text.h"
+#include "cat_probe.h"
+#include "cat_trace.h"
+#include "cat_client.h"
+#include "cat_stats.h"
+
 #define MAX_STRING 80
 #define MAX_ENTRY 1024
 #define MESSAGE_LINE 6
 #define ERROR_LINE 22
 #define Q_LINE 20
 #define PROMPT_LINE 18
+#define COMPLETE_LINE 8
+#define COMPLETIONS 8
+#define CTRL_L 12
+
+/* Over a slow link every byte sent to the terminal is felt, so the screen
+   is never cleared outright: a new screen is erase()d and drawn, and curses
+   sends only the cells that differ from what is already there. Nothing is
+   refreshed before it waits for a key, since getch refreshes by itself, so
+   a whole screen goes out in one write. Ctrl-L in a menu repaints it all
+   for a terminal that has got out of step. */
 
 static char current_cd[MAX_STRING] = "\0";
 static char current_cat[MAX_STRING];
+static cat_trace *recording;   /* with -r */
+static cat_client *server;      /* with -s, which then has the files */
+static const char *metrics_file;    /* with -m */
+static const char *metrics_socket;  /* with -M */
+static char status_line[MAX_STRING];    /* shown once, on the next screen */
 const char *TITLE_FILE = "title.cdb";
 const char *TRACKS_FILE = "tracks.cdb";
 const char *temp_file = "cdb.tmp";
@@ -74,15 +106,28 @@ void get_return(void);
 int get_confirm(void);
 int getchoice(char *greet, char *choices[]);
 void draw_menu(char *options[], int highlight, int start_row, int start_col);
+void draw_menu_row(char *options[], int row, int highlight, int start_row, int start_col);
 void insert_title(char *cdtitle);
 void get_string(char *string);
+int get_completed_string(char *string, char *catalog);
+cat_complete *load_completions(void);
+int server_complete(const char *prefix, complete_match *dest, uint32_t *total);
+int server_call(int op, int num_args, const char *args[], serve_reply *reply);
 void add_record(void);
 void count_cds(void);
 void find_cd(void);
 void list_tracks(void);
+int compare_track_lines(const void *a, const void *b);
 void remove_tracks(void);
 void remove_cd(void);
 void update_cd(void);
+void edit_track(void);
+int server_edit_track(char entered[][MAX_STRING], int count, int track_no,
+                      const char *title);
+int local_edit_track(char entered[][MAX_STRING], int count, int track_no,
+                     const char *title);
+int read_tracks(char entered[][MAX_STRING]);
+void trace_tracks(void);
 
 //todo why aadd? Repeat the first letter?
 char *main_menu[] = 
@@ -102,14 +147,50 @@ char *extended_menu[] =
     "l    list tracks on current CD",
     "r    remove current CD",
     "u    update track information",
+    "e    edit, remove or add the next track",
     "qquit",
     0,
 };
 
-int main()
+int main(int argc, char *argv[])
 {
     int choice;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:m:M:")) != -1) {
+        switch (opt) {
+        case 'r':
+            recording = trace_start(optarg);
+            if (!recording) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            server = client_connect(optarg);
+            if (!server) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'M':
+            metrics_socket = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r trace_file] [-s socket] [-m metrics_file] "
+                    "[-M metrics_socket]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((metrics_file || metrics_socket) &&
+        !stats_start("mini_cd_manager", metrics_file, metrics_socket)) {
+        exit(EXIT_FAILURE);
+    }
+
     initscr();
+    /* left on, since switching it sends the terminal a sequence each time */
+    keypad(stdscr, TRUE);
     do {
         /* 当current_cd 不为'\0'时，需要重绘为扩展菜单 */
         choice = getchoice("Options:", current_cd[0] ? extended_menu : main_menu);
@@ -134,9 +215,18 @@ int main()
         case 'u':
             update_cd();
             break;
+        case 'e':
+            edit_track();
+            break;
         }
     } while (choice != 'q');
     endwin();
+    client_close(server);
+    stats_stop();
+    if (!trace_stop(recording)) {
+        fprintf(stderr, "The trace was not all written\n");
+        exit(EXIT_FAILURE);
+    }
     exit(EXIT_SUCCESS);
 }
 
@@ -148,6 +238,7 @@ int getchoice(char *greet, char *choices[])
     int start_screencol = 10;
     char **option;
     int selected;
+    int old_row;
     int key = 0;
 
     option = choices;
@@ -162,11 +253,12 @@ int getchoice(char *greet, char *choices[])
     }
     clear_all_screen();
     mvprintw(start_screenrow - 2, start_screencol, greet);
-    keypad(stdscr, TRUE);
     cbreak();
     noecho();
+    draw_menu(choices, selected_row, start_screenrow, start_screencol);
     key = 0;
     while (key != 'q' && key != KEY_ENTER && key != '\n') {
+        old_row = selected_row;
         if (key == KEY_UP) {
             if (selected_row == 0) {
                 selected_row = max_row - 1;   
@@ -181,11 +273,17 @@ int getchoice(char *greet, char *choices[])
                 selected_row++;
             }
         }
+        if (key == CTRL_L) {
+            wrefresh(curscr);
+        }
+        /* only the two rows whose highlight changed */
+        if (selected_row != old_row) {
+            draw_menu_row(choices, old_row, selected_row, start_screenrow, start_screencol);
+            draw_menu_row(choices, selected_row, selected_row, start_screenrow, start_screencol);
+        }
         selected = *choices[selected_row];
-        draw_menu(choices, selected_row, start_screenrow, start_screencol);
         key = getch();
     }
-    keypad(stdscr, FALSE);
     nocbreak();
     echo();
 
@@ -201,36 +299,42 @@ void draw_menu(char *options[], int current_highlight,
 {
     int current_row = 0;
     char **option_ptr;
-    char *txt_ptr;
     option_ptr = options;
 
     while (*option_ptr) {
-        if (current_row == current_highlight) {
-            attron(A_STANDOUT);
-        }
-        txt_ptr = options[current_row];
-        txt_ptr++;
-        mvprintw(start_row + current_row, start_col, "%s", txt_ptr);
-        if (current_row == current_highlight) {
-            attroff(A_STANDOUT);
-        }
+        draw_menu_row(options, current_row, current_highlight, start_row, start_col);
         current_row++;
         option_ptr++;
     }
 
     mvprintw(start_row + current_row + 3, start_col, "Move highlight then press Return ");
-    refresh();
+}
+
+void draw_menu_row(char *options[], int row, int highlight,
+                   int start_row, int start_col)
+{
+    if (row == highlight) {
+        attron(A_STANDOUT);
+    }
+    /* skip the key letter */
+    mvprintw(start_row + row, start_col, "%s", options[row] + 1);
+    if (row == highlight) {
+        attroff(A_STANDOUT);
+    }
 }
 
 void clear_all_screen()
 {
-    clear();
+    erase();
     mvprintw(2, 20, "%s", "CD Database Application");
     if (current_cd[0]) {
         mvprintw(ERROR_LINE, 0, "Current CD: %s, %s\n",
                  current_cat, current_cd);
     }
-    refresh();
+    if (status_line[0]) {
+        mvprintw(Q_LINE, 5, "%s", status_line);
+        status_line[0] = '\0';
+    }
 }
 
 void add_record()
@@ -240,6 +344,8 @@ void add_record()
     char cd_type[MAX_STRING];
     char cd_artist[MAX_STRING];
     char cd_entry[MAX_STRING];
+    const char *args[4];
+    serve_reply reply;
 
     int screenrow = MESSAGE_LINE;
     int screencol = 10;
@@ -267,10 +373,20 @@ void add_record()
     mvprintw(PROMPT_LINE-2, 5, "%s", "About to add this new entry");
     sprintf(cd_entry, "%s,%s,%s,%s", catalog_number, cd_title, cd_type, cd_artist);
     mvprintw(PROMPT_LINE, 5, "%s", cd_entry);
-    refresh();
     move(PROMPT_LINE, 0);
     if (get_confirm()) {
-        insert_title(cd_entry);
+        trace_put(recording, catalog_number, cd_title, cd_type, cd_artist);
+        if (server) {
+            args[0] = catalog_number;
+            args[1] = cd_title;
+            args[2] = cd_type;
+            args[3] = cd_artist;
+            if (!server_call(SERVE_PUT, 4, args, &reply)) {
+                return;
+            }
+        } else {
+            insert_title(cd_entry);
+        }
         strcpy(current_cd, cd_title);
         strcpy(current_cat, catalog_number);
     }
@@ -287,13 +403,180 @@ void get_string(char *string)
     }
 }
 
+/* Read a string as get_string does, listing the catalog numbers and titles
+   that start with what has been typed so far. If one of them is chosen
+   when Return is pressed, string gets its title and catalog its catalog
+   number and 1 is returned; otherwise string is what was typed. */
+int get_completed_string(char *string, char *catalog)
+{
+    complete_match matches[COMPLETIONS];
+    cat_complete *index;
+    uint32_t total = 0;
+    int start_row, start_col;
+    int len = 0;
+    int count = 0;
+    int selected = -1;
+    int key, i;
+
+    string[0] = '\0';
+    catalog[0] = '\0';
+    index = server ? NULL : load_completions();
+    getyx(stdscr, start_row, start_col);
+    cbreak();
+    noecho();
+    while (1) {
+        if (server) {
+            count = server_complete(string, matches, &total);
+        } else {
+            count = complete_prefix(index, string, matches, COMPLETIONS, &total);
+        }
+        if (selected >= count) {
+            selected = count - 1;
+        }
+        for (i = 0; i <= COMPLETIONS; i++) {
+            move(COMPLETE_LINE + i, 0);
+            clrtoeol();
+        }
+        for (i = 0; i < count; i++) {
+            if (i == selected) {
+                attron(A_STANDOUT);
+            }
+            mvprintw(COMPLETE_LINE + i, 5, "%-16s %s",
+                     matches[i].catalog, matches[i].title);
+            if (i == selected) {
+                attroff(A_STANDOUT);
+            }
+        }
+        if (total > (uint32_t)count) {
+            mvprintw(COMPLETE_LINE + COMPLETIONS, 5, "and %u more", total - count);
+        }
+        mvprintw(start_row, start_col, "%s", string);
+        clrtoeol();
+
+        key = getch();
+        if (key == '\n' || key == KEY_ENTER) {
+            break;
+        }
+        if (key == KEY_UP) {
+            if (selected >= 0) {
+                selected--;
+            }
+        } else if (key == KEY_DOWN) {
+            if (selected < count - 1) {
+                selected++;
+            }
+        } else if (key == '\t') {
+            if (count > 0) {
+                strncpy(string, matches[selected >= 0 ? selected : 0].text,
+                        MAX_STRING - 1);
+                string[MAX_STRING - 1] = '\0';
+                len = strlen(string);
+                selected = -1;
+            }
+        } else if (key == KEY_BACKSPACE || key == 127 || key == '\b') {
+            /* take off a whole UTF-8 character */
+            while (len > 0 && (string[len - 1] & 0xC0) == 0x80) {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+            string[len] = '\0';
+            selected = -1;
+        } else if (key >= ' ' && key < KEY_MIN && len < MAX_STRING - 1) {
+            string[len++] = key;
+            string[len] = '\0';
+            selected = -1;
+        }
+    }
+    nocbreak();
+    echo();
+
+    if (selected < 0) {
+        return(0);
+    }
+    strcpy(string, matches[selected].title);
+    strcpy(catalog, matches[selected].catalog);
+    return(1);
+}
+
+/* The completion index of the catalog files. It is kept between finds and
+   only built again once the files have changed. */
+cat_complete *load_completions(void)
+{
+    static cat_complete *index = NULL;
+    static char index_stamp[CATALOG_STAMP_LEN + 1];
+    char stamp[CATALOG_STAMP_LEN + 1];
+    catalog_backend *be;
+
+    be = catalog_open("text", 0);
+    if (!be) {
+        return(index);
+    }
+    catalog_stamp(be, stamp);
+    if (!index || !stamp[0] || strcmp(stamp, index_stamp) != 0) {
+        complete_free(index);
+        index = complete_build(be);
+        strcpy(index_stamp, stamp);
+    }
+    catalog_close(be);
+    return(index);
+}
+
+/* Completions from the server, asked for at each key since it keeps the
+   index. The strings last until the next call. */
+int server_complete(const char *prefix, complete_match *dest, uint32_t *total)
+{
+    static char text[COMPLETIONS][MAX_STRING];
+    static char catalog[COMPLETIONS][MAX_STRING];
+    static char title[COMPLETIONS][MAX_STRING];
+    char max[8];
+    const char *args[2];
+    serve_reply reply;
+    int count, i;
+
+    sprintf(max, "%d", COMPLETIONS);
+    args[0] = prefix;
+    args[1] = max;
+    *total = 0;
+    if (!server_call(SERVE_COMPLETE, 2, args, &reply) || reply.num_fields < 1) {
+        return(0);
+    }
+    *total = strtoul(reply.fields[0], NULL, 10);
+    count = (reply.num_fields - 1) / 3;
+    for (i = 0; i < count && i < COMPLETIONS; i++) {
+        snprintf(text[i], MAX_STRING, "%s", reply.fields[1 + i * 3]);
+        snprintf(catalog[i], MAX_STRING, "%s", reply.fields[2 + i * 3]);
+        snprintf(title[i], MAX_STRING, "%s", reply.fields[3 + i * 3]);
+        dest[i].text = text[i];
+        dest[i].catalog = catalog[i];
+        dest[i].title = title[i];
+        dest[i].is_title = strcmp(text[i], title[i]) == 0;
+    }
+    return(i);
+}
+
+/* A request to the server. What went wrong is shown on the next screen. */
+int server_call(int op, int num_args, const char *args[], serve_reply *reply)
+{
+    if (!client_call(server, op, num_args, args, reply)) {
+        strcpy(status_line, "Lost the catalog server");
+        return(0);
+    }
+    if (!reply->ok) {
+        snprintf(status_line, MAX_STRING, "Server: %s",
+                 reply->num_fields ? reply->fields[0] : "failed");
+        return(0);
+    }
+    return(1);
+}
+
 int get_confirm()
 {
     int confirmed = 0;
     char first_char;
     mvprintw(Q_LINE, 5, "Are you sure?");
     clrtoeol();
-    refresh();
 
     cbreak();
     first_char = getch();
@@ -302,11 +585,9 @@ int get_confirm()
     }
     nocbreak();
 
+    /* said on the next screen rather than held up for */
     if (!confirmed) {
-        mvprintw(Q_LINE, 1, "    Cancelled");
-        clrtoeol();
-        refresh();
-        sleep(1);
+        strcpy(status_line, "Cancelled");
     }
     return confirmed;
 }
@@ -330,8 +611,13 @@ void insert_title(char *cdtitle)
 
 void update_cd()
 {
-    FILE *tracks_fp;
+    FILE *tracks_fp = NULL;
+    const char *args[CATALOG_MAX_TRACKS + 1];
+    serve_reply reply;
+    int i;
     char track_name[MAX_STRING];
+    char line[MAX_ENTRY];
+    char entered[CATALOG_MAX_TRACKS][MAX_STRING];
     int len;
     int track = 1;
     int screen_line = 1;
@@ -346,11 +632,13 @@ void update_cd()
     move(PROMPT_LINE, 0);
     clrtoeol();
 
-    remove_tracks();
-
     mvprintw(MESSAGE_LINE, 0, "Enter a blank line to finish");
 
-    tracks_fp = fopen(TRACKS_FILE, "a");
+    /* the server replaces the tracks all at once at the end */
+    if (!server) {
+        remove_tracks();
+        tracks_fp = fopen(TRACKS_FILE, "a");
+    }
 
     /* Just to show how, enter the information in a scrolling, boxed,
        window. The trick is to set-up a sub-window, draw a box around the
@@ -376,14 +664,21 @@ void update_cd()
         //todo mvprintw
         mvwprintw(sub_window_ptr, screen_line++, BOX_ROW_POS + 2, "Track %d: ", track);
         clrtoeol();
-        refresh();
+        /* goes out with the sub window when wgetnstr refreshes it */
+        wnoutrefresh(stdscr);
         wgetnstr(sub_window_ptr, track_name, MAX_STRING);
         len = strlen(track_name);
         if (len > 0 && track_name[len - 1 ] == '\n') {
             track_name[len - 1] = '\0';
         }
         if (*track_name) {
-            fprintf(tracks_fp, "%s,%d,%s\n", current_cat, track, track_name);
+            if (tracks_fp) {
+                text_track_line(line, MAX_ENTRY, current_cat, track, track_name);
+                fputs(line, tracks_fp);
+            }
+            if (track <= CATALOG_MAX_TRACKS) {
+                strcpy(entered[track - 1], track_name);
+            }
         }
 
         track++;
@@ -395,14 +690,195 @@ void update_cd()
     } while (*track_name);
     delwin(sub_window_ptr);
 
+    if (tracks_fp) {
+        fclose(tracks_fp);
+    }
+    /* track is now one past the blank line that ended the list */
+    trace_put_tracks(recording, current_cat, entered[0], MAX_STRING, track - 2);
+    if (server) {
+        args[0] = current_cat;
+        for (i = 0; i < track - 2 && i < CATALOG_MAX_TRACKS; i++) {
+            args[i + 1] = entered[i];
+        }
+        server_call(SERVE_PUT_TRACKS, i + 1, args, &reply);
+    }
+}
+
+/* Change or remove one track, or add the one after the last, without
+   re-entering the rest. Removing a track moves the ones after it up, so
+   the files and cdserve both keep the tracks numbered from 1 with no gaps.
+   In the files a change or an addition writes the one slot of tracks.cdb
+   it is in. */
+void edit_track()
+{
+    char entered[CATALOG_MAX_TRACKS][MAX_STRING];
+    char number[MAX_STRING];
+    char title[MAX_STRING];
+    int track_no;
+    int count;
+    int ok;
+    uint64_t started;
+
+    if (current_cd[0] == '\0') {
+        mvprintw(ERROR_LINE, 0, "You must select a CD first.");
+        get_return();
+        return;
+    }
+    clear_all_screen();
+    mvprintw(MESSAGE_LINE, 0, "Editing a track of %s: %s", current_cat, current_cd);
+    count = read_tracks(entered);
+    if (count < 0) {
+        mvprintw(ERROR_LINE, 0, "Sorry, the tracks of %s could not be read.", current_cat);
+        get_return();
+        return;
+    }
+    mvprintw(Q_LINE, 0, "Track number, 1 to %d: ",
+             count < CATALOG_MAX_TRACKS ? count + 1 : CATALOG_MAX_TRACKS);
+    get_string(number);
+    track_no = atoi(number);
+    if (track_no < 1 || track_no > count + 1 || track_no > CATALOG_MAX_TRACKS) {
+        mvprintw(ERROR_LINE, 0, "%s has %d tracks, so a new one is track %d.",
+                 current_cat, count, count + 1);
+        get_return();
+        return;
+    }
+    mvprintw(Q_LINE, 0, "New title, or a blank line to remove track %d "
+             "and move the later ones up: ", track_no);
+    clrtoeol();
+    get_string(title);
+
+    CD_PROBE(mini_cd, edit_track_start, current_cat, track_no);
+    started = stats_clock();
+    if (server) {
+        ok = server_edit_track(entered, count, track_no, title);
+    } else {
+        ok = local_edit_track(entered, count, track_no, title);
+    }
+    stats_record(STATS_MINI_EDIT_TRACK, started, ok);
+    CD_PROBE(mini_cd, edit_track_done, current_cat, track_no, ok);
+    if (!ok) {
+        mvprintw(ERROR_LINE, 0, "Sorry, track %d could not be changed.", track_no);
+        get_return();
+        return;
+    }
+    trace_tracks();
+}
+
+/* cdserve takes a CD's tracks whole and numbers them from 1, so the list
+   is changed and put back */
+int server_edit_track(char entered[][MAX_STRING], int count, int track_no,
+                      const char *title)
+{
+    const char *args[CATALOG_MAX_TRACKS + 2];
+    serve_reply reply;
+    int num_args = 1;
+    int i;
+
+    args[0] = current_cat;
+    for (i = 0; i < count; i++) {
+        if (i + 1 != track_no) {
+            args[num_args++] = entered[i];
+        } else if (title[0]) {
+            args[num_args++] = title;
+        }
+    }
+    if (track_no == count + 1 && title[0]) {
+        args[num_args++] = title;
+    }
+    return(server_call(SERVE_PUT_TRACKS, num_args, args, &reply));
+}
+
+/* One slot for a change or an addition; a removal rewrites each track
+   after it one place up, then removes the last */
+int local_edit_track(char entered[][MAX_STRING], int count, int track_no,
+                     const char *title)
+{
+    int ok = 1;
+    int i;
+
+    if (title[0]) {
+        return(text_set_track(TRACKS_FILE, current_cat, track_no, title));
+    }
+    if (track_no > count) {
+        return(1);
+    }
+    for (i = track_no; ok && i < count; i++) {
+        ok = text_set_track(TRACKS_FILE, current_cat, i, entered[i]);
+    }
+    return(ok && text_set_track(TRACKS_FILE, current_cat, count, NULL));
+}
+
+/* The current CD's track titles in order, from cdserve or tracks.cdb, and
+   how many there are, or -1 if they couldn't be read. A missing file is
+   no tracks. */
+int read_tracks(char entered[][MAX_STRING])
+{
+    char entry[MAX_ENTRY];
+    const char *args[1];
+    serve_reply reply;
+    cat_track track;
+    FILE *tracks_fp;
+    int count = 0;
+    int i;
+
+    memset(entered, '\0', CATALOG_MAX_TRACKS * MAX_STRING);
+    if (server) {
+        args[0] = current_cat;
+        if (!server_call(SERVE_TRACKS, 1, args, &reply)) {
+            return(-1);
+        }
+        for (i = 0; i + 2 <= reply.num_fields && count < CATALOG_MAX_TRACKS; i += 2) {
+            snprintf(entered[count++], MAX_STRING, "%s", reply.fields[i + 1]);
+        }
+        return(count);
+    }
+    tracks_fp = fopen(TRACKS_FILE, "r");
+    if (!tracks_fp) {
+        return(errno == ENOENT ? 0 : -1);
+    }
+    while (fgets(entry, MAX_ENTRY, tracks_fp)) {
+        if (text_parse_track(entry, &track) &&
+            strcmp(track.catalog, current_cat) == 0 &&
+            track.track_no <= CATALOG_MAX_TRACKS) {
+            snprintf(entered[track.track_no - 1], MAX_STRING, "%s", track.title);
+        }
+    }
     fclose(tracks_fp);
+    for (i = 0; i < CATALOG_MAX_TRACKS; i++) {
+        if (entered[i][0]) {
+            memmove(entered[count++], entered[i], MAX_STRING);
+        }
+    }
+    return(count);
+}
+
+/* A trace has no one-track edit, so it gets the CD's tracks as they now
+   are, in order */
+void trace_tracks()
+{
+    char entered[CATALOG_MAX_TRACKS][MAX_STRING];
+    int count;
+
+    if (!recording) {
+        return;
+    }
+    count = read_tracks(entered);
+    if (count >= 0) {
+        trace_put_tracks(recording, current_cat, entered[0], MAX_STRING, count);
+    }
 }
 
 void remove_cd()
 {
-    FILE *titles_fp, *temp_fp;
+    cat_reader *titles;
+    cat_writer *temp;
     char entry[MAX_ENTRY];
     int cat_length;
+    int copy_ok;
+    off_t bytes_read, bytes_written;
+    const char *args[1];
+    serve_reply reply;
+    uint64_t started;
 
     if (current_cd[0] == '\0') {
         return;
@@ -414,22 +890,50 @@ void remove_cd()
     if (!get_confirm()) {
         return;
     }
-    
+    trace_key(recording, TRACE_DEL, current_cat);
+    if (server) {
+        args[0] = current_cat;
+        if (server_call(SERVE_DEL, 1, args, &reply)) {
+            current_cd[0] = '\0';
+        }
+        return;
+    }
+
     //todo whey current_cd remove all?
     cat_length = strlen(current_cat);
 
     /* Copy the titles file to a tempory, ignoring this CD */
-    titles_fp = fopen(TITLE_FILE, "r");
-    temp_fp = fopen(temp_file, "w");
+    titles = io_open_read(TITLE_FILE);
+    if (!titles) {
+        return;
+    }
+    temp = io_open_write(temp_file);
+    if (!temp) {
+        io_close_read(titles);
+        return;
+    }
 
-    while (fgets(entry, MAX_ENTRY, titles_fp)) {
+    /* The scan probes give the bytes read and written */
+    CD_PROBE(mini_cd, remove_titles_start, current_cat);
+    started = stats_clock();
+    while (io_gets(entry, MAX_ENTRY, titles)) {
         /* Compare catalog number and copy entry if no match */
         if (strncmp(current_cat, entry, cat_length) != 0) {
-            fputs(entry, temp_fp);
+            io_puts(entry, temp);
         }
     }
-    fclose(titles_fp);
-    fclose(temp_fp);
+    bytes_read = io_read_offset(titles);
+    bytes_written = io_write_offset(temp);
+
+    /* Keep the old file if the copy went wrong */
+    copy_ok = io_close_read(titles);
+    copy_ok &= io_close_write(temp);
+    stats_record(STATS_MINI_REMOVE_TITLES, started, copy_ok);
+    CD_PROBE(mini_cd, remove_titles_done, current_cat, bytes_read, bytes_written);
+    if (!copy_ok) {
+        unlink(temp_file);
+        return;
+    }
 
     /* Delete the titles file, and rename the temporary file */
     unlink(TITLE_FILE);
@@ -444,9 +948,13 @@ void remove_cd()
 
 void remove_tracks()
 {
-    FILE *tracks_fp, *temp_fp;
+    cat_reader *tracks;
+    cat_writer *temp;
     char entry[MAX_ENTRY];
     int cat_length;
+    int copy_ok;
+    off_t bytes_read, bytes_written;
+    uint64_t started;
 
     if (current_cd[0] == '\0') {
         return;
@@ -454,20 +962,36 @@ void remove_tracks()
     //todo whey current_cd remove all?
     cat_length = strlen(current_cat);
 
-    tracks_fp = fopen(TRACKS_FILE, "r");
-    if (tracks_fp == (FILE *)NULL) {
+    tracks = io_open_read(TRACKS_FILE);
+    if (!tracks) {
+        return;
+    }
+    temp = io_open_write(temp_file);
+    if (!temp) {
+        io_close_read(tracks);
         return;
     }
-    temp_fp = fopen(temp_file, "w");
 
-    while (fgets(entry, MAX_ENTRY, tracks_fp)) {
-        /* Compare catalog number and copy entry if no match */
-        if (strncmp(current_cat, entry, cat_length) != 0) {
-            fputs(entry, temp_fp);
+    CD_PROBE(mini_cd, remove_tracks_start, current_cat);
+    started = stats_clock();
+    while (io_gets(entry, MAX_ENTRY, tracks)) {
+        /* Compare catalog number and copy entry if no match, leaving out
+           the free slots of removed tracks */
+        if (strncmp(current_cat, entry, cat_length) != 0 && !text_free_slot(entry)) {
+            io_puts(entry, temp);
         }
     }
-    fclose(tracks_fp);
-    fclose(temp_fp);
+    bytes_read = io_read_offset(tracks);
+    bytes_written = io_write_offset(temp);
+
+    copy_ok = io_close_read(tracks);
+    copy_ok &= io_close_write(temp);
+    stats_record(STATS_MINI_REMOVE_TRACKS, started, copy_ok);
+    CD_PROBE(mini_cd, remove_tracks_done, current_cat, bytes_read, bytes_written);
+    if (!copy_ok) {
+        unlink(temp_file);
+        return;
+    }
 
     /* Delete the tracks file, and rename the temporary file */
     unlink(TRACKS_FILE);
@@ -480,7 +1004,22 @@ void count_cds()
     char entry[MAX_ENTRY];
     int titles = 0;
     int tracks = 0;
+    serve_reply reply;
+    uint64_t started;
 
+    trace_key(recording, TRACE_COUNT, NULL);
+    if (server) {
+        if (!server_call(SERVE_COUNT, 0, NULL, &reply) || reply.num_fields != 2) {
+            return;
+        }
+        mvprintw(ERROR_LINE, 0,
+                 "Database contains %s titles, with a total of %s tracks.",
+                 reply.fields[0], reply.fields[1]);
+        get_return();
+        return;
+    }
+    CD_PROBE(mini_cd, count_start);
+    started = stats_clock();
     titles_fp = fopen(TITLE_FILE, "r");
     if (titles_fp) {
         while (fgets(entry, MAX_ENTRY, titles_fp)){
@@ -492,10 +1031,14 @@ void count_cds()
     tracks_fp = fopen(TRACKS_FILE, "r");
     if (tracks_fp) {
         while (fgets(entry, MAX_ENTRY, tracks_fp)){
-            tracks++;
+            if (!text_free_slot(entry)) {
+                tracks++;
+            }
         }
         fclose(tracks_fp);
     }
+    stats_record(STATS_MINI_COUNT, started, 1);
+    CD_PROBE(mini_cd, count_done, titles, tracks);
 
     mvprintw(ERROR_LINE, 0,
              "Database contains %d titles, with a total of %d tracks.",
@@ -503,19 +1046,48 @@ void count_cds()
     get_return();
 }
 
+/* Titles are matched ignoring case and accents, by their folded keys,
+   here and in cdserve alike */
 void find_cd()
 {
-    char match[MAX_STRING], entry[MAX_ENTRY];
-    FILE *titles_fp;
+    char match[MAX_STRING], entry[MAX_ENTRY], picked[MAX_STRING];
+    char folded_match[MAX_ENTRY], folded_title[MAX_ENTRY];
+    cat_reader *titles;
     int count = 0;
+    off_t bytes_read = 0;
     char *found, *title, *catalog;
+    const char *args[1];
+    serve_reply reply;
+    uint64_t started;
+    int i;
 
-    mvprintw(Q_LINE, 0, "Enter a string to search for in CD titles: ");
-    get_string(match);
+    clear_all_screen();
+    mvprintw(MESSAGE_LINE, 0, "Up and Down choose a completion, Tab copies it, Return takes it");
+    mvprintw(Q_LINE, 0, "Enter a string to search for in CD titles, in any case: ");
+    if (get_completed_string(match, picked)) {
+        trace_key(recording, TRACE_GET, picked);
+        strcpy(current_cd, match);
+        strcpy(current_cat, picked);
+        return;
+    }
 
-    titles_fp = fopen(TITLE_FILE, "r");
-    if (titles_fp) {
-        while (fgets(entry, MAX_ENTRY, titles_fp)) {
+    trace_find(recording, FILTER_TITLE | TRACE_IGNORE_CASE, match);
+    CD_PROBE(mini_cd, find_start, match);
+    started = stats_clock();
+    if (server) {
+        args[0] = match;
+        if (!server_call(SERVE_FIND, 1, args, &reply)) {
+            return;
+        }
+        /* the last of them, as the scan below */
+        for (i = 0; i + 4 <= reply.num_fields; i += 4) {
+            count++;
+            snprintf(current_cat, MAX_STRING, "%s", reply.fields[i]);
+            snprintf(current_cd, MAX_STRING, "%s", reply.fields[i + 1]);
+        }
+    } else if ((titles = io_open_read(TITLE_FILE)) != NULL) {
+        catalog_fold(folded_match, match, MAX_ENTRY - 1);
+        while (io_gets(entry, MAX_ENTRY, titles)) {
             /* Skip past catalog number */
             catalog = entry;
             if (found = strstr(catalog, ",")) {
@@ -527,7 +1099,8 @@ void find_cd()
                     *found = '\0';
                     
                     /* Now see if the match substring is present */
-                    if (found = strstr(title, match)) {
+                    catalog_fold(folded_title, title, MAX_ENTRY - 1);
+                    if (found = strstr(folded_title, folded_match)) {
                         count++;
                         strcpy(current_cd, title);
                         strcpy(current_cat, catalog);
@@ -535,8 +1108,11 @@ void find_cd()
                 }
             }
         }
-        fclose(titles_fp);
+        bytes_read = io_read_offset(titles);
+        io_close_read(titles);
     }
+    stats_record(STATS_MINI_FIND, started, 1);
+    CD_PROBE(mini_cd, find_done, match, count, bytes_read);
     if (count != 1) {
         if (count == 0) {
             mvprintw(ERROR_LINE, 0, "Sorry, no matching CD found.");
@@ -559,6 +1135,12 @@ void list_tracks()
     int tracks = 0;
     int key;
     int first_line = 0;
+    const char *args[1];
+    serve_reply reply;
+    uint64_t started;
+    char (*lines)[MAX_ENTRY];
+    size_t len;
+    int i;
 
     if (current_cd[0] == '\0') {
         mvprintw(ERROR_LINE, 0, "You must select a CD first.");
@@ -567,18 +1149,29 @@ void list_tracks()
     }
     clear_all_screen();
     cat_length = strlen(current_cat);
+    trace_key(recording, TRACE_TRACKS, current_cat);
 
     /* First count the number of tracks for the current CD */
-    tracks_fp = fopen(TRACKS_FILE, "r");
-    if (!tracks_fp) {
-        return;
-    }
-    while (fgets(entry, MAX_ENTRY, tracks_fp)) {
-        if (strncmp(current_cat, entry, cat_length) == 0) {
-            tracks++;
+    CD_PROBE(mini_cd, list_tracks_start, current_cat);
+    started = stats_clock();
+    if (server) {
+        args[0] = current_cat;
+        if (!server_call(SERVE_TRACKS, 1, args, &reply)) {
+            return;
+        }
+        tracks = reply.num_fields / 2;
+    } else {
+        tracks_fp = fopen(TRACKS_FILE, "r");
+        if (!tracks_fp) {
+            return;
         }
+        while (fgets(entry, MAX_ENTRY, tracks_fp)) {
+            if (strncmp(current_cat, entry, cat_length) == 0) {
+                tracks++;
+            }
+        }
+        fclose(tracks_fp);
     }
-    fclose(tracks_fp);
 
     /* Make a new pad, ensure that even if there is only a single
        track the PAD is large enough so the later prefresh() is always valid  */
@@ -586,28 +1179,55 @@ void list_tracks()
     if (!track_pad_ptr)
 	return;
 
-    tracks_fp = fopen(TRACKS_FILE, "r");
-    if (!tracks_fp)
-	return;
-
     mvprintw(4, 0, "CD Track Listing\n");
 
-    /* write the track information into the pad */
-    while (fgets(entry, MAX_ENTRY, tracks_fp)) {
-        /* Compare catalog number and output rest of entry */
-        if (strncmp(current_cat, entry, cat_length) == 0) {
-            mvwprintw(track_pad_ptr, lines_op++, 0, "%s", entry + cat_length + 1);
+    /* write the track information into the pad, as the lines of the file */
+    if (server) {
+        for (i = 0; i < tracks; i++) {
+            mvwprintw(track_pad_ptr, lines_op++, 0, "%s,%s\n",
+                      reply.fields[i * 2], reply.fields[i * 2 + 1]);
+        }
+    } else {
+        tracks_fp = fopen(TRACKS_FILE, "r");
+        lines = malloc((tracks + 1) * sizeof(*lines));
+        if (!tracks_fp || !lines) {
+            if (tracks_fp) {
+                fclose(tracks_fp);
+            }
+            free(lines);
+            delwin(track_pad_ptr);
+            return;
         }
+
+        /* Compare catalog number and keep the rest of entry, without the
+           padding of its slot. A track edited in place may have gone into
+           any free slot, so the lines are put in order of track number. */
+        while (lines_op < tracks && fgets(entry, MAX_ENTRY, tracks_fp)) {
+            if (strncmp(current_cat, entry, cat_length) == 0) {
+                len = strcspn(entry, "\n");
+                while (len > 0 && entry[len - 1] == ' ') {
+                    len--;
+                }
+                entry[len] = '\0';
+                strcpy(lines[lines_op++], entry + cat_length + 1);
+            }
+        }
+        fclose(tracks_fp);
+        qsort(lines, lines_op, sizeof(*lines), compare_track_lines);
+        for (i = 0; i < lines_op; i++) {
+            mvwprintw(track_pad_ptr, i, 0, "%s\n", lines[i]);
+        }
+        free(lines);
     }
-    fclose(tracks_fp);
+    stats_record(STATS_MINI_LIST_TRACKS, started, 1);
+    CD_PROBE(mini_cd, list_tracks_done, current_cat, lines_op);
 
     if (lines_op > BOXED_LINES) {
         mvprintw(MESSAGE_LINE, 0, "Cursor keys to scroll, RETURN or q to exit");
     } else {
         mvprintw(MESSAGE_LINE, 0, "RETURN or q to exit");
     }
-    wrefresh(stdscr);
-    keypad(stdscr, TRUE);
+    wnoutrefresh(stdscr);
     cbreak();
     noecho();
     key = 0;
@@ -630,11 +1250,16 @@ void list_tracks()
     }
 
     delwin(track_pad_ptr);
-    keypad(stdscr, FALSE);
     nocbreak();
     echo();
 }
 
+/* Lines of tracks.cdb without their catalog number, "track_no,track" */
+int compare_track_lines(const void *a, const void *b)
+{
+    return(atoi(a) - atoi(b));
+}
+
 void get_return()
 {
     int ch;
@@ -237,8 +237,8 @@ update_cd(){
 count_cds(){
     set $(wc -l $TITLE_FILE)
     num_titles=$1
-    set $(wc -l $TRACKS_FILE)
-    num_tracks=$1
+    # a line of spaces is the free slot of a removed track
+    num_tracks=$(grep -c '[^ ]' $TRACKS_FILE)
     echo "found $num_titles CDs, with a total of $num_tracks tracks"
     get_return
     return
@@ -270,7 +270,9 @@ list_tracks(){
 	echo no CD selected yet
 	return
     else
-        grep "^${cdcatnum}," $TRACKS_FILE > $temp_file
+        # without the padding the C version adds, in order of track number,
+        # as a track it edits can go in any free slot
+        grep "^${cdcatnum}," $TRACKS_FILE | sed 's/ *$//' | sort -t , -k 2,2n > $temp_file
 	num_tracks=$(wc -l $temp_file)
 	if [ "$num_tracks" = "0" ] ; then
 	    echo no tracks found for $cdtitle